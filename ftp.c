@@ -1,3 +1,6 @@
+// Build: gcc -O2 -o ftp ftp.c -lpthread -lcrypto -lz
+// libcrypto (OpenSSL) hashes verified transfers; zlib handles MODE Z.
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -11,17 +14,319 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <dirent.h>
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <ctype.h>
+#include <stddef.h>
+#include <time.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <netinet/tcp.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/file.h>
+#include <linux/fs.h>
+#include <openssl/evp.h>
+#include <zlib.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
 
 #define MAX_BUFFER 4096
 #define MAX_PATH 1024
 #define MAX_COMMAND 256
 
+#define FTP_DEFAULT_PORT 21
+#define FTP_DEFAULT_SEGMENTS 4
+#define FTP_MAX_SEGMENTS 16
+#define FTP_MIN_SEGMENT_SIZE (1024 * 1024)
+#define FTP_SPLICE_CHUNK (64 * 1024)
+#define FTP_ENGINE_MAX_EVENTS 64
+#define FTP_POOL_DEFAULT_PER_SERVER 4
+#define FTP_POOL_IDLE_TIMEOUT 60  // seconds
+#define FTP_POOL_PROBE_AFTER 2    // seconds idle before a reused session is checked with NOOP
+#define FTP_JOURNAL_VERSION 1
+#define FTP_JOURNAL_SUFFIX ".ftpjournal"
+#define FTP_UPLOAD_JOURNAL_SUFFIX ".ftpupload"
+#define FTP_JOURNAL_INTERVAL (8 * 1024 * 1024)  // bytes between checkpoints
+#define FTP_MIRROR_INDEX ".ftpmirror-index"
+#define FTP_LISTING_CACHE_SLOTS 256
+#define FTP_LISTING_CACHE_TTL 30  // seconds
+#define FTP_LISTING_KEY_MAX (MAX_PATH + 320)
+#define FTP_DOWNLOAD_CACHE_BUDGET (1024LL * 1024 * 1024)
+#define FTP_DOWNLOAD_CACHE_STALE 3600  // seconds before an abandoned partial download is removed
+#define FTP_DOWNLOAD_CACHE_LOW_WATER 0.9  // share of the budget an eviction frees down to
+#define FTP_METRICS_MAX_SAMPLES 3600  // one hour of per-second samples
+#define FTP_LATENCY_BUCKETS 13
+#define FTP_DEFAULT_TRANSFER_BUFFER (256 * 1024)
+#define FTP_MIN_TRANSFER_BUFFER (4 * 1024)
+#define FTP_MAX_TRANSFER_BUFFER (64 * 1024 * 1024)
+#define FTP_MAX_SOCKET_BUFFER (256 * 1024 * 1024)
+#define FTP_URING_BUFFERS 8  // registered buffers per ring
+#define FTP_PIPELINE_BUFFERS 4  // ring between the network and disk threads
+#define FTP_DIRECT_ALIGNMENT 4096  // O_DIRECT offset, length and memory alignment
+#define FTP_MAX_ADDRESSES 16
+#define FTP_RESOLVER_SLOTS 64
+#define FTP_RESOLVER_TTL 60          // seconds; getaddrinfo does not expose DNS TTLs
+#define FTP_RESOLVE_TIMEOUT_MS 5000
+#define FTP_CONNECT_TIMEOUT_MS 10000
+#define FTP_ATTEMPT_DELAY_MS 250     // RFC 8305 connection attempt delay
+#define FTP_PREPARED_MAX_AGE 15      // seconds; servers drop idle passive listeners
+#define FTP_REPLY_TIMEOUT_MS 60000   // longest wait for a server reply
+#define FTP_IDLE_TIMEOUT_MS 60000    // longest a data connection may go without progress
+#define FTP_STALL_WINDOW 10          // seconds over which the minimum transfer rate is judged
+#define FTP_DEFAULT_RETRIES 3
+#define FTP_RETRY_DELAY_MS 1000      // first reconnect backoff of a resumable transfer
+#define FTP_RETRY_MAX_DELAY_MS 30000
+#define FTP_SHAPER_BURST_SECONDS 0.1  // a bucket holds this much of its rate
+#define FTP_SHAPER_MIN_BURST (64 * 1024)
+#define FTP_SHAPER_MAX_WAIT 0.1       // seconds; upper bound on a wait for another transfer
+#define FTP_BATCH_DEFAULT_JOBS 8
+#define FTP_BATCH_DEFAULT_RETRIES 2
+#define FTP_BATCH_RETRY_DELAY_MS 500  // doubled after every failed attempt
+#define FTP_BATCH_HEDGE_SAMPLES 256   // recent download times the hedging percentile is taken over
+#define FTP_BATCH_HEDGE_MIN_SAMPLES 20
+#define FTP_BATCH_RATE_POLL 1         // seconds between reads of the --rate-file
+#define FTP_MULTI_CONNECTIONS 2       // sessions per mirror in a multi-mirror download
+#define FTP_MULTI_MAX_SOURCES 16
+#define FTP_MULTI_MAX_WORKERS 64
+#define FTP_MULTI_CHUNKS_PER_WORKER 4
+#define FTP_MULTI_MIN_STEAL (1024 * 1024)  // smallest remainder worth splitting off a range
+#define FTP_MULTI_HEDGE_FACTOR 2.0    // re-issue a range elsewhere when that finishes it this many times sooner
+#define FTP_MULTI_HEDGE_MIN_AGE 1.0   // seconds a range's owner gets to deliver its first byte before a hedge
+#define FTP_CRAWL_SESSIONS 8
+#define FTP_CRAWL_MAX_SESSIONS 64
+#define FTP_INVENTORY_MAGIC "FTPINV01"
+#define FTP_INVENTORY_VERSION 1
+
+// Extensions advertised in the FEAT reply (RFC 2389)
+#define FTP_FEATURE_EPSV 0x01
+#define FTP_FEATURE_MLSD 0x02
+#define FTP_FEATURE_SIZE 0x04
+#define FTP_FEATURE_MDTM 0x08
+#define FTP_FEATURE_REST 0x10
+#define FTP_FEATURE_HASH_SHA256 0x20  // HASH with SHA-256 among its algorithms
+#define FTP_FEATURE_HASH_MD5 0x40
+#define FTP_FEATURE_HASH_CRC32 0x80
+#define FTP_FEATURE_XMD5 0x100
+#define FTP_FEATURE_XCRC 0x200
+#define FTP_FEATURE_MODE_Z 0x400
+
+// Digests computed inline over a transfer's bytes
+#define FTP_HASH_CRC32C 0x01
+#define FTP_HASH_SHA256 0x02
+#define FTP_HASH_MD5 0x04    // for HASH MD5 / XMD5
+#define FTP_HASH_CRC32 0x08  // for HASH CRC32 / XCRC (zlib CRC-32)
+
 typedef enum {
     FTP_DISCONNECTED,
     FTP_CONNECTED,
     FTP_LOGGED_IN
 } FTPState;
 
+typedef enum {
+    FTP_DATA_BUFFERED,  // recv/fwrite and fread/send through a user buffer
+    FTP_DATA_ZEROCOPY,  // splice() for RETR, sendfile() for STOR
+    FTP_DATA_URING,     // batched io_uring reads/writes on registered buffers
+    FTP_DATA_PIPELINED  // network and disk on separate threads around a buffer ring
+} FTPDataPath;
+
+// Sidecar record of an interrupted transfer
+typedef struct {
+    char path[MAX_PATH + 16];
+    char remote_file[MAX_PATH];
+    long long remote_size;
+    char remote_mdtm[32];
+    long long local_size;   // uploads: identity of the source file
+    long long local_mtime;
+    long long committed;    // bytes [0, committed) are durable
+    long long pending;      // bytes written since the last checkpoint
+} FTPJournal;
+
+typedef enum {
+    FTP_PHASE_RESOLVE,
+    FTP_PHASE_CONNECT,
+    FTP_PHASE_BANNER,
+    FTP_PHASE_LOGIN,
+    FTP_PHASE_PASSIVE,     // PASV sent until the data connection is up
+    FTP_PHASE_FIRST_BYTE,  // RETR/STOR sent until the first data byte moved
+    FTP_PHASE_TRANSFER,    // bulk data loop
+    FTP_PHASE_COUNT
+} FTPPhase;
+
+typedef struct {
+    double phase_seconds[FTP_PHASE_COUNT];
+    long long phase_count[FTP_PHASE_COUNT];
+    long long transfers;
+    long long bytes_sent;
+    long long bytes_received;
+    long long syscalls;
+    
+    double samples[FTP_METRICS_MAX_SAMPLES];  // bytes per second, one per elapsed second
+    int sample_count;
+    double sample_started;
+    long long sample_bytes;
+    
+    long long latency_buckets[FTP_LATENCY_BUCKETS];
+    long long latency_count;
+    double latency_sum_ms;
+    
+    double command_sent_at;
+    double transfer_started;
+    int first_byte_seen;
+} FTPMetrics;
+
+typedef struct {
+    char key[FTP_LISTING_KEY_MAX];
+    char *data;  // raw listing bytes; NULL marks a free slot
+    size_t length;
+    time_t expires;
+} FTPListingCacheEntry;
+
+// Directory listings shared by every session that points at it
+typedef struct {
+    FTPListingCacheEntry entries[FTP_LISTING_CACHE_SLOTS];
+    int ttl;
+    char disk_dir[MAX_PATH];  // optional persistent copy; empty to disable
+    long long hits;
+    long long misses;
+    long long expired;
+    long long invalidations;
+    pthread_mutex_t lock;
+} FTPListingCache;
+
+// Downloaded files shared by sessions and by processes: objects/<key> holds
+// one remote file version, keyed by server, path, SIZE and MDTM
+typedef struct {
+    char directory[MAX_PATH];
+    long long budget;  // bytes of objects kept after each insert
+    long long total;   // bytes of objects as of the last scan plus later inserts; -1 before the first scan
+    int hard_links;    // hand out hard links to objects rather than copies, when reflinks are not possible
+    long long hits;
+    long long misses;
+    long long evicted;
+    pthread_mutex_t lock;  // guards the counters
+} FTPDownloadCache;
+
+// Mapped io_uring instance and its registered buffers
+typedef struct {
+    int ring_fd;
+    unsigned entries;
+    void *sq_ring;
+    void *cq_ring;
+    size_t sq_ring_size;
+    size_t cq_ring_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_cqe *cqes;
+    unsigned queued;    // SQEs not yet submitted
+    char *buffers;      // buffer_count registered buffers, buffer_size bytes each
+    size_t buffer_size;
+    int buffer_count;
+    int link_timeout;   // kernel takes IORING_OP_LINK_TIMEOUT (5.5+)
+    struct __kernel_timespec idle_timeout;  // linked to each socket operation
+} FTPUring;
+
+// Buffer ring between the network thread and the disk thread of one transfer
+typedef struct {
+    char *memory;       // FTP_PIPELINE_BUFFERS buffers, buffer_size bytes each, block aligned
+    size_t buffer_size;
+    size_t length[FTP_PIPELINE_BUFFERS];
+    int head, tail, filled;  // consumer takes head, producer fills tail
+    int finished;       // producer has published its last buffer
+    int failed;         // either side gave up; the other stops too
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} FTPPipeline;
+
+// Data connection tuning; all-zero means defaults
+typedef struct {
+    size_t transfer_buffer;  // bytes per read/recv and per splice; 0 for FTP_DEFAULT_TRANSFER_BUFFER
+    long long socket_buffer; // SO_RCVBUF/SO_SNDBUF; 0 sizes from the BDP estimate, -1 leaves kernel autotuning
+    double link_bps;         // bits/s for the BDP estimate; 0 when unknown, which leaves autotuning
+    double rtt_ms;           // RTT for the BDP estimate; 0 measures the control connection
+    int report_tcp_info;     // print TCP_INFO of the data connection after each transfer
+    int connect_timeout_ms;  // per connection, all addresses included; 0 for FTP_CONNECT_TIMEOUT_MS
+    int direct_io;           // pipelined path O_DIRECT: 0 never, 1 for downloads, 2 for uploads too
+    int reply_timeout_ms;    // deadline for each server reply; 0 for FTP_REPLY_TIMEOUT_MS, -1 for none
+    int idle_timeout_ms;     // data connection without progress; 0 for FTP_IDLE_TIMEOUT_MS, -1 for none
+    double min_rate;         // bytes/s a transfer must keep up over stall_window; 0 disables
+    double stall_window;     // seconds; 0 for FTP_STALL_WINDOW
+    int retries;             // reconnects of the *_retry transfers; 0 for FTP_DEFAULT_RETRIES, -1 for none
+} FTPTuning;
+
+// Running digests of one byte stream, and their hex values once finished
+typedef struct {
+    unsigned algorithms;  // FTP_HASH_*
+    uint32_t crc32c;
+    unsigned long crc32;
+    EVP_MD_CTX *sha256;
+    EVP_MD_CTX *md5;
+    long long bytes;
+    char crc32c_hex[9];
+    char crc32_hex[9];
+    char sha256_hex[65];
+    char md5_hex[33];
+} FTPDigest;
+
+// Figures of the last MODE Z transfer
+typedef struct {
+    long long wire_bytes;  // compressed bytes on the data connection
+    long long data_bytes;  // plain bytes read or written locally
+    double cpu_seconds;    // thread CPU spent in the transfer loop
+} FTPCompression;
+
+// Token bucket; rate in bytes/s, 0 for unlimited. Tokens may go negative
+// (debt): bytes are charged after they moved.
+typedef struct {
+    double rate;
+    double burst;
+    double tokens;
+    double updated;
+} FTPTokenBucket;
+
+struct FTPShaper;
+
+// One transfer's share of a shaper
+typedef struct {
+    struct FTPShaper *shaper;
+    FTPTokenBucket bucket;  // per-transfer limit
+    double weight;
+    double finish;          // virtual time at which its bytes so far are served
+} FTPShaperFlow;
+
+// A charge waiting for tokens
+typedef struct FTPShaperRequest {
+    double start;  // start tag in virtual time; the smallest is served first
+    FTPShaperFlow *flow;
+    struct FTPShaperRequest *next;
+} FTPShaperRequest;
+
+// Bandwidth limits shared by every transfer that points at it
+typedef struct FTPShaper {
+    FTPTokenBucket bucket;  // global limit
+    double virtual_time;
+    FTPShaperRequest *waiting;  // in arrival order
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} FTPShaper;
+
+// A resolved socket address, IPv4 or IPv6
+typedef struct {
+    struct sockaddr_storage address;
+    socklen_t length;
+} FTPAddress;
+
 typedef struct {
     char server_hostname[256];
     char username[64];
@@ -34,14 +339,383 @@ typedef struct {
     int server_port;
     int data_port;
     
-    char server_ip[16];
+    char server_ip[INET6_ADDRSTRLEN];
+    FTPAddress server_address;  // control connection peer; EPSV data connections go here too
+    unsigned features;          // FTP_FEATURE_* from FEAT at login
+    int epsv_failed;            // server refused EPSV; use PASV for the rest of the session
     FTPState state;
+    
+    FTPDataPath data_path;       // Requested data path
+    FTPDataPath last_data_path;  // Path actually used by the last transfer
+    
+    char reply_buffer[MAX_BUFFER];  // control bytes received but not yet parsed
+    size_t reply_length;
+    
+    FTPJournal *journal;  // checkpointed by the receive loops when set
+    int mlsd_unsupported;  // server rejected MLSD; list with LIST instead
+    FTPListingCache *listing_cache;  // optional, shared between sessions
+    FTPDownloadCache *download_cache;  // optional, shared between sessions and processes
+    int cache_hit;                   // the last download came from download_cache
+    FTPMetrics *metrics;             // optional instrumentation
+    int quiet;                       // suppress per-transfer success messages
+    
+    FTPTuning tuning;
+    char *transfer_buffer;           // allocated on first use, freed on close
+    size_t transfer_buffer_size;
+    FTPUring *uring;                 // set up on the first io_uring transfer, freed on close
+    int uring_unavailable;
+    long long transfer_size;         // bytes the server announced for this RETR, 0 if unknown
+    int verify;                      // hash downloads/uploads inline and check them with the server
+    FTPDigest *digest;               // fed by the data loops while set
+    int compress_level;              // MODE Z deflate level 1-9 when the server offers it; 0 for stream mode
+    int mode_z;                      // MODE Z currently selected on the session
+    FTPCompression last_compression;
+    FTPShaper *shaper;               // optional bandwidth limits, shared between sessions
+    double shaper_weight;            // share against other shaped transfers; 0 means 1
+    double rate_limit;               // per-transfer limit in bytes/s; 0 for none
+    FTPShaperFlow *flow;             // charged by the data loops while set
+    int prepare_data_channel;        // small-file fast path: send the next PASV/EPSV with each RETR/STOR
+    int prepared_socket;             // data connection opened ahead for the next transfer, or -1
+    double prepared_at;
+    double window_started;           // stall detection: start and bytes of the current window
+    long long window_bytes;
+    int stalled;                     // the last transfer was cut off for going too slowly
+    int last_reply;                  // code of the last server reply, -1 after a connection failure
+    int failed_reply;                // last 4xx/5xx reply, 0 after a connection failure; cleared before each RETR/STOR
+    pthread_mutex_t *socket_lock;    // held to close sockets another thread may shut down
 } FTPClient;
 
+typedef enum {
+    FTP_ENTRY_FILE,
+    FTP_ENTRY_DIRECTORY,
+    FTP_ENTRY_LINK,
+    FTP_ENTRY_OTHER
+} FTPEntryType;
+
+// One parsed line of a directory listing
+typedef struct {
+    char name[256];
+    FTPEntryType type;
+    long long size;
+    long long mtime;  // seconds since the epoch, UTC
+} FTPEntry;
+
+// Local mirror index: what was last downloaded for each relative path
+typedef struct {
+    char *path;
+    long long size;
+    long long mtime;
+    int seen;  // present in the current remote listing
+} FTPIndexEntry;
+
+typedef struct {
+    char path[MAX_PATH];
+    FTPIndexEntry *entries;
+    int count;
+    int capacity;
+} FTPIndex;
+
+// Remote tree inventory file: this header, then the records sorted by path,
+// then the NUL-terminated paths. Laid out to be queried through mmap();
+// integers are in host byte order.
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+    uint64_t names_offset;  // from the start of the file
+    uint64_t names_size;
+    int64_t crawled_at;
+} FTPInventoryHeader;
+
+typedef struct {
+    uint64_t name_offset;  // into the names block
+    uint32_t name_length;
+    uint8_t type;          // FTPEntryType
+    uint8_t reserved[3];
+    int64_t size;
+    int64_t mtime;
+} FTPInventoryRecord;
+
+// An inventory file mapped for queries
+typedef struct {
+    void *map;
+    size_t map_size;
+    const FTPInventoryHeader *header;
+    const FTPInventoryRecord *records;
+    const char *names;
+} FTPInventory;
+
+typedef enum {
+    FTP_JOB_QUEUED,
+    FTP_JOB_CONNECTING,
+    FTP_JOB_GREETING,        // waiting for 220
+    FTP_JOB_USER,
+    FTP_JOB_PASS,
+    FTP_JOB_TYPE,
+    FTP_JOB_PASV,
+    FTP_JOB_TRANSFER_START,  // RETR/STOR sent, waiting for 150
+    FTP_JOB_TRANSFERRING,    // waiting for end of data and 226
+    FTP_JOB_DONE,
+    FTP_JOB_FAILED
+} FTPJobState;
+
+typedef enum {
+    FTP_JOB_DOWNLOAD,
+    FTP_JOB_UPLOAD
+} FTPJobKind;
+
+struct FTPJob;
+
+// What an epoll event refers to: a job's control or data socket
+typedef struct {
+    struct FTPJob *job;
+    int is_data;
+} FTPEndpoint;
+
+typedef struct FTPJob {
+    FTPClient client;
+    FTPJobKind kind;
+    FTPJobState state;
+    char remote_file[MAX_PATH];
+    char local_file[MAX_PATH];
+    int local_fd;
+    
+    FTPEndpoint control_endpoint;
+    FTPEndpoint data_endpoint;
+    
+    char command[MAX_BUFFER];      // pipelined control commands not yet sent
+    size_t command_length;
+    size_t command_sent;
+    char staged[MAX_BUFFER];       // upload bytes read but not yet sent
+    size_t staged_length;
+    size_t staged_sent;
+    
+    int data_connected;
+    int data_done;
+    int reply_done;
+    long long bytes;
+    char error[MAX_COMMAND];
+} FTPJob;
+
+typedef struct {
+    int epoll_fd;
+    FTPJob *jobs;
+    int job_count;
+    int job_capacity;
+    int active;
+} FTPEngine;
+
+typedef struct {
+    FTPClient client;
+    char home_dir[MAX_PATH];  // directory after login; sessions are reset to it
+    int used;                 // slot holds a connection
+    int in_use;               // handed out to a caller
+    time_t last_used;
+} FTPPooledSession;
+
+typedef struct {
+    FTPPooledSession *sessions;
+    int max_sessions;
+    int max_per_server;
+    int idle_timeout;
+    pthread_mutex_t lock;
+    pthread_cond_t released;
+} FTPSessionPool;
+
+// Where a command-line transfer goes, from an ftp:// URL
+typedef struct {
+    char hostname[256];
+    int port;
+    char username[64];
+    char password[64];
+    char path[MAX_PATH];
+} FTPLocation;
+
+// One mirror of a multi-mirror download
+typedef struct {
+    FTPLocation location;
+    FTPClient probe;        // logged-in session that checked SIZE/MDTM
+    long long size;
+    char modified[32];      // MDTM, empty when the server has none
+    int usable;
+    long long bytes;        // received from this mirror, including discarded copies
+    int ranges, steals, hedges, failures;
+} FTPSource;
+
+// A byte range of a multi-mirror download. Its owner streams it from
+// offset; an idle worker may lower end to take the rest over (a steal),
+// or fetch a twin copy from another mirror (a hedge) that races it.
+typedef struct {
+    long long offset;  // next byte to write
+    long long end;     // exclusive
+    int owner;         // worker index, -1 while queued
+    int twin;          // range racing this one for the same bytes, -1 if none
+    int done;
+} FTPSourceRange;
+
+typedef struct FTPMultiDownload FTPMultiDownload;
+
+typedef struct {
+    FTPMultiDownload *download;
+    int source;
+    FTPClient *client;      // the mirror's probe session, or own
+    FTPClient own;
+    int range;              // being fetched, -1 when idle
+    long long bytes;
+    double busy;            // seconds spent on finished ranges, for the rate estimate
+    double range_started;
+    pthread_t thread;
+} FTPSourceWorker;
+
+struct FTPMultiDownload {
+    FTPSource *sources;
+    int source_count;
+    FTPSourceWorker workers[FTP_MULTI_MAX_WORKERS];
+    int worker_count;
+    FTPSourceRange *ranges;  // guarded by lock, like everything the workers share
+    int range_count;
+    int range_capacity;
+    long long size;
+    int local_fd;
+    int failed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+};
+
+// Batch manifest: named servers and the operations to run against them
+typedef struct {
+    char name[64];
+    char hostname[256];
+    int port;
+    char username[64];   // sized like FTPClient's, which they are copied into
+    char password[64];
+    int active;  // operations running against it
+} FTPBatchServer;
+
+typedef enum {
+    FTP_BATCH_GET,
+    FTP_BATCH_PUT,
+    FTP_BATCH_MKDIR,
+    FTP_BATCH_RENAME,
+    FTP_BATCH_DELETE
+} FTPBatchKind;
+
+typedef enum {
+    FTP_BATCH_PENDING,
+    FTP_BATCH_RUNNING,
+    FTP_BATCH_DONE,
+    FTP_BATCH_FAILED
+} FTPBatchState;
+
+typedef struct {
+    FTPBatchKind kind;
+    int server;        // index into FTPBatch.servers
+    char *source;      // remote path for get/mkdir/rename/delete, local for put
+    char *target;      // NULL for mkdir/delete
+    int priority;      // higher runs first within a phase
+    double weight;     // bandwidth share against concurrent transfers
+    int max_attempts;
+    int phase;         // "wait" lines in the manifest start a new phase
+    int line;
+    FTPBatchState state;
+    int attempts;
+    int failed_reply;   // server reply that failed the last attempt; 5xx is permanent, so not retried
+    double not_before;  // retry backoff, on the ftp_now() clock
+    long long bytes;
+    double seconds;
+    double attempt_started;
+    int running;           // attempts in flight: the primary and possibly its hedge
+    int hedged;            // the current attempt has a hedge
+    FTPClient *session[2]; // sessions of the primary and the hedge while they run, to cancel the loser
+} FTPBatchOp;
+
+typedef struct {
+    FTPBatchServer *servers;
+    int server_count;
+    FTPBatchOp *ops;
+    int op_count;
+    int op_capacity;
+    int phase_count;
+    int verify;
+    int compress_level;
+    int quiet;
+    double rate;           // global bandwidth limit in bytes/s; 0 for none
+    const char *rate_file; // optional; polled while running, its number replaces rate
+    double transfer_rate;  // per-transfer limit; 0 for none
+    int timeout_ms;        // reply and data idle deadline; 0 for the defaults
+    double min_rate;       // cut off transfers slower than this; 0 for none
+    double hedge_percentile;  // hedge downloads running longer than this percentile; 0 for none
+    FTPDownloadCache *download_cache;  // optional
+    FTPMetrics *metrics;   // optional; each worker counts on its own and adds in when it exits
+
+    // Run state, guarded by lock
+    int *order;            // op indices in dispatch order
+    int *order_index;      // position of each op in order
+    int first_pending;     // everything before it in order has been dispatched
+    int *phase_remaining;  // unfinished operations per phase
+    int phase;             // phase being dispatched
+    int per_server;
+    int completed;
+    int failed;
+    int retried;
+    int hedges;
+    int hedge_wins;
+    double get_seconds[FTP_BATCH_HEDGE_SAMPLES];  // ring of recent download times
+    int get_samples;
+    long long bytes;
+    double started;
+    double seconds;
+    FTPSessionPool pool;
+    FTPShaper shaper;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} FTPBatch;
+
+// Minimal FTP server on loopback serving synthetic files, for benchmarks.
+// "big<N>" files are file_size bytes, "small<N>" files small_size bytes;
+// uploads are read and discarded (hashed first with hash_uploads, for HASH).
+typedef struct {
+    int listen_socket;
+    int port;
+    long long file_size;
+    int file_count;
+    long long small_size;
+    int small_count;
+    int latency_ms;  // replies and data leave no sooner than this after their command arrived
+    int hash_uploads;
+    double send_rate;  // bytes/s for all downloads together, to play a slow mirror; 0 for none
+    FTPTokenBucket send_bucket;
+    pthread_mutex_t send_lock;
+    long long stall_after;  // a stalled download stops sending after this many bytes; 0 for never
+    int stall_percent;      // share of downloads that stall, when stall_after is set
+    volatile int stopping;
+    pthread_t thread;
+} FTPStandInServer;
+
+typedef struct {
+    long long file_size;
+    int iterations;
+    long long small_size;
+    int small_count;
+    int logins;
+    int latency_ms;
+    FTPDataPath data_path;
+    FTPTuning tuning;
+    const char *json_path;  // append one JSON line per run; NULL to skip
+    int verify;             // hash transfers inline and check them with HASH
+    int compress_level;     // MODE Z level; 0 for stream mode
+    const char *download_path;  // bulk download target; NULL for /dev/null
+    double rate;                // shape transfers to this many bytes/s; 0 for none
+} FTPBenchOptions;
+
 // Function prototypes
 int ftp_connect(FTPClient *client, const char *hostname);
 int ftp_login(FTPClient *client, const char *username, const char *password);
 int ftp_enter_passive_mode(FTPClient *client);
+int ftp_complete_passive_mode(FTPClient *client);
+int ftp_send_passive_pipelined(FTPClient *client, const char **commands, int count, int passive);
+void ftp_discard_prepared_channel(FTPClient *client);
 int ftp_list_remote_files(FTPClient *client);
 int ftp_change_remote_directory(FTPClient *client, const char *path);
 int ftp_make_remote_directory(FTPClient *client, const char *path);
@@ -50,10 +724,168 @@ int ftp_upload_file(FTPClient *client, const char *local_file, const char *remot
 int ftp_download_file(FTPClient *client, const char *remote_file, const char *local_file);
 int ftp_rename_remote_file(FTPClient *client, const char *old_name, const char *new_name);
 void ftp_close_connection(FTPClient *client);
+void ftp_close_socket(FTPClient *client, int *socket_fd);
+long long ftp_download_to_fd(FTPClient *client, const char *remote_file, int fd);
+long long ftp_upload_from_fd(FTPClient *client, int fd, const char *remote_file);
+
+// Segmented (multi-connection) downloads
+int ftp_set_binary_mode(FTPClient *client);
+int ftp_get_remote_size(FTPClient *client, const char *remote_file, long long *size);
+int ftp_open_session(FTPClient *session, const FTPClient *origin);
+int ftp_download_file_segmented(FTPClient *client, const char *remote_file, const char *local_file, int segments);
+
+// Data channel transfer loops
+long long ftp_recv_data(FTPClient *client, int local_fd);
+long long ftp_send_data(FTPClient *client, int local_fd);
+const char *ftp_data_path_name(FTPDataPath path);
+void ftp_uring_destroy(FTPUring *ring);
+long long ftp_parse_transfer_size(const char *reply);
+
+// Inline integrity hashing
+int ftp_digest_init(FTPDigest *digest, unsigned algorithms);
+void ftp_digest_update(FTPDigest *digest, const void *data, size_t length);
+void ftp_digest_final(FTPDigest *digest);
+unsigned ftp_remote_hash_algorithms(const FTPClient *client);
+unsigned ftp_verify_algorithm(const FTPClient *client);
+int ftp_remote_hash(FTPClient *client, const char *remote_file, unsigned algorithm, char *hex);
+int ftp_verify_remote(FTPClient *client, const char *remote_file, const FTPDigest *digest);
+
+// Bandwidth shaping
+int ftp_shaper_init(FTPShaper *shaper, double rate);
+void ftp_shaper_destroy(FTPShaper *shaper);
+void ftp_shaper_set_rate(FTPShaper *shaper, double rate);
+void ftp_shaper_flow_init(FTPShaperFlow *flow, FTPShaper *shaper, double weight, double rate);
+void ftp_shaper_set_flow(FTPShaperFlow *flow, double weight, double rate);
+void ftp_shaper_charge(FTPShaperFlow *flow, size_t bytes);
+
+// MODE Z compressed transfers
+int ftp_select_transfer_mode(FTPClient *client, int compressed);
+void ftp_report_compression(const FTPClient *client);
+
+// Non-blocking multi-session engine
+int ftp_engine_init(FTPEngine *engine, int max_jobs);
+int ftp_engine_add_job(FTPEngine *engine, FTPJobKind kind, const FTPClient *origin,
+                       const char *remote_file, const char *local_file);
+int ftp_engine_run(FTPEngine *engine);
+void ftp_engine_destroy(FTPEngine *engine);
+
+// Session pool
+int ftp_print_working_directory(FTPClient *client, char *path, size_t max_len);
+int ftp_noop(FTPClient *client);
+int ftp_pool_init(FTPSessionPool *pool, int max_sessions, int max_per_server, int idle_timeout);
+FTPClient *ftp_pool_acquire(FTPSessionPool *pool, const char *hostname, int port,
+                            const char *username, const char *password);
+void ftp_pool_release(FTPSessionPool *pool, FTPClient *client, int broken);
+void ftp_pool_destroy(FTPSessionPool *pool);
+
+// Resumable transfers
+int ftp_get_remote_mdtm(FTPClient *client, const char *remote_file, char *stamp, size_t max_len);
+int ftp_journal_load(FTPJournal *journal, const char *path);
+int ftp_journal_save(const FTPJournal *journal);
+int ftp_download_file_resume(FTPClient *client, const char *remote_file, const char *local_file);
+int ftp_upload_file_resume(FTPClient *client, const char *local_file, const char *remote_file);
+int ftp_reconnect(FTPClient *client);
+int ftp_download_file_retry(FTPClient *client, const char *remote_file, const char *local_file);
+int ftp_upload_file_retry(FTPClient *client, const char *local_file, const char *remote_file);
+
+// Structured listings and mirroring
+int ftp_fetch_listing(FTPClient *client, const char *command, char **data, size_t *length);
+long long ftp_parse_timestamp(const char *stamp);
+int ftp_parse_mlsd_line(char *line, FTPEntry *entry);
+int ftp_parse_list_line(char *line, FTPEntry *entry);
+int ftp_read_directory(FTPClient *client, const char *path, FTPEntry **entries, int *count);
+int ftp_index_load(FTPIndex *index, const char *path);
+int ftp_index_add(FTPIndex *index, const FTPIndexEntry *entry);
+FTPIndexEntry *ftp_index_find(FTPIndex *index, int sorted_count, const char *path);
+int ftp_index_save(FTPIndex *index);
+void ftp_index_free(FTPIndex *index);
+int ftp_mirror(FTPClient *client, const char *remote_dir, const char *local_dir, int delete_extraneous);
+int ftp_mirror_main(int argc, char *argv[]);
+
+// Listing cache
+void ftp_normalize_path(const char *base, const char *path, char *out, size_t max_len);
+int ftp_resolve_remote_path(FTPClient *client, const char *path, char *out, size_t max_len);
+int ftp_listing_cache_init(FTPListingCache *cache, int ttl, const char *disk_dir);
+void ftp_listing_cache_invalidate(FTPClient *client, const char *directory);
+void ftp_listing_cache_invalidate_parent(FTPClient *client, const char *path);
+void ftp_listing_cache_print_stats(const FTPListingCache *cache, FILE *out);
+void ftp_listing_cache_destroy(FTPListingCache *cache);
+
+// Download cache
+int ftp_download_cache_init(FTPDownloadCache *cache, const char *directory, long long budget);
+void ftp_download_cache_print_stats(const FTPDownloadCache *cache, FILE *out);
+void ftp_download_cache_destroy(FTPDownloadCache *cache);
+int ftp_download_cached(FTPClient *client, const char *remote_file, const char *local_file);
+
+// Name resolution and connection setup
+int ftp_resolve(const char *hostname, FTPAddress *addresses, int max);
+void ftp_resolver_set_ttl(int ttl);
+void ftp_resolver_flush(void);
+void ftp_address_set_port(FTPAddress *address, int port);
+void ftp_address_to_string(const FTPAddress *address, char *out, size_t max_len);
+int ftp_connect_race(const FTPClient *client, const FTPAddress *addresses, int count,
+                     int is_data, int timeout_ms, FTPAddress *connected);
+const char *ftp_passive_command(const FTPClient *client);
+unsigned ftp_parse_features(const char *reply);
+int ftp_parse_passive_reply(const FTPClient *client, int code, const char *reply, FTPAddress *address);
+
+// Socket and buffer tuning
+size_t ftp_transfer_buffer_size(const FTPClient *client);
+long long ftp_estimate_bdp(const FTPClient *client);
+void ftp_tune_control_socket(int socket_fd);
+void ftp_tune_data_socket(const FTPClient *client, int socket_fd);
+void ftp_report_tcp_info(const FTPClient *client, int socket_fd);
+
+// Instrumentation
+double ftp_now(void);
+void ftp_metrics_reset(FTPMetrics *metrics);
+void ftp_metrics_phase(FTPClient *client, FTPPhase phase, double started);
+void ftp_metrics_merge(FTPMetrics *total, const FTPMetrics *part);
+void ftp_metrics_write_json(const FTPMetrics *metrics, const char *label, FILE *out);
+int ftp_metrics_write_prometheus(const FTPMetrics *metrics, const char *path);
+
+// Batch runner
+int ftp_batch_load(FTPBatch *batch, const char *path, int default_retries);
+int ftp_batch_run(FTPBatch *batch, int jobs, int per_server);
+void ftp_batch_write_summary(const FTPBatch *batch, FILE *out);
+void ftp_batch_free(FTPBatch *batch);
+int ftp_batch_main(int argc, char *argv[]);
+
+// Command-line transfers
+int ftp_parse_url(const char *url, FTPLocation *location);
+int ftp_transfer_main(int argc, char *argv[]);
+int ftp_mget_main(int argc, char *argv[]);
+
+// Server-to-server transfers
+long long ftp_fxp_transfer(FTPClient *source, const char *source_file, FTPClient *destination,
+                           const char *destination_file);
+int ftp_fxp_main(int argc, char *argv[]);
+
+// Multi-mirror downloads
+long long ftp_multi_download(FTPSource *sources, int count, const char *local_file, int connections,
+                             long long chunk_size);
+int ftp_multi_main(int argc, char *argv[]);
+
+// Remote tree inventory
+long long ftp_crawl(const FTPClient *origin, const char *root, int sessions, const char *inventory_path, int quiet);
+int ftp_inventory_open(FTPInventory *inventory, const char *path);
+void ftp_inventory_close(FTPInventory *inventory);
+long long ftp_inventory_lower_bound(const FTPInventory *inventory, const char *path);
+const FTPInventoryRecord *ftp_inventory_find(const FTPInventory *inventory, const char *path);
+int ftp_crawl_main(int argc, char *argv[]);
+int ftp_inventory_main(int argc, char *argv[]);
+
+// Loopback benchmark
+int ftp_standin_start(FTPStandInServer *server, int port);
+void ftp_standin_stop(FTPStandInServer *server);
+int ftp_benchmark_run(const FTPBenchOptions *options);
+int ftp_benchmark_main(int argc, char *argv[]);
 
 // Utility functions
 void trim_whitespace(char *str);
+int ftp_extract_reply(char *buffer, size_t *length, char *response, size_t max_len);
 int send_ftp_command(FTPClient *client, const char *command);
+int send_ftp_pipelined(FTPClient *client, const char *const commands[], int count);
 int recv_ftp_response(FTPClient *client, char *response, size_t max_len);
 void print_error(const char *message);
 
@@ -77,420 +909,8711 @@ void trim_whitespace(char *str) {
     str[end - start + 1] = '\0';
 }
 
-// Send FTP command and check for basic error
-int send_ftp_command(FTPClient *client, const char *command) {
-    char full_command[MAX_COMMAND];
-    snprintf(full_command, sizeof(full_command), "%s\r\n", command);
-    
-    int sent_bytes = send(client->control_socket, full_command, strlen(full_command), 0);
-    if (sent_bytes < 0) {
-        print_error("Failed to send command");
-        return -1;
+// Parse a byte count with an optional K, M or G suffix (powers of 1024)
+static long long ftp_parse_byte_count(const char *text) {
+    char *end;
+    long long value = strtoll(text, &end, 10);
+
+    switch (toupper((unsigned char)*end)) {
+        case 'K': value <<= 10; break;
+        case 'M': value <<= 20; break;
+        case 'G': value <<= 30; break;
     }
-    
-    return 0;
+    return value;
 }
 
-// Receive FTP response
-int recv_ftp_response(FTPClient *client, char *response, size_t max_len) {
-    int received_bytes = recv(client->control_socket, response, max_len - 1, 0);
-    if (received_bytes < 0) {
-        print_error("Failed to receive server response");
-        return -1;
+// Write a whole buffer to a file descriptor
+static int write_all(int fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t written = write(fd, buffer, length);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buffer += written;
+        length -= written;
     }
-    
-    response[received_bytes] = '\0';
-    trim_whitespace(response);
-    
-    return atoi(response);
+    return 0;
 }
 
-// Print error with system error description
-void print_error(const char *message) {
-    fprintf(stderr, "%s: %s\n", message, strerror(errno));
+// Send a whole buffer over a socket
+static int send_all(int socket_fd, const char *buffer, size_t length) {
+    while (length > 0) {
+        ssize_t sent = send(socket_fd, buffer, length, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buffer += sent;
+        length -= sent;
+    }
+    return 0;
 }
 
-// Connect to FTP server
-int ftp_connect(FTPClient *client, const char *hostname) {
-    struct hostent *host_info;
-    struct sockaddr_in server_addr;
-    char response[MAX_BUFFER];
-
-    // Resolve hostname
-    host_info = gethostbyname(hostname);
-    if (!host_info) {
-        herror("gethostbyname");
-        return -1;
+// Write a whole buffer at a given file offset
+static int pwrite_all(int fd, const char *buffer, size_t length, off_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, buffer, length, offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buffer += written;
+        length -= written;
+        offset += written;
     }
+    return 0;
+}
 
-    // Create socket
-    client->control_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client->control_socket < 0) {
-        print_error("Socket creation failed");
-        return -1;
+// Create every missing directory along path
+static int make_local_directories(const char *path) {
+    char partial[MAX_PATH];
+    
+    snprintf(partial, sizeof(partial), "%s", path);
+    for (char *slash = strchr(partial + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+        if (slash) *slash = '\0';
+        if (mkdir(partial, 0755) < 0 && errno != EEXIST) return -1;
+        if (!slash) return 0;
+        *slash = '/';
     }
+}
 
-    // Prepare server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET; //ipv4
-    server_addr.sin_port = htons(21);  // Standard FTP control port, convert in bigendian
-    memcpy(&server_addr.sin_addr, host_info->h_addr, host_info->h_length);
+// ---------------------------------------------------------------------------
+// Transfer instrumentation: phase timings, byte/syscall counts, throughput
+// samples and control round-trip latency histograms
+// ---------------------------------------------------------------------------
 
-    // Connect to server
-    if (connect(client->control_socket, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        print_error("Connection failed");
-        close(client->control_socket);
-        return -1;
-    }
+static const char *ftp_phase_names[FTP_PHASE_COUNT] = {
+    "resolve", "connect", "banner", "login", "passive", "first_byte", "transfer"
+};
 
-    // Store server details
-    strcpy(client->server_hostname, hostname);
-    strcpy(client->server_ip, inet_ntoa(server_addr.sin_addr));
-    
-    // Receive welcome message
-    int response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 220) {
-        fprintf(stderr, "Server connection failed: %s\n", response);
-        close(client->control_socket);
-        return -1;
-    }
+// Upper bounds (milliseconds) of the latency histogram buckets; the last is +Inf
+static const double ftp_latency_bounds_ms[FTP_LATENCY_BUCKETS - 1] = {
+    1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000
+};
 
-    client->state = FTP_CONNECTED;
-    return 0;
+// Monotonic clock in seconds
+double ftp_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
 }
 
-// Login to FTP server
-int ftp_login(FTPClient *client, const char *username, const char *password) {
-    char command[MAX_COMMAND];
-    char response[MAX_BUFFER];
-    
-    // Send username
-    snprintf(command, sizeof(command), "USER %s", username);
-    if (send_ftp_command(client, command) < 0) return -1;
-    
-    int response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 331) {
-        fprintf(stderr, "Username error: %s\n", response);
-        return -1;
+void ftp_metrics_reset(FTPMetrics *metrics) {
+    memset(metrics, 0, sizeof(*metrics));
+}
+
+// Add part's counts into total. Throughput samples are appended, so each
+// still describes the session that took it.
+void ftp_metrics_merge(FTPMetrics *total, const FTPMetrics *part) {
+    for (int i = 0; i < FTP_PHASE_COUNT; i++) {
+        total->phase_seconds[i] += part->phase_seconds[i];
+        total->phase_count[i] += part->phase_count[i];
     }
+    total->transfers += part->transfers;
+    total->bytes_sent += part->bytes_sent;
+    total->bytes_received += part->bytes_received;
+    total->syscalls += part->syscalls;
     
-    // Send password
-    snprintf(command, sizeof(command), "PASS %s", password);
-    if (send_ftp_command(client, command) < 0) return -1;
-    
-    response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 230) {
-        fprintf(stderr, "Login failed: %s\n", response);
-        return -1;
+    for (int i = 0; i < part->sample_count && total->sample_count < FTP_METRICS_MAX_SAMPLES; i++) {
+        total->samples[total->sample_count++] = part->samples[i];
     }
     
-    // Store login details
-    strcpy(client->username, username);
-    strcpy(client->password, password);
+    for (int i = 0; i < FTP_LATENCY_BUCKETS; i++) total->latency_buckets[i] += part->latency_buckets[i];
+    total->latency_count += part->latency_count;
+    total->latency_sum_ms += part->latency_sum_ms;
+}
+
+// Add the time since started to a phase
+void ftp_metrics_phase(FTPClient *client, FTPPhase phase, double started) {
+    if (!client->metrics || started <= 0) return;
+    client->metrics->phase_seconds[phase] += ftp_now() - started;
+    client->metrics->phase_count[phase]++;
+}
+
+static void ftp_metrics_syscall(FTPClient *client) {
+    if (client->metrics) client->metrics->syscalls++;
+}
+
+// A command left on the control connection; replies are timed against it
+static void ftp_metrics_command_sent(FTPClient *client) {
+    if (!client->metrics) return;
+    client->metrics->syscalls++;
+    client->metrics->command_sent_at = ftp_now();
+}
+
+static void ftp_metrics_reply(FTPClient *client) {
+    FTPMetrics *metrics = client->metrics;
+    int bucket = 0;
     
-    client->state = FTP_LOGGED_IN;
-    return 0;
+    if (!metrics || metrics->command_sent_at <= 0) return;
+    double latency_ms = (ftp_now() - metrics->command_sent_at) * 1000.0;
+    while (bucket < FTP_LATENCY_BUCKETS - 1 && latency_ms > ftp_latency_bounds_ms[bucket]) bucket++;
+    metrics->latency_buckets[bucket]++;
+    metrics->latency_count++;
+    metrics->latency_sum_ms += latency_ms;
 }
 
-// Enter passive mode
-int ftp_enter_passive_mode(FTPClient *client) {
-    char response[MAX_BUFFER];
-    int h1, h2, h3, h4, p1, p2;
+// Mark the start of a data transfer; time-to-first-byte counts from the RETR/STOR
+static void ftp_metrics_transfer_start(FTPClient *client) {
+    FTPMetrics *metrics = client->metrics;
     
-    if (send_ftp_command(client, "PASV") < 0) return -1;
+    if (!metrics) return;
+    metrics->transfer_started = ftp_now();
+    metrics->sample_started = metrics->transfer_started;
+    metrics->sample_bytes = 0;
+    metrics->first_byte_seen = 0;
+}
+
+// Account data bytes moved by one syscall
+static void ftp_metrics_data(FTPClient *client, long long received, long long sent) {
+    FTPMetrics *metrics = client->metrics;
     
-    int response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 227) {
-        fprintf(stderr, "Passive mode failed: %s\n", response);
-        return -1;
+    if (!metrics) return;
+    metrics->syscalls++;
+    metrics->bytes_received += received;
+    metrics->bytes_sent += sent;
+    
+    double now = ftp_now();
+    if (!metrics->first_byte_seen && received + sent > 0) {
+        metrics->first_byte_seen = 1;
+        metrics->phase_seconds[FTP_PHASE_FIRST_BYTE] += now - (metrics->command_sent_at > 0 ?
+                                                               metrics->command_sent_at : metrics->transfer_started);
+        metrics->phase_count[FTP_PHASE_FIRST_BYTE]++;
     }
     
-    // Parse passive mode response
-    if (sscanf(response, "227 Entering Passive Mode (%d,%d,%d,%d,%d,%d)", 
-               &h1, &h2, &h3, &h4, &p1, &p2) != 6) {
-        fprintf(stderr, "Failed to parse passive mode response\n");
-        return -1;
+    metrics->sample_bytes += received + sent;
+    if (now - metrics->sample_started >= 1.0) {
+        if (metrics->sample_count < FTP_METRICS_MAX_SAMPLES) {
+            metrics->samples[metrics->sample_count++] = metrics->sample_bytes / (now - metrics->sample_started);
+        }
+        metrics->sample_started = now;
+        metrics->sample_bytes = 0;
     }
+}
+
+static void ftp_metrics_transfer_end(FTPClient *client) {
+    FTPMetrics *metrics = client->metrics;
     
-    // Construct IP and port
-    snprintf(client->server_ip, sizeof(client->server_ip), 
-             "%d.%d.%d.%d", h1, h2, h3, h4);
-    client->data_port = p1 * 256 + p2;
+    if (!metrics || metrics->transfer_started <= 0) return;
     
-    // Create data socket
-    client->data_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client->data_socket < 0) {
-        print_error("Data socket creation failed");
-        return -1;
+    // Keep a final partial-second sample so short transfers still report throughput
+    double now = ftp_now();
+    if (metrics->sample_bytes > 0 && now > metrics->sample_started &&
+        metrics->sample_count < FTP_METRICS_MAX_SAMPLES) {
+        metrics->samples[metrics->sample_count++] = metrics->sample_bytes / (now - metrics->sample_started);
+    }
+    metrics->phase_seconds[FTP_PHASE_TRANSFER] += now - metrics->transfer_started;
+    metrics->phase_count[FTP_PHASE_TRANSFER]++;
+    metrics->transfer_started = 0;
+    metrics->transfers++;
+}
+
+static double ftp_metrics_peak_throughput(const FTPMetrics *metrics) {
+    double peak = 0;
+    for (int i = 0; i < metrics->sample_count; i++) {
+        if (metrics->samples[i] > peak) peak = metrics->samples[i];
     }
+    return peak;
+}
+
+// Write text as a quoted JSON string
+static void ftp_json_string(FILE *out, const char *text) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)text; *p; p++) {
+        if (*p == '"' || *p == '\\') fprintf(out, "\\%c", *p);
+        else if (*p < 0x20) fprintf(out, "\\u%04x", *p);
+        else fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+// Emit one JSON object on a single line
+void ftp_metrics_write_json(const FTPMetrics *metrics, const char *label, FILE *out) {
+    fprintf(out, "{\"label\":");
+    ftp_json_string(out, label);
+    fprintf(out, ",\"time\":%lld,\"transfers\":%lld,\"bytes_sent\":%lld,\"bytes_received\":%lld,\"syscalls\":%lld",
+            (long long)time(NULL), metrics->transfers, metrics->bytes_sent, metrics->bytes_received, metrics->syscalls);
     
-    struct sockaddr_in data_addr;
-    memset(&data_addr, 0, sizeof(data_addr));
-    data_addr.sin_family = AF_INET;
-    data_addr.sin_port = htons(client->data_port);
-    inet_aton(client->server_ip, &data_addr.sin_addr);
+    fprintf(out, ",\"phases\":{");
+    for (int i = 0; i < FTP_PHASE_COUNT; i++) {
+        fprintf(out, "%s\"%s\":{\"seconds\":%.6f,\"count\":%lld}", i ? "," : "",
+                ftp_phase_names[i], metrics->phase_seconds[i], metrics->phase_count[i]);
+    }
     
-    // Connect data socket
-    if (connect(client->data_socket, (struct sockaddr*)&data_addr, sizeof(data_addr)) < 0) {
-        print_error("Data connection failed");
-        close(client->data_socket);
-        return -1;
+    fprintf(out, "},\"throughput_samples\":[");
+    for (int i = 0; i < metrics->sample_count; i++) {
+        fprintf(out, "%s%.0f", i ? "," : "", metrics->samples[i]);
     }
     
-    return 0;
+    fprintf(out, "],\"latency_ms\":{\"count\":%lld,\"sum\":%.3f,\"buckets\":{",
+            metrics->latency_count, metrics->latency_sum_ms);
+    for (int i = 0; i < FTP_LATENCY_BUCKETS; i++) {
+        if (i < FTP_LATENCY_BUCKETS - 1) fprintf(out, "%s\"%g\":%lld", i ? "," : "", ftp_latency_bounds_ms[i], metrics->latency_buckets[i]);
+        else fprintf(out, ",\"+Inf\":%lld", metrics->latency_buckets[i]);
+    }
+    fprintf(out, "}}}\n");
 }
 
-// List remote files
-int ftp_list_remote_files(FTPClient *client) {
-    char response[MAX_BUFFER];
-    char data_buffer[MAX_BUFFER];
-    
-    // Enter passive mode
-    if (ftp_enter_passive_mode(client) < 0) return -1;
+// Write a Prometheus text-format file (node_exporter textfile collector), atomically
+int ftp_metrics_write_prometheus(const FTPMetrics *metrics, const char *path) {
+    char temp_path[MAX_PATH + 16];
     
-    // Send LIST command
-    if (send_ftp_command(client, "LIST") < 0) return -1;
-    
-    // Get initial response
-    int response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 150) {
-        fprintf(stderr, "LIST command failed: %s\n", response);
-        close(client->data_socket);
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", path, (int)getpid());
+    FILE *out = fopen(temp_path, "w");
+    if (!out) {
+        print_error("Failed to write metrics file");
         return -1;
     }
     
-    // Read data
-    printf("Remote Files:\n");
-    int bytes_read;
-    while ((bytes_read = recv(client->data_socket, data_buffer, sizeof(data_buffer) - 1, 0)) > 0) {
-        data_buffer[bytes_read] = '\0';
-        printf("%s", data_buffer);
+    fprintf(out, "# HELP ftp_transfers_total Completed data transfers.\n# TYPE ftp_transfers_total counter\n");
+    fprintf(out, "ftp_transfers_total %lld\n", metrics->transfers);
+    fprintf(out, "# HELP ftp_bytes_total Data bytes moved.\n# TYPE ftp_bytes_total counter\n");
+    fprintf(out, "ftp_bytes_total{direction=\"sent\"} %lld\n", metrics->bytes_sent);
+    fprintf(out, "ftp_bytes_total{direction=\"received\"} %lld\n", metrics->bytes_received);
+    fprintf(out, "# HELP ftp_syscalls_total Socket and file syscalls issued by transfers.\n# TYPE ftp_syscalls_total counter\n");
+    fprintf(out, "ftp_syscalls_total %lld\n", metrics->syscalls);
+    
+    fprintf(out, "# HELP ftp_phase_seconds_total Time spent per phase.\n# TYPE ftp_phase_seconds_total counter\n");
+    for (int i = 0; i < FTP_PHASE_COUNT; i++) {
+        fprintf(out, "ftp_phase_seconds_total{phase=\"%s\"} %.6f\n", ftp_phase_names[i], metrics->phase_seconds[i]);
+    }
+    fprintf(out, "# HELP ftp_phase_count_total Times each phase ran.\n# TYPE ftp_phase_count_total counter\n");
+    for (int i = 0; i < FTP_PHASE_COUNT; i++) {
+        fprintf(out, "ftp_phase_count_total{phase=\"%s\"} %lld\n", ftp_phase_names[i], metrics->phase_count[i]);
     }
     
-    // Close data connection
-    close(client->data_socket);
+    double mean = 0;
+    for (int i = 0; i < metrics->sample_count; i++) mean += metrics->samples[i];
+    if (metrics->sample_count) mean /= metrics->sample_count;
+    fprintf(out, "# HELP ftp_throughput_bytes_per_second Per-second data throughput samples.\n# TYPE ftp_throughput_bytes_per_second gauge\n");
+    fprintf(out, "ftp_throughput_bytes_per_second{stat=\"mean\"} %.0f\n", mean);
+    fprintf(out, "ftp_throughput_bytes_per_second{stat=\"peak\"} %.0f\n", ftp_metrics_peak_throughput(metrics));
+    fprintf(out, "ftp_throughput_bytes_per_second{stat=\"last\"} %.0f\n",
+            metrics->sample_count ? metrics->samples[metrics->sample_count - 1] : 0.0);
     
-    // Get final response
-    response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 226) {
-        fprintf(stderr, "File listing incomplete: %s\n", response);
-        return -1;
+    fprintf(out, "# HELP ftp_reply_latency_seconds Control command to reply latency.\n# TYPE ftp_reply_latency_seconds histogram\n");
+    long long cumulative = 0;
+    for (int i = 0; i < FTP_LATENCY_BUCKETS; i++) {
+        cumulative += metrics->latency_buckets[i];
+        if (i < FTP_LATENCY_BUCKETS - 1) {
+            fprintf(out, "ftp_reply_latency_seconds_bucket{le=\"%g\"} %lld\n", ftp_latency_bounds_ms[i] / 1000.0, cumulative);
+        } else {
+            fprintf(out, "ftp_reply_latency_seconds_bucket{le=\"+Inf\"} %lld\n", cumulative);
+        }
     }
+    fprintf(out, "ftp_reply_latency_seconds_sum %.6f\n", metrics->latency_sum_ms / 1000.0);
+    fprintf(out, "ftp_reply_latency_seconds_count %lld\n", metrics->latency_count);
     
+    if (fclose(out) != 0 || rename(temp_path, path) < 0) {
+        print_error("Failed to write metrics file");
+        unlink(temp_path);
+        return -1;
+    }
     return 0;
 }
 
-// Change remote directory
-int ftp_change_remote_directory(FTPClient *client, const char *path) {
-    char command[MAX_COMMAND];
-    char response[MAX_BUFFER];
-    
-    snprintf(command, sizeof(command), "CWD %s", path);
-    if (send_ftp_command(client, command) < 0) return -1;
-    
-    int response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 250) {
-        fprintf(stderr, "Change directory failed: %s\n", response);
+// --metrics FILE: Prometheus text into FILE, or one JSON line on stderr for "-"
+static int ftp_metrics_write_file(const FTPMetrics *metrics, const char *label, const char *path) {
+    if (strcmp(path, "-")) return ftp_metrics_write_prometheus(metrics, path);
+    ftp_metrics_write_json(metrics, label, stderr);
+    return 0;
+}
+
+// Close one of client's sockets and mark it closed. Another thread holding
+// socket_lock may shut the sockets down; closing under the same lock keeps it
+// from hitting a descriptor number that was already reused
+void ftp_close_socket(FTPClient *client, int *socket_fd) {
+    if (client->socket_lock) pthread_mutex_lock(client->socket_lock);
+    if (*socket_fd >= 0) close(*socket_fd);
+    *socket_fd = -1;
+    if (client->socket_lock) pthread_mutex_unlock(client->socket_lock);
+}
+
+// Send FTP command and check for basic error
+int send_ftp_command(FTPClient *client, const char *command) {
+    char full_command[MAX_COMMAND];
+    snprintf(full_command, sizeof(full_command), "%s\r\n", command);
+    
+    // A dropped connection is reported here, not by SIGPIPE
+    int sent_bytes = send(client->control_socket, full_command, strlen(full_command), MSG_NOSIGNAL);
+    if (sent_bytes < 0) {
+        print_error("Failed to send command");
         return -1;
     }
+    ftp_metrics_command_sent(client);
     
-    strncpy(client->current_remote_dir, path, sizeof(client->current_remote_dir) - 1);
     return 0;
 }
 
-// Download file
-int ftp_download_file(FTPClient *client, const char *remote_file, const char *local_file) {
-    char response[MAX_BUFFER];
-    char command[MAX_COMMAND];
-    FILE *local_fp;
+// Send several independent commands in one write; their replies arrive in order
+int send_ftp_pipelined(FTPClient *client, const char *const commands[], int count) {
+    char batch[MAX_BUFFER];
+    size_t length = 0;
     
-    // Enter passive mode
-    if (ftp_enter_passive_mode(client) < 0) return -1;
+    for (int i = 0; i < count; i++) {
+        int written = snprintf(batch + length, sizeof(batch) - length, "%s\r\n", commands[i]);
+        if (written < 0 || (size_t)written >= sizeof(batch) - length) {
+            fprintf(stderr, "Pipelined commands too long\n");
+            return -1;
+        }
+        length += written;
+    }
     
-    // Open local file
-    local_fp = fopen(local_file, "wb");
-    if (!local_fp) {
-        print_error("Failed to open local file");
+    if (send_all(client->control_socket, batch, length) < 0) {
+        print_error("Failed to send command");
         return -1;
     }
+    ftp_metrics_command_sent(client);
     
-    // Send RETR command
-    snprintf(command, sizeof(command), "RETR %s", remote_file);
-    if (send_ftp_command(client, command) < 0) {
-        fclose(local_fp);
+    return 0;
+}
+
+// Drop the middle lines of a multi-line reply that does not fit the buffer
+static int ftp_compact_reply(FTPClient *client) {
+    char *first = memchr(client->reply_buffer, '\n', client->reply_length);
+    char *last = memrchr(client->reply_buffer, '\n', client->reply_length);
+    if (!first || first == last) return -1;
+    
+    size_t keep_head = first - client->reply_buffer + 1;
+    size_t tail_start = last - client->reply_buffer + 1;
+    memmove(client->reply_buffer + keep_head, client->reply_buffer + tail_start, client->reply_length - tail_start);
+    client->reply_length -= tail_start - keep_head;
+    return 0;
+}
+
+// Receive one complete FTP response, buffering partial and extra bytes
+int recv_ftp_response(FTPClient *client, char *response, size_t max_len) {
+    int response_code;
+    
+    if (response && max_len > 0) response[0] = '\0';
+    
+    while ((response_code = ftp_extract_reply(client->reply_buffer, &client->reply_length, response, max_len)) == 0) {
+        if (client->reply_length == sizeof(client->reply_buffer) && ftp_compact_reply(client) < 0) {
+            fprintf(stderr, "Server response too long\n");
+            client->reply_length = 0;
+            return -1;
+        }
+        
+        // A server that stops answering must not hang the session for ever
+        int timeout_ms = client->tuning.reply_timeout_ms ? client->tuning.reply_timeout_ms : FTP_REPLY_TIMEOUT_MS;
+        struct pollfd control = { client->control_socket, POLLIN, 0 };
+        int ready = timeout_ms > 0 ? poll(&control, 1, timeout_ms) : 1;
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready == 0) {
+            // Whatever arrives later would be taken for the next command's reply
+            fprintf(stderr, "No reply from server within %.1f s\n", timeout_ms / 1000.0);
+            shutdown(client->control_socket, SHUT_RDWR);
+            client->last_reply = -1;
+            client->failed_reply = 0;  // no reply ended the operation: not a refusal
+            return -1;
+        }
+
+        ssize_t received_bytes = recv(client->control_socket, client->reply_buffer + client->reply_length,
+                                      sizeof(client->reply_buffer) - client->reply_length, 0);
+        if (received_bytes < 0) {
+            if (errno == EINTR) continue;
+            print_error("Failed to receive server response");
+            client->last_reply = -1;
+            client->failed_reply = 0;
+            return -1;
+        }
+        if (received_bytes == 0) {
+            fprintf(stderr, "Server closed the control connection\n");
+            client->last_reply = -1;
+            client->failed_reply = 0;
+            return -1;
+        }
+        client->reply_length += received_bytes;
+        ftp_metrics_syscall(client);
+    }
+    
+    ftp_metrics_reply(client);
+    client->last_reply = response_code;
+    if (response_code >= 400) client->failed_reply = response_code;
+    return response_code;
+}
+
+// Print error with system error description
+void print_error(const char *message) {
+    fprintf(stderr, "%s: %s\n", message, strerror(errno));
+}
+
+// ---------------------------------------------------------------------------
+// Socket tuning: transfer buffer size, BDP-sized socket buffers, TCP_NODELAY
+// on the control connection and TCP_INFO reports
+// ---------------------------------------------------------------------------
+
+// Transfer buffer size in effect, clamped to sane bounds
+size_t ftp_transfer_buffer_size(const FTPClient *client) {
+    size_t size = client->tuning.transfer_buffer ? client->tuning.transfer_buffer : FTP_DEFAULT_TRANSFER_BUFFER;
+    
+    if (size < FTP_MIN_TRANSFER_BUFFER) size = FTP_MIN_TRANSFER_BUFFER;
+    if (size > FTP_MAX_TRANSFER_BUFFER) size = FTP_MAX_TRANSFER_BUFFER;
+    return size;
+}
+
+// The client's transfer buffer, (re)allocated when the configured size changed
+static char *ftp_transfer_buffer(FTPClient *client) {
+    size_t size = ftp_transfer_buffer_size(client);
+    
+    if (client->transfer_buffer && client->transfer_buffer_size == size) return client->transfer_buffer;
+    free(client->transfer_buffer);
+    client->transfer_buffer = malloc(size);
+    client->transfer_buffer_size = client->transfer_buffer ? size : 0;
+    if (!client->transfer_buffer) print_error("Failed to allocate transfer buffer");
+    return client->transfer_buffer;
+}
+
+// Commands and replies are small and latency bound: never hold them back
+void ftp_tune_control_socket(int socket_fd) {
+    int enable = 1;
+    setsockopt(socket_fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+}
+
+// Bandwidth-delay product in bytes, from the configured link speed and the
+// configured RTT or the kernel's smoothed RTT of the control connection;
+// 0 when the link speed is not known
+long long ftp_estimate_bdp(const FTPClient *client) {
+    double bps = client->tuning.link_bps;
+    double rtt = client->tuning.rtt_ms / 1000;
+    
+    if (bps <= 0) return 0;
+    
+    if (rtt <= 0 && client->control_socket >= 0) {
+        struct tcp_info info;
+        socklen_t length = sizeof(info);
+        if (getsockopt(client->control_socket, IPPROTO_TCP, TCP_INFO, &info, &length) == 0) {
+            rtt = info.tcpi_rtt / 1e6;
+        }
+    }
+    return (long long)(bps / 8 * rtt);
+}
+
+// Upper limit of receive buffer autotuning (net.ipv4.tcp_rmem / tcp_wmem)
+static long long ftp_autotuning_limit(const char *path) {
+    long long minimum, initial, maximum = 0;
+    FILE *file = fopen(path, "r");
+    
+    if (!file) return 0;
+    if (fscanf(file, "%lld %lld %lld", &minimum, &initial, &maximum) != 3) maximum = 0;
+    fclose(file);
+    return maximum;
+}
+
+// Set one socket buffer; SO_*BUFFORCE lifts the net.core.*mem_max cap when privileged.
+// Without force_only an unprivileged process falls back to the capped option.
+static void ftp_set_socket_buffer(int socket_fd, int force_option, int option, long long bytes, int force_only) {
+    int value = bytes > FTP_MAX_SOCKET_BUFFER ? FTP_MAX_SOCKET_BUFFER : (int)bytes;
+    
+    if (setsockopt(socket_fd, SOL_SOCKET, force_option, &value, sizeof(value)) < 0 && !force_only) {
+        setsockopt(socket_fd, SOL_SOCKET, option, &value, sizeof(value));
+    }
+}
+
+// How long a data connection may go without progress, in ms; <= 0 for no
+// limit. With a minimum rate it is at most one stall window, so that a
+// connection that stops dead is caught even though no bytes arrive to check.
+static int ftp_data_idle_ms(const FTPClient *client) {
+    int idle_ms = client->tuning.idle_timeout_ms ? client->tuning.idle_timeout_ms : FTP_IDLE_TIMEOUT_MS;
+    if (client->tuning.min_rate > 0) {
+        double window = client->tuning.stall_window > 0 ? client->tuning.stall_window : FTP_STALL_WINDOW;
+        if (idle_ms < 0 || idle_ms > window * 1000) idle_ms = (int)(window * 1000);
+    }
+    return idle_ms;
+}
+
+// Size a data socket's buffers before connect() so the window scale covers them.
+// Fixing a buffer size switches off the kernel's autotuning, so in the default
+// (BDP) mode that is only done for a direction whose autotuning cannot reach
+// the BDP of a known link, and only when SO_*BUFFORCE gets past mem_max:
+// a buffer capped at net.core.*mem_max would be smaller than autotuning's.
+void ftp_tune_data_socket(const FTPClient *client, int socket_fd) {
+    long long bytes = client->tuning.socket_buffer;
+    
+    // A data connection that makes no progress fails the blocking loops
+    // with EAGAIN instead of hanging; stall detection covers slow progress
+    int idle_ms = ftp_data_idle_ms(client);
+    if (idle_ms > 0) {
+        struct timeval timeout = { idle_ms / 1000, (idle_ms % 1000) * 1000 };
+        setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    }
+    
+    if (bytes > 0) {
+        ftp_set_socket_buffer(socket_fd, SO_RCVBUFFORCE, SO_RCVBUF, bytes, 0);
+        ftp_set_socket_buffer(socket_fd, SO_SNDBUFFORCE, SO_SNDBUF, bytes, 0);
+        return;
+    }
+    if (bytes < 0 || (bytes = ftp_estimate_bdp(client)) == 0) return;
+    
+    // The kernel keeps part of the buffer for its own overhead
+    if (bytes > ftp_autotuning_limit("/proc/sys/net/ipv4/tcp_rmem") / 2) {
+        ftp_set_socket_buffer(socket_fd, SO_RCVBUFFORCE, SO_RCVBUF, bytes * 2, 1);
+    }
+    if (bytes > ftp_autotuning_limit("/proc/sys/net/ipv4/tcp_wmem") / 2) {
+        ftp_set_socket_buffer(socket_fd, SO_SNDBUFFORCE, SO_SNDBUF, bytes * 2, 1);
+    }
+}
+
+// Print the kernel's view of a data connection: RTT, congestion window, retransmits
+void ftp_report_tcp_info(const FTPClient *client, int socket_fd) {
+    struct tcp_info info;
+    socklen_t length = sizeof(info);
+    int receive_buffer = 0, send_buffer = 0;
+    socklen_t option_length = sizeof(int);
+    
+    if (getsockopt(socket_fd, IPPROTO_TCP, TCP_INFO, &info, &length) < 0) {
+        print_error("TCP_INFO unavailable");
+        return;
+    }
+    getsockopt(socket_fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, &option_length);
+    option_length = sizeof(int);
+    getsockopt(socket_fd, SOL_SOCKET, SO_SNDBUF, &send_buffer, &option_length);
+    
+    printf("TCP: rtt %.3f ms (var %.3f), cwnd %u x %u bytes, retransmits %u, "
+           "rcv_space %u, rcvbuf %d, sndbuf %d, buffer %zu\n",
+           info.tcpi_rtt / 1000.0, info.tcpi_rttvar / 1000.0, info.tcpi_snd_cwnd, info.tcpi_snd_mss,
+           info.tcpi_total_retrans, info.tcpi_rcv_space, receive_buffer, send_buffer,
+           ftp_transfer_buffer_size(client));
+}
+
+// ---------------------------------------------------------------------------
+// Name resolution and connection racing: getaddrinfo_a with a timeout, an
+// in-process TTL cache, and RFC 8305 happy eyeballs across the results
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char hostname[256];
+    FTPAddress addresses[FTP_MAX_ADDRESSES];
+    int count;
+    time_t expires;
+} FTPResolverEntry;
+
+static FTPResolverEntry ftp_resolver_cache[FTP_RESOLVER_SLOTS];
+static pthread_mutex_t ftp_resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static int ftp_resolver_ttl = FTP_RESOLVER_TTL;
+
+// An asynchronous lookup, shared between the caller and glibc's completion
+// thread; whichever lets go last frees it, so a timed-out lookup can be abandoned
+typedef struct {
+    struct gaicb request;
+    struct addrinfo hints;
+    char hostname[256];
+    int references;
+} FTPLookup;
+
+static void ftp_lookup_release(FTPLookup *lookup) {
+    if (__atomic_sub_fetch(&lookup->references, 1, __ATOMIC_ACQ_REL) > 0) return;
+    if (lookup->request.ar_result) freeaddrinfo(lookup->request.ar_result);
+    free(lookup);
+}
+
+static void ftp_lookup_done(union sigval value) {
+    ftp_lookup_release(value.sival_ptr);
+}
+
+// Entries older than ttl seconds are resolved again; 0 disables caching
+void ftp_resolver_set_ttl(int ttl) {
+    pthread_mutex_lock(&ftp_resolver_lock);
+    ftp_resolver_ttl = ttl;
+    pthread_mutex_unlock(&ftp_resolver_lock);
+}
+
+void ftp_resolver_flush(void) {
+    pthread_mutex_lock(&ftp_resolver_lock);
+    memset(ftp_resolver_cache, 0, sizeof(ftp_resolver_cache));
+    pthread_mutex_unlock(&ftp_resolver_lock);
+}
+
+// Order addresses as RFC 8305 section 4 asks: keep getaddrinfo's (RFC 6724)
+// preference, but alternate address families starting with the preferred one
+static int ftp_interleave_families(const struct addrinfo *list, FTPAddress *addresses, int max) {
+    const struct addrinfo *first[2] = { NULL, NULL }, *cursor[2];
+    int preferred = -1, count = 0;
+
+    for (const struct addrinfo *ai = list; ai; ai = ai->ai_next) {
+        int family = ai->ai_family == AF_INET6;
+        if (ai->ai_family != AF_INET && ai->ai_family != AF_INET6) continue;
+        if (preferred < 0) preferred = family;
+        if (!first[family]) first[family] = ai;
+    }
+    if (preferred < 0) return 0;
+
+    cursor[0] = first[0];
+    cursor[1] = first[1];
+    for (int turn = preferred; count < max && (cursor[0] || cursor[1]); turn = !turn) {
+        const struct addrinfo *ai = cursor[turn];
+        if (!ai) continue;
+
+        memcpy(&addresses[count].address, ai->ai_addr, ai->ai_addrlen);
+        addresses[count].length = ai->ai_addrlen;
+        count++;
+
+        // Next address of the same family
+        int family = turn ? AF_INET6 : AF_INET;
+        for (ai = ai->ai_next; ai && ai->ai_family != family; ai = ai->ai_next) {
+        }
+        cursor[turn] = ai;
+    }
+    return count;
+}
+
+// Resolve hostname into at most max addresses (port not set), from the cache
+// when possible. Returns the number of addresses, or -1.
+int ftp_resolve(const char *hostname, FTPAddress *addresses, int max) {
+    time_t now = time(NULL);
+    int count = -1;
+
+    pthread_mutex_lock(&ftp_resolver_lock);
+    for (int i = 0; i < FTP_RESOLVER_SLOTS; i++) {
+        FTPResolverEntry *entry = &ftp_resolver_cache[i];
+        if (entry->count > 0 && entry->expires > now && !strcmp(entry->hostname, hostname)) {
+            count = entry->count < max ? entry->count : max;
+            memcpy(addresses, entry->addresses, count * sizeof(FTPAddress));
+            break;
+        }
+    }
+    pthread_mutex_unlock(&ftp_resolver_lock);
+    if (count > 0) return count;
+
+    FTPLookup *lookup = calloc(1, sizeof(*lookup));
+    struct gaicb *list[1];
+    struct sigevent notify;
+
+    if (!lookup) return -1;
+    snprintf(lookup->hostname, sizeof(lookup->hostname), "%s", hostname);
+    lookup->hints.ai_family = AF_UNSPEC;
+    lookup->hints.ai_socktype = SOCK_STREAM;
+    lookup->hints.ai_flags = AI_ADDRCONFIG;
+    lookup->request.ar_name = lookup->hostname;
+    lookup->request.ar_request = &lookup->hints;
+    lookup->references = 2;
+    list[0] = &lookup->request;
+
+    memset(&notify, 0, sizeof(notify));
+    notify.sigev_notify = SIGEV_THREAD;
+    notify.sigev_notify_function = ftp_lookup_done;
+    notify.sigev_value.sival_ptr = lookup;
+
+    int status = getaddrinfo_a(GAI_NOWAIT, list, 1, &notify);
+    if (status != 0) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", hostname, gai_strerror(status));
+        free(lookup);
+        return -1;
+    }
+
+    struct timespec timeout = { FTP_RESOLVE_TIMEOUT_MS / 1000, (FTP_RESOLVE_TIMEOUT_MS % 1000) * 1000000L };
+    const struct gaicb *const *wait_list = (const struct gaicb *const *)list;
+    do {
+        status = gai_suspend(wait_list, 1, &timeout);
+    } while (status == EAI_INTR);
+
+    status = gai_error(&lookup->request);
+    if (status == EAI_INPROGRESS) {
+        fprintf(stderr, "Failed to resolve %s: timed out\n", hostname);
+        gai_cancel(&lookup->request);  // the completion thread still frees it
+        ftp_lookup_release(lookup);
+        return -1;
+    }
+    if (status != 0) {
+        fprintf(stderr, "Failed to resolve %s: %s\n", hostname, gai_strerror(status));
+        ftp_lookup_release(lookup);
+        return -1;
+    }
+
+    count = ftp_interleave_families(lookup->request.ar_result, addresses, max);
+    ftp_lookup_release(lookup);
+    if (count <= 0) {
+        fprintf(stderr, "Failed to resolve %s: no IPv4 or IPv6 address\n", hostname);
         return -1;
     }
+
+    // Cache in the expired or oldest slot
+    pthread_mutex_lock(&ftp_resolver_lock);
+    if (ftp_resolver_ttl > 0 && strlen(hostname) < sizeof(ftp_resolver_cache[0].hostname)) {
+        FTPResolverEntry *slot = &ftp_resolver_cache[0];
+        for (int i = 0; i < FTP_RESOLVER_SLOTS; i++) {
+            FTPResolverEntry *entry = &ftp_resolver_cache[i];
+            if (!strcmp(entry->hostname, hostname) || entry->expires <= now) {
+                slot = entry;
+                break;
+            }
+            if (entry->expires < slot->expires) slot = entry;
+        }
+        snprintf(slot->hostname, sizeof(slot->hostname), "%s", hostname);
+        memcpy(slot->addresses, addresses, count * sizeof(FTPAddress));
+        slot->count = count;
+        slot->expires = now + ftp_resolver_ttl;
+    }
+    pthread_mutex_unlock(&ftp_resolver_lock);
+    return count;
+}
+
+void ftp_address_set_port(FTPAddress *address, int port) {
+    if (address->address.ss_family == AF_INET6) ((struct sockaddr_in6 *)&address->address)->sin6_port = htons(port);
+    else ((struct sockaddr_in *)&address->address)->sin_port = htons(port);
+}
+
+// Numeric form of an address, without the port
+void ftp_address_to_string(const FTPAddress *address, char *out, size_t max_len) {
+    const void *raw = address->address.ss_family == AF_INET6
+        ? (const void *)&((const struct sockaddr_in6 *)&address->address)->sin6_addr
+        : (const void *)&((const struct sockaddr_in *)&address->address)->sin_addr;
+
+    if (!inet_ntop(address->address.ss_family, raw, out, max_len)) snprintf(out, max_len, "?");
+}
+
+// Connect to whichever address answers first (RFC 8305 section 5): a new attempt
+// starts every FTP_ATTEMPT_DELAY_MS, or as soon as one fails, while earlier ones
+// keep running. Data sockets are tuned before connect(). Returns a blocking
+// socket and its address in connected, or -1 after timeout_ms.
+int ftp_connect_race(const FTPClient *client, const FTPAddress *addresses, int count,
+                     int is_data, int timeout_ms, FTPAddress *connected) {
+    struct pollfd attempts[FTP_MAX_ADDRESSES];
+    int attempt_index[FTP_MAX_ADDRESSES];
+    int pending = 0, next = 0, winner = -1, last_error = ECONNREFUSED;
+    double deadline = ftp_now() + timeout_ms / 1000.0;
+    double next_attempt = 0;
+
+    if (count > FTP_MAX_ADDRESSES) count = FTP_MAX_ADDRESSES;
+
+    while (winner < 0) {
+        double now = ftp_now();
+        if (now >= deadline) {
+            last_error = ETIMEDOUT;
+            break;
+        }
+
+        if (next < count && (pending == 0 || now >= next_attempt)) {
+            const FTPAddress *address = &addresses[next];
+            int socket_fd = socket(address->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+            if (socket_fd >= 0) {
+                if (is_data) ftp_tune_data_socket(client, socket_fd);
+                else ftp_tune_control_socket(socket_fd);
+
+                if (connect(socket_fd, (const struct sockaddr *)&address->address, address->length) == 0) {
+                    winner = socket_fd;
+                    *connected = *address;
+                    break;
+                }
+                if (errno == EINPROGRESS) {
+                    attempts[pending].fd = socket_fd;
+                    attempts[pending].events = POLLOUT;
+                    attempt_index[pending] = next;
+                    pending++;
+                } else {
+                    last_error = errno;
+                    close(socket_fd);
+                }
+            } else {
+                last_error = errno;
+            }
+            next++;
+            next_attempt = now + FTP_ATTEMPT_DELAY_MS / 1000.0;
+            continue;
+        }
+        if (pending == 0) break;  // every address failed
+
+        double until = (next < count && next_attempt < deadline) ? next_attempt : deadline;
+        int wait_ms = (int)((until - now) * 1000) + 1;
+        if (poll(attempts, pending, wait_ms) < 0 && errno != EINTR) {
+            last_error = errno;
+            break;
+        }
+
+        for (int i = 0; i < pending; i++) {
+            int error = 0;
+            socklen_t length = sizeof(error);
+
+            if (!attempts[i].revents) continue;
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &length);
+            if (error == 0) {
+                winner = attempts[i].fd;
+                *connected = addresses[attempt_index[i]];
+                attempts[i] = attempts[--pending];
+                attempt_index[i] = attempt_index[pending];
+                break;
+            }
+            // Failed: drop it and let the next address start right away
+            last_error = error;
+            close(attempts[i].fd);
+            attempts[i] = attempts[--pending];
+            attempt_index[i] = attempt_index[pending];
+            next_attempt = 0;
+            i--;
+        }
+    }
+
+    for (int i = 0; i < pending; i++) close(attempts[i].fd);
+    if (winner < 0) {
+        errno = last_error;
+        return -1;
+    }
+    fcntl(winner, F_SETFL, fcntl(winner, F_GETFL) & ~O_NONBLOCK);
+    return winner;
+}
+
+// Connect timeout in effect for a client
+static int ftp_connect_timeout_ms(const FTPClient *client) {
+    return client->tuning.connect_timeout_ms > 0 ? client->tuning.connect_timeout_ms : FTP_CONNECT_TIMEOUT_MS;
+}
+
+// Command that opens a passive data connection. EPSV (RFC 2428) reuses the
+// control connection's address, so it works over IPv6 and through NAT; IPv4
+// sessions use it when FEAT advertised it and it has not failed before.
+const char *ftp_passive_command(const FTPClient *client) {
+    if (client->server_address.address.ss_family == AF_INET6) return "EPSV";
+    return (client->features & FTP_FEATURE_EPSV) && !client->epsv_failed ? "EPSV" : "PASV";
+}
+
+// Turn a 227 (PASV) or 229 (EPSV) reply into the data connection's address
+int ftp_parse_passive_reply(const FTPClient *client, int code, const char *reply, FTPAddress *address) {
+    const char *open = strchr(reply, '(');
+    int h1, h2, h3, h4, p1, p2, port;
+
+    if (!open) return -1;
+    if (code == 229) {
+        // "(|||port|)"; the delimiter may be any printable character
+        char delimiter = open[1];
+        const char *digits = open + 4;
+        if (!delimiter || open[2] != delimiter || open[3] != delimiter ||
+            sscanf(digits, "%d", &port) != 1 || port <= 0 || port > 65535) {
+            return -1;
+        }
+        *address = client->server_address;
+        ftp_address_set_port(address, port);
+        return 0;
+    }
+    if (code == 227 && sscanf(open, "(%d,%d,%d,%d,%d,%d)", &h1, &h2, &h3, &h4, &p1, &p2) == 6) {
+        struct sockaddr_in *ipv4 = (struct sockaddr_in *)&address->address;
+        memset(address, 0, sizeof(*address));
+        ipv4->sin_family = AF_INET;
+        ipv4->sin_addr.s_addr = htonl((unsigned)h1 << 24 | h2 << 16 | h3 << 8 | h4);
+        ipv4->sin_port = htons(p1 * 256 + p2);
+        address->length = sizeof(*ipv4);
+        return 0;
+    }
+    return -1;
+}
+
+// Connect to FTP server
+int ftp_connect(FTPClient *client, const char *hostname) {
+    FTPAddress addresses[FTP_MAX_ADDRESSES];
+    char response[MAX_BUFFER];
+    double started = ftp_now();
+
+    client->prepared_socket = -1;  // -1 like the other descriptors: 0 is a valid one
+
+    // Resolve hostname (IPv4 and IPv6, cached)
+    int count = ftp_resolve(hostname, addresses, FTP_MAX_ADDRESSES);
+    if (count < 0) return -1;
+    ftp_metrics_phase(client, FTP_PHASE_RESOLVE, started);
+    started = ftp_now();
+
+    // Prepare server addresses
+    if (client->server_port <= 0) {
+        client->server_port = FTP_DEFAULT_PORT;  // Standard FTP control port
+    }
+    for (int i = 0; i < count; i++) ftp_address_set_port(&addresses[i], client->server_port);
+
+    // Connect to whichever address answers first
+    client->control_socket = ftp_connect_race(client, addresses, count, 0, ftp_connect_timeout_ms(client),
+                                              &client->server_address);
+    if (client->control_socket < 0) {
+        print_error("Connection failed");
+        return -1;
+    }
+
+    ftp_metrics_phase(client, FTP_PHASE_CONNECT, started);
+    started = ftp_now();
+
+    // Store server details
+    client->reply_length = 0;
+    client->features = 0;
+    client->epsv_failed = 0;
+    if (client->server_hostname != hostname) {
+        snprintf(client->server_hostname, sizeof(client->server_hostname), "%s", hostname);
+    }
+    ftp_address_to_string(&client->server_address, client->server_ip, sizeof(client->server_ip));
     
-    // Initial response
+    // Receive welcome message
     int response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 150) {
-        fprintf(stderr, "File retrieval failed: %s\n", response);
-        fclose(local_fp);
-        close(client->data_socket);
+    if (response_code != 220) {
+        fprintf(stderr, "Server connection failed: %s\n", response);
+        ftp_close_socket(client, &client->control_socket);
         return -1;
     }
+    ftp_metrics_phase(client, FTP_PHASE_BANNER, started);
+
+    client->state = FTP_CONNECTED;
+    return 0;
+}
+
+// Parse a multi-line FEAT reply: one extension per line, indented by a space
+unsigned ftp_parse_features(const char *reply) {
+    static const struct { const char *name; unsigned flag; } known[] = {
+        { "EPSV", FTP_FEATURE_EPSV }, { "MLSD", FTP_FEATURE_MLSD }, { "SIZE", FTP_FEATURE_SIZE },
+        { "MDTM", FTP_FEATURE_MDTM }, { "REST STREAM", FTP_FEATURE_REST },
+        { "XMD5", FTP_FEATURE_XMD5 }, { "XCRC", FTP_FEATURE_XCRC }, { "MODE Z", FTP_FEATURE_MODE_Z }
+    };
+    static const struct { const char *name; unsigned flag; } hashes[] = {
+        { "SHA-256", FTP_FEATURE_HASH_SHA256 }, { "MD5", FTP_FEATURE_HASH_MD5 }, { "CRC32", FTP_FEATURE_HASH_CRC32 }
+    };
+    unsigned features = 0;
+    
+    for (const char *line = strchr(reply, '\n'); line; line = strchr(line + 1, '\n')) {
+        if (line[1] != ' ') continue;
+        for (size_t i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+            size_t length = strlen(known[i].name);
+            if (!strncasecmp(line + 2, known[i].name, length) && !isalnum((unsigned char)line[2 + length])) {
+                features |= known[i].flag;
+            }
+        }
+        // " HASH SHA-1;SHA-256*;MD5": '*' marks the current selection
+        if (!strncasecmp(line + 2, "HASH ", 5)) {
+            const char *algorithm = line + 7;
+            while (*algorithm && *algorithm != '\r' && *algorithm != '\n') {
+                size_t length = strcspn(algorithm, ";*\r\n");
+                for (size_t i = 0; i < sizeof(hashes) / sizeof(hashes[0]); i++) {
+                    if (length == strlen(hashes[i].name) && !strncasecmp(algorithm, hashes[i].name, length)) {
+                        features |= hashes[i].flag;
+                    }
+                }
+                algorithm += length;
+                algorithm += strspn(algorithm, ";*");
+            }
+        }
+    }
+    return features;
+}
+
+// Login to FTP server
+int ftp_login(FTPClient *client, const char *username, const char *password) {
+    char user_command[MAX_COMMAND];
+    char pass_command[MAX_COMMAND];
+    char response[MAX_BUFFER];
+    double started = ftp_now();
     
-    // Download file
-    char data_buffer[MAX_BUFFER];
-    int bytes_read;
-    while ((bytes_read = recv(client->data_socket, data_buffer, sizeof(data_buffer), 0)) > 0) {
-        fwrite(data_buffer, 1, bytes_read, local_fp);
+    // Send username, password and FEAT back-to-back
+    snprintf(user_command, sizeof(user_command), "USER %s", username);
+    snprintf(pass_command, sizeof(pass_command), "PASS %s", password);
+    const char *commands[] = { user_command, pass_command, "FEAT" };
+    if (send_ftp_pipelined(client, commands, 3) < 0) return -1;
+    
+    int user_code = recv_ftp_response(client, response, sizeof(response));
+    if (user_code != 331 && user_code != 230) {
+        fprintf(stderr, "Username error: %s\n", response);
+        recv_ftp_response(client, NULL, 0);  // PASS reply
+        recv_ftp_response(client, NULL, 0);  // FEAT reply
+        return -1;
     }
     
-    // Close file and data connection
-    fclose(local_fp);
-    close(client->data_socket);
+    // After a 230 to USER the PASS reply (usually 503/202) carries no news
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (user_code == 331 && response_code != 230 && response_code != 202) {
+        fprintf(stderr, "Login failed: %s\n", response);
+        recv_ftp_response(client, NULL, 0);  // FEAT reply
+        return -1;
+    }
     
-    // Final response
+    // Servers without FEAT (500/502) get the RFC 959 baseline
     response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 226) {
-        fprintf(stderr, "File download incomplete: %s\n", response);
+    client->features = response_code == 211 ? ftp_parse_features(response) : 0;
+    
+    // Store login details
+    snprintf(client->username, sizeof(client->username), "%s", username);
+    snprintf(client->password, sizeof(client->password), "%s", password);
+    
+    client->state = FTP_LOGGED_IN;
+    ftp_metrics_phase(client, FTP_PHASE_LOGIN, started);
+    return 0;
+}
+
+// Enter passive mode
+int ftp_enter_passive_mode(FTPClient *client) {
+    const char *commands[1];
+    
+    return ftp_send_passive_pipelined(client, commands, 1, 0);
+}
+
+// Read the PASV/EPSV reply and connect the data socket (it may have been pipelined).
+// Returns -2 when an IPv4 server refused EPSV: the same request sent again
+// goes out as PASV.
+int ftp_complete_passive_mode(FTPClient *client) {
+    char response[MAX_BUFFER];
+    FTPAddress data_address;
+    double started = client->metrics ? client->metrics->command_sent_at : 0;
+    
+    // This PASV replaced the one a prepared connection was for
+    ftp_discard_prepared_channel(client);
+    
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 227 && response_code != 229) {
+        // An IPv4 session falls back to PASV after a refused EPSV
+        if (response_code >= 500 && client->server_address.address.ss_family == AF_INET &&
+            !strcmp(ftp_passive_command(client), "EPSV")) {
+            client->epsv_failed = 1;
+            client->failed_reply = 0;  // the PASV retry decides
+            return -2;
+        }
+        fprintf(stderr, "Passive mode failed: %s\n", response);
+        return -1;
+    }
+    
+    // Parse passive mode response
+    if (ftp_parse_passive_reply(client, response_code, response, &data_address) < 0) {
+        fprintf(stderr, "Failed to parse passive mode response\n");
+        return -1;
+    }
+    client->data_port = ntohs(data_address.address.ss_family == AF_INET6
+                              ? ((struct sockaddr_in6 *)&data_address.address)->sin6_port
+                              : ((struct sockaddr_in *)&data_address.address)->sin_port);
+    
+    // Connect data socket
+    client->data_socket = ftp_connect_race(client, &data_address, 1, 1, ftp_connect_timeout_ms(client), &data_address);
+    if (client->data_socket < 0) {
+        print_error("Data connection failed");
         return -1;
     }
-    
-    printf("File downloaded successfully: %s\n", local_file);
-    return 0;
+    ftp_metrics_phase(client, FTP_PHASE_PASSIVE, started);
+    
+    return 0;
+}
+
+// Send commands[] in one write with the PASV/EPSV filled in at commands[passive],
+// read the replies to the commands before it (which must succeed), and
+// connect the data socket. When an IPv4 server refuses EPSV the replies to
+// the rest are read and everything from commands[passive] on goes out once
+// more behind a PASV. Returns 0, or -1 with the replies to the rest read.
+int ftp_send_passive_pipelined(FTPClient *client, const char **commands, int count, int passive) {
+    char response[MAX_BUFFER];
+    
+    for (int attempt = 0; ; attempt++) {
+        commands[passive] = ftp_passive_command(client);
+        int first = attempt ? passive : 0;
+        if (send_ftp_pipelined(client, commands + first, count - first) < 0) return -1;
+        
+        for (int i = first; i < passive; i++) {
+            int code = recv_ftp_response(client, response, sizeof(response));
+            if (code < 0 || code >= 400) {
+                fprintf(stderr, "%s failed: %s\n", commands[i], response);
+                for (int j = i + 1; j < count; j++) recv_ftp_response(client, NULL, 0);
+                return -1;
+            }
+        }
+        
+        int status = ftp_complete_passive_mode(client);
+        if (status == 0) return 0;
+        for (int i = passive + 1; i < count; i++) recv_ftp_response(client, NULL, 0);
+        if (status != -2 || attempt > 0) return -1;
+    }
+}
+
+// Drop a data connection opened ahead that the next command will not use
+void ftp_discard_prepared_channel(FTPClient *client) {
+    if (client->prepared_socket >= 0) close(client->prepared_socket);
+    client->prepared_socket = -1;
+}
+
+// Read the reply to a PASV/EPSV sent ahead with the previous transfer and
+// start connecting; the handshake runs while the caller moves on to the
+// next file. Nothing is lost if it fails: the next transfer asks again.
+static void ftp_prepare_data_channel(FTPClient *client) {
+    char response[MAX_BUFFER];
+    FTPAddress address;
+
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if ((response_code != 227 && response_code != 229) ||
+        ftp_parse_passive_reply(client, response_code, response, &address) < 0) {
+        return;
+    }
+    int socket_fd = socket(address.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (socket_fd < 0) return;
+    ftp_tune_data_socket(client, socket_fd);
+    if (connect(socket_fd, (const struct sockaddr *)&address.address, address.length) < 0 && errno != EINPROGRESS) {
+        close(socket_fd);
+        return;
+    }
+    client->prepared_socket = socket_fd;
+    client->prepared_at = ftp_now();
+}
+
+// Use the prepared data connection for this transfer, once its handshake
+// has finished. Returns -1 when there is none, or it is stale or failed.
+static int ftp_take_prepared_channel(FTPClient *client) {
+    int socket_fd = client->prepared_socket;
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (socket_fd < 0) return -1;
+    client->prepared_socket = -1;
+
+    struct pollfd connected = { socket_fd, POLLOUT, 0 };
+    if (ftp_now() - client->prepared_at > FTP_PREPARED_MAX_AGE ||
+        poll(&connected, 1, ftp_connect_timeout_ms(client)) != 1 ||
+        getsockopt(socket_fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error) {
+        close(socket_fd);
+        return -1;
+    }
+    fcntl(socket_fd, F_SETFL, fcntl(socket_fd, F_GETFL) & ~O_NONBLOCK);
+    client->data_socket = socket_fd;
+    return 0;
+}
+
+// Send a RETR or STOR with what it needs for its data connection: a PASV
+// first unless a prepared connection is ready, and on the fast path the
+// PASV for the next transfer behind it. Leaves client->data_socket connected.
+// *ahead is set when a PASV went out ahead; its reply follows the transfer's.
+static int ftp_start_transfer_command(FTPClient *client, const char *command, int *ahead) {
+    const char *commands[3];
+    int count = 0;
+
+    client->failed_reply = 0;  // earlier refusals (MDTM, OPTS) must not decide a retry
+    int prepared = ftp_take_prepared_channel(client) == 0;
+    *ahead = client->prepare_data_channel;
+    if (!prepared) commands[count++] = NULL;  // filled in by ftp_send_passive_pipelined
+    commands[count++] = command;
+    if (*ahead) commands[count++] = ftp_passive_command(client);
+
+    if (!prepared) return ftp_send_passive_pipelined(client, commands, count, 0);
+    if (send_ftp_pipelined(client, commands, count) < 0) {
+        ftp_close_socket(client, &client->data_socket);
+        return -1;
+    }
+    return 0;
+}
+
+// List remote files
+int ftp_list_remote_files(FTPClient *client) {
+    char *listing;
+    size_t length;
+    
+    int response_code = ftp_fetch_listing(client, "LIST", &listing, &length);
+    if (response_code != 226) {
+        fprintf(stderr, "File listing failed\n");
+        return -1;
+    }
+    
+    printf("Remote Files:\n");
+    fwrite(listing, 1, length, stdout);
+    free(listing);
+    if (client->last_compression.wire_bytes > 0) ftp_report_compression(client);  // not from the cache
+    
+    return 0;
+}
+
+// Change remote directory
+int ftp_change_remote_directory(FTPClient *client, const char *path) {
+    char command[MAX_COMMAND];
+    char response[MAX_BUFFER];
+    char resolved[MAX_PATH];
+    
+    // Track the directory for new sessions to return to: absolute when
+    // listings are cached by path (which may cost a PWD), else relative to
+    // the login directory unless that gets too long
+    size_t base_length = strlen(client->current_remote_dir), path_length = strlen(path);
+    int relative = path[0] != '/' && base_length > 0;
+    if (client->listing_cache || (relative && base_length + path_length + 2 > sizeof(resolved))) {
+        if (ftp_resolve_remote_path(client, path, resolved, sizeof(resolved)) < 0) {
+            snprintf(resolved, sizeof(resolved), "%s", path);
+        }
+    } else if (relative) {
+        memcpy(resolved, client->current_remote_dir, base_length);
+        resolved[base_length] = '/';
+        memcpy(resolved + base_length + 1, path, path_length + 1);
+    } else {
+        snprintf(resolved, sizeof(resolved), "%s", path);
+    }
+    
+    snprintf(command, sizeof(command), "CWD %s", path);
+    if (send_ftp_command(client, command) < 0) return -1;
+    
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 250) {
+        fprintf(stderr, "Change directory failed: %s\n", response);
+        return -1;
+    }
+    
+    snprintf(client->current_remote_dir, sizeof(client->current_remote_dir), "%s", resolved);
+    return 0;
+}
+
+// Human-readable name of a data path, for transfer reports
+const char *ftp_data_path_name(FTPDataPath path) {
+    switch (path) {
+        case FTP_DATA_ZEROCOPY: return "zero-copy";
+        case FTP_DATA_URING:    return "io_uring";
+        case FTP_DATA_PIPELINED: return "pipelined";
+        default:                return "buffered";
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Resumable transfers: a sidecar journal records what is safely on disk
+// ---------------------------------------------------------------------------
+
+// Load a journal; returns -1 if it is missing or unreadable
+int ftp_journal_load(FTPJournal *journal, const char *path) {
+    char line[MAX_PATH + 32];
+    int version = 0;
+    
+    memset(journal, 0, sizeof(*journal));
+    snprintf(journal->path, sizeof(journal->path), "%s", path);
+    
+    FILE *fp = fopen(path, "r");
+    if (!fp) return -1;
+    
+    while (fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (sscanf(line, "FTPJOURNAL %d", &version) == 1) continue;
+        sscanf(line, "remote %1023[^\n]", journal->remote_file);
+        sscanf(line, "mdtm %31s", journal->remote_mdtm);
+        sscanf(line, "size %lld", &journal->remote_size);
+        sscanf(line, "local %lld %lld", &journal->local_size, &journal->local_mtime);
+        sscanf(line, "committed %lld", &journal->committed);
+    }
+    fclose(fp);
+    
+    return version == FTP_JOURNAL_VERSION ? 0 : -1;
+}
+
+// Write the journal to a temporary file and rename it into place
+int ftp_journal_save(const FTPJournal *journal) {
+    char temp_path[sizeof(journal->path) + 8];
+    
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", journal->path);
+    FILE *fp = fopen(temp_path, "w");
+    if (!fp) {
+        print_error("Failed to write transfer journal");
+        return -1;
+    }
+    
+    fprintf(fp, "FTPJOURNAL %d\n", FTP_JOURNAL_VERSION);
+    fprintf(fp, "remote %s\n", journal->remote_file);
+    fprintf(fp, "size %lld\n", journal->remote_size);
+    fprintf(fp, "mdtm %s\n", journal->remote_mdtm);
+    fprintf(fp, "local %lld %lld\n", journal->local_size, journal->local_mtime);
+    fprintf(fp, "committed %lld\n", journal->committed);
+    
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+        print_error("Failed to flush transfer journal");
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    
+    if (rename(temp_path, journal->path) < 0) {
+        print_error("Failed to commit transfer journal");
+        return -1;
+    }
+    return 0;
+}
+
+// Called from the receive loops: every FTP_JOURNAL_INTERVAL bytes, make the file
+// durable and record the new offset
+static int ftp_journal_checkpoint(FTPClient *client, int local_fd, long long bytes) {
+    FTPJournal *journal = client->journal;
+    
+    if (!journal) return 0;
+    journal->pending += bytes;
+    if (journal->pending < FTP_JOURNAL_INTERVAL) return 0;
+    journal->pending = 0;
+    
+    if (fdatasync(local_fd) < 0) {
+        print_error("Failed to sync local file");
+        return -1;
+    }
+    journal->committed = lseek(local_fd, 0, SEEK_CUR);
+    return ftp_journal_save(journal);
+}
+
+// ---------------------------------------------------------------------------
+// Bandwidth shaping: token buckets for the global and per-transfer limits,
+// and start-time fair queuing among the transfers waiting for tokens, so each
+// gets a share in proportion to its weight and an idle share goes to the rest
+// ---------------------------------------------------------------------------
+
+// Wait on cond for at most seconds; condition variables use the realtime clock
+static void ftp_cond_wait_seconds(pthread_cond_t *cond, pthread_mutex_t *lock, double seconds) {
+    struct timespec until;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    if (seconds < 0) seconds = 0;
+    until.tv_sec += (time_t)seconds;
+    until.tv_nsec += (long)((seconds - (time_t)seconds) * 1e9);
+    if (until.tv_nsec >= 1000000000L) {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(cond, lock, &until);
+}
+
+// Change a bucket's rate (bytes/s, 0 for unlimited), keeping what it holds
+static void ftp_bucket_set_rate(FTPTokenBucket *bucket, double rate, double now) {
+    bucket->rate = rate > 0 ? rate : 0;
+    bucket->burst = bucket->rate * FTP_SHAPER_BURST_SECONDS;
+    if (bucket->burst < FTP_SHAPER_MIN_BURST) bucket->burst = FTP_SHAPER_MIN_BURST;
+    if (bucket->tokens > bucket->burst || !bucket->updated) bucket->tokens = bucket->burst;
+    bucket->updated = now;
+}
+
+static void ftp_bucket_refill(FTPTokenBucket *bucket, double now) {
+    if (bucket->rate > 0) {
+        bucket->tokens += (now - bucket->updated) * bucket->rate;
+        if (bucket->tokens > bucket->burst) bucket->tokens = bucket->burst;
+    }
+    bucket->updated = now;
+}
+
+// Seconds until the bucket is out of debt
+static double ftp_bucket_delay(const FTPTokenBucket *bucket) {
+    return bucket->rate > 0 && bucket->tokens < 0 ? -bucket->tokens / bucket->rate : 0;
+}
+
+// rate is the global limit in bytes/s; 0 leaves only per-transfer limits
+int ftp_shaper_init(FTPShaper *shaper, double rate) {
+    memset(shaper, 0, sizeof(*shaper));
+    ftp_bucket_set_rate(&shaper->bucket, rate, ftp_now());
+    if (pthread_mutex_init(&shaper->lock, NULL) != 0) return -1;
+    if (pthread_cond_init(&shaper->changed, NULL) != 0) {
+        pthread_mutex_destroy(&shaper->lock);
+        return -1;
+    }
+    return 0;
+}
+
+void ftp_shaper_destroy(FTPShaper *shaper) {
+    pthread_mutex_destroy(&shaper->lock);
+    pthread_cond_destroy(&shaper->changed);
+}
+
+// Change the global limit; transfers waiting for tokens pick it up at once
+void ftp_shaper_set_rate(FTPShaper *shaper, double rate) {
+    pthread_mutex_lock(&shaper->lock);
+    double now = ftp_now();
+    ftp_bucket_refill(&shaper->bucket, now);
+    ftp_bucket_set_rate(&shaper->bucket, rate, now);
+    pthread_cond_broadcast(&shaper->changed);
+    pthread_mutex_unlock(&shaper->lock);
+}
+
+// Set up a transfer's flow: its weight against the other transfers and its own limit
+void ftp_shaper_flow_init(FTPShaperFlow *flow, FTPShaper *shaper, double weight, double rate) {
+    memset(flow, 0, sizeof(*flow));
+    flow->shaper = shaper;
+    flow->weight = weight > 0 ? weight : 1;
+    ftp_bucket_set_rate(&flow->bucket, rate, ftp_now());
+}
+
+// Change a running transfer's weight and limit
+void ftp_shaper_set_flow(FTPShaperFlow *flow, double weight, double rate) {
+    pthread_mutex_lock(&flow->shaper->lock);
+    double now = ftp_now();
+    flow->weight = weight > 0 ? weight : 1;
+    ftp_bucket_refill(&flow->bucket, now);
+    ftp_bucket_set_rate(&flow->bucket, rate, now);
+    pthread_cond_broadcast(&flow->shaper->changed);
+    pthread_mutex_unlock(&flow->shaper->lock);
+}
+
+// Whether another waiting request should be served before request: it has
+// an earlier start tag and is not held back by its own transfer's limit.
+// Called with the lock held.
+static int ftp_shaper_ahead(FTPShaper *shaper, const FTPShaperRequest *request, double now) {
+    int before = 1;  // ties go to the request that queued first
+
+    for (FTPShaperRequest *other = shaper->waiting; other; other = other->next) {
+        if (other == request) {
+            before = 0;
+            continue;
+        }
+        if (other->start > request->start || (other->start == request->start && !before)) continue;
+        ftp_bucket_refill(&other->flow->bucket, now);
+        if (ftp_bucket_delay(&other->flow->bucket) == 0) return 1;
+    }
+    return 0;
+}
+
+// Account bytes a transfer just moved, blocking until it may move more.
+// Buckets go into debt by the bytes charged and refill at their rate, so a
+// transfer stalls for exactly as long as it ran ahead of its limits.
+void ftp_shaper_charge(FTPShaperFlow *flow, size_t bytes) {
+    FTPShaper *shaper = flow->shaper;
+    FTPShaperRequest request;
+
+    pthread_mutex_lock(&shaper->lock);
+    // Start tag: where this transfer's previous bytes left off in virtual
+    // time, or now if it has been idle; a heavier weight advances it slower
+    request.start = flow->finish > shaper->virtual_time ? flow->finish : shaper->virtual_time;
+    request.flow = flow;
+    request.next = NULL;
+    flow->finish = request.start + bytes / flow->weight;
+
+    FTPShaperRequest **tail = &shaper->waiting;
+    while (*tail) tail = &(*tail)->next;
+    *tail = &request;
+
+    while (1) {
+        double now = ftp_now();
+        ftp_bucket_refill(&shaper->bucket, now);
+        ftp_bucket_refill(&flow->bucket, now);
+
+        double delay = ftp_bucket_delay(&flow->bucket);
+        if (delay == 0) delay = ftp_bucket_delay(&shaper->bucket);
+        if (delay > 0) {
+            ftp_cond_wait_seconds(&shaper->changed, &shaper->lock, delay);
+        } else if (ftp_shaper_ahead(shaper, &request, now)) {
+            // The request ahead broadcasts once it has been served
+            ftp_cond_wait_seconds(&shaper->changed, &shaper->lock, FTP_SHAPER_MAX_WAIT);
+        } else {
+            break;
+        }
+    }
+
+    for (tail = &shaper->waiting; *tail != &request; tail = &(*tail)->next);
+    *tail = request.next;
+    if (shaper->bucket.rate > 0) shaper->bucket.tokens -= bytes;
+    if (flow->bucket.rate > 0) flow->bucket.tokens -= bytes;
+    if (request.start > shaper->virtual_time) shaper->virtual_time = request.start;
+    pthread_cond_broadcast(&shaper->changed);
+    pthread_mutex_unlock(&shaper->lock);
+}
+
+// Give a transfer on client its flow in the shaper, if the client is shaped.
+// Sessions opened from a shaped client share its flow (segmented downloads).
+static void ftp_shaping_begin(FTPClient *client, FTPShaperFlow *flow) {
+    if (!client->shaper || client->flow) return;
+    ftp_shaper_flow_init(flow, client->shaper, client->shaper_weight, client->rate_limit);
+    client->flow = flow;
+}
+
+static void ftp_shaping_end(FTPClient *client, FTPShaperFlow *flow) {
+    if (client->flow == flow) client->flow = NULL;
+}
+
+// Cut off a transfer that moved less than tuning.min_rate bytes/s over the
+// last window. Shutting the data connection down makes its loop fail at the
+// next call; client->stalled tells the caller why.
+static void ftp_stall_check(FTPClient *client, size_t length) {
+    double window = client->tuning.stall_window > 0 ? client->tuning.stall_window : FTP_STALL_WINDOW;
+    double now = ftp_now();
+
+    client->window_bytes += length;
+    if (client->window_started == 0) client->window_started = now;
+    if (now - client->window_started < window) return;
+
+    double rate = client->window_bytes / (now - client->window_started);
+    if (rate < client->tuning.min_rate && !client->stalled) {
+        fprintf(stderr, "Transfer stalled: %.0f bytes/s over %.1f s, below %.0f\n", rate,
+                now - client->window_started, client->tuning.min_rate);
+        client->stalled = 1;
+        if (client->data_socket >= 0) shutdown(client->data_socket, SHUT_RDWR);
+    }
+    client->window_started = now;
+    client->window_bytes = 0;
+}
+
+// Per-chunk hook of the data loops: charge the transfer's flow, if any,
+// and watch its throughput
+static inline void ftp_transfer_progress(FTPClient *client, size_t length) {
+    if (client->flow) ftp_shaper_charge(client->flow, length);
+    if (client->tuning.min_rate > 0) ftp_stall_check(client, length);
+}
+
+// ---------------------------------------------------------------------------
+// Inline integrity hashing: the data loops feed every byte they move through
+// client->digest, so verifying a transfer needs no second pass over the file
+// ---------------------------------------------------------------------------
+
+// CRC-32C (Castagnoli), reflected polynomial 0x82F63B78
+static uint32_t ftp_crc32c_table[256];
+static pthread_once_t ftp_crc32c_once = PTHREAD_ONCE_INIT;
+static uint32_t (*ftp_crc32c_update)(uint32_t crc, const unsigned char *data, size_t length);
+
+static uint32_t ftp_crc32c_software(uint32_t crc, const unsigned char *data, size_t length) {
+    while (length--) crc = ftp_crc32c_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    return crc;
+}
+
+#if defined(__x86_64__)
+// SSE4.2 crc32 instruction: 8 bytes per step
+__attribute__((target("sse4.2")))
+static uint32_t ftp_crc32c_sse42(uint32_t crc, const unsigned char *data, size_t length) {
+    uint64_t state = crc;
+
+    while (length > 0 && ((uintptr_t)data & 7)) {
+        state = _mm_crc32_u8((uint32_t)state, *data++);
+        length--;
+    }
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        state = _mm_crc32_u64(state, word);
+        data += 8;
+        length -= 8;
+    }
+    while (length--) state = _mm_crc32_u8((uint32_t)state, *data++);
+    return (uint32_t)state;
+}
+#endif
+
+static void ftp_crc32c_setup(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (crc & 1 ? 0x82F63B78u : 0);
+        ftp_crc32c_table[i] = crc;
+    }
+    ftp_crc32c_update = ftp_crc32c_software;
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) ftp_crc32c_update = ftp_crc32c_sse42;
+#endif
+}
+
+// Start digests of a new byte stream. algorithms is a mask of FTP_HASH_*.
+int ftp_digest_init(FTPDigest *digest, unsigned algorithms) {
+    pthread_once(&ftp_crc32c_once, ftp_crc32c_setup);
+
+    memset(digest, 0, sizeof(*digest));
+    digest->algorithms = algorithms;
+    digest->crc32c = 0xffffffffu;
+    digest->crc32 = crc32(0L, Z_NULL, 0);
+
+    // EVP picks the SHA-NI / AVX2 / ARMv8 code paths the CPU supports
+    if (algorithms & FTP_HASH_SHA256) {
+        digest->sha256 = EVP_MD_CTX_new();
+        if (!digest->sha256 || !EVP_DigestInit_ex(digest->sha256, EVP_sha256(), NULL)) goto fail;
+    }
+    if (algorithms & FTP_HASH_MD5) {
+        digest->md5 = EVP_MD_CTX_new();
+        if (!digest->md5 || !EVP_DigestInit_ex(digest->md5, EVP_md5(), NULL)) goto fail;
+    }
+    return 0;
+
+fail:
+    fprintf(stderr, "Failed to set up transfer digests\n");
+    EVP_MD_CTX_free(digest->sha256);
+    EVP_MD_CTX_free(digest->md5);
+    digest->sha256 = digest->md5 = NULL;
+    return -1;
+}
+
+void ftp_digest_update(FTPDigest *digest, const void *data, size_t length) {
+    if (digest->algorithms & FTP_HASH_CRC32C) digest->crc32c = ftp_crc32c_update(digest->crc32c, data, length);
+    if (digest->algorithms & FTP_HASH_CRC32) {
+        // zlib takes 32-bit lengths
+        const unsigned char *bytes = data;
+        for (size_t left = length; left > 0;) {
+            unsigned chunk = left > (1u << 30) ? (1u << 30) : (unsigned)left;
+            digest->crc32 = crc32(digest->crc32, bytes, chunk);
+            bytes += chunk;
+            left -= chunk;
+        }
+    }
+    if (digest->sha256) EVP_DigestUpdate(digest->sha256, data, length);
+    if (digest->md5) EVP_DigestUpdate(digest->md5, data, length);
+    digest->bytes += length;
+}
+
+static void ftp_hex_encode(const unsigned char *bytes, unsigned length, char *hex) {
+    for (unsigned i = 0; i < length; i++) sprintf(hex + 2 * i, "%02x", bytes[i]);
+    hex[2 * length] = '\0';
+}
+
+// Finish the digests into lowercase hex and release them. Safe to call twice.
+void ftp_digest_final(FTPDigest *digest) {
+    unsigned char value[EVP_MAX_MD_SIZE];
+    unsigned length;
+
+    snprintf(digest->crc32c_hex, sizeof(digest->crc32c_hex), "%08x", digest->crc32c ^ 0xffffffffu);
+    snprintf(digest->crc32_hex, sizeof(digest->crc32_hex), "%08lx", digest->crc32);
+    if (digest->sha256) {
+        if (EVP_DigestFinal_ex(digest->sha256, value, &length)) ftp_hex_encode(value, length, digest->sha256_hex);
+        EVP_MD_CTX_free(digest->sha256);
+        digest->sha256 = NULL;
+    }
+    if (digest->md5) {
+        if (EVP_DigestFinal_ex(digest->md5, value, &length)) ftp_hex_encode(value, length, digest->md5_hex);
+        EVP_MD_CTX_free(digest->md5);
+        digest->md5 = NULL;
+    }
+}
+
+// Feed bytes moved by a data loop into the transfer's digest, if any
+static inline void ftp_transfer_digest(FTPClient *client, const void *data, size_t length) {
+    if (client->digest) ftp_digest_update(client->digest, data, length);
+}
+
+// Algorithms the server can hash for us, from FEAT: HASH (draft-bryan-ftpext-hash)
+// or the XMD5/XCRC extensions. A mask of FTP_HASH_*.
+unsigned ftp_remote_hash_algorithms(const FTPClient *client) {
+    unsigned algorithms = 0;
+
+    if (client->features & FTP_FEATURE_HASH_SHA256) algorithms |= FTP_HASH_SHA256;
+    if (client->features & (FTP_FEATURE_HASH_MD5 | FTP_FEATURE_XMD5)) algorithms |= FTP_HASH_MD5;
+    if (client->features & (FTP_FEATURE_HASH_CRC32 | FTP_FEATURE_XCRC)) algorithms |= FTP_HASH_CRC32;
+    return algorithms;
+}
+
+// Strongest algorithm in a mask of FTP_HASH_* the servers can compute; 0 for none
+static unsigned ftp_strongest_remote_hash(unsigned algorithms) {
+    if (algorithms & FTP_HASH_SHA256) return FTP_HASH_SHA256;
+    if (algorithms & FTP_HASH_MD5) return FTP_HASH_MD5;
+    return algorithms & FTP_HASH_CRC32;
+}
+
+// Algorithm the server can check for us, strongest first. 0 when none is available.
+unsigned ftp_verify_algorithm(const FTPClient *client) {
+    return ftp_strongest_remote_hash(ftp_remote_hash_algorithms(client));
+}
+
+// Begin hashing a transfer on client when verification is on
+static int ftp_verify_begin(FTPClient *client, FTPDigest *digest) {
+    if (!client->verify) return 0;
+    if (ftp_digest_init(digest, FTP_HASH_CRC32C | FTP_HASH_SHA256 | ftp_verify_algorithm(client)) < 0) return -1;
+    client->digest = digest;
+    return 0;
+}
+
+// First token of the reply's first line that is a hex number of 1..max_digits digits
+static int ftp_reply_hex_token(const char *reply, size_t max_digits, char *hex) {
+    const char *p = reply + 4;  // past the reply code
+
+    while (*p && *p != '\r' && *p != '\n') {
+        size_t length = 0;
+        while (p[length] && !isspace((unsigned char)p[length])) length++;
+        size_t digits = 0;
+        while (digits < length && isxdigit((unsigned char)p[digits])) digits++;
+        if (length > 0 && digits == length && length <= max_digits) {
+            memcpy(hex, p, length);
+            hex[length] = '\0';
+            return 0;
+        }
+        p += length;
+        while (*p == ' ' || *p == '\t') p++;
+    }
+    return -1;
+}
+
+// Ask the server for its hash of remote_file with one of the algorithms it
+// supports. Returns 0 with hex filled in (129 bytes), 1 when it cannot hash.
+int ftp_remote_hash(FTPClient *client, const char *remote_file, unsigned algorithm, char *hex) {
+    char command[MAX_COMMAND], response[MAX_BUFFER];
+    unsigned hash_feature = algorithm == FTP_HASH_SHA256 ? FTP_FEATURE_HASH_SHA256 :
+                            algorithm == FTP_HASH_MD5 ? FTP_FEATURE_HASH_MD5 : FTP_FEATURE_HASH_CRC32;
+    int code;
+
+    if (client->features & hash_feature) {
+        // Select the algorithm and ask in one round trip
+        const char *name = algorithm == FTP_HASH_SHA256 ? "SHA-256" : algorithm == FTP_HASH_MD5 ? "MD5" : "CRC32";
+        char opts_command[MAX_COMMAND];
+        snprintf(opts_command, sizeof(opts_command), "OPTS HASH %s", name);
+        snprintf(command, sizeof(command), "HASH %s", remote_file);
+        const char *commands[] = { opts_command, command };
+        if (send_ftp_pipelined(client, commands, 2) < 0) return -1;
+        if (recv_ftp_response(client, response, sizeof(response)) != 200) {
+            fprintf(stderr, "Server refused hash algorithm %s: %s\n", name, response);
+            recv_ftp_response(client, NULL, 0);  // HASH reply
+            return 1;
+        }
+        code = recv_ftp_response(client, response, sizeof(response));
+        // 213 <algorithm> <start>-<end> <hash> <path>
+        char reply_algorithm[32], range[64];
+        if (code != 213 || sscanf(response, "%*d %31s %63s %128s", reply_algorithm, range, hex) != 3 ||
+            strcasecmp(reply_algorithm, name)) {
+            fprintf(stderr, "Server could not hash %s: %s\n", remote_file, response);
+            return 1;
+        }
+    } else if (algorithm == FTP_HASH_MD5 || algorithm == FTP_HASH_CRC32) {
+        snprintf(command, sizeof(command), "%s %s", algorithm == FTP_HASH_MD5 ? "XMD5" : "XCRC", remote_file);
+        if (send_ftp_command(client, command) < 0) return -1;
+        code = recv_ftp_response(client, response, sizeof(response));
+        if ((code != 250 && code != 251) ||
+            ftp_reply_hex_token(response, algorithm == FTP_HASH_MD5 ? 32 : 8, hex) < 0) {
+            fprintf(stderr, "Server could not hash %s: %s\n", remote_file, response);
+            return 1;
+        }
+    } else {
+        return 1;
+    }
+    return 0;
+}
+
+// Compare two hex digests of one algorithm. Some servers drop leading zeros from a CRC.
+static int ftp_hash_equal(unsigned algorithm, const char *a, const char *b) {
+    if (algorithm == FTP_HASH_CRC32) return strtoul(a, NULL, 16) == strtoul(b, NULL, 16);
+    return !strcasecmp(a, b);
+}
+
+// Ask the server for the hash of remote_file and compare it with the finished
+// digest. Returns 0 on a match, 1 when the server cannot verify, -1 otherwise.
+int ftp_verify_remote(FTPClient *client, const char *remote_file, const FTPDigest *digest) {
+    unsigned algorithm = ftp_verify_algorithm(client);
+    char hex[129];
+
+    if (!algorithm) return 1;
+    const char *expected = algorithm == FTP_HASH_SHA256 ? digest->sha256_hex :
+                           algorithm == FTP_HASH_MD5 ? digest->md5_hex : digest->crc32_hex;
+    int status = ftp_remote_hash(client, remote_file, algorithm, hex);
+    if (status != 0) return status;
+    if (!ftp_hash_equal(algorithm, hex, expected)) {
+        fprintf(stderr, "Integrity check failed for %s: server %s, local %s\n", remote_file, hex, expected);
+        return -1;
+    }
+    return 0;
+}
+
+// Finish a verified transfer: compare with the server and report.
+// Returns -1 on a mismatch, which fails the transfer.
+static int ftp_verify_end(FTPClient *client, const char *remote_file, FTPDigest *digest, int transferred) {
+    if (client->digest != digest) return 0;
+    client->digest = NULL;
+    ftp_digest_final(digest);
+    if (!transferred) return 0;
+
+    int status = ftp_verify_remote(client, remote_file, digest);
+    if (status < 0) return -1;
+    if (!client->quiet) {
+        printf("%s %s: crc32c %s, sha256 %s\n", status == 0 ? "Verified" : "Hashed (server cannot verify)",
+               remote_file, digest->crc32c_hex, digest->sha256_hex);
+    }
+    return 0;
+}
+
+// Verify a file that no single data stream covered (resumed or segmented):
+// hash the whole local copy and compare with the server's hash of remote_file
+static int ftp_verify_file(FTPClient *client, const char *remote_file, const char *local_file) {
+    FTPDigest digest;
+    ssize_t bytes_read;
+
+    if (!client->verify) return 0;
+    int fd = open(local_file, O_RDONLY);
+    if (fd < 0) {
+        print_error("Failed to open local file");
+        return -1;
+    }
+    char *buffer = ftp_transfer_buffer(client);
+    if (!buffer || ftp_verify_begin(client, &digest) < 0) {
+        close(fd);
+        return -1;
+    }
+    while ((bytes_read = read(fd, buffer, client->transfer_buffer_size)) > 0 || (bytes_read < 0 && errno == EINTR)) {
+        if (bytes_read > 0) ftp_digest_update(&digest, buffer, bytes_read);
+    }
+    if (bytes_read < 0) print_error("Failed to read local file");
+    close(fd);
+    int status = ftp_verify_end(client, remote_file, &digest, bytes_read == 0);
+    return bytes_read < 0 ? -1 : status;
+}
+
+// ---------------------------------------------------------------------------
+// MODE Z: the data connection carries one zlib (RFC 1950) stream per transfer,
+// inflated/deflated in the data loops. Negotiated per session, on demand.
+// ---------------------------------------------------------------------------
+
+// CPU time of the calling thread, in seconds
+static double ftp_thread_cpu_now(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// Switch the session to MODE Z (compressed) or back to MODE S before a
+// transfer. Compression is used when asked for, configured and advertised.
+int ftp_select_transfer_mode(FTPClient *client, int compressed) {
+    char response[MAX_BUFFER];
+    int want = compressed && client->compress_level > 0 && (client->features & FTP_FEATURE_MODE_Z);
+
+    if (want == client->mode_z) return 0;
+    if (!want) {
+        if (send_ftp_command(client, "MODE S") < 0) return -1;
+        if (recv_ftp_response(client, response, sizeof(response)) != 200) {
+            fprintf(stderr, "Cannot leave compressed mode: %s\n", response);
+            return -1;
+        }
+        client->mode_z = 0;
+        return 0;
+    }
+
+    // The level only matters for what the server sends; a refusal is harmless
+    char level_command[MAX_COMMAND];
+    snprintf(level_command, sizeof(level_command), "OPTS MODE Z LEVEL %d", client->compress_level);
+    const char *commands[] = { "MODE Z", level_command };
+    if (send_ftp_pipelined(client, commands, 2) < 0) return -1;
+    int code = recv_ftp_response(client, response, sizeof(response));
+    recv_ftp_response(client, NULL, 0);  // OPTS reply
+    if (code != 200) {
+        // Advertised but refused: stay in stream mode for this session
+        fprintf(stderr, "Server refused MODE Z: %s\n", response);
+        client->features &= ~FTP_FEATURE_MODE_Z;
+        return 0;
+    }
+    client->mode_z = 1;
+    return 0;
+}
+
+// Print the compression figures of the last MODE Z transfer
+void ftp_report_compression(const FTPClient *client) {
+    const FTPCompression *stats = &client->last_compression;
+
+    printf("MODE Z: %lld bytes on the wire for %lld bytes (%.2fx), %.3f s CPU\n",
+           stats->wire_bytes, stats->data_bytes,
+           stats->wire_bytes > 0 ? (double)stats->data_bytes / stats->wire_bytes : 0.0, stats->cpu_seconds);
+}
+
+// Receives the inflated bytes of a MODE Z transfer
+typedef int (*FTPInflateSink)(void *context, const char *data, size_t length);
+
+static int ftp_inflate_to_fd(void *context, const char *data, size_t length) {
+    return write_all(*(int *)context, data, length);
+}
+
+// Inflate the whole data connection into sink. Returns the plain byte count.
+static long long ftp_recv_inflate(FTPClient *client, FTPInflateSink sink, void *context) {
+    char *wire = ftp_transfer_buffer(client);
+    size_t size = client->transfer_buffer_size;
+    char *plain = malloc(size);
+    double cpu = ftp_thread_cpu_now();
+    long long wire_bytes = 0, total = 0;
+    int status = Z_OK, failed = 0;
+    z_stream stream;
+    ssize_t bytes_read;
+
+    memset(&stream, 0, sizeof(stream));
+    if (!wire || !plain || inflateInit(&stream) != Z_OK) {
+        fprintf(stderr, "Failed to set up decompression\n");
+        free(plain);
+        return -1;
+    }
+
+    while (!failed && (bytes_read = recv(client->data_socket, wire, size, 0)) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            print_error("Failed to receive data");
+            failed = 1;
+            break;
+        }
+        ftp_metrics_data(client, bytes_read, 0);
+        ftp_transfer_progress(client, bytes_read);
+        wire_bytes += bytes_read;
+        stream.next_in = (Bytef *)wire;
+        stream.avail_in = bytes_read;
+
+        do {
+            // Some servers send one stream per buffer flush; accept them back to back
+            if (status == Z_STREAM_END) {
+                if (stream.avail_in == 0) break;
+                inflateReset(&stream);
+            }
+            stream.next_out = (Bytef *)plain;
+            stream.avail_out = size;
+            status = inflate(&stream, Z_NO_FLUSH);
+            if (status != Z_OK && status != Z_STREAM_END && status != Z_BUF_ERROR) {
+                fprintf(stderr, "Corrupt compressed data: %s\n", stream.msg ? stream.msg : "inflate failed");
+                failed = 1;
+                break;
+            }
+
+            size_t produced = size - stream.avail_out;
+            if (produced > 0) {
+                ftp_transfer_digest(client, plain, produced);
+                ftp_metrics_syscall(client);  // write
+                if (sink(context, plain, produced) < 0) {
+                    print_error("Failed to write local data");
+                    failed = 1;
+                    break;
+                }
+                total += produced;
+            }
+        } while (status != Z_BUF_ERROR && (stream.avail_in > 0 || stream.avail_out == 0));
+    }
+    if (!failed && wire_bytes > 0 && status != Z_STREAM_END) {
+        fprintf(stderr, "Compressed stream ended early\n");
+        failed = 1;
+    }
+
+    inflateEnd(&stream);
+    free(plain);
+    client->last_compression.wire_bytes = wire_bytes;
+    client->last_compression.data_bytes = total;
+    client->last_compression.cpu_seconds = ftp_thread_cpu_now() - cpu;
+    return failed ? -1 : total;
+}
+
+// Deflate local_fd into the data connection at the configured level
+static long long ftp_send_deflate(FTPClient *client, int local_fd) {
+    char *plain = ftp_transfer_buffer(client);
+    size_t size = client->transfer_buffer_size;
+    char *wire = malloc(size);
+    double cpu = ftp_thread_cpu_now();
+    long long wire_bytes = 0, total = 0;
+    int flush = Z_NO_FLUSH, failed = 0;
+    z_stream stream;
+
+    memset(&stream, 0, sizeof(stream));
+    if (!plain || !wire || deflateInit(&stream, client->compress_level) != Z_OK) {
+        fprintf(stderr, "Failed to set up compression\n");
+        free(wire);
+        return -1;
+    }
+
+    while (!failed && flush != Z_FINISH) {
+        ssize_t bytes_read = read(local_fd, plain, size);
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            print_error("Failed to read local file");
+            failed = 1;
+            break;
+        }
+        ftp_metrics_syscall(client);  // read
+        ftp_transfer_digest(client, plain, bytes_read);
+        total += bytes_read;
+        flush = bytes_read == 0 ? Z_FINISH : Z_NO_FLUSH;
+        stream.next_in = (Bytef *)plain;
+        stream.avail_in = bytes_read;
+
+        do {
+            stream.next_out = (Bytef *)wire;
+            stream.avail_out = size;
+            deflate(&stream, flush);
+            size_t produced = size - stream.avail_out;
+            if (produced > 0) {
+                if (send_all(client->data_socket, wire, produced) < 0) {
+                    print_error("Failed to send data");
+                    failed = 1;
+                    break;
+                }
+                ftp_metrics_data(client, 0, produced);
+                ftp_transfer_progress(client, produced);
+                wire_bytes += produced;
+            }
+        } while (stream.avail_out == 0);
+    }
+
+    deflateEnd(&stream);
+    free(wire);
+    client->last_compression.wire_bytes = wire_bytes;
+    client->last_compression.data_bytes = total;
+    client->last_compression.cpu_seconds = ftp_thread_cpu_now() - cpu;
+    return failed ? -1 : total;
+}
+
+// ---------------------------------------------------------------------------
+// io_uring data path: socket and file I/O queued on one ring against
+// registered buffers, through the raw syscalls (no liburing dependency)
+// ---------------------------------------------------------------------------
+
+enum { FTP_URING_FREE, FTP_URING_FILLING, FTP_URING_FILLED, FTP_URING_DRAINING };
+enum { FTP_URING_OP_FILL, FTP_URING_OP_DRAIN };  // low bit of user_data
+#define FTP_URING_TIMEOUT (~0ULL)  // user_data of linked timeouts, which reaping skips
+
+static int ftp_uring_setup(FTPUring *ring, unsigned entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(*ring));
+    memset(&params, 0, sizeof(params));
+    ring->ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->ring_fd < 0) return -1;
+
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+
+    ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) goto fail;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) ring->cq_ring = ring->sq_ring;
+    else {
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             ring->ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) goto fail;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) goto fail;
+
+    char *sq = ring->sq_ring, *cq = ring->cq_ring;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    ring->entries = params.sq_entries;
+    // Stable submissions came with linked timeouts
+    ring->link_timeout = (params.features & IORING_FEAT_SUBMIT_STABLE) != 0;
+    return 0;
+
+fail:
+    if (ring->sq_ring && ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+    if (ring->cq_ring && ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    close(ring->ring_fd);
+    return -1;
+}
+
+static void ftp_uring_unregister_buffers(FTPUring *ring) {
+    if (!ring->buffers) return;
+    syscall(__NR_io_uring_register, ring->ring_fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+    free(ring->buffers);
+    ring->buffers = NULL;
+    ring->buffer_count = 0;
+    ring->buffer_size = 0;
+}
+
+// Pin count buffers of size bytes once, so the kernel skips per-I/O page mapping
+static int ftp_uring_register_buffers(FTPUring *ring, size_t size, int count) {
+    struct iovec iov[FTP_URING_BUFFERS];
+    void *memory;
+
+    if (posix_memalign(&memory, 4096, size * count) != 0) return -1;
+    for (int i = 0; i < count; i++) {
+        iov[i].iov_base = (char *)memory + i * size;
+        iov[i].iov_len = size;
+    }
+    if (syscall(__NR_io_uring_register, ring->ring_fd, IORING_REGISTER_BUFFERS, iov, count) < 0) {
+        free(memory);
+        return -1;
+    }
+    ring->buffers = memory;
+    ring->buffer_size = size;
+    ring->buffer_count = count;
+    return 0;
+}
+
+void ftp_uring_destroy(FTPUring *ring) {
+    ftp_uring_unregister_buffers(ring);
+    munmap(ring->sqes, ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+    munmap(ring->sq_ring, ring->sq_ring_size);
+    close(ring->ring_fd);
+}
+
+// The client's ring with buffers of the current transfer buffer size, set up on
+// first use. NULL when io_uring is unavailable (old kernel, seccomp, sysctl).
+static FTPUring *ftp_client_uring(FTPClient *client) {
+    size_t size = ftp_transfer_buffer_size(client);
+
+    if (client->uring_unavailable) return NULL;
+    if (!client->uring) {
+        client->uring = malloc(sizeof(FTPUring));
+        if (!client->uring || ftp_uring_setup(client->uring, 2 * FTP_URING_BUFFERS) < 0) {
+            print_error("io_uring unavailable, using buffered transfers");
+            free(client->uring);
+            client->uring = NULL;
+            client->uring_unavailable = 1;
+            return NULL;
+        }
+    }
+    if (client->uring->buffer_size != size) {
+        ftp_uring_unregister_buffers(client->uring);
+        if (ftp_uring_register_buffers(client->uring, size, FTP_URING_BUFFERS) < 0) {
+            print_error("io_uring buffer registration failed (RLIMIT_MEMLOCK?), using buffered transfers");
+            client->uring_unavailable = 1;  // report once, not on every transfer
+            return NULL;
+        }
+    }
+    return client->uring;
+}
+
+// Queue a fixed-buffer read or write of buffer[index] + skip
+static void ftp_uring_queue(FTPUring *ring, int opcode, int fd, int index, size_t skip,
+                            unsigned length, long long offset, int op) {
+    unsigned tail = *ring->sq_tail;
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (unsigned long)(ring->buffers + index * ring->buffer_size + skip);
+    sqe->len = length;
+    sqe->off = (unsigned long long)offset;
+    sqe->buf_index = index;
+    sqe->user_data = (unsigned long long)index << 1 | op;
+
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+// Bound the socket operation just queued by the idle timeout: SO_RCVTIMEO and
+// SO_SNDTIMEO do not apply to io_uring, so a linked timeout cancels it instead
+// (it completes with -ECANCELED)
+static void ftp_uring_link_timeout(FTPUring *ring, int timeout_ms) {
+    if (timeout_ms <= 0) return;
+    unsigned tail = *ring->sq_tail;
+    ring->sqes[(tail - 1) & *ring->sq_mask].flags |= IOSQE_IO_LINK;
+
+    unsigned slot = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[slot];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->idle_timeout.tv_sec = timeout_ms / 1000;
+    ring->idle_timeout.tv_nsec = (timeout_ms % 1000) * 1000000LL;
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->fd = -1;
+    sqe->addr = (unsigned long)&ring->idle_timeout;
+    sqe->len = 1;
+    sqe->user_data = FTP_URING_TIMEOUT;
+
+    ring->sq_array[slot] = slot;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->queued++;
+}
+
+// Submit everything queued and wait for at least one completion: one syscall
+static int ftp_uring_enter(FTPClient *client, FTPUring *ring) {
+    for (;;) {
+        int submitted = syscall(__NR_io_uring_enter, ring->ring_fd, ring->queued, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+        ftp_metrics_syscall(client);
+        if (submitted >= 0) {
+            ring->queued -= submitted;
+            return 0;
+        }
+        if (errno != EINTR) return -1;
+    }
+}
+
+// Pop one completion; returns 0 when the queue is empty
+static int ftp_uring_reap(FTPUring *ring, int *index, int *op, int *result) {
+    for (;;) {
+        unsigned head = *ring->cq_head;
+
+        if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) return 0;
+        struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        unsigned long long user_data = cqe->user_data;
+        *index = user_data >> 1;
+        *op = user_data & 1;
+        *result = cqe->res;
+        __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+        if (user_data != FTP_URING_TIMEOUT) return 1;
+    }
+}
+
+// Receive the data connection into local_fd with one recv and several file
+// writes in flight. Returns -2 when io_uring cannot be used for this transfer.
+static long long ftp_recv_data_uring(FTPClient *client, int local_fd) {
+    struct stat st;
+    FTPUring *ring;
+
+    if (fstat(local_fd, &st) < 0) return -2;
+    if (!(ring = ftp_client_uring(client))) return -2;
+    int idle_ms = ftp_data_idle_ms(client);
+    if (idle_ms > 0 && !ring->link_timeout) return -2;  // could not enforce it
+
+    int count = ring->buffer_count;
+    int state[FTP_URING_BUFFERS] = {0};
+    long long offset[FTP_URING_BUFFERS];
+    size_t length[FTP_URING_BUFFERS], written[FTP_URING_BUFFERS];
+
+    // Writes at explicit offsets may complete in any order. Pipes, devices,
+    // O_APPEND files and journalled downloads get one write at a time instead.
+    int positioned = S_ISREG(st.st_mode) && !(fcntl(local_fd, F_GETFL) & O_APPEND);
+    int in_order = !positioned || client->journal;
+    long long position = positioned ? lseek(local_fd, 0, SEEK_CUR) : 0;
+    if (position < 0) return -2;
+
+    long long next_fill = 0, next_drain = 0;  // chunk sequence numbers; chunk n uses buffer n % count
+    int filling = 0, draining = 0, eof = 0, failed = 0;
+    long long total = 0;
+
+    for (;;) {
+        if (!eof && !failed && !filling && state[next_fill % count] == FTP_URING_FREE) {
+            ftp_uring_queue(ring, IORING_OP_READ_FIXED, client->data_socket, next_fill % count, 0,
+                            ring->buffer_size, 0, FTP_URING_OP_FILL);
+            ftp_uring_link_timeout(ring, idle_ms);
+            state[next_fill % count] = FTP_URING_FILLING;
+            filling = 1;
+        }
+        while (!failed && next_drain < next_fill && state[next_drain % count] == FTP_URING_FILLED &&
+               (!in_order || !draining)) {
+            int index = next_drain % count;
+            ftp_uring_queue(ring, IORING_OP_WRITE_FIXED, local_fd, index, 0, length[index],
+                            positioned ? offset[index] : -1, FTP_URING_OP_DRAIN);
+            state[index] = FTP_URING_DRAINING;
+            draining++;
+            next_drain++;
+        }
+        if (!filling && !draining) break;
+
+        if (ftp_uring_enter(client, ring) < 0) {
+            // Nothing can complete without the ring; buffers stay registered
+            print_error("io_uring_enter failed");
+            return -1;
+        }
+
+        int index, op, result;
+        while (ftp_uring_reap(ring, &index, &op, &result)) {
+            if (op == FTP_URING_OP_FILL) {
+                filling = 0;
+                if (result == -EINTR || result == -EAGAIN) state[index] = FTP_URING_FREE;
+                else if (result < 0) {
+                    errno = result == -ECANCELED ? ETIMEDOUT : -result;  // cancelled by the idle timeout
+                    print_error("Failed to receive data");
+                    state[index] = FTP_URING_FREE;
+                    failed = 1;
+                } else if (result == 0) {
+                    state[index] = FTP_URING_FREE;
+                    eof = 1;
+                } else {
+                    // One socket read is in flight at a time, so completions arrive in stream order
+                    ftp_metrics_data(client, result, 0);
+                    ftp_transfer_progress(client, result);
+                    ftp_transfer_digest(client, ring->buffers + (size_t)index * ring->buffer_size, result);
+                    offset[index] = position;
+                    length[index] = result;
+                    written[index] = 0;
+                    position += result;
+                    state[index] = FTP_URING_FILLED;
+                    next_fill++;
+                }
+                continue;
+            }
+
+            if (result < 0 && result != -EINTR && result != -EAGAIN) {
+                errno = -result;
+                print_error("Failed to write local file");
+                state[index] = FTP_URING_FREE;
+                draining--;
+                failed = 1;
+                continue;
+            }
+            written[index] += result > 0 ? result : 0;
+            if (written[index] < length[index] && !failed) {
+                // Short write: queue the rest of the same buffer
+                ftp_uring_queue(ring, IORING_OP_WRITE_FIXED, local_fd, index, written[index],
+                                length[index] - written[index],
+                                positioned ? offset[index] + (long long)written[index] : -1, FTP_URING_OP_DRAIN);
+                continue;
+            }
+            state[index] = FTP_URING_FREE;
+            draining--;
+            total += written[index];
+            if (client->journal) {
+                lseek(local_fd, offset[index] + length[index], SEEK_SET);
+                if (ftp_journal_checkpoint(client, local_fd, length[index]) < 0) failed = 1;
+            }
+        }
+    }
+
+    if (positioned) lseek(local_fd, position, SEEK_SET);
+    return failed ? -1 : total;
+}
+
+// Send local_fd with file reads queued ahead and one socket write in flight.
+// Returns -2 when io_uring cannot be used for this transfer.
+static long long ftp_send_data_uring(FTPClient *client, int local_fd) {
+    struct stat st;
+    FTPUring *ring;
+
+    // Reads are issued at explicit offsets, so the source must be a regular file
+    if (fstat(local_fd, &st) < 0 || !S_ISREG(st.st_mode)) return -2;
+    long long start = lseek(local_fd, 0, SEEK_CUR);
+    if (start < 0) return -2;
+    if (!(ring = ftp_client_uring(client))) return -2;
+    int idle_ms = ftp_data_idle_ms(client);
+    if (idle_ms > 0 && !ring->link_timeout) return -2;
+
+    int count = ring->buffer_count;
+    int state[FTP_URING_BUFFERS] = {0};
+    size_t length[FTP_URING_BUFFERS], done[FTP_URING_BUFFERS];
+    long long chunk_offset[FTP_URING_BUFFERS];
+
+    long long size = st.st_size > start ? st.st_size - start : 0;
+    long long chunks = (size + ring->buffer_size - 1) / ring->buffer_size;
+    long long next_fill = 0, next_drain = 0;
+    int filling = 0, draining = 0, failed = 0;
+    long long total = 0;
+
+    for (;;) {
+        while (!failed && next_fill < chunks && state[next_fill % count] == FTP_URING_FREE) {
+            int index = next_fill % count;
+            long long left = size - next_fill * (long long)ring->buffer_size;
+            chunk_offset[index] = start + next_fill * (long long)ring->buffer_size;
+            length[index] = left < (long long)ring->buffer_size ? (size_t)left : ring->buffer_size;
+            done[index] = 0;
+            ftp_uring_queue(ring, IORING_OP_READ_FIXED, local_fd, index, 0, length[index],
+                            chunk_offset[index], FTP_URING_OP_FILL);
+            state[index] = FTP_URING_FILLING;
+            filling++;
+            next_fill++;
+        }
+        if (!failed && !draining && next_drain < chunks && state[next_drain % count] == FTP_URING_FILLED) {
+            int index = next_drain % count;
+            done[index] = 0;
+            ftp_transfer_digest(client, ring->buffers + (size_t)index * ring->buffer_size, length[index]);
+            ftp_uring_queue(ring, IORING_OP_WRITE_FIXED, client->data_socket, index, 0, length[index], 0, FTP_URING_OP_DRAIN);
+            ftp_uring_link_timeout(ring, idle_ms);
+            state[index] = FTP_URING_DRAINING;
+            draining = 1;
+        }
+        if (!filling && !draining) break;
+
+        if (ftp_uring_enter(client, ring) < 0) {
+            print_error("io_uring_enter failed");
+            return -1;
+        }
+
+        int index, op, result;
+        while (ftp_uring_reap(ring, &index, &op, &result)) {
+            if (result < 0 && result != -EINTR && result != -EAGAIN) {
+                errno = result == -ECANCELED ? ETIMEDOUT : -result;
+                print_error(op == FTP_URING_OP_FILL ? "Failed to read local file" : "Failed to send data");
+                if (op == FTP_URING_OP_FILL) filling--;
+                else draining = 0;
+                state[index] = FTP_URING_FREE;
+                failed = 1;
+                continue;
+            }
+            if (result < 0) result = 0;
+
+            if (op == FTP_URING_OP_FILL) {
+                if (result == 0 && done[index] < length[index]) {
+                    // The file shrank under us: stop after what was read
+                    long long limit = (chunk_offset[index] - start) / ring->buffer_size + (done[index] > 0);
+                    length[index] = done[index];
+                    if (limit < chunks) chunks = limit;
+                }
+                done[index] += result;
+                if (done[index] < length[index] && !failed) {
+                    ftp_uring_queue(ring, IORING_OP_READ_FIXED, local_fd, index, done[index],
+                                    length[index] - done[index], chunk_offset[index] + done[index], FTP_URING_OP_FILL);
+                    continue;
+                }
+                filling--;
+                state[index] = FTP_URING_FILLED;
+                continue;
+            }
+
+            ftp_metrics_data(client, 0, result);
+            ftp_transfer_progress(client, result);
+            done[index] += result;
+            total += result;
+            if (done[index] < length[index] && !failed) {
+                ftp_uring_queue(ring, IORING_OP_WRITE_FIXED, client->data_socket, index, done[index],
+                                length[index] - done[index], 0, FTP_URING_OP_DRAIN);
+                ftp_uring_link_timeout(ring, idle_ms);
+                continue;
+            }
+            draining = 0;
+            state[index] = FTP_URING_FREE;
+            next_drain++;
+        }
+    }
+
+    lseek(local_fd, start + total, SEEK_SET);
+    return failed ? -1 : total;
+}
+
+// ---------------------------------------------------------------------------
+// Pipelined data path: the network side and the disk side run on separate
+// threads around a ring of large buffers, so a disk stall does not stop the
+// socket from draining (and the TCP window from staying open)
+// ---------------------------------------------------------------------------
+
+// Claim the next empty buffer (network side of a download, disk side of an
+// upload). Returns NULL once the other side has failed.
+static char *ftp_pipeline_claim_empty(FTPPipeline *pipeline) {
+    char *buffer = NULL;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->filled == FTP_PIPELINE_BUFFERS && !pipeline->failed) {
+        pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    }
+    if (!pipeline->failed) buffer = pipeline->memory + pipeline->tail * pipeline->buffer_size;
+    pthread_mutex_unlock(&pipeline->lock);
+    return buffer;
+}
+
+// Hand the claimed buffer, holding length bytes, to the other side
+static void ftp_pipeline_publish(FTPPipeline *pipeline, size_t length) {
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->length[pipeline->tail] = length;
+    pipeline->tail = (pipeline->tail + 1) % FTP_PIPELINE_BUFFERS;
+    pipeline->filled++;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+// Wait for the oldest full buffer. Returns NULL at the end of the stream or on failure.
+static char *ftp_pipeline_claim_full(FTPPipeline *pipeline, size_t *length) {
+    char *buffer = NULL;
+
+    pthread_mutex_lock(&pipeline->lock);
+    while (pipeline->filled == 0 && !pipeline->finished && !pipeline->failed) {
+        pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+    }
+    if (pipeline->filled > 0 && !pipeline->failed) {
+        buffer = pipeline->memory + pipeline->head * pipeline->buffer_size;
+        *length = pipeline->length[pipeline->head];
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    return buffer;
+}
+
+static void ftp_pipeline_recycle(FTPPipeline *pipeline) {
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->head = (pipeline->head + 1) % FTP_PIPELINE_BUFFERS;
+    pipeline->filled--;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+// Producer is done: no more buffers will be published. failed also stops the consumer.
+static void ftp_pipeline_end(FTPPipeline *pipeline, int failed) {
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->finished = 1;
+    if (failed) pipeline->failed = 1;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+}
+
+static int ftp_pipeline_init(FTPPipeline *pipeline, size_t buffer_size) {
+    void *memory;
+
+    memset(pipeline, 0, sizeof(*pipeline));
+    // O_DIRECT needs block-aligned memory, lengths and offsets
+    pipeline->buffer_size = (buffer_size + FTP_DIRECT_ALIGNMENT - 1) & ~(size_t)(FTP_DIRECT_ALIGNMENT - 1);
+    if (posix_memalign(&memory, FTP_DIRECT_ALIGNMENT, pipeline->buffer_size * FTP_PIPELINE_BUFFERS) != 0) {
+        print_error("Failed to allocate pipeline buffers");
+        return -1;
+    }
+    pipeline->memory = memory;
+    pthread_mutex_init(&pipeline->lock, NULL);
+    pthread_cond_init(&pipeline->changed, NULL);
+    return 0;
+}
+
+static void ftp_pipeline_destroy(FTPPipeline *pipeline) {
+    pthread_mutex_destroy(&pipeline->lock);
+    pthread_cond_destroy(&pipeline->changed);
+    free(pipeline->memory);
+}
+
+// Bypass the page cache for a regular file whose position is block aligned.
+// Opt-in (tuning.direct_io): while files fit in memory the cache is faster,
+// O_DIRECT pays off for transfers larger than RAM that would evict everything.
+// Returns 1 when O_DIRECT was switched on (filesystems like tmpfs refuse it).
+static int ftp_enable_direct_io(int local_fd) {
+    off_t position = lseek(local_fd, 0, SEEK_CUR);
+    int flags = fcntl(local_fd, F_GETFL);
+
+    if (position < 0 || position % FTP_DIRECT_ALIGNMENT || flags < 0 || (flags & O_APPEND)) return 0;
+    return fcntl(local_fd, F_SETFL, flags | O_DIRECT) == 0;
+}
+
+static void ftp_disable_direct_io(int local_fd) {
+    fcntl(local_fd, F_SETFL, fcntl(local_fd, F_GETFL) & ~O_DIRECT);
+}
+
+// Disk side of a pipelined download or upload
+typedef struct {
+    FTPPipeline *pipeline;
+    FTPClient *client;
+    int local_fd;
+    int direct;
+    long long bytes;
+    long long syscalls;
+    int status;
+} FTPPipelineDisk;
+
+// Drain full buffers into the file, in order
+static void *ftp_pipeline_writer(void *arg) {
+    FTPPipelineDisk *disk = arg;
+    char *buffer;
+    size_t length;
+
+    while ((buffer = ftp_pipeline_claim_full(disk->pipeline, &length))) {
+        // Only the final buffer can be short; it has to go through the page cache
+        if (disk->direct && length % FTP_DIRECT_ALIGNMENT) {
+            ftp_disable_direct_io(disk->local_fd);
+            disk->direct = 0;
+        }
+        ftp_transfer_digest(disk->client, buffer, length);
+        disk->syscalls++;
+        if (write_all(disk->local_fd, buffer, length) < 0 ||
+            ftp_journal_checkpoint(disk->client, disk->local_fd, length) < 0) {
+            print_error("Failed to write local file");
+            disk->status = -1;
+            ftp_pipeline_end(disk->pipeline, 1);
+            break;
+        }
+        disk->bytes += length;
+        ftp_pipeline_recycle(disk->pipeline);
+    }
+    if (disk->direct) ftp_disable_direct_io(disk->local_fd);
+    return NULL;
+}
+
+// Fill buffers from the file ahead of the network
+static void *ftp_pipeline_reader(void *arg) {
+    FTPPipelineDisk *disk = arg;
+    char *buffer;
+    int eof = 0;
+
+    while (!eof && (buffer = ftp_pipeline_claim_empty(disk->pipeline))) {
+        size_t length = 0;
+        while (length < disk->pipeline->buffer_size) {
+            ssize_t bytes_read = read(disk->local_fd, buffer + length, disk->pipeline->buffer_size - length);
+            disk->syscalls++;
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read < 0 && errno == EINVAL && disk->direct) {
+                // Some filesystems accept O_DIRECT at open time but not these reads
+                ftp_disable_direct_io(disk->local_fd);
+                disk->direct = 0;
+                continue;
+            }
+            if (bytes_read < 0) {
+                print_error("Failed to read local file");
+                disk->status = -1;
+                ftp_pipeline_end(disk->pipeline, 1);
+                return NULL;
+            }
+            if (bytes_read == 0) {
+                eof = 1;
+                break;
+            }
+            length += bytes_read;
+            // A short O_DIRECT read means end of file; the next read would be unaligned
+            if (disk->direct && length % FTP_DIRECT_ALIGNMENT) {
+                eof = 1;
+                break;
+            }
+        }
+        ftp_transfer_digest(disk->client, buffer, length);
+        if (length > 0) ftp_pipeline_publish(disk->pipeline, length);
+        disk->bytes += length;
+    }
+    if (disk->direct) ftp_disable_direct_io(disk->local_fd);
+    ftp_pipeline_end(disk->pipeline, 0);
+    return NULL;
+}
+
+// Receive on this thread while a writer thread drains the ring to disk.
+// Returns -2 for anything but a regular file, where the plain loop is as good.
+static long long ftp_recv_data_pipelined(FTPClient *client, int local_fd) {
+    FTPPipeline pipeline;
+    FTPPipelineDisk disk;
+    pthread_t writer;
+    struct stat st;
+    int failed = 0;
+
+    if (fstat(local_fd, &st) < 0 || !S_ISREG(st.st_mode)) return -2;
+    if (ftp_pipeline_init(&pipeline, ftp_transfer_buffer_size(client)) < 0) return -2;
+
+    // Reserve the blocks up front (contiguous extents, early ENOSPC); the
+    // visible size still grows only with what was written, for resume
+    if (client->transfer_size > 0) {
+        off_t position = lseek(local_fd, 0, SEEK_CUR);
+        if (position >= 0) fallocate(local_fd, FALLOC_FL_KEEP_SIZE, position, client->transfer_size);
+    }
+
+    memset(&disk, 0, sizeof(disk));
+    disk.pipeline = &pipeline;
+    disk.client = client;
+    disk.local_fd = local_fd;
+    disk.direct = client->tuning.direct_io >= 1 && ftp_enable_direct_io(local_fd);
+    if (pthread_create(&writer, NULL, ftp_pipeline_writer, &disk) != 0) {
+        if (disk.direct) ftp_disable_direct_io(local_fd);
+        ftp_pipeline_destroy(&pipeline);
+        return -2;
+    }
+
+    char *buffer;
+    int eof = 0;
+    while (!eof && (buffer = ftp_pipeline_claim_empty(&pipeline))) {
+        size_t length = 0;
+        while (length < pipeline.buffer_size) {
+            ssize_t bytes_read = recv(client->data_socket, buffer + length, pipeline.buffer_size - length, 0);
+            if (bytes_read < 0 && errno == EINTR) continue;
+            if (bytes_read < 0) {
+                print_error("Failed to receive data");
+                failed = 1;
+                break;
+            }
+            if (bytes_read == 0) {
+                eof = 1;
+                break;
+            }
+            ftp_metrics_data(client, bytes_read, 0);
+            ftp_transfer_progress(client, bytes_read);
+            length += bytes_read;
+        }
+        if (failed) break;
+        if (length > 0) ftp_pipeline_publish(&pipeline, length);
+    }
+    ftp_pipeline_end(&pipeline, failed);
+    pthread_join(writer, NULL);
+
+    if (client->metrics) client->metrics->syscalls += disk.syscalls;
+    ftp_pipeline_destroy(&pipeline);
+    return (failed || disk.status < 0 || pipeline.failed) ? -1 : disk.bytes;
+}
+
+// Send on this thread while a reader thread keeps the ring full from disk
+static long long ftp_send_data_pipelined(FTPClient *client, int local_fd) {
+    FTPPipeline pipeline;
+    FTPPipelineDisk disk;
+    pthread_t reader;
+    struct stat st;
+    long long total = 0;
+    int failed = 0;
+
+    if (fstat(local_fd, &st) < 0 || !S_ISREG(st.st_mode)) return -2;
+    if (ftp_pipeline_init(&pipeline, ftp_transfer_buffer_size(client)) < 0) return -2;
+    posix_fadvise(local_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    memset(&disk, 0, sizeof(disk));
+    disk.pipeline = &pipeline;
+    disk.client = client;
+    disk.local_fd = local_fd;
+    disk.direct = client->tuning.direct_io >= 2 && ftp_enable_direct_io(local_fd);
+    if (pthread_create(&reader, NULL, ftp_pipeline_reader, &disk) != 0) {
+        if (disk.direct) ftp_disable_direct_io(local_fd);
+        ftp_pipeline_destroy(&pipeline);
+        return -2;
+    }
+
+    char *buffer;
+    size_t length;
+    while ((buffer = ftp_pipeline_claim_full(&pipeline, &length))) {
+        if (send_all(client->data_socket, buffer, length) < 0) {
+            print_error("Failed to send data");
+            failed = 1;
+            break;
+        }
+        ftp_metrics_data(client, 0, length);
+        ftp_transfer_progress(client, length);
+        total += length;
+        ftp_pipeline_recycle(&pipeline);
+    }
+    // Unblock a reader waiting for an empty buffer
+    if (failed) {
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.failed = 1;
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+    }
+    pthread_join(reader, NULL);
+
+    if (client->metrics) client->metrics->syscalls += disk.syscalls;
+    ftp_pipeline_destroy(&pipeline);
+    return (failed || disk.status < 0) ? -1 : total;
+}
+
+// "(12345 bytes)" in a 150 reply, as most servers send; 0 when absent
+long long ftp_parse_transfer_size(const char *reply) {
+    const char *open = strrchr(reply, '(');
+    long long size;
+
+    if (open && sscanf(open, "(%lld bytes)", &size) == 1 && size > 0) return size;
+    return 0;
+}
+
+// Copy the data connection into local_fd through a user buffer
+static long long ftp_recv_data_buffered(FTPClient *client, int local_fd) {
+    char *data_buffer = ftp_transfer_buffer(client);
+    long long total = 0;
+    ssize_t bytes_read;
+    
+    if (!data_buffer) return -1;
+    while ((bytes_read = recv(client->data_socket, data_buffer, client->transfer_buffer_size, 0)) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            print_error("Failed to receive data");
+            return -1;
+        }
+        ftp_metrics_data(client, bytes_read, 0);
+        ftp_transfer_progress(client, bytes_read);
+        ftp_transfer_digest(client, data_buffer, bytes_read);
+        ftp_metrics_syscall(client);  // write
+        if (write_all(local_fd, data_buffer, bytes_read) < 0) {
+            print_error("Failed to write local file");
+            return -1;
+        }
+        total += bytes_read;
+        if (ftp_journal_checkpoint(client, local_fd, bytes_read) < 0) return -1;
+    }
+    
+    return total;
+}
+
+// Streaming into a pipe (stdout of "ftp get ... -"): the target is a pipe
+// already, so one splice() per chunk moves the bytes. A slow reader fills
+// the pipe, which blocks the splice, which closes the TCP window.
+static long long ftp_recv_data_splice_fifo(FTPClient *client, int fifo_fd) {
+    long long total = 0;
+    
+    while (1) {
+        ssize_t moved = splice(client->data_socket, NULL, fifo_fd, NULL,
+                               ftp_transfer_buffer_size(client), SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved < 0) {
+            if (errno == EINTR) continue;
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS)) return -2;
+            print_error("Failed to splice into pipe");
+            return -1;
+        }
+        if (moved == 0) break;
+        ftp_metrics_data(client, moved, 0);
+        ftp_transfer_progress(client, moved);
+        ftp_metrics_syscall(client);
+        total += moved;
+    }
+    
+    return total;
+}
+
+// Move the data connection into local_fd with splice() through a pipe.
+// Returns -2 when the kernel refuses before any byte moved, so the caller can fall back.
+static long long ftp_recv_data_zerocopy(FTPClient *client, int local_fd) {
+    struct stat st;
+    int pipe_fds[2];
+    long long total = 0;
+    
+    // Inline hashing needs the bytes in user space
+    if (client->digest) return -2;
+    // splice() cannot write to O_APPEND files or to anything but files and pipes
+    if (fstat(local_fd, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode)) ||
+        (fcntl(local_fd, F_GETFL) & O_APPEND)) {
+        return -2;
+    }
+    if (S_ISFIFO(st.st_mode)) return ftp_recv_data_splice_fifo(client, local_fd);
+    if (pipe(pipe_fds) < 0) return -2;
+    
+    // A larger pipe moves more per splice pair; the kernel may grant less
+    fcntl(pipe_fds[1], F_SETPIPE_SZ, (int)ftp_transfer_buffer_size(client));
+    int chunk = fcntl(pipe_fds[1], F_GETPIPE_SZ);
+    if (chunk <= 0) chunk = FTP_SPLICE_CHUNK;
+    
+    while (1) {
+        ssize_t in_pipe = splice(client->data_socket, NULL, pipe_fds[1], NULL,
+                                 chunk, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in_pipe < 0) {
+            if (errno == EINTR) continue;
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS)) total = -2;
+            else {
+                print_error("Failed to splice from data connection");
+                total = -1;
+            }
+            break;
+        }
+        if (in_pipe == 0) break;
+        ftp_metrics_data(client, in_pipe, 0);
+        ftp_transfer_progress(client, in_pipe);
+        
+        while (in_pipe > 0) {
+            ssize_t out = splice(pipe_fds[0], NULL, local_fd, NULL, in_pipe, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0) {
+                if (errno == EINTR) continue;
+                print_error("Failed to splice into local file");
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return -1;
+            }
+            ftp_metrics_syscall(client);
+            in_pipe -= out;
+            total += out;
+            if (ftp_journal_checkpoint(client, local_fd, out) < 0) {
+                close(pipe_fds[0]);
+                close(pipe_fds[1]);
+                return -1;
+            }
+        }
+    }
+    
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    return total;
+}
+
+// Receive the whole data connection into local_fd using the requested path
+long long ftp_recv_data(FTPClient *client, int local_fd) {
+    long long total = -2;
+    FTPShaperFlow flow;
+    
+    ftp_shaping_begin(client, &flow);
+    client->window_started = 0;
+    client->window_bytes = 0;
+    client->stalled = 0;
+    ftp_metrics_transfer_start(client);
+    if (client->mode_z) {
+        client->last_data_path = FTP_DATA_BUFFERED;
+        total = ftp_recv_inflate(client, ftp_inflate_to_fd, &local_fd);
+    } else if (client->data_path == FTP_DATA_ZEROCOPY) {
+        total = ftp_recv_data_zerocopy(client, local_fd);
+        client->last_data_path = FTP_DATA_ZEROCOPY;
+    } else if (client->data_path == FTP_DATA_URING) {
+        total = ftp_recv_data_uring(client, local_fd);
+        client->last_data_path = FTP_DATA_URING;
+    } else if (client->data_path == FTP_DATA_PIPELINED) {
+        total = ftp_recv_data_pipelined(client, local_fd);
+        client->last_data_path = FTP_DATA_PIPELINED;
+    }
+    if (total == -2) {
+        client->last_data_path = FTP_DATA_BUFFERED;
+        total = ftp_recv_data_buffered(client, local_fd);
+    }
+    if (client->tuning.report_tcp_info) ftp_report_tcp_info(client, client->data_socket);
+    ftp_metrics_transfer_end(client);
+    ftp_shaping_end(client, &flow);
+    
+    return total;
+}
+
+// Copy local_fd into the data connection through a user buffer
+static long long ftp_send_data_buffered(FTPClient *client, int local_fd) {
+    char *data_buffer = ftp_transfer_buffer(client);
+    long long total = 0;
+    ssize_t bytes_read;
+    
+    if (!data_buffer) return -1;
+    while ((bytes_read = read(local_fd, data_buffer, client->transfer_buffer_size)) != 0) {
+        if (bytes_read < 0) {
+            if (errno == EINTR) continue;
+            print_error("Failed to read local file");
+            return -1;
+        }
+        ftp_metrics_syscall(client);  // read
+        ftp_transfer_digest(client, data_buffer, bytes_read);
+        if (send_all(client->data_socket, data_buffer, bytes_read) < 0) {
+            print_error("Failed to send data");
+            return -1;
+        }
+        ftp_metrics_data(client, 0, bytes_read);
+        ftp_transfer_progress(client, bytes_read);
+        total += bytes_read;
+    }
+    
+    return total;
+}
+
+// Send local_fd with sendfile(), or splice() when it is a pipe (stdin of
+// "ftp put - ..."). Returns -2 when zero-copy is not possible.
+static long long ftp_send_data_zerocopy(FTPClient *client, int local_fd) {
+    struct stat st;
+    long long total = 0;
+    
+    // sendfile() needs a mappable (regular) input file; hashing needs the bytes
+    if (client->digest || fstat(local_fd, &st) < 0 || !(S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode))) return -2;
+    int fifo = S_ISFIFO(st.st_mode);
+    
+    while (1) {
+        ssize_t sent = fifo ? splice(local_fd, NULL, client->data_socket, NULL, ftp_transfer_buffer_size(client),
+                                     SPLICE_F_MOVE | SPLICE_F_MORE)
+                            : sendfile(client->data_socket, local_fd, NULL, ftp_transfer_buffer_size(client));
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (total == 0 && (errno == EINVAL || errno == ENOSYS)) return -2;
+            print_error("Failed to sendfile to data connection");
+            return -1;
+        }
+        if (sent == 0) break;
+        ftp_metrics_data(client, 0, sent);
+        ftp_transfer_progress(client, sent);
+        total += sent;
+    }
+    
+    return total;
+}
+
+// Send all of local_fd over the data connection using the requested path
+long long ftp_send_data(FTPClient *client, int local_fd) {
+    long long total = -2;
+    FTPShaperFlow flow;
+    
+    ftp_shaping_begin(client, &flow);
+    client->window_started = 0;
+    client->window_bytes = 0;
+    client->stalled = 0;
+    ftp_metrics_transfer_start(client);
+    if (client->mode_z) {
+        client->last_data_path = FTP_DATA_BUFFERED;
+        total = ftp_send_deflate(client, local_fd);
+    } else if (client->data_path == FTP_DATA_ZEROCOPY) {
+        total = ftp_send_data_zerocopy(client, local_fd);
+        client->last_data_path = FTP_DATA_ZEROCOPY;
+    } else if (client->data_path == FTP_DATA_URING) {
+        total = ftp_send_data_uring(client, local_fd);
+        client->last_data_path = FTP_DATA_URING;
+    } else if (client->data_path == FTP_DATA_PIPELINED) {
+        total = ftp_send_data_pipelined(client, local_fd);
+        client->last_data_path = FTP_DATA_PIPELINED;
+    }
+    if (total == -2) {
+        client->last_data_path = FTP_DATA_BUFFERED;
+        total = ftp_send_data_buffered(client, local_fd);
+    }
+    if (client->tuning.report_tcp_info) ftp_report_tcp_info(client, client->data_socket);
+    ftp_metrics_transfer_end(client);
+    ftp_shaping_end(client, &flow);
+    
+    return total;
+}
+
+// Download remote_file into fd, which may be a pipe, socket or terminal as
+// well as a file; fd is left open. Returns the bytes received, or -1.
+long long ftp_download_to_fd(FTPClient *client, const char *remote_file, int fd) {
+    char response[MAX_BUFFER];
+    char command[MAX_COMMAND];
+    
+    // Compress on the wire when MODE Z is configured and offered
+    if (ftp_select_transfer_mode(client, 1) < 0) return -1;
+    
+    // Send PASV and RETR together, then connect once the 227 arrives
+    int ahead;
+    snprintf(command, sizeof(command), "RETR %s", remote_file);
+    if (ftp_start_transfer_command(client, command, &ahead) < 0) return -1;
+    
+    // Initial response
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 150) {
+        fprintf(stderr, "File retrieval failed: %s\n", response);
+        ftp_close_socket(client, &client->data_socket);
+        if (ahead) ftp_prepare_data_channel(client);
+        return -1;
+    }
+    
+    // Download file; the announced size lets the pipelined path preallocate
+    FTPDigest digest;
+    client->transfer_size = ftp_parse_transfer_size(response);
+    long long bytes_received = ftp_verify_begin(client, &digest) < 0 ? -1 : ftp_recv_data(client, fd);
+    client->transfer_size = 0;
+    
+    // Close the data connection; if fd stopped taking data this makes the server abort
+    ftp_close_socket(client, &client->data_socket);
+    
+    // Final response, then the server's hash of what it sent
+    response_code = recv_ftp_response(client, response, sizeof(response));
+    if (ahead) ftp_prepare_data_channel(client);
+    int verified = ftp_verify_end(client, remote_file, &digest, response_code == 226 && bytes_received >= 0);
+    if (response_code != 226 || bytes_received < 0) {
+        fprintf(stderr, "File download incomplete: %s\n", response);
+        return -1;
+    }
+    if (verified < 0) return -1;
+    return bytes_received;
+}
+
+// Download file
+int ftp_download_file(FTPClient *client, const char *remote_file, const char *local_file) {
+    int local_fd;
+    
+    if (client->download_cache) {
+        int status = ftp_download_cached(client, remote_file, local_file);
+        if (status <= 0) return status;
+    }
+    
+    // Open local file
+    local_fd = open(local_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (local_fd < 0) {
+        print_error("Failed to open local file");
+        return -1;
+    }
+    
+    long long bytes_received = ftp_download_to_fd(client, remote_file, local_fd);
+    if (close(local_fd) < 0 && bytes_received >= 0) {
+        print_error("Failed to write local file");
+        return -1;
+    }
+    if (bytes_received < 0) return -1;
+    
+    if (!client->quiet) printf("File downloaded successfully: %s (%lld bytes, %s)\n",
+                               local_file, bytes_received, ftp_data_path_name(client->last_data_path));
+    if (client->mode_z && !client->quiet) ftp_report_compression(client);
+    return 0;
+}
+
+// Switch the transfer type to binary (image)
+int ftp_set_binary_mode(FTPClient *client) {
+    char response[MAX_BUFFER];
+    
+    if (send_ftp_command(client, "TYPE I") < 0) return -1;
+    
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 200) {
+        fprintf(stderr, "Binary mode failed: %s\n", response);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Query the size of a remote file (SIZE, RFC 3659)
+int ftp_get_remote_size(FTPClient *client, const char *remote_file, long long *size) {
+    char command[MAX_COMMAND];
+    char response[MAX_BUFFER];
+    
+    snprintf(command, sizeof(command), "SIZE %s", remote_file);
+    if (send_ftp_command(client, command) < 0) return -1;
+    
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 213 || sscanf(response, "213 %lld", size) != 1) {
+        fprintf(stderr, "Size query failed: %s\n", response);
+        return -1;
+    }
+    
+    return 0;
+}
+
+// Open a new logged-in session to the same server, user and directory as origin
+int ftp_open_session(FTPClient *session, const FTPClient *origin) {
+    memset(session, 0, sizeof(*session));
+    session->control_socket = -1;
+    session->data_socket = -1;
+    session->prepared_socket = -1;
+    session->server_port = origin->server_port;
+    session->state = FTP_DISCONNECTED;
+    session->tuning = origin->tuning;
+    session->shaper = origin->shaper;
+    session->shaper_weight = origin->shaper_weight;
+    session->rate_limit = origin->rate_limit;
+    session->flow = origin->flow;  // a shaped transfer's sessions share its flow
+    session->listing_cache = origin->listing_cache;
+    
+    if (ftp_connect(session, origin->server_hostname) < 0) return -1;
+    
+    if (ftp_login(session, origin->username, origin->password) < 0) {
+        ftp_close_connection(session);
+        return -1;
+    }
+    
+    if (origin->current_remote_dir[0] &&
+        ftp_change_remote_directory(session, origin->current_remote_dir) < 0) {
+        ftp_close_connection(session);
+        return -1;
+    }
+    
+    return 0;
+}
+
+typedef struct {
+    const FTPClient *origin;
+    const char *remote_file;
+    int local_fd;
+    long long offset;
+    long long length;
+    int status;
+} FTPSegment;
+
+// Download one byte range [offset, offset + length) over its own session
+static void *ftp_segment_worker(void *arg) {
+    FTPSegment *segment = arg;
+    FTPClient session;
+    char rest_command[MAX_COMMAND];
+    char retr_command[MAX_COMMAND];
+    char response[MAX_BUFFER];
+    
+    segment->status = -1;
+    if (ftp_open_session(&session, segment->origin) < 0) return NULL;
+    
+    // The session's tuned transfer buffer, freed by ftp_close_connection
+    char *data_buffer = ftp_transfer_buffer(&session);
+    if (!data_buffer) {
+        ftp_close_connection(&session);
+        return NULL;
+    }
+    size_t buffer_size = session.transfer_buffer_size;
+    
+    // TYPE, PASV, REST and RETR go out in one write; replies are checked in order
+    snprintf(rest_command, sizeof(rest_command), "REST %lld", segment->offset);
+    snprintf(retr_command, sizeof(retr_command), "RETR %s", segment->remote_file);
+    const char *commands[] = { "TYPE I", NULL, rest_command, retr_command };
+    if (ftp_send_passive_pipelined(&session, commands, 4, 1) < 0) {
+        fprintf(stderr, "Segment setup failed at %lld\n", segment->offset);
+        ftp_close_connection(&session);
+        return NULL;
+    }
+    
+    // Without a 350 the RETR would start at 0: drop it before reading any data
+    if (recv_ftp_response(&session, response, sizeof(response)) != 350) {
+        fprintf(stderr, "Restart at %lld failed: %s\n", segment->offset, response);
+        ftp_close_socket(&session, &session.data_socket);
+        ftp_close_connection(&session);
+        return NULL;
+    }
+    
+    if (recv_ftp_response(&session, response, sizeof(response)) != 150) {
+        fprintf(stderr, "Segment retrieval failed: %s\n", response);
+        ftp_close_socket(&session, &session.data_socket);
+        ftp_close_connection(&session);
+        return NULL;
+    }
+    
+    // Read exactly this segment's bytes, then drop the data connection
+    long long offset = segment->offset;
+    long long remaining = segment->length;
+    while (remaining > 0) {
+        size_t wanted = remaining < (long long)buffer_size ? (size_t)remaining : buffer_size;
+        ssize_t bytes_read = recv(session.data_socket, data_buffer, wanted, 0);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read <= 0) break;
+        
+        if (pwrite_all(segment->local_fd, data_buffer, bytes_read, offset) < 0) {
+            print_error("Failed to write segment");
+            break;
+        }
+        ftp_transfer_progress(&session, bytes_read);
+        offset += bytes_read;
+        remaining -= bytes_read;
+    }
+    
+    ftp_close_socket(&session, &session.data_socket);
+    
+    // The server answers 226, or 426/451 when the segment ended before EOF
+    recv_ftp_response(&session, response, sizeof(response));
+    ftp_close_connection(&session);
+    
+    if (remaining == 0) {
+        segment->status = 0;
+    } else {
+        fprintf(stderr, "Segment at %lld incomplete: %lld bytes missing\n", segment->offset, remaining);
+    }
+    return NULL;
+}
+
+// Download file over several parallel data connections, one byte range each
+int ftp_download_file_segmented(FTPClient *client, const char *remote_file, const char *local_file, int segments) {
+    long long file_size;
+    
+    if (segments > FTP_MAX_SEGMENTS) segments = FTP_MAX_SEGMENTS;
+    
+    if (ftp_set_binary_mode(client) < 0) return -1;
+    if (segments <= 1 || ftp_get_remote_size(client, remote_file, &file_size) < 0) {
+        return ftp_download_file(client, remote_file, local_file);
+    }
+    
+    // Keep every segment worth the cost of an extra session
+    if (file_size / segments < FTP_MIN_SEGMENT_SIZE) {
+        segments = (int)(file_size / FTP_MIN_SEGMENT_SIZE);
+    }
+    if (segments <= 1) {
+        return ftp_download_file(client, remote_file, local_file);
+    }
+    
+    // Preallocate the local file so each segment can write at its own offset
+    int local_fd = open(local_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (local_fd < 0) {
+        print_error("Failed to open local file");
+        return -1;
+    }
+    if (ftruncate(local_fd, file_size) < 0) {
+        print_error("Failed to size local file");
+        close(local_fd);
+        return -1;
+    }
+    posix_fallocate(local_fd, 0, file_size);
+    
+    FTPSegment segment_list[FTP_MAX_SEGMENTS];
+    pthread_t threads[FTP_MAX_SEGMENTS];
+    long long segment_size = file_size / segments;
+    FTPShaperFlow flow;
+    
+    // All segments count as one transfer against the bandwidth limits
+    ftp_shaping_begin(client, &flow);
+    
+    int failed = 0;
+    for (int i = 0; i < segments; i++) {
+        segment_list[i].origin = client;
+        segment_list[i].remote_file = remote_file;
+        segment_list[i].local_fd = local_fd;
+        segment_list[i].offset = i * segment_size;
+        segment_list[i].length = (i == segments - 1) ? file_size - i * segment_size : segment_size;
+        segment_list[i].status = -1;
+        
+        if (pthread_create(&threads[i], NULL, ftp_segment_worker, &segment_list[i]) != 0) {
+            // The ranges from here on would be left as holes in the file
+            fprintf(stderr, "Failed to start segment %d\n", i);
+            segments = i;
+            failed = 1;
+            break;
+        }
+    }
+    
+    for (int i = 0; i < segments; i++) {
+        pthread_join(threads[i], NULL);
+        if (segment_list[i].status != 0) failed = 1;
+    }
+    ftp_shaping_end(client, &flow);
+    
+    if (close(local_fd) < 0) failed = 1;
+    if (failed) {
+        fprintf(stderr, "Segmented download failed: %s\n", remote_file);
+        return -1;
+    }
+    if (ftp_verify_file(client, remote_file, local_file) < 0) return -1;
+    
+    if (!client->quiet) printf("File downloaded successfully: %s (%d segments)\n", local_file, segments);
+    return 0;
+}
+
+// Upload everything read from fd until end of file; the size need not be
+// known up front, so fd may be a pipe. fd is left open. Returns bytes sent, or -1.
+long long ftp_upload_from_fd(FTPClient *client, int fd, const char *remote_file) {
+    char response[MAX_BUFFER];
+    char command[MAX_COMMAND];
+    
+    // Compress on the wire when MODE Z is configured and offered
+    if (ftp_select_transfer_mode(client, 1) < 0) return -1;
+    
+    // Send PASV and STOR together, then connect once the 227 arrives
+    int ahead;
+    snprintf(command, sizeof(command), "STOR %s", remote_file);
+    if (ftp_start_transfer_command(client, command, &ahead) < 0) return -1;
+    
+    // Initial response
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 150) {
+        fprintf(stderr, "File upload failed: %s\n", response);
+        ftp_close_socket(client, &client->data_socket);
+        if (ahead) ftp_prepare_data_channel(client);
+        return -1;
+    }
+    
+    // Upload file
+    FTPDigest digest;
+    long long bytes_sent = ftp_verify_begin(client, &digest) < 0 ? -1 : ftp_send_data(client, fd);
+    
+    // Closing the data connection marks the end of the file
+    ftp_close_socket(client, &client->data_socket);
+
+    // Final response, then the server's hash of what it stored
+    response_code = recv_ftp_response(client, response, sizeof(response));
+    if (ahead) ftp_prepare_data_channel(client);
+    int verified = ftp_verify_end(client, remote_file, &digest, response_code == 226 && bytes_sent >= 0);
+    if (response_code != 226 || bytes_sent < 0) {
+        fprintf(stderr, "File upload incomplete: %s\n",response);
+        return -1;
+    }
+    if (verified < 0) return -1;
+    
+    ftp_listing_cache_invalidate_parent(client, remote_file);
+    return bytes_sent;
+}
+
+// Upload file
+int ftp_upload_file(FTPClient *client, const char *local_file, const char *remote_file) {
+    int local_fd;
+    
+    // Open local file
+    local_fd = open(local_file, O_RDONLY);
+    if (local_fd < 0) {
+        print_error("Failed to open local file");
+        return -1;
+    }
+    
+    long long bytes_sent = ftp_upload_from_fd(client, local_fd, remote_file);
+    close(local_fd);
+    if (bytes_sent < 0) return -1;
+    
+    if (!client->quiet) printf("File uploaded successfully: %s (%lld bytes, %s)\n",
+                               local_file, bytes_sent, ftp_data_path_name(client->last_data_path));
+    if (client->mode_z && !client->quiet) ftp_report_compression(client);
+    return 0;
+}
+
+// Create remote directory
+int ftp_make_remote_directory(FTPClient *client, const char *path) {
+    char command[MAX_COMMAND];
+    char response[MAX_BUFFER];
+    
+    snprintf(command, sizeof(command), "MKD %s", path);
+    if (send_ftp_command(client, command) < 0) return -1;
+    
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 257) {
+        fprintf(stderr, "Create directory failed: %s\n", response);
+        return -1;
+    }
+    
+    ftp_listing_cache_invalidate_parent(client, path);
+    if (!client->quiet) printf("Directory created: %s\n", path);
+    return 0;
+}
+
+// Remove remote file
+int ftp_remove_remote_file(FTPClient *client, const char *filename) {
+    char command[MAX_COMMAND];
+    char response[MAX_BUFFER];
+    
+    snprintf(command, sizeof(command), "DELE %s", filename);
+    if (send_ftp_command(client, command) < 0) return -1;
+    
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 250) {
+        fprintf(stderr, "File deletion failed: %s\n", response);
+        return -1;
+    }
+    
+    ftp_listing_cache_invalidate_parent(client, filename);
+    if (!client->quiet) printf("File deleted: %s\n", filename);
+    return 0;
+}
+
+// Rename remote file
+int ftp_rename_remote_file(FTPClient *client, const char *old_name, const char *new_name) {
+    char command[MAX_COMMAND];
+    char response[MAX_BUFFER];
+    
+    // Send RNFR (Rename From) command
+    snprintf(command, sizeof(command), "RNFR %s", old_name);
+    if (send_ftp_command(client, command) < 0) return -1;
+    
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 350) {
+        fprintf(stderr, "Rename preparation failed: %s\n", response);
+        return -1;
+    }
+    
+    // Send RNTO (Rename To) command
+    snprintf(command, sizeof(command), "RNTO %s", new_name);
+    if (send_ftp_command(client, command) < 0) return -1;
+    
+    response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 250) {
+        fprintf(stderr, "File rename failed: %s\n", response);
+        return -1;
+    }
+    
+    ftp_listing_cache_invalidate_parent(client, old_name);
+    ftp_listing_cache_invalidate_parent(client, new_name);
+    if (!client->quiet) printf("File renamed from %s to %s\n", old_name, new_name);
+    return 0;
+}
+
+// Close FTP connection
+void ftp_close_connection(FTPClient *client) {
+    if (client->state == FTP_LOGGED_IN || client->state == FTP_CONNECTED) {
+        send_ftp_command(client, "QUIT");
+        recv_ftp_response(client, NULL, 0);
+    }
+    
+    ftp_close_socket(client, &client->control_socket);
+    ftp_close_socket(client, &client->data_socket);
+    ftp_discard_prepared_channel(client);
+    
+    free(client->transfer_buffer);
+    client->transfer_buffer = NULL;
+    client->transfer_buffer_size = 0;
+    if (client->uring) {
+        ftp_uring_destroy(client->uring);
+        free(client->uring);
+        client->uring = NULL;
+    }
+    
+    client->state = FTP_DISCONNECTED;
+    memset(client->username, 0, sizeof(client->username));
+    memset(client->password, 0, sizeof(client->password));
+}
+
+// Extract one complete reply (single or RFC 959 multi-line) from the front of buffer.
+// Returns the reply code, 0 if more bytes are needed, -1 for a malformed reply.
+int ftp_extract_reply(char *buffer, size_t *length, char *response, size_t max_len) {
+    size_t consumed = 0;
+    int code = -1;
+    
+    while (1) {
+        char *line = buffer + consumed;
+        char *newline = memchr(line, '\n', *length - consumed);
+        if (!newline) return 0;
+        
+        size_t line_length = newline - line + 1;
+        int line_code = -1;
+        if (line_length >= 4 && isdigit((unsigned char)line[0]) &&
+            isdigit((unsigned char)line[1]) && isdigit((unsigned char)line[2])) {
+            line_code = (line[0] - '0') * 100 + (line[1] - '0') * 10 + (line[2] - '0');
+        }
+        consumed += line_length;
+        
+        if (line == buffer) {
+            code = line_code;
+            if (code < 0 || line[3] != '-') break;
+        } else if (line_code == code && line[3] == ' ') {
+            // A multi-line reply ends with the same code followed by a space
+            break;
+        }
+    }
+    
+    if (response && max_len > 0) {
+        size_t copy = consumed < max_len - 1 ? consumed : max_len - 1;
+        memcpy(response, buffer, copy);
+        response[copy] = '\0';
+        trim_whitespace(response);
+    }
+    
+    memmove(buffer, buffer + consumed, *length - consumed);
+    *length -= consumed;
+    return code;
+}
+
+// ---------------------------------------------------------------------------
+// epoll transfer engine: many sessions driven as state machines by one thread
+// ---------------------------------------------------------------------------
+
+// Send (the rest of) a job's pending control command without blocking
+static int ftp_job_flush_command(FTPEngine *engine, FTPJob *job) {
+    while (job->command_sent < job->command_length) {
+        ssize_t sent = send(job->client.control_socket, job->command + job->command_sent,
+                            job->command_length - job->command_sent, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            return -1;
+        }
+        job->command_sent += sent;
+    }
+    
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | (job->command_sent < job->command_length ? EPOLLOUT : 0);
+    event.data.ptr = &job->control_endpoint;
+    return epoll_ctl(engine->epoll_fd, EPOLL_CTL_MOD, job->client.control_socket, &event);
+}
+
+// Append a command behind any still-unsent ones; replies come back in order
+static int ftp_job_queue_command(FTPJob *job, const char *format, const char *argument) {
+    if (job->command_sent == job->command_length) {
+        job->command_sent = job->command_length = 0;
+    }
+    
+    size_t space = sizeof(job->command) - job->command_length;
+    int length = snprintf(job->command + job->command_length, space, format, argument);
+    if (length < 0 || (size_t)length + 2 >= space) return -1;
+    
+    memcpy(job->command + job->command_length + length, "\r\n", 2);
+    job->command_length += length + 2;
+    return 0;
+}
+
+// Start a non-blocking connect and register the socket with epoll
+static int ftp_engine_open_socket(FTPEngine *engine, FTPEndpoint *endpoint, const FTPAddress *address) {
+    int socket_fd = socket(address->address.ss_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (socket_fd < 0) return -1;
+    if (endpoint->is_data) ftp_tune_data_socket(&endpoint->job->client, socket_fd);
+    else ftp_tune_control_socket(socket_fd);
+    
+    if (connect(socket_fd, (const struct sockaddr *)&address->address, address->length) < 0 && errno != EINPROGRESS) {
+        close(socket_fd);
+        return -1;
+    }
+    
+    struct epoll_event event = {0};
+    event.events = EPOLLOUT;
+    event.data.ptr = endpoint;
+    if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) < 0) {
+        close(socket_fd);
+        return -1;
+    }
+    
+    return socket_fd;
+}
+
+static void ftp_job_close_data(FTPJob *job) {
+    if (job->client.data_socket >= 0) {
+        ftp_close_socket(&job->client, &job->client.data_socket);  // also removes it from the epoll set
+    }
+}
+
+// Release a finished job's sockets and file and record the outcome
+static void ftp_job_finish(FTPEngine *engine, FTPJob *job, const char *error) {
+    if (error) {
+        snprintf(job->error, sizeof(job->error), "%s", error);
+        job->state = FTP_JOB_FAILED;
+    } else {
+        job->state = FTP_JOB_DONE;
+    }
+    
+    ftp_job_close_data(job);
+    if (job->client.control_socket >= 0) {
+        if (!error) send(job->client.control_socket, "QUIT\r\n", 6, MSG_NOSIGNAL);
+        ftp_close_socket(&job->client, &job->client.control_socket);
+    }
+    if (job->local_fd >= 0) {
+        if (close(job->local_fd) < 0 && !error) {
+            snprintf(job->error, sizeof(job->error), "Failed to close local file");
+            job->state = FTP_JOB_FAILED;
+        }
+        job->local_fd = -1;
+    }
+    
+    job->client.state = FTP_DISCONNECTED;
+    engine->active--;
+}
+
+static void ftp_job_check_complete(FTPEngine *engine, FTPJob *job) {
+    if (job->data_done && job->reply_done) ftp_job_finish(engine, job, NULL);
+}
+
+// Advance a job's state machine on one control reply
+static void ftp_job_on_reply(FTPEngine *engine, FTPJob *job, int code, const char *reply) {
+    int failed = 0;
+    
+    // Preliminary replies (e.g. 120 "service ready soon") need no action
+    if (code >= 100 && code < 200 && job->state != FTP_JOB_TRANSFER_START) return;
+    
+    switch (job->state) {
+        case FTP_JOB_GREETING:
+            if (code != 220) break;
+            // Login, setup and the transfer command go out in one write
+            failed = ftp_job_queue_command(job, "USER %s", job->client.username) < 0 ||
+                     ftp_job_queue_command(job, "PASS %s", job->client.password) < 0 ||
+                     ftp_job_queue_command(job, "%s", "TYPE I") < 0 ||
+                     ftp_job_queue_command(job, "%s", ftp_passive_command(&job->client)) < 0 ||
+                     ftp_job_queue_command(job, job->kind == FTP_JOB_DOWNLOAD ? "RETR %s" : "STOR %s",
+                                           job->remote_file) < 0 ||
+                     ftp_job_flush_command(engine, job) < 0;
+            if (failed) break;
+            job->state = FTP_JOB_USER;
+            return;
+        
+        case FTP_JOB_USER:
+            if (code != 331 && code != 230) break;
+            if (code == 230) job->client.state = FTP_LOGGED_IN;
+            job->state = FTP_JOB_PASS;
+            return;
+        
+        case FTP_JOB_PASS:
+            // After a 230 to USER, the PASS reply (usually 503) carries no news
+            if (code != 230 && code != 202 && job->client.state != FTP_LOGGED_IN) break;
+            job->client.state = FTP_LOGGED_IN;
+            job->state = FTP_JOB_TYPE;
+            return;
+        
+        case FTP_JOB_TYPE:
+            if (code != 200) break;
+            job->state = FTP_JOB_PASV;
+            return;
+        
+        case FTP_JOB_PASV: {
+            FTPAddress data_address;
+            if (ftp_parse_passive_reply(&job->client, code, reply, &data_address) < 0) break;
+            job->client.data_socket = ftp_engine_open_socket(engine, &job->data_endpoint, &data_address);
+            if (job->client.data_socket < 0) break;
+            job->state = FTP_JOB_TRANSFER_START;
+            return;
+        }
+        
+        case FTP_JOB_TRANSFER_START:
+            if (code != 150 && code != 125) break;
+            job->state = FTP_JOB_TRANSFERRING;
+            return;
+        
+        case FTP_JOB_TRANSFERRING:
+            if (code != 226 && code != 250) break;
+            job->reply_done = 1;
+            ftp_job_check_complete(engine, job);
+            return;
+        
+        default:
+            return;
+    }
+    
+    ftp_job_finish(engine, job, reply[0] ? reply : "Unexpected server reply");
+}
+
+static void ftp_job_on_control(FTPEngine *engine, FTPJob *job, uint32_t events) {
+    char response[MAX_BUFFER];
+    
+    if (job->state == FTP_JOB_CONNECTING) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        getsockopt(job->client.control_socket, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        if (error) {
+            ftp_job_finish(engine, job, strerror(error));
+            return;
+        }
+        job->client.state = FTP_CONNECTED;
+        job->state = FTP_JOB_GREETING;
+        job->command_length = job->command_sent = 0;
+        if (ftp_job_flush_command(engine, job) < 0) ftp_job_finish(engine, job, "epoll_ctl failed");
+        return;
+    }
+    
+    if ((events & EPOLLOUT) && ftp_job_flush_command(engine, job) < 0) {
+        ftp_job_finish(engine, job, "Failed to send command");
+        return;
+    }
+    if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+    
+    while (1) {
+        FTPClient *client = &job->client;
+        if (client->reply_length == sizeof(client->reply_buffer)) {
+            ftp_job_finish(engine, job, "Server reply too long");
+            return;
+        }
+        ssize_t received = recv(client->control_socket, client->reply_buffer + client->reply_length,
+                                sizeof(client->reply_buffer) - client->reply_length, 0);
+        if (received < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            ftp_job_finish(engine, job, strerror(errno));
+            return;
+        }
+        if (received == 0) {
+            ftp_job_finish(engine, job, "Control connection closed");
+            return;
+        }
+        client->reply_length += received;
+        
+        int code;
+        while ((code = ftp_extract_reply(client->reply_buffer, &client->reply_length, response, sizeof(response))) != 0) {
+            if (code < 0) {
+                ftp_job_finish(engine, job, "Malformed server reply");
+                return;
+            }
+            ftp_job_on_reply(engine, job, code, response);
+            if (job->state == FTP_JOB_DONE || job->state == FTP_JOB_FAILED) return;
+        }
+    }
+}
+
+static void ftp_job_on_data(FTPEngine *engine, FTPJob *job, uint32_t events) {
+    char data_buffer[MAX_BUFFER];
+    
+    if (!job->data_connected) {
+        int error = 0;
+        socklen_t error_length = sizeof(error);
+        getsockopt(job->client.data_socket, SOL_SOCKET, SO_ERROR, &error, &error_length);
+        if (error) {
+            ftp_job_finish(engine, job, strerror(error));
+            return;
+        }
+        job->data_connected = 1;
+        
+        struct epoll_event event = {0};
+        event.events = job->kind == FTP_JOB_DOWNLOAD ? EPOLLIN : EPOLLOUT;
+        event.data.ptr = &job->data_endpoint;
+        epoll_ctl(engine->epoll_fd, EPOLL_CTL_MOD, job->client.data_socket, &event);
+        if (job->kind == FTP_JOB_DOWNLOAD) return;
+        events = EPOLLOUT;
+    }
+    
+    if (job->kind == FTP_JOB_DOWNLOAD) {
+        if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR))) return;
+        while (1) {
+            ssize_t received = recv(job->client.data_socket, data_buffer, sizeof(data_buffer), 0);
+            if (received < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                ftp_job_finish(engine, job, strerror(errno));
+                return;
+            }
+            if (received == 0) break;
+            if (write_all(job->local_fd, data_buffer, received) < 0) {
+                ftp_job_finish(engine, job, "Failed to write local file");
+                return;
+            }
+            job->bytes += received;
+        }
+    } else {
+        if (!(events & (EPOLLOUT | EPOLLHUP | EPOLLERR))) return;
+        while (1) {
+            if (job->staged_sent == job->staged_length) {
+                ssize_t bytes_read = read(job->local_fd, job->staged, sizeof(job->staged));
+                if (bytes_read < 0) {
+                    if (errno == EINTR) continue;
+                    ftp_job_finish(engine, job, "Failed to read local file");
+                    return;
+                }
+                if (bytes_read == 0) break;
+                job->staged_length = bytes_read;
+                job->staged_sent = 0;
+            }
+            ssize_t sent = send(job->client.data_socket, job->staged + job->staged_sent,
+                                job->staged_length - job->staged_sent, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return;
+                ftp_job_finish(engine, job, strerror(errno));
+                return;
+            }
+            job->staged_sent += sent;
+            job->bytes += sent;
+        }
+    }
+    
+    // End of data: closing the data connection tells the server an upload is complete
+    ftp_job_close_data(job);
+    job->data_done = 1;
+    ftp_job_check_complete(engine, job);
+}
+
+int ftp_engine_init(FTPEngine *engine, int max_jobs) {
+    memset(engine, 0, sizeof(*engine));
+    
+    engine->epoll_fd = epoll_create1(0);
+    if (engine->epoll_fd < 0) {
+        print_error("epoll_create1 failed");
+        return -1;
+    }
+    
+    // Jobs never move once queued: epoll events point straight into them
+    engine->jobs = calloc(max_jobs, sizeof(FTPJob));
+    if (!engine->jobs) {
+        close(engine->epoll_fd);
+        return -1;
+    }
+    engine->job_capacity = max_jobs;
+    return 0;
+}
+
+// Queue a download (FTP_JOB_DOWNLOAD) or upload (FTP_JOB_UPLOAD) on its own session
+int ftp_engine_add_job(FTPEngine *engine, FTPJobKind kind, const FTPClient *origin,
+                       const char *remote_file, const char *local_file) {
+    if (engine->job_count == engine->job_capacity) {
+        fprintf(stderr, "Engine job table full\n");
+        return -1;
+    }
+    
+    FTPJob *job = &engine->jobs[engine->job_count];
+    memset(job, 0, sizeof(*job));
+    job->kind = kind;
+    job->client.control_socket = -1;
+    job->client.data_socket = -1;
+    job->client.prepared_socket = -1;
+    job->local_fd = -1;
+    job->control_endpoint.job = job;
+    job->data_endpoint.job = job;
+    job->data_endpoint.is_data = 1;
+    
+    memcpy(job->client.server_hostname, origin->server_hostname, sizeof(job->client.server_hostname));
+    memcpy(job->client.username, origin->username, sizeof(job->client.username));
+    memcpy(job->client.password, origin->password, sizeof(job->client.password));
+    job->client.server_port = origin->server_port > 0 ? origin->server_port : FTP_DEFAULT_PORT;
+    job->client.tuning = origin->tuning;
+    strncpy(job->remote_file, remote_file, sizeof(job->remote_file) - 1);
+    strncpy(job->local_file, local_file, sizeof(job->local_file) - 1);
+    
+    engine->job_count++;
+    return 0;
+}
+
+// Resolve, open the local file and start connecting one queued job
+static void ftp_engine_start_job(FTPEngine *engine, FTPJob *job) {
+    FTPAddress addresses[FTP_MAX_ADDRESSES];
+    
+    engine->active++;
+    job->state = FTP_JOB_CONNECTING;
+    
+    // Jobs share the resolver cache; each connects to the preferred address
+    if (ftp_resolve(job->client.server_hostname, addresses, FTP_MAX_ADDRESSES) < 0) {
+        ftp_job_finish(engine, job, "Failed to resolve hostname");
+        return;
+    }
+    job->client.server_address = addresses[0];
+    ftp_address_set_port(&job->client.server_address, job->client.server_port);
+    
+    if (job->kind == FTP_JOB_DOWNLOAD) {
+        job->local_fd = open(job->local_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else {
+        job->local_fd = open(job->local_file, O_RDONLY);
+    }
+    if (job->local_fd < 0) {
+        ftp_job_finish(engine, job, "Failed to open local file");
+        return;
+    }
+    
+    job->client.control_socket = ftp_engine_open_socket(engine, &job->control_endpoint, &job->client.server_address);
+    if (job->client.control_socket < 0) {
+        ftp_job_finish(engine, job, "Connection failed");
+        return;
+    }
+    ftp_address_to_string(&job->client.server_address, job->client.server_ip, sizeof(job->client.server_ip));
+}
+
+// Run every queued job to completion. Returns the number of failed jobs.
+int ftp_engine_run(FTPEngine *engine) {
+    struct epoll_event events[FTP_ENGINE_MAX_EVENTS];
+    int failed = 0;
+    
+    for (int i = 0; i < engine->job_count; i++) {
+        if (engine->jobs[i].state == FTP_JOB_QUEUED) ftp_engine_start_job(engine, &engine->jobs[i]);
+    }
+    
+    while (engine->active > 0) {
+        int ready = epoll_wait(engine->epoll_fd, events, FTP_ENGINE_MAX_EVENTS, -1);
+        if (ready < 0) {
+            if (errno == EINTR) continue;
+            print_error("epoll_wait failed");
+            return -1;
+        }
+        
+        for (int i = 0; i < ready; i++) {
+            FTPEndpoint *endpoint = events[i].data.ptr;
+            FTPJob *job = endpoint->job;
+            
+            // An earlier event in this batch may already have finished the job
+            if (job->state == FTP_JOB_DONE || job->state == FTP_JOB_FAILED) continue;
+            if (endpoint->is_data) {
+                if (job->client.data_socket >= 0) ftp_job_on_data(engine, job, events[i].events);
+            } else {
+                ftp_job_on_control(engine, job, events[i].events);
+            }
+        }
+    }
+    
+    for (int i = 0; i < engine->job_count; i++) {
+        FTPJob *job = &engine->jobs[i];
+        if (job->state == FTP_JOB_DONE) {
+            printf("%s %s: %lld bytes\n", job->kind == FTP_JOB_DOWNLOAD ? "Downloaded" : "Uploaded",
+                   job->remote_file, job->bytes);
+        } else {
+            fprintf(stderr, "Transfer of %s failed: %s\n", job->remote_file, job->error);
+            failed++;
+        }
+    }
+    
+    return failed;
+}
+
+void ftp_engine_destroy(FTPEngine *engine) {
+    close(engine->epoll_fd);
+    free(engine->jobs);
+    memset(engine, 0, sizeof(*engine));
+}
+
+// Print working directory (PWD) into path
+int ftp_print_working_directory(FTPClient *client, char *path, size_t max_len) {
+    char response[MAX_BUFFER];
+    
+    if (send_ftp_command(client, "PWD") < 0) return -1;
+    
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 257) {
+        fprintf(stderr, "Print directory failed: %s\n", response);
+        return -1;
+    }
+    
+    // 257 "<path>" ...; embedded quotes are doubled
+    char *quote = strchr(response, '"');
+    size_t length = 0;
+    if (!quote) return -1;
+    for (char *p = quote + 1; *p && length + 1 < max_len; p++) {
+        if (*p == '"') {
+            if (p[1] != '"') break;
+            p++;
+        }
+        path[length++] = *p;
+    }
+    path[length] = '\0';
+    return 0;
+}
+
+// Check that the control connection is still alive
+int ftp_noop(FTPClient *client) {
+    char response[MAX_BUFFER];
+    
+    if (send_ftp_command(client, "NOOP") < 0) return -1;
+    return recv_ftp_response(client, response, sizeof(response)) == 200 ? 0 : -1;
+}
+
+// ---------------------------------------------------------------------------
+// Session pool: logged-in control connections reused across jobs
+// ---------------------------------------------------------------------------
+
+int ftp_pool_init(FTPSessionPool *pool, int max_sessions, int max_per_server, int idle_timeout) {
+    memset(pool, 0, sizeof(*pool));
+    
+    pool->sessions = calloc(max_sessions, sizeof(FTPPooledSession));
+    if (!pool->sessions) return -1;
+    
+    pool->max_sessions = max_sessions;
+    pool->max_per_server = max_per_server > 0 ? max_per_server : FTP_POOL_DEFAULT_PER_SERVER;
+    pool->idle_timeout = idle_timeout > 0 ? idle_timeout : FTP_POOL_IDLE_TIMEOUT;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->released, NULL);
+    return 0;
+}
+
+static int ftp_pool_matches(const FTPPooledSession *slot, const char *hostname, int port, const char *username) {
+    return strcmp(slot->client.server_hostname, hostname) == 0 &&
+           slot->client.server_port == port &&
+           strcmp(slot->client.username, username) == 0;
+}
+
+// Close an idle slot's connection and free the slot. Called with the lock
+// held; the slot stays reserved while the QUIT round trip runs unlocked.
+static void ftp_pool_close_slot(FTPSessionPool *pool, FTPPooledSession *slot) {
+    slot->in_use = 1;
+    pthread_mutex_unlock(&pool->lock);
+    ftp_close_connection(&slot->client);
+    pthread_mutex_lock(&pool->lock);
+    slot->in_use = 0;
+    slot->used = 0;
+    pthread_cond_broadcast(&pool->released);
+}
+
+// Close idle sessions that outlived the idle timeout. Called with the lock held.
+static void ftp_pool_evict_idle(FTPSessionPool *pool) {
+    for (int i = 0; i < pool->max_sessions; i++) {
+        FTPPooledSession *slot = &pool->sessions[i];
+        if (slot->used && !slot->in_use && time(NULL) - slot->last_used > pool->idle_timeout) {
+            ftp_pool_close_slot(pool, slot);
+        }
+    }
+}
+
+// Hand out a logged-in session for (hostname, port, username), reusing an idle one
+// when possible. Blocks while the server is at its session cap.
+FTPClient *ftp_pool_acquire(FTPSessionPool *pool, const char *hostname, int port,
+                            const char *username, const char *password) {
+    if (port <= 0) port = FTP_DEFAULT_PORT;
+    
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        FTPPooledSession *free_slot = NULL;
+        int server_sessions = 0;
+        
+        ftp_pool_evict_idle(pool);
+        
+        for (int i = 0; i < pool->max_sessions; i++) {
+            FTPPooledSession *slot = &pool->sessions[i];
+            if (!slot->used) {
+                if (!free_slot) free_slot = slot;
+                continue;
+            }
+            if (!ftp_pool_matches(slot, hostname, port, username)) continue;
+            server_sessions++;
+            if (slot->in_use) continue;
+            
+            // Reuse an idle session if it still answers NOOP; one released
+            // moments ago is taken as is, saving a round trip per job
+            slot->in_use = 1;
+            int fresh = time(NULL) - slot->last_used < FTP_POOL_PROBE_AFTER;
+            pthread_mutex_unlock(&pool->lock);
+            if (fresh || ftp_noop(&slot->client) == 0) {
+                return &slot->client;
+            }
+            
+            ftp_close_connection(&slot->client);
+            pthread_mutex_lock(&pool->lock);
+            slot->in_use = 0;
+            slot->used = 0;
+            pthread_cond_broadcast(&pool->released);
+            free_slot = NULL;
+            server_sessions = -1;  // the table changed; rescan
+            break;
+        }
+        if (server_sessions < 0) continue;
+        
+        // Full of idle sessions to other servers: close the least recently used
+        if (!free_slot && server_sessions < pool->max_per_server) {
+            for (int i = 0; i < pool->max_sessions; i++) {
+                FTPPooledSession *slot = &pool->sessions[i];
+                if (slot->used && !slot->in_use && (!free_slot || slot->last_used < free_slot->last_used)) {
+                    free_slot = slot;
+                }
+            }
+            if (free_slot) {
+                ftp_pool_close_slot(pool, free_slot);
+                continue;  // the table may have changed while unlocked; rescan
+            }
+        }
+        
+        if (free_slot && server_sessions < pool->max_per_server) {
+            // Reserve the slot, then connect without holding the lock
+            FTPClient *client = &free_slot->client;
+            free_slot->used = 1;
+            free_slot->in_use = 1;
+            memset(client, 0, sizeof(*client));
+            strncpy(client->server_hostname, hostname, sizeof(client->server_hostname) - 1);
+            strncpy(client->username, username, sizeof(client->username) - 1);
+            client->server_port = port;
+            pthread_mutex_unlock(&pool->lock);
+            
+            client->control_socket = -1;
+            client->data_socket = -1;
+            client->prepared_socket = -1;
+            if (ftp_connect(client, hostname) == 0) {
+                if (ftp_login(client, username, password) == 0 && ftp_set_binary_mode(client) == 0 &&
+                    ftp_print_working_directory(client, free_slot->home_dir, sizeof(free_slot->home_dir)) == 0) {
+                    snprintf(client->current_remote_dir, sizeof(client->current_remote_dir), "%s", free_slot->home_dir);
+                    return client;
+                }
+                ftp_close_connection(client);
+            }
+            
+            pthread_mutex_lock(&pool->lock);
+            free_slot->used = 0;
+            free_slot->in_use = 0;
+            pthread_cond_broadcast(&pool->released);
+            pthread_mutex_unlock(&pool->lock);
+            return NULL;
+        }
+        
+        // At the per-server cap or out of slots: wait for a release
+        pthread_cond_wait(&pool->released, &pool->lock);
+    }
+}
+
+// Return a session to the pool, reset to its home directory and binary type.
+// Sessions that cannot be reset, or that the caller marks broken, are closed.
+void ftp_pool_release(FTPSessionPool *pool, FTPClient *client, int broken) {
+    FTPPooledSession *slot = (FTPPooledSession *)((char *)client - offsetof(FTPPooledSession, client));
+    
+    if (!broken && client->state == FTP_LOGGED_IN &&
+        ((strcmp(client->current_remote_dir, slot->home_dir) &&
+          ftp_change_remote_directory(client, slot->home_dir) < 0) || ftp_set_binary_mode(client) < 0)) {
+        broken = 1;
+    }
+    if (broken || client->state != FTP_LOGGED_IN) {
+        ftp_close_connection(client);
+    }
+    
+    pthread_mutex_lock(&pool->lock);
+    slot->in_use = 0;
+    slot->last_used = time(NULL);
+    if (client->state != FTP_LOGGED_IN) slot->used = 0;
+    pthread_cond_broadcast(&pool->released);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void ftp_pool_destroy(FTPSessionPool *pool) {
+    for (int i = 0; i < pool->max_sessions; i++) {
+        if (pool->sessions[i].used) ftp_close_connection(&pool->sessions[i].client);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->released);
+    free(pool->sessions);
+    memset(pool, 0, sizeof(*pool));
+}
+
+// Query the modification time of a remote file (MDTM, RFC 3659)
+int ftp_get_remote_mdtm(FTPClient *client, const char *remote_file, char *stamp, size_t max_len) {
+    char command[MAX_COMMAND];
+    char response[MAX_BUFFER];
+    
+    snprintf(command, sizeof(command), "MDTM %s", remote_file);
+    if (send_ftp_command(client, command) < 0) return -1;
+    
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 213 || strlen(response) < 5) {
+        fprintf(stderr, "Modification time query failed: %s\n", response);
+        return -1;
+    }
+    
+    snprintf(stamp, max_len, "%s", response + 4);
+    return 0;
+}
+
+// Download file, continuing from the journal's last durable offset when the
+// remote file still has the same SIZE and MDTM
+int ftp_download_file_resume(FTPClient *client, const char *remote_file, const char *local_file) {
+    char response[MAX_BUFFER];
+    char rest_command[MAX_COMMAND];
+    char retr_command[MAX_COMMAND];
+    char journal_path[MAX_PATH + 16];
+    FTPJournal saved, journal;
+    long long remote_size;
+    char remote_mdtm[32] = "";
+    struct stat st;
+    
+    if (ftp_set_binary_mode(client) < 0) return -1;
+    if (ftp_get_remote_size(client, remote_file, &remote_size) < 0) return -1;
+    ftp_get_remote_mdtm(client, remote_file, remote_mdtm, sizeof(remote_mdtm));
+    
+    // Trust the journal only if it describes this exact remote file
+    snprintf(journal_path, sizeof(journal_path), "%s" FTP_JOURNAL_SUFFIX, local_file);
+    long long offset = 0;
+    if (ftp_journal_load(&saved, journal_path) == 0 &&
+        strcmp(saved.remote_file, remote_file) == 0 &&
+        saved.remote_size == remote_size &&
+        strcmp(saved.remote_mdtm, remote_mdtm) == 0 &&
+        stat(local_file, &st) == 0 && st.st_size >= saved.committed &&
+        saved.committed <= remote_size) {
+        offset = saved.committed;
+    }
+    
+    memset(&journal, 0, sizeof(journal));
+    snprintf(journal.path, sizeof(journal.path), "%s", journal_path);
+    snprintf(journal.remote_file, sizeof(journal.remote_file), "%s", remote_file);
+    snprintf(journal.remote_mdtm, sizeof(journal.remote_mdtm), "%s", remote_mdtm);
+    journal.remote_size = remote_size;
+    journal.committed = offset;
+    
+    // Anything past the durable offset may be torn: cut it off
+    int local_fd = open(local_file, O_WRONLY | O_CREAT, 0644);
+    if (local_fd < 0) {
+        print_error("Failed to open local file");
+        return -1;
+    }
+    if (ftruncate(local_fd, offset) < 0 || lseek(local_fd, offset, SEEK_SET) < 0 ||
+        ftp_journal_save(&journal) < 0) {
+        print_error("Failed to prepare local file");
+        close(local_fd);
+        return -1;
+    }
+    
+    if (offset == remote_size) {
+        close(local_fd);
+        unlink(journal_path);
+        if (!client->quiet) printf("File already complete: %s\n", local_file);
+        return ftp_verify_file(client, remote_file, local_file);
+    }
+    if (offset > 0 && !client->quiet) printf("Resuming %s at byte %lld of %lld\n", remote_file, offset, remote_size);
+    
+    // PASV, REST and RETR go out in one write: REST must come right before
+    // the RETR (RFC 959), and is only sent when resuming
+    snprintf(rest_command, sizeof(rest_command), "REST %lld", offset);
+    snprintf(retr_command, sizeof(retr_command), "RETR %s", remote_file);
+    if (ftp_select_transfer_mode(client, 0) < 0) {  // REST offsets count uncompressed bytes
+        close(local_fd);
+        return -1;
+    }
+    const char *commands[] = { NULL, offset > 0 ? rest_command : retr_command, retr_command };
+    client->failed_reply = 0;  // earlier refusals (MDTM, OPTS) must not decide a retry
+    if (ftp_send_passive_pipelined(client, commands, offset > 0 ? 3 : 2, 0) < 0) {
+        close(local_fd);
+        return -1;
+    }
+    
+    int rest_code = offset > 0 ? recv_ftp_response(client, response, sizeof(response)) : 350;
+    if (rest_code != 350) fprintf(stderr, "Server cannot resume: %s\n", response);
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (rest_code != 350 || response_code != 150) {
+        // A refused REST must not start a RETR at 0: drop it before reading any data
+        if (rest_code == 350) fprintf(stderr, "File retrieval failed: %s\n", response);
+        close(local_fd);
+        ftp_close_socket(client, &client->data_socket);
+        if (response_code == 150 || response_code == 125) recv_ftp_response(client, NULL, 0);
+        return -1;
+    }
+    
+    client->journal = &journal;
+    client->transfer_size = remote_size - offset;
+    long long bytes_received = ftp_recv_data(client, local_fd);
+    client->transfer_size = 0;
+    client->journal = NULL;
+    ftp_close_socket(client, &client->data_socket);
+    
+    // Record whatever reached the disk, even after a failure
+    int synced = fdatasync(local_fd) == 0;
+    if (synced) journal.committed = lseek(local_fd, 0, SEEK_CUR);
+    close(local_fd);
+    
+    response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 226 || bytes_received < 0 || !synced || journal.committed != remote_size) {
+        if (synced) ftp_journal_save(&journal);
+        fprintf(stderr, "File download incomplete at %lld of %lld bytes: %s\n",
+                journal.committed, remote_size, response);
+        return -1;
+    }
+    
+    // The stream covered only the bytes after offset: check the whole file.
+    // Without the journal a mismatch is downloaded again from the start.
+    unlink(journal_path);
+    if (ftp_verify_file(client, remote_file, local_file) < 0) return -1;
+    if (!client->quiet) printf("File downloaded successfully: %s (%lld bytes resumed from %lld)\n",
+                               local_file, bytes_received, offset);
+    return 0;
+}
+
+// Upload file, continuing after the bytes the server already holds when the
+// local file is unchanged since the interrupted attempt
+int ftp_upload_file_resume(FTPClient *client, const char *local_file, const char *remote_file) {
+    char response[MAX_BUFFER];
+    char command[MAX_COMMAND];
+    char journal_path[MAX_PATH + 16];
+    FTPJournal saved, journal;
+    struct stat st;
+    long long remote_size = 0;
+    
+    int local_fd = open(local_file, O_RDONLY);
+    if (local_fd < 0 || fstat(local_fd, &st) < 0) {
+        print_error("Failed to open local file");
+        if (local_fd >= 0) close(local_fd);
+        return -1;
+    }
+    
+    if (ftp_set_binary_mode(client) < 0) {
+        close(local_fd);
+        return -1;
+    }
+    
+    // The server's SIZE is the durable offset; the journal proves the source is the same
+    snprintf(journal_path, sizeof(journal_path), "%s" FTP_UPLOAD_JOURNAL_SUFFIX, local_file);
+    long long offset = 0;
+    if (ftp_journal_load(&saved, journal_path) == 0 &&
+        strcmp(saved.remote_file, remote_file) == 0 &&
+        saved.local_size == (long long)st.st_size &&
+        saved.local_mtime == (long long)st.st_mtime &&
+        ftp_get_remote_size(client, remote_file, &remote_size) == 0 &&
+        remote_size <= (long long)st.st_size) {
+        offset = remote_size;
+    }
+    
+    memset(&journal, 0, sizeof(journal));
+    snprintf(journal.path, sizeof(journal.path), "%s", journal_path);
+    snprintf(journal.remote_file, sizeof(journal.remote_file), "%s", remote_file);
+    journal.local_size = st.st_size;
+    journal.local_mtime = st.st_mtime;
+    journal.committed = offset;
+    if (ftp_journal_save(&journal) < 0 || lseek(local_fd, offset, SEEK_SET) < 0) {
+        close(local_fd);
+        return -1;
+    }
+    
+    if (offset == (long long)st.st_size && offset > 0) {
+        close(local_fd);
+        unlink(journal_path);
+        if (!client->quiet) printf("File already complete: %s\n", remote_file);
+        return ftp_verify_file(client, remote_file, local_file);
+    }
+    
+    // Prefer REST+STOR; servers without upload restart get APPE. PASV goes
+    // first, so that REST is followed right away by the STOR (RFC 959).
+    const char *store_verb = "STOR";
+    if (ftp_select_transfer_mode(client, 0) < 0) {  // REST offsets count uncompressed bytes
+        close(local_fd);
+        return -1;
+    }
+    if (offset > 0) {
+        char rest_command[MAX_COMMAND];
+        snprintf(rest_command, sizeof(rest_command), "REST %lld", offset);
+        const char *commands[] = { NULL, rest_command };
+        if (ftp_send_passive_pipelined(client, commands, 2, 0) < 0) {
+            close(local_fd);
+            return -1;
+        }
+        if (recv_ftp_response(client, response, sizeof(response)) != 350) store_verb = "APPE";
+        if (!client->quiet) {
+            printf("Resuming %s at byte %lld of %lld (%s)\n", local_file, offset, (long long)st.st_size, store_verb);
+        }
+        snprintf(command, sizeof(command), "%s %s", store_verb, remote_file);
+        client->failed_reply = 0;
+        if (send_ftp_command(client, command) < 0) {
+            ftp_close_socket(client, &client->data_socket);
+            close(local_fd);
+            return -1;
+        }
+    } else {
+        snprintf(command, sizeof(command), "%s %s", store_verb, remote_file);
+        const char *commands[] = { NULL, command };
+        client->failed_reply = 0;
+        if (ftp_send_passive_pipelined(client, commands, 2, 0) < 0) {
+            close(local_fd);
+            return -1;
+        }
+    }
+    
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 150) {
+        fprintf(stderr, "File upload failed: %s\n", response);
+        close(local_fd);
+        ftp_close_socket(client, &client->data_socket);
+        return -1;
+    }
+    
+    long long bytes_sent = ftp_send_data(client, local_fd);
+    close(local_fd);
+    ftp_close_socket(client, &client->data_socket);
+    
+    response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 226 || bytes_sent < 0) {
+        fprintf(stderr, "File upload incomplete: %s\n", response);
+        return -1;
+    }
+    
+    unlink(journal_path);
+    ftp_listing_cache_invalidate_parent(client, remote_file);
+    if (ftp_verify_file(client, remote_file, local_file) < 0) return -1;
+    if (!client->quiet) printf("File uploaded successfully: %s (%lld bytes resumed from %lld)\n", local_file, bytes_sent, offset);
+    return 0;
+}
+
+// Drop a session that timed out or lost its connection, without QUIT (the
+// server may not be answering), and log in again to the same server and
+// directory. Settings, statistics and hooks on client are kept.
+int ftp_reconnect(FTPClient *client) {
+    char hostname[sizeof(client->server_hostname)], directory[MAX_PATH];
+    char username[sizeof(client->username)], password[sizeof(client->password)];
+
+    snprintf(hostname, sizeof(hostname), "%s", client->server_hostname);
+    snprintf(username, sizeof(username), "%s", client->username);
+    snprintf(password, sizeof(password), "%s", client->password);
+    snprintf(directory, sizeof(directory), "%s", client->current_remote_dir);
+
+    ftp_close_socket(client, &client->control_socket);
+    ftp_close_socket(client, &client->data_socket);
+    ftp_discard_prepared_channel(client);
+    client->state = FTP_DISCONNECTED;
+    client->last_reply = -1;
+    client->mode_z = 0;
+    client->current_remote_dir[0] = '\0';
+
+    if (ftp_connect(client, hostname) < 0 || ftp_login(client, username, password) < 0) return -1;
+    if (directory[0] && ftp_change_remote_directory(client, directory) < 0) return -1;
+    return 0;
+}
+
+typedef int (*FTPResumableTransfer)(FTPClient *client, const char *from, const char *to);
+
+// Run a resumable transfer until it succeeds, reconnecting and resuming
+// from its journal after transient failures: timeouts, stalls, dropped
+// connections and 4xx replies. A 5xx reply is final. The backoff doubles
+// from FTP_RETRY_DELAY_MS, jittered so that clients cut off together do
+// not all come back at once.
+static int ftp_transfer_with_retries(FTPClient *client, FTPResumableTransfer transfer, const char *from,
+                                     const char *to) {
+    int retries = client->tuning.retries ? client->tuning.retries : FTP_DEFAULT_RETRIES;
+
+    for (int attempt = 0;; attempt++) {
+        client->stalled = 0;
+        client->failed_reply = 0;
+        if (client->state == FTP_LOGGED_IN && transfer(client, from, to) == 0) return 0;
+        if (attempt >= retries || (client->failed_reply >= 500 && !client->stalled)) return -1;
+
+        double delay = FTP_RETRY_DELAY_MS * (double)(1 << (attempt < 10 ? attempt : 10));
+        if (delay > FTP_RETRY_MAX_DELAY_MS) delay = FTP_RETRY_MAX_DELAY_MS;
+        delay = delay / 2 + delay / 2 * random() / RAND_MAX;
+        fprintf(stderr, "Reconnecting in %.1f s (attempt %d of %d)\n", delay / 1000, attempt + 2, retries + 1);
+        usleep((useconds_t)(delay * 1000));
+        ftp_reconnect(client);  // a failure here counts as the next attempt
+    }
+}
+
+// Download with ftp_download_file_resume, retrying per client->tuning.retries
+int ftp_download_file_retry(FTPClient *client, const char *remote_file, const char *local_file) {
+    return ftp_transfer_with_retries(client, ftp_download_file_resume, remote_file, local_file);
+}
+
+// Upload with ftp_upload_file_resume, retrying per client->tuning.retries
+int ftp_upload_file_retry(FTPClient *client, const char *local_file, const char *remote_file) {
+    return ftp_transfer_with_retries(client, ftp_upload_file_resume, local_file, remote_file);
+}
+
+// ---------------------------------------------------------------------------
+// Listing cache: parsed-from-raw listings keyed by server and absolute path
+// ---------------------------------------------------------------------------
+
+// Join path onto base and fold "." and ".." components into an absolute path
+void ftp_normalize_path(const char *base, const char *path, char *out, size_t max_len) {
+    char joined[MAX_PATH * 2];
+    size_t length = 0;
+    
+    if (path[0] == '/') snprintf(joined, sizeof(joined), "%s", path);
+    else snprintf(joined, sizeof(joined), "%s/%s", base[0] ? base : "/", path);
+    
+    out[0] = '\0';
+    char *save = NULL;
+    for (char *part = strtok_r(joined, "/", &save); part; part = strtok_r(NULL, "/", &save)) {
+        if (strcmp(part, ".") == 0) continue;
+        if (strcmp(part, "..") == 0) {
+            char *slash = strrchr(out, '/');
+            length = slash ? (size_t)(slash - out) : 0;
+            out[length] = '\0';
+            continue;
+        }
+        int written = snprintf(out + length, max_len - length, "/%s", part);
+        if (written < 0 || (size_t)written >= max_len - length) break;
+        length += written;
+    }
+    if (length == 0) snprintf(out, max_len, "/");
+}
+
+// Resolve a remote path against the session's working directory
+int ftp_resolve_remote_path(FTPClient *client, const char *path, char *out, size_t max_len) {
+    if (path[0] != '/' && client->current_remote_dir[0] != '/' &&
+        ftp_print_working_directory(client, client->current_remote_dir, sizeof(client->current_remote_dir)) < 0) {
+        return -1;
+    }
+    
+    ftp_normalize_path(client->current_remote_dir, path, out, max_len);
+    return 0;
+}
+
+// Directory that contains a remote path
+static void ftp_parent_directory(FTPClient *client, const char *path, char *out, size_t max_len) {
+    char resolved[MAX_PATH];
+    
+    if (ftp_resolve_remote_path(client, path, resolved, sizeof(resolved)) < 0) {
+        out[0] = '\0';
+        return;
+    }
+    char *slash = strrchr(resolved, '/');
+    if (slash == resolved) slash[1] = '\0';
+    else *slash = '\0';
+    snprintf(out, max_len, "%s", resolved);
+}
+
+int ftp_listing_cache_init(FTPListingCache *cache, int ttl, const char *disk_dir) {
+    memset(cache, 0, sizeof(*cache));
+    cache->ttl = ttl > 0 ? ttl : FTP_LISTING_CACHE_TTL;
+    if (disk_dir) {
+        snprintf(cache->disk_dir, sizeof(cache->disk_dir), "%s", disk_dir);
+        if (make_local_directories(disk_dir) < 0) {
+            print_error("Failed to create listing cache directory");
+            return -1;
+        }
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return 0;
+}
+
+void ftp_listing_cache_destroy(FTPListingCache *cache) {
+    for (int i = 0; i < FTP_LISTING_CACHE_SLOTS; i++) free(cache->entries[i].data);
+    pthread_mutex_destroy(&cache->lock);
+    memset(cache, 0, sizeof(*cache));
+}
+
+void ftp_listing_cache_print_stats(const FTPListingCache *cache, FILE *out) {
+    fprintf(out, "Listing cache: %lld hits, %lld misses, %lld expired, %lld invalidated (ttl %ds)\n",
+            cache->hits, cache->misses, cache->expired, cache->invalidations, cache->ttl);
+}
+
+// FNV-1a; names the on-disk copy of a cache key
+static unsigned long long fnv1a_hash(const char *text) {
+    unsigned long long hash = 1469598103934665603ULL;
+    for (; *text; text++) {
+        hash ^= (unsigned char)*text;
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void ftp_listing_disk_path(const FTPListingCache *cache, const char *key, char *out, size_t max_len) {
+    snprintf(out, max_len, "%s/%016llx.listing", cache->disk_dir, fnv1a_hash(key));
+}
+
+// Keys look like "host:port <verb> <absolute dir>" so a directory's keys share a suffix
+static void ftp_listing_key(const FTPClient *client, const char *verb, const char *directory, char *key, size_t max_len) {
+    snprintf(key, max_len, "%s:%d %s %s", client->server_hostname, client->server_port, verb, directory);
+}
+
+static FTPListingCacheEntry *ftp_listing_cache_slot(FTPListingCache *cache, const char *key) {
+    for (int i = 0; i < FTP_LISTING_CACHE_SLOTS; i++) {
+        if (cache->entries[i].data && strcmp(cache->entries[i].key, key) == 0) return &cache->entries[i];
+    }
+    return NULL;
+}
+
+// Store a copy of data, reusing the key's slot or the least recently stored one.
+// Called with the lock held.
+static void ftp_listing_cache_store_locked(FTPListingCache *cache, const char *key, const char *data,
+                                           size_t length, time_t expires) {
+    FTPListingCacheEntry *slot = ftp_listing_cache_slot(cache, key);
+    
+    if (!slot) {
+        slot = &cache->entries[0];
+        for (int i = 0; i < FTP_LISTING_CACHE_SLOTS; i++) {
+            if (!cache->entries[i].data) {
+                slot = &cache->entries[i];
+                break;
+            }
+            if (cache->entries[i].expires < slot->expires) slot = &cache->entries[i];
+        }
+    }
+    
+    char *copy = malloc(length + 1);
+    if (!copy) return;
+    memcpy(copy, data, length);
+    copy[length] = '\0';
+    
+    free(slot->data);
+    snprintf(slot->key, sizeof(slot->key), "%s", key);
+    slot->data = copy;
+    slot->length = length;
+    slot->expires = expires;
+}
+
+// Look up a listing; on a hit *data is a malloc'd copy the caller frees
+static int ftp_listing_cache_lookup(FTPListingCache *cache, const char *key, char **data, size_t *length) {
+    time_t now = time(NULL);
+    int found = 0;
+    
+    pthread_mutex_lock(&cache->lock);
+    FTPListingCacheEntry *slot = ftp_listing_cache_slot(cache, key);
+    if (slot && slot->expires <= now) {
+        free(slot->data);
+        slot->data = NULL;
+        cache->expired++;
+        slot = NULL;
+    }
+    
+    // Fall back to the on-disk copy: "<expiry>\n<raw listing>"
+    if (!slot && cache->disk_dir[0]) {
+        char disk_path[MAX_PATH + 32];
+        long long expires = 0;
+        ftp_listing_disk_path(cache, key, disk_path, sizeof(disk_path));
+        
+        FILE *fp = fopen(disk_path, "r");
+        if (fp) {
+            if (fscanf(fp, "%lld", &expires) == 1 && fgetc(fp) == '\n' && expires > now) {
+                long start = ftell(fp);
+                fseek(fp, 0, SEEK_END);
+                long end = ftell(fp);
+                fseek(fp, start, SEEK_SET);
+                char *buffer = malloc(end - start + 1);
+                if (buffer && fread(buffer, 1, end - start, fp) == (size_t)(end - start)) {
+                    ftp_listing_cache_store_locked(cache, key, buffer, end - start, expires);
+                    slot = ftp_listing_cache_slot(cache, key);
+                }
+                free(buffer);
+            }
+            fclose(fp);
+        }
+    }
+    
+    if (slot) {
+        *data = malloc(slot->length + 1);
+        if (*data) {
+            memcpy(*data, slot->data, slot->length + 1);
+            *length = slot->length;
+            found = 1;
+        }
+    }
+    if (found) cache->hits++;
+    else cache->misses++;
+    pthread_mutex_unlock(&cache->lock);
+    
+    return found;
+}
+
+static void ftp_listing_cache_store(FTPListingCache *cache, const char *key, const char *data, size_t length) {
+    time_t expires = time(NULL) + cache->ttl;
+    
+    pthread_mutex_lock(&cache->lock);
+    ftp_listing_cache_store_locked(cache, key, data, length, expires);
+    pthread_mutex_unlock(&cache->lock);
+    
+    if (cache->disk_dir[0]) {
+        char disk_path[MAX_PATH + 32], temp_path[MAX_PATH + 48];
+        ftp_listing_disk_path(cache, key, disk_path, sizeof(disk_path));
+        snprintf(temp_path, sizeof(temp_path), "%s.%d.tmp", disk_path, (int)getpid());
+        
+        FILE *fp = fopen(temp_path, "w");
+        if (!fp) return;
+        int ok = fprintf(fp, "%lld\n", (long long)expires) > 0 && fwrite(data, 1, length, fp) == length;
+        if (fclose(fp) == 0 && ok) rename(temp_path, disk_path);
+        else unlink(temp_path);
+    }
+}
+
+// Forget every cached listing of one remote directory on this client's server
+void ftp_listing_cache_invalidate(FTPClient *client, const char *directory) {
+    static const char *verbs[] = { "MLSD", "LIST", "NLST" };
+    FTPListingCache *cache = client->listing_cache;
+    char key[FTP_LISTING_KEY_MAX];
+    
+    if (!cache || !directory[0]) return;
+    
+    for (size_t i = 0; i < sizeof(verbs) / sizeof(verbs[0]); i++) {
+        ftp_listing_key(client, verbs[i], directory, key, sizeof(key));
+        
+        pthread_mutex_lock(&cache->lock);
+        FTPListingCacheEntry *slot = ftp_listing_cache_slot(cache, key);
+        if (slot) {
+            free(slot->data);
+            slot->data = NULL;
+            cache->invalidations++;
+        }
+        pthread_mutex_unlock(&cache->lock);
+        
+        if (cache->disk_dir[0]) {
+            char disk_path[MAX_PATH + 32];
+            ftp_listing_disk_path(cache, key, disk_path, sizeof(disk_path));
+            unlink(disk_path);
+        }
+    }
+}
+
+// Invalidate the directory that contains a remote path (after MKD/DELE/RNTO/STOR)
+void ftp_listing_cache_invalidate_parent(FTPClient *client, const char *path) {
+    char parent[MAX_PATH];
+    
+    if (!client->listing_cache) return;
+    ftp_parent_directory(client, path, parent, sizeof(parent));
+    ftp_listing_cache_invalidate(client, parent);
+}
+
+// ---------------------------------------------------------------------------
+// Download cache: remote file versions kept on local disk across runs. A hit
+// costs one SIZE+MDTM round trip and no data connection. Objects are only
+// ever published by rename() and removed by unlink(), so processes sharing
+// the directory need no lock except to keep two evictions from overlapping.
+// ---------------------------------------------------------------------------
+
+int ftp_download_cache_init(FTPDownloadCache *cache, const char *directory, long long budget) {
+    char path[MAX_PATH + 16];
+
+    memset(cache, 0, sizeof(*cache));
+    snprintf(cache->directory, sizeof(cache->directory), "%s", directory);
+    cache->budget = budget > 0 ? budget : FTP_DOWNLOAD_CACHE_BUDGET;
+    cache->total = -1;
+    snprintf(path, sizeof(path), "%s/objects", directory);
+    int failed = make_local_directories(path) < 0;
+    snprintf(path, sizeof(path), "%s/partial", directory);
+    if (failed || make_local_directories(path) < 0) {
+        print_error("Failed to create download cache directory");
+        return -1;
+    }
+    pthread_mutex_init(&cache->lock, NULL);
+    return 0;
+}
+
+void ftp_download_cache_destroy(FTPDownloadCache *cache) {
+    pthread_mutex_destroy(&cache->lock);
+}
+
+void ftp_download_cache_print_stats(const FTPDownloadCache *cache, FILE *out) {
+    fprintf(out, "Download cache: %lld hits, %lld misses, %lld evicted (%s, %lld byte budget)\n",
+            cache->hits, cache->misses, cache->evicted, cache->directory, cache->budget);
+}
+
+static void ftp_download_cache_count(FTPDownloadCache *cache, long long *counter, long long amount) {
+    pthread_mutex_lock(&cache->lock);
+    *counter += amount;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// SHA-256 of "host:port user /absolute/path size mdtm", in hex
+static int ftp_download_cache_key(FTPClient *client, const char *remote_file, long long size,
+                                  const char *mdtm, char *hex) {
+    char path[MAX_PATH], key[MAX_PATH + 512];
+    FTPDigest digest;
+
+    if (ftp_resolve_remote_path(client, remote_file, path, sizeof(path)) < 0) return -1;
+    int length = snprintf(key, sizeof(key), "%s:%d %s %s %lld %s", client->server_hostname, client->server_port,
+                          client->username, path, size, mdtm);
+    if (ftp_digest_init(&digest, FTP_HASH_SHA256) < 0) return -1;
+    ftp_digest_update(&digest, key, length);
+    ftp_digest_final(&digest);
+    memcpy(hex, digest.sha256_hex, sizeof(digest.sha256_hex));
+    return 0;
+}
+
+// Copy the rest of source into target: in the kernel with copy_file_range(),
+// through a buffer where that is not supported
+static int ftp_copy_file(int source, int target) {
+    char buffer[MAX_BUFFER * 16];
+    ssize_t copied;
+
+    while ((copied = copy_file_range(source, NULL, target, NULL, FTP_MAX_TRANSFER_BUFFER, 0)) != 0) {
+        if (copied > 0 || errno == EINTR) continue;
+        if (errno != EXDEV && errno != EINVAL && errno != ENOSYS && errno != EOPNOTSUPP) return -1;
+        while ((copied = read(source, buffer, sizeof(buffer))) != 0) {
+            if (copied < 0 && errno == EINTR) continue;
+            if (copied < 0 || write_all(target, buffer, copied) < 0) return -1;
+        }
+        break;
+    }
+    return 0;
+}
+
+// Give local_file the contents of a cached object, sharing its blocks when
+// the filesystem can: a reflink (FICLONE) is copy-on-write, else the file
+// is copied. A hard link would make local_file the object itself, so it is
+// only used when the cache was set up for hard links.
+// Returns 1 when the object is not (or no longer) in the cache.
+static int ftp_download_cache_link(const FTPDownloadCache *cache, const char *object, const char *local_file) {
+    char temp_path[MAX_PATH + 32];
+    int source = open(object, O_RDONLY);
+
+    if (source < 0) return 1;
+    snprintf(temp_path, sizeof(temp_path), "%s.%d.cache", local_file, (int)getpid());
+    unlink(temp_path);
+
+    int target = open(temp_path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    int failed = target < 0;
+    if (!failed && ioctl(target, FICLONE, source) < 0) {
+        if (cache->hard_links) {
+            close(target);
+            unlink(temp_path);
+            target = -1;
+            failed = link(object, temp_path) < 0;
+        } else {
+            failed = ftp_copy_file(source, target) < 0;
+        }
+    }
+    if (target >= 0 && close(target) < 0) failed = 1;
+    close(source);
+    if (failed || rename(temp_path, local_file) < 0) {
+        print_error("Failed to copy from download cache");
+        unlink(temp_path);
+        return -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    time_t used;
+    long long size;
+    char name[72];
+} FTPCacheObject;
+
+static int ftp_cache_object_compare(const void *a, const void *b) {
+    const FTPCacheObject *x = a, *y = b;
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+// Drop the least recently used objects (by mtime, which a hit refreshes)
+// until the cache is down to FTP_DOWNLOAD_CACHE_LOW_WATER of its budget,
+// and partial downloads abandoned by dead processes. One process evicts at
+// a time; the others skip it. Leaves the total it found in cache->total.
+static void ftp_download_cache_scan(FTPDownloadCache *cache) {
+    char path[MAX_PATH + 288];
+    FTPCacheObject *objects = NULL;
+    int count = 0, capacity = 0;
+    long long total = 0;
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "%s/lock", cache->directory);
+    int lock_fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (lock_fd < 0) return;
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) < 0) {
+        close(lock_fd);
+        return;
+    }
+
+    snprintf(path, sizeof(path), "%s/partial", cache->directory);
+    if ((dir = opendir(path))) {
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] == '.') continue;
+            snprintf(path, sizeof(path), "%s/partial/%s", cache->directory, entry->d_name);
+            if (stat(path, &st) == 0 && time(NULL) - st.st_mtime > FTP_DOWNLOAD_CACHE_STALE) unlink(path);
+        }
+        closedir(dir);
+    }
+
+    snprintf(path, sizeof(path), "%s/objects", cache->directory);
+    if ((dir = opendir(path))) {
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] == '.' || strlen(entry->d_name) >= sizeof(objects->name)) continue;
+            snprintf(path, sizeof(path), "%s/objects/%s", cache->directory, entry->d_name);
+            if (stat(path, &st) < 0) continue;
+            if (count == capacity) {
+                int grown_capacity = capacity ? capacity * 2 : 64;
+                FTPCacheObject *grown = realloc(objects, grown_capacity * sizeof(*grown));
+                if (!grown) break;
+                objects = grown;
+                capacity = grown_capacity;
+            }
+            objects[count].used = st.st_mtime;
+            objects[count].size = st.st_size;
+            memcpy(objects[count].name, entry->d_name, strlen(entry->d_name) + 1);
+            total += st.st_size;
+            count++;
+        }
+        closedir(dir);
+    }
+
+    long long low_water = (long long)(cache->budget * FTP_DOWNLOAD_CACHE_LOW_WATER);
+    if (total > cache->budget) {
+        qsort(objects, count, sizeof(*objects), ftp_cache_object_compare);
+        for (int i = 0; i < count && total > low_water; i++) {
+            snprintf(path, sizeof(path), "%s/objects/%s", cache->directory, objects[i].name);
+            if (unlink(path) == 0) {
+                total -= objects[i].size;
+                ftp_download_cache_count(cache, &cache->evicted, 1);
+            }
+        }
+    }
+    free(objects);
+    close(lock_fd);
+
+    pthread_mutex_lock(&cache->lock);
+    cache->total = total;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Account for a new object. The directory is only scanned when the running
+// total passes the budget (or is not known yet); since a scan frees down to
+// the low-water mark, that happens once per tenth of the budget inserted.
+// Objects inserted by other processes show up at the next scan.
+static void ftp_download_cache_evict(FTPDownloadCache *cache, long long inserted) {
+    pthread_mutex_lock(&cache->lock);
+    if (cache->total >= 0) cache->total += inserted;
+    int scan = cache->total < 0 || cache->total > cache->budget;
+    pthread_mutex_unlock(&cache->lock);
+    if (scan) ftp_download_cache_scan(cache);
+}
+
+// Download through the cache. SIZE and MDTM go out together and name the
+// object; a hit is linked into place, a miss is downloaded into the cache
+// and published there with rename() before it is linked. Returns 1 when the
+// server cannot tell SIZE and MDTM, for the caller to download directly.
+int ftp_download_cached(FTPClient *client, const char *remote_file, const char *local_file) {
+    FTPDownloadCache *cache = client->download_cache;
+    char size_command[MAX_COMMAND + MAX_PATH], mdtm_command[MAX_COMMAND + MAX_PATH];
+    char response[MAX_BUFFER], mdtm[32], hex[65];
+    char object[MAX_PATH + 96], partial[MAX_PATH + 128];
+    long long size;
+
+    client->cache_hit = 0;
+    if (ftp_set_binary_mode(client) < 0) return -1;
+    snprintf(size_command, sizeof(size_command), "SIZE %s", remote_file);
+    snprintf(mdtm_command, sizeof(mdtm_command), "MDTM %s", remote_file);
+    const char *commands[] = { size_command, mdtm_command };
+    if (send_ftp_pipelined(client, commands, 2) < 0) return -1;
+    int failed_reply = client->failed_reply;
+    int size_known = recv_ftp_response(client, response, sizeof(response)) == 213 &&
+                     sscanf(response, "213 %lld", &size) == 1;
+    int mdtm_known = recv_ftp_response(client, response, sizeof(response)) == 213 &&
+                     sscanf(response, "213 %31s", mdtm) == 1;
+    client->failed_reply = failed_reply;  // a refusal here only means no caching
+    if (!size_known || !mdtm_known || ftp_download_cache_key(client, remote_file, size, mdtm, hex) < 0) return 1;
+
+    snprintf(object, sizeof(object), "%s/objects/%s", cache->directory, hex);
+    int status = ftp_download_cache_link(cache, object, local_file);
+    if (status < 0) return -1;
+    if (status == 0) {
+        utimensat(AT_FDCWD, object, NULL, 0);  // most recently used
+        ftp_download_cache_count(cache, &cache->hits, 1);
+        client->cache_hit = 1;
+        if (!client->quiet) printf("File served from cache: %s (%lld bytes)\n", local_file, size);
+        return 0;
+    }
+
+    ftp_download_cache_count(cache, &cache->misses, 1);
+    snprintf(partial, sizeof(partial), "%s/partial/%s.%d.%lx", cache->directory, hex, (int)getpid(),
+             (unsigned long)pthread_self());
+    int local_fd = open(partial, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (local_fd < 0) {
+        print_error("Failed to open download cache file");
+        return -1;
+    }
+    long long bytes_received = ftp_download_to_fd(client, remote_file, local_fd);
+    if (close(local_fd) < 0 && bytes_received >= 0) {
+        print_error("Failed to write download cache file");
+        bytes_received = -1;
+    }
+    if (bytes_received >= 0 && bytes_received != size) {
+        fprintf(stderr, "%s changed during the download: %lld bytes, SIZE said %lld\n", remote_file,
+                bytes_received, size);
+        bytes_received = -1;
+    }
+    // Objects are read-only, so that a hard-linked copy cannot change them
+    if (bytes_received < 0 || chmod(partial, 0444) < 0 || rename(partial, object) < 0 ||
+        ftp_download_cache_link(cache, object, local_file) != 0) {
+        unlink(partial);
+        return -1;
+    }
+    ftp_download_cache_evict(cache, bytes_received);
+
+    if (!client->quiet) printf("File downloaded successfully: %s (%lld bytes, %s)\n",
+                               local_file, bytes_received, ftp_data_path_name(client->last_data_path));
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Directory listings: MLSD (RFC 3659) with a LIST fallback, parsed into entries
+// ---------------------------------------------------------------------------
+
+// Growing buffer for an inflated (MODE Z) listing, with room for a final NUL
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;
+} FTPListingSink;
+
+static int ftp_inflate_to_listing(void *context, const char *data, size_t length) {
+    FTPListingSink *sink = context;
+
+    while (sink->length + length + 1 > sink->capacity) {
+        char *grown = realloc(sink->data, sink->capacity * 2);
+        if (!grown) return -1;
+        sink->data = grown;
+        sink->capacity *= 2;
+    }
+    memcpy(sink->data + sink->length, data, length);
+    sink->length += length;
+    return 0;
+}
+
+// Retrieve the raw output of a listing command ("MLSD dir", "LIST dir") into a
+// malloc'd buffer. Returns the final reply code, or -1 on transport failure.
+int ftp_fetch_listing(FTPClient *client, const char *command, char **data, size_t *length) {
+    char response[MAX_BUFFER];
+    char key[FTP_LISTING_KEY_MAX];
+    size_t capacity = MAX_BUFFER * 4;
+    
+    *data = NULL;
+    *length = 0;
+    key[0] = '\0';
+    memset(&client->last_compression, 0, sizeof(client->last_compression));
+    
+    // "VERB [path]": cacheable when the path resolves (options like "-la" are not)
+    if (client->listing_cache) {
+        char verb[8] = "", directory[MAX_PATH];
+        int argument_offset = 0;
+        sscanf(command, "%7s %n", verb, &argument_offset);
+        const char *argument = argument_offset ? command + argument_offset : "";
+        if (argument[0] != '-' &&
+            ftp_resolve_remote_path(client, argument[0] ? argument : ".", directory, sizeof(directory)) == 0) {
+            ftp_listing_key(client, verb, directory, key, sizeof(key));
+            if (ftp_listing_cache_lookup(client->listing_cache, key, data, length)) return 226;
+        }
+    }
+    
+    if (ftp_select_transfer_mode(client, 1) < 0) return -1;
+    const char *commands[] = { NULL, command };
+    if (ftp_send_passive_pipelined(client, commands, 2, 0) < 0) return -1;
+    
+    int response_code = recv_ftp_response(client, response, sizeof(response));
+    if (response_code != 150 && response_code != 125) {
+        ftp_close_socket(client, &client->data_socket);
+        return response_code;
+    }
+    
+    char *buffer = malloc(capacity);
+    ssize_t bytes_read = 0;
+    if (client->mode_z && buffer) {
+        FTPListingSink sink = { buffer, 0, capacity };
+        if (ftp_recv_inflate(client, ftp_inflate_to_listing, &sink) < 0) bytes_read = -1;
+        buffer = sink.data;
+        *length = sink.length;
+    }
+    while (buffer && !client->mode_z) {
+        if (*length + MAX_BUFFER + 1 > capacity) {
+            char *grown = realloc(buffer, capacity * 2);
+            if (!grown) {
+                free(buffer);
+                buffer = NULL;
+                break;
+            }
+            buffer = grown;
+            capacity *= 2;
+        }
+        bytes_read = recv(client->data_socket, buffer + *length, MAX_BUFFER, 0);
+        if (bytes_read < 0 && errno == EINTR) continue;
+        if (bytes_read <= 0) break;
+        ftp_metrics_data(client, bytes_read, 0);
+        *length += bytes_read;
+    }
+    ftp_close_socket(client, &client->data_socket);
+    
+    response_code = recv_ftp_response(client, response, sizeof(response));
+    if (!buffer || bytes_read < 0 || response_code != 226) {
+        fprintf(stderr, "Listing failed: %s\n", response);
+        free(buffer);
+        *length = 0;
+        return response_code == 226 ? -1 : response_code;
+    }
+    
+    buffer[*length] = '\0';
+    *data = buffer;
+    if (key[0]) ftp_listing_cache_store(client->listing_cache, key, buffer, *length);
+    return response_code;
+}
+
+// Parse "YYYYMMDDHHMMSS[.sss]" (UTC) as used by MDTM and MLSD modify=
+long long ftp_parse_timestamp(const char *stamp) {
+    struct tm tm;
+    
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(stamp, "%4d%2d%2d%2d%2d%2d", &tm.tm_year, &tm.tm_mon, &tm.tm_mday,
+               &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6) {
+        return 0;
+    }
+    tm.tm_year -= 1900;
+    tm.tm_mon -= 1;
+    return (long long)timegm(&tm);
+}
+
+// A listing name is used as a local path component: reject what could
+// leave the directory being listed ("..", "a/../b")
+static int ftp_safe_entry_name(const char *name, size_t length) {
+    return length > 0 && !memchr(name, '/', length) &&
+           !(length == 1 && name[0] == '.') && !(length == 2 && name[0] == '.' && name[1] == '.');
+}
+
+// Parse one MLSD line: "fact=value;fact=value; name". Works in place on line.
+int ftp_parse_mlsd_line(char *line, FTPEntry *entry) {
+    char *name = strstr(line, "; ");
+    char *save = NULL;
+    if (!name) return -1;
+    *name = '\0';
+    name += 2;
+    if (!ftp_safe_entry_name(name, strlen(name))) return -1;
+    
+    memset(entry, 0, sizeof(*entry));
+    entry->type = FTP_ENTRY_OTHER;
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    
+    for (char *fact = strtok_r(line, ";", &save); fact; fact = strtok_r(NULL, ";", &save)) {
+        char *value = strchr(fact, '=');
+        if (!value) continue;
+        *value++ = '\0';
+        
+        if (strcasecmp(fact, "type") == 0) {
+            if (strcasecmp(value, "file") == 0) entry->type = FTP_ENTRY_FILE;
+            else if (strcasecmp(value, "dir") == 0) entry->type = FTP_ENTRY_DIRECTORY;
+            else if (strcasecmp(value, "cdir") == 0 || strcasecmp(value, "pdir") == 0) return -1;
+            else if (strncasecmp(value, "OS.unix=slink", 13) == 0) entry->type = FTP_ENTRY_LINK;
+        } else if (strcasecmp(fact, "size") == 0) {
+            entry->size = atoll(value);
+        } else if (strcasecmp(fact, "modify") == 0) {
+            entry->mtime = ftp_parse_timestamp(value);
+        }
+    }
+    
+    return 0;
+}
+
+// Parse one Unix "ls -l" style LIST line. Works in place on line.
+int ftp_parse_list_line(char *line, FTPEntry *entry) {
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char permissions[16], month[4], year_or_time[8];
+    int day, name_offset = 0;
+    long long size;
+    
+    if (sscanf(line, "%15s %*s %*s %*s %lld %3s %d %7s %n",
+               permissions, &size, month, &day, year_or_time, &name_offset) != 5 || name_offset == 0) {
+        return -1;
+    }
+    
+    memset(entry, 0, sizeof(*entry));
+    char *name = line + name_offset;
+    if (permissions[0] == 'l') {
+        char *arrow = strstr(name, " -> ");
+        if (arrow) *arrow = '\0';
+        entry->type = FTP_ENTRY_LINK;
+    } else {
+        entry->type = permissions[0] == 'd' ? FTP_ENTRY_DIRECTORY :
+                      permissions[0] == '-' ? FTP_ENTRY_FILE : FTP_ENTRY_OTHER;
+    }
+    if (!ftp_safe_entry_name(name, strlen(name))) return -1;
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    entry->size = size;
+    
+    // "Mon DD HH:MM" is within the last six months; "Mon DD YYYY" is older
+    const char *found = strstr(months, month);
+    struct tm tm;
+    time_t now = time(NULL);
+    gmtime_r(&now, &tm);
+    tm.tm_mon = found ? (int)(found - months) / 3 : 0;
+    tm.tm_mday = day;
+    tm.tm_sec = 0;
+    if (sscanf(year_or_time, "%d:%d", &tm.tm_hour, &tm.tm_min) == 2) {
+        if (timegm(&tm) > now + 86400) tm.tm_year--;
+    } else {
+        tm.tm_year = atoi(year_or_time) - 1900;
+        tm.tm_hour = tm.tm_min = 0;
+    }
+    entry->mtime = timegm(&tm);
+    return 0;
+}
+
+// List a remote directory into a malloc'd entry array, using MLSD when the server has it
+int ftp_read_directory(FTPClient *client, const char *path, FTPEntry **entries, int *count) {
+    char command[MAX_COMMAND];
+    char *data;
+    size_t length;
+    int response_code = -1;
+    int use_mlsd = !client->mlsd_unsupported;
+    
+    *entries = NULL;
+    *count = 0;
+    
+    if (use_mlsd) {
+        snprintf(command, sizeof(command), "MLSD %s", path);
+        response_code = ftp_fetch_listing(client, command, &data, &length);
+        if (response_code == 500 || response_code == 502 || response_code == 504) {
+            client->mlsd_unsupported = 1;
+            use_mlsd = 0;
+        }
+    }
+    if (!use_mlsd) {
+        snprintf(command, sizeof(command), "LIST %s", path);
+        response_code = ftp_fetch_listing(client, command, &data, &length);
+    }
+    if (response_code != 226) return -1;
+    
+    int capacity = 64;
+    FTPEntry *list = malloc(capacity * sizeof(FTPEntry));
+    char *save = NULL;
+    for (char *line = strtok_r(data, "\r\n", &save); line && list; line = strtok_r(NULL, "\r\n", &save)) {
+        if (*count == capacity) {
+            FTPEntry *grown = realloc(list, capacity * 2 * sizeof(FTPEntry));
+            if (!grown) break;
+            list = grown;
+            capacity *= 2;
+        }
+        int parsed = use_mlsd ? ftp_parse_mlsd_line(line, &list[*count]) : ftp_parse_list_line(line, &list[*count]);
+        if (parsed == 0) (*count)++;
+    }
+    free(data);
+    
+    if (!list) return -1;
+    *entries = list;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Incremental mirror: only new or changed files are transferred
+// ---------------------------------------------------------------------------
+
+static int ftp_index_compare(const void *a, const void *b) {
+    return strcmp(((const FTPIndexEntry *)a)->path, ((const FTPIndexEntry *)b)->path);
+}
+
+// Load "<size> <mtime> <relative path>" lines; a missing index is an empty one
+int ftp_index_load(FTPIndex *index, const char *path) {
+    char line[MAX_PATH + 64];
+    
+    memset(index, 0, sizeof(*index));
+    snprintf(index->path, sizeof(index->path), "%s", path);
+    
+    FILE *fp = fopen(path, "r");
+    if (!fp) return 0;
+    
+    while (fgets(line, sizeof(line), fp)) {
+        FTPIndexEntry entry;
+        int name_offset = 0;
+        
+        line[strcspn(line, "\n")] = '\0';
+        memset(&entry, 0, sizeof(entry));
+        if (sscanf(line, "%lld %lld %n", &entry.size, &entry.mtime, &name_offset) != 2 || !line[name_offset]) continue;
+        
+        entry.path = strdup(line + name_offset);
+        if (!entry.path || ftp_index_add(index, &entry) < 0) {
+            free(entry.path);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    
+    qsort(index->entries, index->count, sizeof(FTPIndexEntry), ftp_index_compare);
+    return 0;
+}
+
+int ftp_index_add(FTPIndex *index, const FTPIndexEntry *entry) {
+    if (index->count == index->capacity) {
+        int capacity = index->capacity ? index->capacity * 2 : 256;
+        FTPIndexEntry *grown = realloc(index->entries, capacity * sizeof(FTPIndexEntry));
+        if (!grown) return -1;
+        index->entries = grown;
+        index->capacity = capacity;
+    }
+    index->entries[index->count++] = *entry;
+    return 0;
+}
+
+// Binary search; only valid on the sorted, loaded part of the index
+FTPIndexEntry *ftp_index_find(FTPIndex *index, int sorted_count, const char *path) {
+    FTPIndexEntry key;
+    key.path = (char *)path;
+    return bsearch(&key, index->entries, sorted_count, sizeof(FTPIndexEntry), ftp_index_compare);
+}
+
+int ftp_index_save(FTPIndex *index) {
+    char temp_path[sizeof(index->path) + 8];
+    int kept = 0;
+    
+    // Drop deleted entries (path == NULL), then keep the file sorted
+    for (int i = 0; i < index->count; i++) {
+        if (index->entries[i].path) index->entries[kept++] = index->entries[i];
+    }
+    index->count = kept;
+    qsort(index->entries, index->count, sizeof(FTPIndexEntry), ftp_index_compare);
+    
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", index->path);
+    FILE *fp = fopen(temp_path, "w");
+    if (!fp) {
+        print_error("Failed to write mirror index");
+        return -1;
+    }
+    for (int i = 0; i < index->count; i++) {
+        fprintf(fp, "%lld %lld %s\n", index->entries[i].size, index->entries[i].mtime, index->entries[i].path);
+    }
+    if (fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return rename(temp_path, index->path);
+}
+
+void ftp_index_free(FTPIndex *index) {
+    for (int i = 0; i < index->count; i++) free(index->entries[i].path);
+    free(index->entries);
+    memset(index, 0, sizeof(*index));
+}
+
+typedef struct {
+    FTPClient *client;
+    FTPIndex index;
+    int loaded_count;  // entries [0, loaded_count) are sorted and searchable
+    const char *local_root;
+    int listing_failed;
+    int files_checked;
+    int files_transferred;
+    long long bytes_transferred;
+} FTPMirror;
+
+static void ftp_mirror_directory(FTPMirror *mirror, const char *remote_dir, const char *relative_dir) {
+    FTPEntry *entries;
+    int count;
+    
+    if (ftp_read_directory(mirror->client, remote_dir, &entries, &count) < 0) {
+        fprintf(stderr, "Skipping unreadable directory %s\n", remote_dir);
+        mirror->listing_failed = 1;
+        return;
+    }
+    
+    size_t remote_length = strlen(remote_dir);
+    for (int i = 0; i < count; i++) {
+        FTPEntry *entry = &entries[i];
+        char remote_path[MAX_PATH], relative_path[MAX_PATH], local_path[MAX_PATH * 2], part_path[MAX_PATH * 2 + 8];
+        
+        // The parsers already drop these; the local tree must never be left
+        if (!ftp_safe_entry_name(entry->name, strlen(entry->name))) continue;
+        snprintf(remote_path, sizeof(remote_path), "%s%s%s", remote_dir,
+                 remote_length == 0 || remote_dir[remote_length - 1] == '/' ? "" : "/", entry->name);
+        snprintf(relative_path, sizeof(relative_path), "%s%s%s", relative_dir,
+                 relative_dir[0] ? "/" : "", entry->name);
+        
+        if (entry->type == FTP_ENTRY_DIRECTORY) {
+            ftp_mirror_directory(mirror, remote_path, relative_path);
+            continue;
+        }
+        if (entry->type != FTP_ENTRY_FILE) continue;
+        mirror->files_checked++;
+        
+        // Unchanged when the index and the file on disk both agree with the listing
+        snprintf(local_path, sizeof(local_path), "%s/%s", mirror->local_root, relative_path);
+        FTPIndexEntry *known = ftp_index_find(&mirror->index, mirror->loaded_count, relative_path);
+        struct stat st;
+        if (known) {
+            known->seen = 1;
+            if (known->size == entry->size && known->mtime == entry->mtime &&
+                stat(local_path, &st) == 0 && st.st_size == entry->size) {
+                continue;
+            }
+        }
+        
+        // Download next to the target and rename, so a failure never leaves a torn file
+        snprintf(part_path, sizeof(part_path), "%s.part", local_path);
+        char *slash = strrchr(local_path, '/');
+        *slash = '\0';
+        int made = make_local_directories(local_path);
+        *slash = '/';
+        if (made < 0 || ftp_download_file(mirror->client, remote_path, part_path) < 0 ||
+            rename(part_path, local_path) < 0) {
+            unlink(part_path);
+            mirror->listing_failed = 1;  // keep the index conservative
+            continue;
+        }
+        
+        struct timeval times[2] = { { entry->mtime, 0 }, { entry->mtime, 0 } };
+        utimes(local_path, times);
+        
+        if (known) {
+            known->size = entry->size;
+            known->mtime = entry->mtime;
+        } else {
+            FTPIndexEntry added = { strdup(relative_path), entry->size, entry->mtime, 1 };
+            if (added.path) ftp_index_add(&mirror->index, &added);
+        }
+        mirror->files_transferred++;
+        mirror->bytes_transferred += entry->size;
+    }
+    
+    free(entries);
+}
+
+// Mirror remote_dir into local_dir. With delete_extraneous, local files whose
+// remote counterpart disappeared are removed (skipped if any listing failed).
+int ftp_mirror(FTPClient *client, const char *remote_dir, const char *local_dir, int delete_extraneous) {
+    FTPMirror mirror;
+    char index_path[MAX_PATH];
+    int files_deleted = 0;
+    
+    memset(&mirror, 0, sizeof(mirror));
+    mirror.client = client;
+    mirror.local_root = local_dir;
+    
+    if (make_local_directories(local_dir) < 0) {
+        print_error("Failed to create local directory");
+        return -1;
+    }
+    snprintf(index_path, sizeof(index_path), "%s/" FTP_MIRROR_INDEX, local_dir);
+    if (ftp_index_load(&mirror.index, index_path) < 0) {
+        fprintf(stderr, "Failed to load mirror index %s\n", index_path);
+        return -1;
+    }
+    mirror.loaded_count = mirror.index.count;
+    
+    if (ftp_set_binary_mode(client) < 0) {
+        ftp_index_free(&mirror.index);
+        return -1;
+    }
+    
+    // A mirror is mostly runs of small files: keep the next data connection ready
+    int prepare_data_channel = client->prepare_data_channel;
+    client->prepare_data_channel = 1;
+    ftp_mirror_directory(&mirror, remote_dir, "");
+    client->prepare_data_channel = prepare_data_channel;
+    ftp_discard_prepared_channel(client);
+    
+    if (delete_extraneous && !mirror.listing_failed) {
+        for (int i = 0; i < mirror.loaded_count; i++) {
+            FTPIndexEntry *entry = &mirror.index.entries[i];
+            char local_path[MAX_PATH];
+            
+            if (entry->seen) continue;
+            snprintf(local_path, sizeof(local_path), "%s/%s", local_dir, entry->path);
+            if (unlink(local_path) == 0 || errno == ENOENT) {
+                printf("Deleted: %s\n", local_path);
+                free(entry->path);
+                entry->path = NULL;
+                files_deleted++;
+            }
+        }
+    }
+    
+    int status = ftp_index_save(&mirror.index);
+    ftp_index_free(&mirror.index);
+    
+    printf("Mirror complete: %d files checked, %d transferred (%lld bytes), %d deleted\n",
+           mirror.files_checked, mirror.files_transferred, mirror.bytes_transferred, files_deleted);
+    if (client->listing_cache) ftp_listing_cache_print_stats(client->listing_cache, stdout);
+    return (status < 0 || mirror.listing_failed) ? -1 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Batch runner: a manifest of operations across servers, run by a fixed set
+// of workers over the session pool with per-server limits, priorities and
+// retries, ending in a JSON summary
+// ---------------------------------------------------------------------------
+
+static const char *ftp_batch_kind_names[] = { "get", "put", "mkdir", "rename", "delete" };
+
+// Split a manifest line into whitespace-separated tokens, in place.
+// "double quotes" keep spaces; a # outside quotes starts a comment.
+static int ftp_batch_tokenize(char *line, char **tokens, int max_tokens) {
+    int count = 0;
+    char *p = line;
+
+    while (*p) {
+        while (isspace((unsigned char)*p)) p++;
+        if (!*p || *p == '#') break;
+        if (count == max_tokens) return -1;
+
+        char *out = p;
+        tokens[count++] = out;
+        int quoted = 0;
+        while (*p && (quoted || !isspace((unsigned char)*p))) {
+            if (*p == '"') quoted = !quoted;
+            else *out++ = *p;
+            p++;
+        }
+        if (quoted) return -1;
+        if (*p) p++;
+        *out = '\0';
+    }
+    return count;
+}
+
+// "host", "host:port" or "[v6 address]:port"
+static int ftp_parse_host_port(const char *text, char *hostname, size_t max_len, int *port) {
+    const char *colon;
+
+    *port = FTP_DEFAULT_PORT;
+    if (text[0] == '[') {
+        const char *end = strchr(text, ']');
+        if (!end || (size_t)(end - text - 1) >= max_len) return -1;
+        snprintf(hostname, max_len, "%.*s", (int)(end - text - 1), text + 1);
+        colon = end[1] == ':' ? end + 1 : NULL;
+    } else {
+        colon = strchr(text, ':');
+        if (colon && strchr(colon + 1, ':')) colon = NULL;  // bare IPv6 address
+        snprintf(hostname, max_len, "%.*s", colon ? (int)(colon - text) : (int)strlen(text), text);
+    }
+    if (colon) *port = atoi(colon + 1);
+    return hostname[0] && *port > 0 && *port < 65536 ? 0 : -1;
+}
+
+static int ftp_batch_find_server(const FTPBatch *batch, const char *name) {
+    for (int i = 0; i < batch->server_count; i++) {
+        if (!strcmp(batch->servers[i].name, name)) return i;
+    }
+    return -1;
+}
+
+// Load a line-based manifest:
+//   server NAME HOST[:PORT] USER [PASSWORD]
+//   get NAME REMOTE LOCAL      put NAME LOCAL REMOTE
+//   mkdir NAME PATH            delete NAME PATH       rename NAME FROM TO
+//   wait                       (later operations start once earlier ones finish)
+// Operations take optional priority=N (higher first), retries=N and
+// weight=N (bandwidth share while shaped).
+int ftp_batch_load(FTPBatch *batch, const char *path, int default_retries) {
+    FILE *file = fopen(path, "r");
+    char line[3 * MAX_PATH];
+    int line_number = 0, phase = 0, status = 0;
+
+    memset(batch, 0, sizeof(*batch));
+    if (!file) {
+        print_error("Failed to open manifest");
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), file)) {
+        char *tokens[8];
+        line_number++;
+        int count = ftp_batch_tokenize(line, tokens, 8);
+        if (count == 0) continue;
+        if (count < 0) {
+            fprintf(stderr, "%s:%d: unbalanced quotes or too many fields\n", path, line_number);
+            status = -1;
+            continue;
+        }
+
+        if (!strcmp(tokens[0], "wait")) {
+            phase++;
+            continue;
+        }
+        if (!strcmp(tokens[0], "server")) {
+            if (count < 4 || count > 5) {
+                fprintf(stderr, "%s:%d: expected: server NAME HOST[:PORT] USER [PASSWORD]\n", path, line_number);
+                status = -1;
+                continue;
+            }
+            if (strlen(tokens[3]) >= sizeof(batch->servers->username) ||
+                (count == 5 && strlen(tokens[4]) >= sizeof(batch->servers->password))) {
+                fprintf(stderr, "%s:%d: user name or password too long\n", path, line_number);
+                status = -1;
+                continue;
+            }
+            FTPBatchServer *grown = realloc(batch->servers, (batch->server_count + 1) * sizeof(*grown));
+            if (!grown) {
+                status = -1;
+                break;
+            }
+            batch->servers = grown;
+            FTPBatchServer *server = &batch->servers[batch->server_count];
+            memset(server, 0, sizeof(*server));
+            snprintf(server->name, sizeof(server->name), "%s", tokens[1]);
+            snprintf(server->username, sizeof(server->username), "%s", tokens[3]);
+            snprintf(server->password, sizeof(server->password), "%s", count == 5 ? tokens[4] : "");
+            if (ftp_parse_host_port(tokens[2], server->hostname, sizeof(server->hostname), &server->port) < 0 ||
+                ftp_batch_find_server(batch, server->name) >= 0) {
+                fprintf(stderr, "%s:%d: bad or duplicate server\n", path, line_number);
+                status = -1;
+                continue;
+            }
+            batch->server_count++;
+            continue;
+        }
+
+        int kind = -1;
+        for (int k = 0; k < (int)(sizeof(ftp_batch_kind_names) / sizeof(ftp_batch_kind_names[0])); k++) {
+            if (!strcmp(tokens[0], ftp_batch_kind_names[k])) kind = k;
+        }
+        if (kind < 0) {
+            fprintf(stderr, "%s:%d: unknown operation %s\n", path, line_number, tokens[0]);
+            status = -1;
+            continue;
+        }
+
+        FTPBatchOp op;
+        memset(&op, 0, sizeof(op));
+        op.kind = kind;
+        op.line = line_number;
+        op.phase = phase;
+        op.max_attempts = default_retries + 1;
+
+        // Trailing key=value options
+        while (count > 2 && strchr(tokens[count - 1], '=')) {
+            const char *option = tokens[--count];
+            if (!strncmp(option, "priority=", 9)) op.priority = atoi(option + 9);
+            else if (!strncmp(option, "weight=", 7)) op.weight = atof(option + 7);
+            else if (!strncmp(option, "retries=", 8)) op.max_attempts = atoi(option + 8) + 1;
+            else {
+                fprintf(stderr, "%s:%d: unknown option %s\n", path, line_number, option);
+                status = -1;
+            }
+        }
+
+        int arguments = (op.kind == FTP_BATCH_MKDIR || op.kind == FTP_BATCH_DELETE) ? 1 : 2;
+        if (count != 2 + arguments) {
+            fprintf(stderr, "%s:%d: expected: %s NAME %s\n", path, line_number, tokens[0],
+                    arguments == 1 ? "PATH" : "SOURCE TARGET");
+            status = -1;
+            continue;
+        }
+        if ((op.server = ftp_batch_find_server(batch, tokens[1])) < 0) {
+            fprintf(stderr, "%s:%d: unknown server %s\n", path, line_number, tokens[1]);
+            status = -1;
+            continue;
+        }
+        op.source = strdup(tokens[2]);
+        op.target = arguments == 2 ? strdup(tokens[3]) : NULL;
+
+        if (batch->op_count == batch->op_capacity) {
+            int capacity = batch->op_capacity ? batch->op_capacity * 2 : 64;
+            FTPBatchOp *grown = realloc(batch->ops, capacity * sizeof(*grown));
+            if (grown) {
+                batch->ops = grown;
+                batch->op_capacity = capacity;
+            }
+        }
+        if (batch->op_count == batch->op_capacity || !op.source || (arguments == 2 && !op.target)) {
+            fprintf(stderr, "Out of memory loading manifest\n");
+            free(op.source);
+            free(op.target);
+            status = -1;
+            break;
+        }
+        batch->ops[batch->op_count++] = op;
+    }
+    fclose(file);
+    batch->phase_count = phase + 1;
+    return status;
+}
+
+void ftp_batch_free(FTPBatch *batch) {
+    for (int i = 0; i < batch->op_count; i++) {
+        free(batch->ops[i].source);
+        free(batch->ops[i].target);
+    }
+    free(batch->ops);
+    free(batch->order);
+    free(batch->order_index);
+    free(batch->phase_remaining);
+    free(batch->servers);
+    memset(batch, 0, sizeof(*batch));
+}
+
+// Dispatch order: phase, then priority (highest first), then manifest order
+static const FTPBatch *ftp_batch_sorting;
+
+static int ftp_batch_compare(const void *a, const void *b) {
+    const FTPBatchOp *x = &ftp_batch_sorting->ops[*(const int *)a];
+    const FTPBatchOp *y = &ftp_batch_sorting->ops[*(const int *)b];
+
+    if (x->phase != y->phase) return x->phase - y->phase;
+    if (x->priority != y->priority) return y->priority - x->priority;
+    return x->line - y->line;
+}
+
+// Next operation a worker may start: the first pending one of the current
+// phase, in order, whose server is below its limit and whose retry delay
+// has passed. Sets *wake to the earliest retry time when nothing is ready.
+// Called with the lock held.
+static FTPBatchOp *ftp_batch_next(FTPBatch *batch, double now, double *wake) {
+    *wake = 0;
+    while (batch->first_pending < batch->op_count &&
+           batch->ops[batch->order[batch->first_pending]].state != FTP_BATCH_PENDING) {
+        batch->first_pending++;
+    }
+    for (int i = batch->first_pending; i < batch->op_count; i++) {
+        FTPBatchOp *op = &batch->ops[batch->order[i]];
+        if (op->phase > batch->phase) break;
+        if (op->state != FTP_BATCH_PENDING) continue;
+        if (batch->servers[op->server].active >= batch->per_server) continue;
+        if (op->not_before > now) {
+            if (!*wake || op->not_before < *wake) *wake = op->not_before;
+            continue;
+        }
+        return op;
+    }
+    return NULL;
+}
+
+static int ftp_compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// A download that has been running for longer than hedge_percentile of the
+// recent ones, and has no hedge yet. Sets *wake to when the next running
+// download would qualify. Called with the lock held.
+static FTPBatchOp *ftp_batch_hedge_candidate(FTPBatch *batch, double now, double *wake) {
+    int samples = batch->get_samples < FTP_BATCH_HEDGE_SAMPLES ? batch->get_samples : FTP_BATCH_HEDGE_SAMPLES;
+    double sorted[FTP_BATCH_HEDGE_SAMPLES];
+
+    *wake = 0;
+    if (batch->hedge_percentile <= 0 || samples < FTP_BATCH_HEDGE_MIN_SAMPLES) return NULL;
+    memcpy(sorted, batch->get_seconds, samples * sizeof(double));
+    qsort(sorted, samples, sizeof(double), ftp_compare_doubles);
+    double threshold = sorted[(int)((samples - 1) * batch->hedge_percentile / 100)];
+
+    for (int i = 0; i < batch->op_count; i++) {
+        FTPBatchOp *op = &batch->ops[i];
+        if (op->kind != FTP_BATCH_GET || op->state != FTP_BATCH_RUNNING || op->hedged || op->running != 1) continue;
+        if (batch->servers[op->server].active >= batch->per_server) continue;
+        double due = op->attempt_started + threshold;
+        if (due <= now) return op;
+        if (!*wake || due < *wake) *wake = due;
+    }
+    return NULL;
+}
+
+// Where the hedge of a download writes until it wins
+static void ftp_batch_hedge_path(const FTPBatchOp *op, char *path, size_t max_len) {
+    snprintf(path, max_len, "%s.hedge", op->target);
+}
+
+// Run one operation on a pooled session; a hedge downloads beside the target
+static int ftp_batch_execute(FTPBatch *batch, FTPBatchOp *op, int hedge, FTPMetrics *metrics) {
+    const FTPBatchServer *server = &batch->servers[op->server];
+    char hedge_path[MAX_PATH + 8];
+    struct stat st;
+
+    FTPClient *client = ftp_pool_acquire(&batch->pool, server->hostname, server->port,
+                                         server->username, server->password);
+    if (!client) return -1;
+    client->quiet = 1;
+    client->verify = batch->verify;
+    client->compress_level = batch->compress_level;
+    client->shaper = batch->rate_file || batch->rate > 0 || batch->transfer_rate > 0 ? &batch->shaper : NULL;
+    client->shaper_weight = op->weight;
+    client->rate_limit = batch->transfer_rate;
+    client->prepare_data_channel = 1;
+    client->tuning.reply_timeout_ms = batch->timeout_ms;
+    client->tuning.idle_timeout_ms = batch->timeout_ms;
+    client->tuning.min_rate = batch->min_rate;
+    client->download_cache = batch->download_cache;
+    client->metrics = metrics;
+    client->failed_reply = 0;
+
+    // Registered so that whichever of the primary and its hedge finishes
+    // first can cut the other off
+    pthread_mutex_lock(&batch->lock);
+    op->session[hedge] = client;
+    client->socket_lock = &batch->lock;
+    int cancelled = op->state != FTP_BATCH_RUNNING;
+    pthread_mutex_unlock(&batch->lock);
+
+    int status = -1;
+    if (cancelled) {
+        // The twin finished while this session was being set up
+    } else if (hedge) {
+        ftp_batch_hedge_path(op, hedge_path, sizeof(hedge_path));
+        status = ftp_download_file(client, op->source, hedge_path);
+    } else {
+        switch (op->kind) {
+            case FTP_BATCH_GET:    status = ftp_download_file(client, op->source, op->target); break;
+            case FTP_BATCH_PUT:    status = ftp_upload_file(client, op->source, op->target); break;
+            case FTP_BATCH_MKDIR:  status = ftp_make_remote_directory(client, op->source); break;
+            case FTP_BATCH_RENAME: status = ftp_rename_remote_file(client, op->source, op->target); break;
+            default:               status = ftp_remove_remote_file(client, op->source); break;
+        }
+    }
+    if (status == 0 && op->kind == FTP_BATCH_GET && stat(hedge ? hedge_path : op->target, &st) == 0) {
+        op->bytes = st.st_size;
+    }
+    if (status == 0 && op->kind == FTP_BATCH_PUT && stat(op->source, &st) == 0) op->bytes = st.st_size;
+
+    pthread_mutex_lock(&batch->lock);
+    op->session[hedge] = NULL;
+    client->socket_lock = NULL;
+    if (!cancelled && status < 0 && op->state == FTP_BATCH_RUNNING) op->failed_reply = client->stalled ? 0 : client->failed_reply;
+    // A session cut off by its twin has a dead control connection: no QUIT
+    if (!cancelled && status < 0 && op->state != FTP_BATCH_RUNNING) client->state = FTP_DISCONNECTED;
+    pthread_mutex_unlock(&batch->lock);
+
+    // The next worker to take the session brings its own
+    client->metrics = NULL;
+    // A failed command leaves the session in an unknown state; reconnect next time
+    ftp_pool_release(&batch->pool, client, status < 0 && !cancelled);
+    return status;
+}
+
+// Cut off the running twin of a finished attempt: its loops fail at the next call
+static void ftp_batch_cancel(FTPBatchOp *op, int slot) {
+    FTPClient *client = op->session[slot];
+
+    if (!client) return;
+    if (client->data_socket >= 0) shutdown(client->data_socket, SHUT_RDWR);
+    if (client->control_socket >= 0) shutdown(client->control_socket, SHUT_RDWR);
+}
+
+// Account for the end of one attempt at op, the primary or its hedge. The
+// first success completes op and cancels the other; a failure counts only
+// once nothing else is running for op. Called with the lock held.
+static void ftp_batch_settle(FTPBatch *batch, FTPBatchOp *op, int status, int hedge, double finished) {
+    char hedge_path[MAX_PATH + 8];
+
+    if (hedge) ftp_batch_hedge_path(op, hedge_path, sizeof(hedge_path));
+    if (op->state != FTP_BATCH_RUNNING || (status < 0 && op->running > 0)) {
+        // Lost the race, or failed while the twin may still make it
+        if (hedge) unlink(hedge_path);
+        return;
+    }
+    if (status == 0 && hedge && rename(hedge_path, op->target) < 0) {
+        print_error("Failed to move hedged download into place");
+        unlink(hedge_path);
+        status = -1;
+        if (op->running > 0) return;
+    }
+    if (status == 0) {
+        ftp_batch_cancel(op, !hedge);
+        if (hedge) batch->hedge_wins++;
+        if (op->kind == FTP_BATCH_GET) {
+            batch->get_seconds[batch->get_samples++ % FTP_BATCH_HEDGE_SAMPLES] = finished - op->attempt_started;
+        }
+    }
+    op->seconds += finished - op->attempt_started;
+    op->hedged = 0;
+
+    int permanent = op->failed_reply >= 500 && op->failed_reply < 600;
+    if (status < 0 && op->attempts < op->max_attempts && !permanent) {
+        // Exponential backoff; other operations keep the workers busy meanwhile
+        double delay = FTP_BATCH_RETRY_DELAY_MS / 1000.0 * (1 << (op->attempts - 1 < 6 ? op->attempts - 1 : 6));
+        op->state = FTP_BATCH_PENDING;
+        op->not_before = finished + delay;
+        if (batch->order_index[op - batch->ops] < batch->first_pending) {
+            batch->first_pending = batch->order_index[op - batch->ops];
+        }
+        batch->retried++;
+        return;
+    }
+    op->state = status < 0 ? FTP_BATCH_FAILED : FTP_BATCH_DONE;
+    batch->completed++;
+    if (status < 0) batch->failed++;
+    else batch->bytes += op->bytes;
+    if (--batch->phase_remaining[op->phase] == 0) {
+        while (batch->phase < batch->phase_count - 1 && batch->phase_remaining[batch->phase] == 0) batch->phase++;
+    }
+    if (!batch->quiet) {
+        printf("[%d/%d] %s %s%s%s: %s%s\n", batch->completed, batch->op_count, ftp_batch_kind_names[op->kind],
+               op->source, op->target ? " -> " : "", op->target ? op->target : "",
+               status < 0 ? "FAILED" : "ok", hedge && status == 0 ? " (hedge)" : "");
+    }
+}
+
+static void *ftp_batch_worker(void *arg) {
+    FTPBatch *batch = arg;
+    FTPMetrics metrics;
+
+    // FTPMetrics is not shared between threads: this worker's sessions count here
+    ftp_metrics_reset(&metrics);
+    pthread_mutex_lock(&batch->lock);
+    while (batch->completed < batch->op_count) {
+        double now = ftp_now(), wake, hedge_wake;
+        FTPBatchOp *op = ftp_batch_next(batch, now, &wake);
+        int hedge = 0;
+        if (!op) {
+            // Nothing new to start: back up a download that is taking too long
+            op = ftp_batch_hedge_candidate(batch, now, &hedge_wake);
+            hedge = op != NULL;
+            if (hedge_wake && (!wake || hedge_wake < wake)) wake = hedge_wake;
+        }
+        if (!op) {
+            if (wake) {
+                ftp_cond_wait_seconds(&batch->changed, &batch->lock, wake - ftp_now());
+            } else {
+                pthread_cond_wait(&batch->changed, &batch->lock);
+            }
+            continue;
+        }
+
+        if (hedge) {
+            op->hedged = 1;
+            batch->hedges++;
+        } else {
+            op->state = FTP_BATCH_RUNNING;
+            op->attempts++;
+            op->attempt_started = now;
+            op->failed_reply = 0;
+        }
+        op->running++;
+        batch->servers[op->server].active++;
+        pthread_mutex_unlock(&batch->lock);
+
+        int status = ftp_batch_execute(batch, op, hedge, batch->metrics ? &metrics : NULL);
+        double finished = ftp_now();
+
+        pthread_mutex_lock(&batch->lock);
+        batch->servers[op->server].active--;
+        op->running--;
+        ftp_batch_settle(batch, op, status, hedge, finished);
+        pthread_cond_broadcast(&batch->changed);
+    }
+    if (batch->metrics) ftp_metrics_merge(batch->metrics, &metrics);
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+// Apply the limit in batch->rate_file when it changed. A missing file, or one
+// that does not start with a number (say, while being rewritten), keeps the
+// current limit.
+static void ftp_batch_read_rate(FTPBatch *batch) {
+    char line[64];
+    FILE *file = fopen(batch->rate_file, "r");
+
+    if (!file) return;
+    char *text = fgets(line, sizeof(line), file);
+    fclose(file);
+    if (!text) return;
+    while (isspace((unsigned char)*text)) text++;
+    if (!isdigit((unsigned char)*text)) return;
+
+    double rate = ftp_parse_byte_count(text);
+    if (rate == batch->rate) return;
+    batch->rate = rate;
+    ftp_shaper_set_rate(&batch->shaper, rate);
+    if (!batch->quiet && rate > 0) printf("Bandwidth limit now %.0f bytes/s\n", rate);
+    else if (!batch->quiet) printf("Bandwidth limit lifted\n");
+}
+
+// Re-read the rate file every FTP_BATCH_RATE_POLL seconds until the batch is done
+static void *ftp_batch_rate_watcher(void *arg) {
+    FTPBatch *batch = arg;
+    double next_poll = 0;
+
+    pthread_mutex_lock(&batch->lock);
+    while (batch->completed < batch->op_count) {
+        double now = ftp_now();
+        if (now < next_poll) {
+            ftp_cond_wait_seconds(&batch->changed, &batch->lock, next_poll - now);
+            continue;
+        }
+        // Only this thread writes batch->rate while workers run
+        pthread_mutex_unlock(&batch->lock);
+        ftp_batch_read_rate(batch);
+        pthread_mutex_lock(&batch->lock);
+        next_poll = ftp_now() + FTP_BATCH_RATE_POLL;
+    }
+    pthread_mutex_unlock(&batch->lock);
+    return NULL;
+}
+
+// Run every loaded operation with jobs workers, at most per_server at a time
+// against any one server. Returns 0 when all operations succeeded.
+int ftp_batch_run(FTPBatch *batch, int jobs, int per_server) {
+    if (batch->op_count == 0) return 0;
+    if (jobs < 1) jobs = 1;
+    if (jobs > batch->op_count) jobs = batch->op_count;
+    batch->per_server = per_server > 0 ? per_server : FTP_POOL_DEFAULT_PER_SERVER;
+
+    batch->order = malloc(batch->op_count * sizeof(int));
+    batch->order_index = malloc(batch->op_count * sizeof(int));
+    batch->phase_remaining = calloc(batch->phase_count, sizeof(int));
+    pthread_t *workers = malloc(jobs * sizeof(pthread_t));
+    if (!batch->order || !batch->order_index || !batch->phase_remaining || !workers ||
+        ftp_pool_init(&batch->pool, jobs, batch->per_server, 0) < 0) {
+        fprintf(stderr, "Failed to allocate batch state\n");
+        free(workers);
+        return -1;
+    }
+    if (ftp_shaper_init(&batch->shaper, batch->rate) < 0) {
+        ftp_pool_destroy(&batch->pool);
+        free(workers);
+        return -1;
+    }
+    for (int i = 0; i < batch->op_count; i++) {
+        batch->order[i] = i;
+        batch->phase_remaining[batch->ops[i].phase]++;
+    }
+    ftp_batch_sorting = batch;
+    qsort(batch->order, batch->op_count, sizeof(int), ftp_batch_compare);
+    for (int i = 0; i < batch->op_count; i++) batch->order_index[batch->order[i]] = i;
+    while (batch->phase < batch->phase_count - 1 && batch->phase_remaining[batch->phase] == 0) batch->phase++;
+
+    pthread_mutex_init(&batch->lock, NULL);
+    pthread_cond_init(&batch->changed, NULL);
+    batch->started = ftp_now();
+
+    // The limit in effect from the first operation on
+    pthread_t watcher;
+    int watching = 0;
+    if (batch->rate_file) {
+        ftp_batch_read_rate(batch);
+        watching = pthread_create(&watcher, NULL, ftp_batch_rate_watcher, batch) == 0;
+        if (!watching) fprintf(stderr, "Failed to start watching %s; the limit stays fixed\n", batch->rate_file);
+    }
+
+    int started = 0;
+    for (; started < jobs; started++) {
+        if (pthread_create(&workers[started], NULL, ftp_batch_worker, batch) != 0) break;
+    }
+    if (started == 0) ftp_batch_worker(batch);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    if (watching) pthread_join(watcher, NULL);
+
+    batch->seconds = ftp_now() - batch->started;
+    ftp_pool_destroy(&batch->pool);
+    ftp_shaper_destroy(&batch->shaper);
+    pthread_mutex_destroy(&batch->lock);
+    pthread_cond_destroy(&batch->changed);
+    free(workers);
+    return batch->failed ? -1 : 0;
+}
+
+// Machine-readable results: totals plus one record per operation, in manifest order
+void ftp_batch_write_summary(const FTPBatch *batch, FILE *out) {
+    fprintf(out, "{\"operations\":%d,\"succeeded\":%d,\"failed\":%d,\"retries\":%d,\"hedges\":%d,\"hedge_wins\":%d,"
+            "\"bytes\":%lld,\"seconds\":%.3f,\"results\":[",
+            batch->op_count, batch->completed - batch->failed, batch->failed, batch->retried, batch->hedges,
+            batch->hedge_wins, batch->bytes, batch->seconds);
+    for (int i = 0; i < batch->op_count; i++) {
+        const FTPBatchOp *op = &batch->ops[i];
+        fprintf(out, "%s{\"line\":%d,\"op\":\"%s\",\"server\":", i ? "," : "", op->line, ftp_batch_kind_names[op->kind]);
+        ftp_json_string(out, batch->servers[op->server].name);
+        fprintf(out, ",\"source\":");
+        ftp_json_string(out, op->source);
+        if (op->target) {
+            fprintf(out, ",\"target\":");
+            ftp_json_string(out, op->target);
+        }
+        fprintf(out, ",\"status\":\"%s\",\"attempts\":%d,\"bytes\":%lld,\"seconds\":%.3f}",
+                op->state == FTP_BATCH_DONE ? "ok" : op->state == FTP_BATCH_FAILED ? "failed" : "skipped",
+                op->attempts, op->bytes, op->seconds);
+    }
+    fprintf(out, "]}\n");
+}
+
+static void ftp_batch_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s batch MANIFEST [--jobs N] [--per-server N] [--retries N]\n"
+            "                [--summary FILE|-] [--verify] [--compress LEVEL] [--quiet]\n"
+            "                [--rate BYTES/S] [--rate-file FILE] [--transfer-rate BYTES/S]\n"
+            "                [--timeout SECONDS] [--min-rate BYTES/S] [--hedge PERCENTILE]\n"
+            "                [--cache DIR] [--cache-size BYTES] [--cache-link] [--metrics FILE|-]\n"
+            "--hedge starts a second copy of a download that runs longer than that\n"
+            "percentile of the recent ones; the first copy to finish is kept.\n"
+            "--cache-link hard-links cached files into place where they cannot be reflinked;\n"
+            "such files are read-only and shared with the cache. --metrics writes the\n"
+            "transfers' phase times, reply latencies and throughput in Prometheus text\n"
+            "format, or as JSON on stderr for -. --rate-file is read every %d s while the\n"
+            "batch runs; the BYTES/S it holds replaces --rate (0 for no limit).\n",
+            program, FTP_BATCH_RATE_POLL);
+}
+
+// "ftp batch MANIFEST ...": run a manifest non-interactively
+int ftp_batch_main(int argc, char *argv[]) {
+    const char *summary_path = NULL, *metrics_path = NULL, *rate_file = NULL;
+    int jobs = FTP_BATCH_DEFAULT_JOBS, per_server = FTP_POOL_DEFAULT_PER_SERVER, retries = FTP_BATCH_DEFAULT_RETRIES;
+    int verify = 0, compress_level = 0, quiet = 0, cache_link = 0;
+    double rate = 0, transfer_rate = 0, min_rate = 0, hedge_percentile = 0, timeout = 0;
+    const char *cache_dir = NULL;
+    long long cache_size = 0;
+    FTPDownloadCache cache;
+    FTPMetrics metrics;
+    FTPBatch batch;
+
+    if (argc < 3) {
+        ftp_batch_usage(argv[0]);
+        return 2;
+    }
+    for (int i = 3; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(argv[i], "--verify")) verify = 1;
+        else if (!strcmp(argv[i], "--quiet")) quiet = 1;
+        else if (!strcmp(argv[i], "--cache-link")) cache_link = 1;
+        else if (!value) {
+            ftp_batch_usage(argv[0]);
+            return 2;
+        } else {
+            if (!strcmp(argv[i], "--jobs")) jobs = atoi(value);
+            else if (!strcmp(argv[i], "--per-server")) per_server = atoi(value);
+            else if (!strcmp(argv[i], "--retries")) retries = atoi(value);
+            else if (!strcmp(argv[i], "--summary")) summary_path = value;
+            else if (!strcmp(argv[i], "--compress")) compress_level = atoi(value);
+            else if (!strcmp(argv[i], "--rate")) rate = ftp_parse_byte_count(value);
+            else if (!strcmp(argv[i], "--transfer-rate")) transfer_rate = ftp_parse_byte_count(value);
+            else if (!strcmp(argv[i], "--timeout")) timeout = atof(value);
+            else if (!strcmp(argv[i], "--min-rate")) min_rate = ftp_parse_byte_count(value);
+            else if (!strcmp(argv[i], "--hedge")) hedge_percentile = atof(value);
+            else if (!strcmp(argv[i], "--cache")) cache_dir = value;
+            else if (!strcmp(argv[i], "--cache-size")) cache_size = ftp_parse_byte_count(value);
+            else if (!strcmp(argv[i], "--metrics")) metrics_path = value;
+            else if (!strcmp(argv[i], "--rate-file")) rate_file = value;
+            else {
+                ftp_batch_usage(argv[0]);
+                return 2;
+            }
+            i++;
+        }
+    }
+
+    if (ftp_batch_load(&batch, argv[2], retries > 0 ? retries : 0) < 0) {
+        ftp_batch_free(&batch);
+        return 2;
+    }
+    batch.verify = verify;
+    batch.compress_level = compress_level;
+    batch.quiet = quiet;
+    batch.rate = rate;
+    batch.rate_file = rate_file;
+    batch.transfer_rate = transfer_rate;
+    batch.timeout_ms = (int)(timeout * 1000);
+    batch.min_rate = min_rate;
+    batch.hedge_percentile = hedge_percentile < 100 ? hedge_percentile : 0;
+    if (cache_dir) {
+        if (ftp_download_cache_init(&cache, cache_dir, cache_size) < 0) {
+            ftp_batch_free(&batch);
+            return 2;
+        }
+        cache.hard_links = cache_link;
+        batch.download_cache = &cache;
+    }
+    if (metrics_path) {
+        ftp_metrics_reset(&metrics);
+        batch.metrics = &metrics;
+    }
+
+    // A dropped data connection must fail the operation, not the process
+    signal(SIGPIPE, SIG_IGN);
+    int status = ftp_batch_run(&batch, jobs, per_server);
+    // Keep stdout pure JSON when the summary goes there
+    FILE *report = summary_path && !strcmp(summary_path, "-") ? stderr : stdout;
+    fprintf(report, "Batch: %d operations, %d succeeded, %d failed, %d retries, %lld bytes in %.2f s\n",
+           batch.op_count, batch.completed - batch.failed, batch.failed, batch.retried, batch.bytes, batch.seconds);
+    if (batch.hedges) fprintf(report, "Hedged %d slow downloads, %d won\n", batch.hedges, batch.hedge_wins);
+    if (batch.download_cache) {
+        ftp_download_cache_print_stats(&cache, report);
+        ftp_download_cache_destroy(&cache);
+    }
+
+    if (summary_path) {
+        FILE *out = strcmp(summary_path, "-") ? fopen(summary_path, "w") : stdout;
+        if (!out) {
+            print_error("Failed to open summary file");
+            status = -1;
+        } else {
+            ftp_batch_write_summary(&batch, out);
+            if (out != stdout) fclose(out);
+        }
+    }
+    if (metrics_path && ftp_metrics_write_file(&metrics, "batch", metrics_path) < 0) status = -1;
+    ftp_batch_free(&batch);
+    return status < 0 ? 1 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Command-line transfers: "ftp get URL [FILE|-]" and "ftp put FILE|- URL"
+// stream through stdout/stdin, so they can sit in a shell pipeline
+// ---------------------------------------------------------------------------
+
+// Undo %XX escapes in place
+static void ftp_url_decode(char *text) {
+    char *out = text;
+
+    for (char *p = text; *p; p++) {
+        if (p[0] == '%' && isxdigit((unsigned char)p[1]) && isxdigit((unsigned char)p[2])) {
+            char hex[3] = { p[1], p[2], '\0' };
+            *out++ = (char)strtol(hex, NULL, 16);
+            p += 2;
+        } else {
+            *out++ = *p;
+        }
+    }
+    *out = '\0';
+}
+
+// Split [ftp://][user[:password]@]host[:port]/path (RFC 1738). The path is
+// relative to the login directory; %2F at its start makes it absolute.
+// The login defaults to anonymous.
+int ftp_parse_url(const char *url, FTPLocation *location) {
+    char authority[512];
+
+    memset(location, 0, sizeof(*location));
+    if (!strncasecmp(url, "ftp://", 6)) url += 6;
+
+    const char *slash = strchr(url, '/');
+    size_t length = slash ? (size_t)(slash - url) : strlen(url);
+    if (length == 0 || length >= sizeof(authority)) return -1;
+    memcpy(authority, url, length);
+    authority[length] = '\0';
+    // No path at all is the login directory itself
+    snprintf(location->path, sizeof(location->path), "%s", slash && slash[1] ? slash + 1 : ".");
+    ftp_url_decode(location->path);
+
+    char *host = authority;
+    char *at = strrchr(authority, '@');
+    snprintf(location->username, sizeof(location->username), "anonymous");
+    if (at) {
+        *at = '\0';
+        host = at + 1;
+        char *colon = strchr(authority, ':');
+        if (colon) {
+            *colon = '\0';
+            snprintf(location->password, sizeof(location->password), "%s", colon + 1);
+            ftp_url_decode(location->password);
+        }
+        if (strlen(authority) >= sizeof(location->username)) return -1;
+        memcpy(location->username, authority, strlen(authority) + 1);
+        ftp_url_decode(location->username);
+    }
+    return ftp_parse_host_port(host, location->hostname, sizeof(location->hostname), &location->port);
+}
+
+static void ftp_transfer_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s get [ftp://][USER[:PASSWORD]@]HOST[:PORT]/PATH [FILE|-]\n"
+            "       %s put FILE|- [ftp://][USER[:PASSWORD]@]HOST[:PORT]/PATH\n"
+            "       options: [--verify] [--compress LEVEL] [--rate BYTES/S] [--quiet]\n"
+            "                [--timeout SECONDS] [--min-rate BYTES/S] [--retries N]\n"
+            "                [--cache DIR] [--cache-size BYTES] [--cache-link] [--segments N]\n"
+            "                [--metrics FILE|-]\n"
+            "- (the default for get) is stdout for get and stdin for put.\n"
+            "--timeout bounds each reply and each data connection without progress;\n"
+            "--min-rate cuts off a transfer slower than that over %d s. With --retries,\n"
+            "a file transfer reconnects and resumes after such failures. --cache keeps\n"
+            "downloads in DIR, shared with other runs, and serves unchanged files from it:\n"
+            "reflinked where the filesystem can, else copied, or with --cache-link hard-linked\n"
+            "(read-only, and the same file as the cached one). --segments downloads into\n"
+            "FILE over N sessions at once, one byte range each (at most %d). --metrics\n"
+            "writes phase times, reply latencies and throughput in Prometheus text format,\n"
+            "or as JSON on stderr for -.\n",
+            program, program, FTP_STALL_WINDOW, FTP_MAX_SEGMENTS);
+}
+
+// "get" and "put" subcommands
+int ftp_transfer_main(int argc, char *argv[]) {
+    int upload = !strcmp(argv[1], "put");
+    const char *operands[2] = { NULL, NULL };
+    int operand_count = 0, verify = 0, compress_level = 0, quiet = 0, timeout_ms = 0, retries = -1, cache_link = 0;
+    int segments = 0;
+    double rate = 0, min_rate = 0;
+    const char *cache_dir = NULL, *metrics_path = NULL;
+    long long cache_size = 0;
+    FTPDownloadCache cache;
+    FTPMetrics metrics;
+    FTPLocation location;
+    FTPClient client;
+    FTPShaper shaper;
+
+    for (int i = 2; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(argv[i], "--verify")) verify = 1;
+        else if (!strcmp(argv[i], "--quiet")) quiet = 1;
+        else if (!strcmp(argv[i], "--compress") && value) compress_level = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--rate") && value) rate = ftp_parse_byte_count(argv[++i]);
+        else if (!strcmp(argv[i], "--timeout") && value) timeout_ms = (int)(atof(argv[++i]) * 1000);
+        else if (!strcmp(argv[i], "--min-rate") && value) min_rate = ftp_parse_byte_count(argv[++i]);
+        else if (!strcmp(argv[i], "--retries") && value) retries = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--cache") && value) cache_dir = argv[++i];
+        else if (!strcmp(argv[i], "--cache-size") && value) cache_size = ftp_parse_byte_count(argv[++i]);
+        else if (!strcmp(argv[i], "--cache-link")) cache_link = 1;
+        else if (!strcmp(argv[i], "--segments") && value) segments = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--metrics") && value) metrics_path = argv[++i];
+        else if (operand_count < 2 && (strncmp(argv[i], "--", 2) || !argv[i][2])) operands[operand_count++] = argv[i];
+        else {
+            ftp_transfer_usage(argv[0]);
+            return 2;
+        }
+    }
+    const char *url = upload ? operands[1] : operands[0];
+    const char *local = (upload ? operands[0] : operands[1]) ? (upload ? operands[0] : operands[1]) : "-";
+    if (!url || (upload && operand_count != 2) || ftp_parse_url(url, &location) < 0) {
+        ftp_transfer_usage(argv[0]);
+        return 2;
+    }
+
+    // Data goes through stdout; everything else has to go to stderr
+    int stream = !strcmp(local, "-");
+    // Retried transfers resume from a journal and cached ones are linked into
+    // place, so they need a file by name
+    int resumable = retries >= 0 && !stream;
+    int cached = cache_dir && !upload && !stream;
+    if (cached && resumable) {
+        fprintf(stderr, "--cache cannot be combined with --retries\n");
+        return 2;
+    }
+    // Segments write at their own offsets of a file named on the command line
+    int segmented = segments > 1;
+    if (segmented && (upload || stream || resumable || cached)) {
+        fprintf(stderr, "--segments needs a local FILE for get and cannot be combined with --retries or --cache\n");
+        return 2;
+    }
+    int fd = stream ? (upload ? STDIN_FILENO : STDOUT_FILENO)
+                    : upload || resumable || cached || segmented ? open(local, O_RDONLY | (upload ? 0 : O_CREAT), 0644)
+                                                    : open(local, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        print_error("Failed to open local file");
+        return 1;
+    }
+
+    memset(&client, 0, sizeof(client));
+    client.control_socket = -1;
+    client.data_socket = -1;
+    client.prepared_socket = -1;
+    client.server_port = location.port;
+    client.quiet = 1;
+    client.verify = verify;
+    client.compress_level = compress_level;
+    client.tuning.reply_timeout_ms = timeout_ms;
+    client.tuning.idle_timeout_ms = timeout_ms;
+    client.tuning.min_rate = min_rate;
+    client.tuning.retries = retries > 0 ? retries : -1;
+    // splice()s straight between a pipe and the socket when nothing needs the bytes
+    client.data_path = FTP_DATA_ZEROCOPY;
+    if (rate > 0 && ftp_shaper_init(&shaper, rate) == 0) client.shaper = &shaper;
+    if (metrics_path) {
+        ftp_metrics_reset(&metrics);
+        client.metrics = &metrics;
+    }
+    if (cached) {
+        if (ftp_download_cache_init(&cache, cache_dir, cache_size) < 0) {
+            if (!stream) close(fd);
+            return 1;
+        }
+        cache.hard_links = cache_link;
+        client.download_cache = &cache;
+    }
+
+    // A reader that goes away must fail the transfer, not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    long long bytes = -1;
+    double started = ftp_now();
+    if (ftp_connect(&client, location.hostname) == 0) {
+        if (ftp_login(&client, location.username, location.password) == 0 && ftp_set_binary_mode(&client) == 0) {
+            if (resumable) {
+                struct stat st;
+                int status = upload ? ftp_upload_file_retry(&client, local, location.path)
+                                    : ftp_download_file_retry(&client, location.path, local);
+                bytes = status == 0 && stat(local, &st) == 0 ? (long long)st.st_size : -1;
+            } else if (cached) {
+                struct stat st;
+                bytes = ftp_download_file(&client, location.path, local) == 0 && stat(local, &st) == 0
+                            ? (long long)st.st_size : -1;
+            } else if (segmented) {
+                struct stat st;
+                bytes = ftp_download_file_segmented(&client, location.path, local, segments) == 0 &&
+                        stat(local, &st) == 0 ? (long long)st.st_size : -1;
+            } else {
+                bytes = upload ? ftp_upload_from_fd(&client, fd, location.path)
+                               : ftp_download_to_fd(&client, location.path, fd);
+            }
+        }
+        ftp_close_connection(&client);
+    }
+    double seconds = ftp_now() - started;
+
+    if (!stream && close(fd) < 0 && bytes >= 0) {
+        print_error("Failed to write local file");
+        bytes = -1;
+    }
+    if (client.shaper) ftp_shaper_destroy(&shaper);
+    if (client.download_cache) ftp_download_cache_destroy(&cache);
+    if (client.metrics && ftp_metrics_write_file(&metrics, location.hostname, metrics_path) < 0) bytes = -1;
+    if (bytes >= 0 && !quiet) {
+        fprintf(stderr, "%s %s: %lld bytes in %.2f s (%.1f MB/s, %s)\n", upload ? "Uploaded" : "Downloaded",
+                location.path, bytes, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0,
+                client.cache_hit ? "cache" : segmented ? "segmented" : ftp_data_path_name(client.last_data_path));
+    }
+    return bytes < 0 ? 1 : 0;
+}
+
+static void ftp_mget_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s mget DIR [ftp://][USER[:PASSWORD]@]HOST[:PORT]/PATH...\n"
+            "Downloads every URL into DIR under its base name, all at once, each over its\n"
+            "own session driven by one event loop.\n", program);
+}
+
+// "mget" subcommand: the event-driven engine, one job per URL
+int ftp_mget_main(int argc, char *argv[]) {
+    FTPEngine engine;
+    FTPLocation location;
+    FTPClient origin;
+    char local[MAX_PATH];
+
+    if (argc < 4) {
+        ftp_mget_usage(argv[0]);
+        return 2;
+    }
+    const char *directory = argv[2];
+    if (make_local_directories(directory) < 0) {
+        print_error("Failed to create local directory");
+        return 1;
+    }
+    if (ftp_engine_init(&engine, argc - 3) < 0) return 1;
+
+    // Jobs log in on their own: origin only carries each URL's server and account
+    for (int i = 3; i < argc; i++) {
+        if (ftp_parse_url(argv[i], &location) < 0) {
+            ftp_engine_destroy(&engine);
+            ftp_mget_usage(argv[0]);
+            return 2;
+        }
+        memset(&origin, 0, sizeof(origin));
+        memcpy(origin.server_hostname, location.hostname, sizeof(origin.server_hostname));
+        memcpy(origin.username, location.username, sizeof(origin.username));
+        memcpy(origin.password, location.password, sizeof(origin.password));
+        origin.server_port = location.port;
+
+        const char *base_name = strrchr(location.path, '/');
+        if (snprintf(local, sizeof(local), "%s/%s", directory, base_name ? base_name + 1 : location.path) >=
+            (int)sizeof(local)) {
+            fprintf(stderr, "Local path too long for %s\n", location.path);
+            ftp_engine_destroy(&engine);
+            return 1;
+        }
+        ftp_engine_add_job(&engine, FTP_JOB_DOWNLOAD, &origin, location.path, local);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    int failed = ftp_engine_run(&engine);
+    ftp_engine_destroy(&engine);
+    return failed != 0 ? 1 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Server-to-server (FXP) transfers: one server listens (PASV), the other is
+// sent its address with PORT, and the file flows between the two servers
+// without passing through this host
+// ---------------------------------------------------------------------------
+
+// PORT h1,h2,h3,h4,p1,p2 for IPv4, EPRT |2|address|port| (RFC 2428) for IPv6
+static void ftp_format_port_command(const FTPAddress *address, char *command, size_t max_len) {
+    if (address->address.ss_family == AF_INET) {
+        const struct sockaddr_in *ipv4 = (const struct sockaddr_in *)&address->address;
+        unsigned long ip = ntohl(ipv4->sin_addr.s_addr);
+        int port = ntohs(ipv4->sin_port);
+        snprintf(command, max_len, "PORT %lu,%lu,%lu,%lu,%d,%d", ip >> 24, ip >> 16 & 0xff, ip >> 8 & 0xff,
+                 ip & 0xff, port >> 8, port & 0xff);
+        return;
+    }
+
+    const struct sockaddr_in6 *ipv6 = (const struct sockaddr_in6 *)&address->address;
+    char host[INET6_ADDRSTRLEN];
+    inet_ntop(AF_INET6, &ipv6->sin6_addr, host, sizeof(host));
+    snprintf(command, max_len, "EPRT |2|%s|%d|", host, ntohs(ipv6->sin6_port));
+}
+
+// Open a passive port on listener and point connector at it.
+// Returns -1 when either server refuses; the caller may swap the roles.
+static int ftp_fxp_pair(FTPClient *listener, FTPClient *connector) {
+    char response[MAX_BUFFER], command[MAX_COMMAND];
+    FTPAddress address;
+
+    if (send_ftp_command(listener, ftp_passive_command(listener)) < 0) return -1;
+    int response_code = recv_ftp_response(listener, response, sizeof(response));
+    if ((response_code != 227 && response_code != 229) ||
+        ftp_parse_passive_reply(listener, response_code, response, &address) < 0) {
+        if (response_code >= 500 && listener->server_address.address.ss_family == AF_INET &&
+            !strcmp(ftp_passive_command(listener), "EPSV")) {
+            listener->epsv_failed = 1;
+        }
+        fprintf(stderr, "Passive mode failed: %s\n", response);
+        return -1;
+    }
+
+    // A 229 carries only a port; the address is the one we reach the listener at
+    ftp_format_port_command(&address, command, sizeof(command));
+    if (send_ftp_command(connector, command) < 0) return -1;
+    if (recv_ftp_response(connector, response, sizeof(response)) != 200) {
+        fprintf(stderr, "Server refused %.4s: %s\n", command, response);
+        return -1;
+    }
+    return 0;
+}
+
+// Abandon the transfer command outstanding on client: ABOR, then read
+// through its acknowledgement. The transfer's own replies (150, then 426
+// or 425) may come first.
+static void ftp_fxp_abort(FTPClient *client) {
+    if (send_ftp_command(client, "ABOR") < 0) return;
+    for (int i = 0; i < 3; i++) {
+        int response_code = recv_ftp_response(client, NULL, 0);
+        if (response_code < 0 || response_code == 225 || response_code == 226 || response_code >= 500) break;
+    }
+}
+
+// After an FXP copy, compare what the two servers hold: the strongest hash
+// both can compute, else the sizes. Returns 0 on a match, 1 when the
+// servers cannot tell, -1 on a mismatch.
+static int ftp_fxp_verify(FTPClient *source, const char *source_file, FTPClient *destination,
+                          const char *destination_file) {
+    unsigned algorithm = ftp_strongest_remote_hash(ftp_remote_hash_algorithms(source) &
+                                                   ftp_remote_hash_algorithms(destination));
+    char source_hex[129], destination_hex[129];
+
+    if (algorithm) {
+        if (ftp_remote_hash(source, source_file, algorithm, source_hex) != 0 ||
+            ftp_remote_hash(destination, destination_file, algorithm, destination_hex) != 0) {
+            return 1;
+        }
+        if (!ftp_hash_equal(algorithm, source_hex, destination_hex)) {
+            fprintf(stderr, "Integrity check failed for %s: source %s, destination %s\n", destination_file,
+                    source_hex, destination_hex);
+            return -1;
+        }
+        if (!destination->quiet) printf("Verified %s: %s\n", destination_file, destination_hex);
+        return 0;
+    }
+
+    long long source_size, destination_size;
+    if (!(source->features & destination->features & FTP_FEATURE_SIZE) ||
+        ftp_get_remote_size(source, source_file, &source_size) < 0 ||
+        ftp_get_remote_size(destination, destination_file, &destination_size) < 0) {
+        return 1;
+    }
+    if (source_size != destination_size) {
+        fprintf(stderr, "Size check failed for %s: source %lld, destination %lld bytes\n", destination_file,
+                source_size, destination_size);
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for the reply that ends a server-to-server copy. It only comes once
+// the whole file has moved, so the default reply deadline does not apply:
+// only one the caller set
+static int ftp_fxp_completion(FTPClient *client, char *response, size_t max_len) {
+    int saved = client->tuning.reply_timeout_ms;
+    if (saved == 0) client->tuning.reply_timeout_ms = -1;
+    int code = recv_ftp_response(client, response, max_len);
+    client->tuning.reply_timeout_ms = saved;
+    return code;
+}
+
+// Copy source_file on source's server to destination_file on destination's.
+// Both sessions must be logged in. The destination listens when it agrees
+// to, else the source does. Returns the size of the file (0 when the
+// source does not tell), or -1.
+long long ftp_fxp_transfer(FTPClient *source, const char *source_file, FTPClient *destination,
+                           const char *destination_file) {
+    char retr_command[MAX_COMMAND], stor_command[MAX_COMMAND];
+    char listener_reply[MAX_BUFFER], connector_reply[MAX_BUFFER];
+    FTPClient *sessions[] = { source, destination };
+
+    // Both servers have to move the same bytes: binary, stream mode
+    for (int i = 0; i < 2; i++) {
+        ftp_discard_prepared_channel(sessions[i]);
+        if (ftp_set_binary_mode(sessions[i]) < 0 || ftp_select_transfer_mode(sessions[i], 0) < 0) return -1;
+    }
+
+    int destination_listens = ftp_fxp_pair(destination, source) == 0;
+    if (!destination_listens && ftp_fxp_pair(source, destination) < 0) {
+        fprintf(stderr, "Neither server accepts a server-to-server data connection\n");
+        return -1;
+    }
+    FTPClient *listener = destination_listens ? destination : source;
+    FTPClient *connector = destination_listens ? source : destination;
+
+    // The listening side goes first, so it is waiting when the other connects
+    snprintf(retr_command, sizeof(retr_command), "RETR %s", source_file);
+    snprintf(stor_command, sizeof(stor_command), "STOR %s", destination_file);
+    if (send_ftp_command(listener, destination_listens ? stor_command : retr_command) < 0) return -1;
+    if (send_ftp_command(connector, destination_listens ? retr_command : stor_command) < 0) return -1;
+
+    // The connecting side answers first: many servers send their 150 only
+    // once the data connection is up
+    int connector_code = recv_ftp_response(connector, connector_reply, sizeof(connector_reply));
+    if (connector_code < 100 || connector_code >= 200) {
+        fprintf(stderr, "Transfer failed: %s\n", connector_reply);
+        ftp_fxp_abort(listener);
+        return -1;
+    }
+    int listener_code = recv_ftp_response(listener, listener_reply, sizeof(listener_reply));
+    if (listener_code < 100 || listener_code >= 200) {
+        fprintf(stderr, "Transfer failed: %s\n", listener_reply);
+        ftp_fxp_abort(connector);
+        return -1;
+    }
+    long long size = ftp_parse_transfer_size(destination_listens ? connector_reply : listener_reply);
+
+    // The data flows between the servers while both wait to report
+    connector_code = ftp_fxp_completion(connector, connector_reply, sizeof(connector_reply));
+    listener_code = ftp_fxp_completion(listener, listener_reply, sizeof(listener_reply));
+    if (connector_code < 200 || connector_code >= 300 || listener_code < 200 || listener_code >= 300) {
+        fprintf(stderr, "Transfer failed: %s\n", connector_code < 200 || connector_code >= 300
+                                                 ? connector_reply : listener_reply);
+        return -1;
+    }
+
+    if ((source->verify || destination->verify) &&
+        ftp_fxp_verify(source, source_file, destination, destination_file) < 0) {
+        return -1;
+    }
+    if (size == 0 && (source->features & FTP_FEATURE_SIZE) && ftp_get_remote_size(source, source_file, &size) < 0) {
+        size = 0;
+    }
+    return size;
+}
+
+// Log in to the server of a parsed URL
+static int ftp_open_location(FTPClient *client, const FTPLocation *location, int verify, int quiet) {
+    memset(client, 0, sizeof(*client));
+    client->control_socket = -1;
+    client->data_socket = -1;
+    client->prepared_socket = -1;
+    client->server_port = location->port;
+    client->verify = verify;
+    client->quiet = quiet;
+    if (ftp_connect(client, location->hostname) < 0) return -1;
+    if (ftp_login(client, location->username, location->password) < 0) {
+        ftp_close_connection(client);
+        return -1;
+    }
+    return 0;
+}
+
+static void ftp_fxp_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s fxp [ftp://][USER[:PASSWORD]@]HOST[:PORT]/PATH [ftp://][USER[:PASSWORD]@]HOST[:PORT]/PATH\n"
+            "       options: [--verify] [--quiet] [--timeout SECONDS]\n"
+            "Copies between the two servers directly; a destination ending in / keeps the name.\n"
+            "Without --timeout the copy may take as long as it needs.\n", program);
+}
+
+// "fxp" subcommand
+int ftp_fxp_main(int argc, char *argv[]) {
+    const char *operands[2] = { NULL, NULL };
+    int operand_count = 0, verify = 0, quiet = 0, timeout_ms = 0;
+    FTPLocation from, to;
+    FTPClient source, destination;
+
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--verify")) verify = 1;
+        else if (!strcmp(argv[i], "--quiet")) quiet = 1;
+        else if (!strcmp(argv[i], "--timeout") && i + 1 < argc) timeout_ms = (int)(atof(argv[++i]) * 1000);
+        else if (argv[i][0] != '-' && operand_count < 2) operands[operand_count++] = argv[i];
+        else {
+            ftp_fxp_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (operand_count != 2 || ftp_parse_url(operands[0], &from) < 0 || ftp_parse_url(operands[1], &to) < 0) {
+        ftp_fxp_usage(argv[0]);
+        return 2;
+    }
+    if (!strcmp(to.path, ".")) to.path[0] = '\0';  // the login directory
+    size_t length = strlen(to.path);
+    if (length == 0 || to.path[length - 1] == '/') {
+        const char *name = strrchr(from.path, '/');
+        snprintf(to.path + length, sizeof(to.path) - length, "%s", name ? name + 1 : from.path);
+    }
+
+    if (ftp_open_location(&source, &from, verify, quiet) < 0) return 1;
+    if (ftp_open_location(&destination, &to, verify, quiet) < 0) {
+        ftp_close_connection(&source);
+        return 1;
+    }
+    source.tuning.reply_timeout_ms = timeout_ms;
+    destination.tuning.reply_timeout_ms = timeout_ms;
+    // A deadline shuts the control connection; the ABOR after it must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+
+    double started = ftp_now();
+    long long bytes = ftp_fxp_transfer(&source, from.path, &destination, to.path);
+    double seconds = ftp_now() - started;
+    ftp_close_connection(&source);
+    ftp_close_connection(&destination);
+
+    if (bytes >= 0 && !quiet) {
+        printf("Copied %s to %s:%s server to server: %lld bytes in %.2f s (%.1f MB/s)\n", from.path, to.hostname,
+               to.path, bytes, seconds, seconds > 0 ? bytes / seconds / 1e6 : 0);
+    }
+    return bytes < 0 ? 1 : 0;
+}
+
+static void ftp_mirror_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s mirror [--delete] [ftp://][USER[:PASSWORD]@]HOST[:PORT]/PATH DIR\n"
+            "Brings DIR up to date with the remote directory PATH (\".\" for the login\n"
+            "directory), fetching only files whose size or time changed since the last run.\n"
+            "--delete also removes local files that are gone from the server.\n", program);
+}
+
+// "mirror" subcommand
+int ftp_mirror_main(int argc, char *argv[]) {
+    const char *operands[2] = { NULL, NULL };
+    int operand_count = 0, delete_extraneous = 0;
+    FTPLocation location;
+    FTPClient client;
+
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--delete")) delete_extraneous = 1;
+        else if (operand_count < 2 && strncmp(argv[i], "--", 2)) operands[operand_count++] = argv[i];
+        else {
+            ftp_mirror_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (operand_count != 2 || ftp_parse_url(operands[0], &location) < 0) {
+        ftp_mirror_usage(argv[0]);
+        return 2;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    if (ftp_open_location(&client, &location, 0, 1) < 0) return 1;
+    int status = ftp_mirror(&client, location.path, operands[1], delete_extraneous);
+    ftp_close_connection(&client);
+    return status < 0 ? 1 : 0;
+}
+
+// ---------------------------------------------------------------------------
+// Multi-mirror downloads: byte ranges of one file are pulled with REST+RETR
+// from every mirror at once. Idle workers split the slowest range or race
+// its tail from a faster mirror, so the total time follows the aggregate
+// bandwidth rather than the slowest mirror.
+// ---------------------------------------------------------------------------
+
+// Log in to a mirror and read the file's SIZE and MDTM
+static int ftp_multi_probe_open(FTPSource *source) {
+    FTPClient *client = &source->probe;
+
+    if (ftp_open_location(client, &source->location, 0, 1) < 0) return -1;
+    if (ftp_set_binary_mode(client) < 0 || ftp_get_remote_size(client, source->location.path, &source->size) < 0) {
+        ftp_close_connection(client);
+        return -1;
+    }
+    if ((client->features & FTP_FEATURE_MDTM) &&
+        ftp_get_remote_mdtm(client, source->location.path, source->modified, sizeof(source->modified)) < 0) {
+        source->modified[0] = '\0';
+    }
+    return 0;
+}
+
+static void *ftp_multi_probe(void *arg) {
+    FTPSource *source = arg;
+
+    source->usable = ftp_multi_probe_open(source) == 0;
+    if (!source->usable) fprintf(stderr, "Mirror %s unavailable\n", source->location.hostname);
+    return NULL;
+}
+
+// Same file on both mirrors: equal SIZE, and equal MDTM where both report one
+static int ftp_multi_same_file(const FTPSource *a, const FTPSource *b) {
+    return a->size == b->size && (!a->modified[0] || !b->modified[0] || !strcmp(a->modified, b->modified));
+}
+
+// Probe every mirror in parallel and keep those that agree with the most
+// others. Returns the file size, or -1 when no mirror is usable.
+static long long ftp_multi_check_sources(FTPSource *sources, int count) {
+    pthread_t threads[FTP_MULTI_MAX_SOURCES];
+    int started[FTP_MULTI_MAX_SOURCES];
+    int reference = -1, best_votes = 0;
+
+    for (int i = 0; i < count; i++) {
+        started[i] = pthread_create(&threads[i], NULL, ftp_multi_probe, &sources[i]) == 0;
+        if (!started[i]) ftp_multi_probe(&sources[i]);
+    }
+    for (int i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (!sources[i].usable) continue;
+        int votes = 0;
+        for (int j = 0; j < count; j++) votes += sources[j].usable && ftp_multi_same_file(&sources[i], &sources[j]);
+        if (votes > best_votes) {
+            best_votes = votes;
+            reference = i;
+        }
+    }
+    if (reference < 0) return -1;
+
+    for (int i = 0; i < count; i++) {
+        if (!sources[i].usable || ftp_multi_same_file(&sources[i], &sources[reference])) continue;
+        fprintf(stderr, "Mirror %s has a different file (%lld bytes, modified %s); skipping it\n",
+                sources[i].location.hostname, sources[i].size, sources[i].modified[0] ? sources[i].modified : "?");
+        ftp_close_connection(&sources[i].probe);
+        sources[i].usable = 0;
+    }
+    return sources[reference].size;
+}
+
+// Bytes per second a worker has achieved so far; 0 before its first byte
+static double ftp_multi_worker_rate(const FTPSourceWorker *worker, double now) {
+    double seconds = worker->busy + (worker->range >= 0 ? now - worker->range_started : 0);
+    return seconds > 0 ? worker->bytes / seconds : 0;
+}
+
+// Append a range; the caller holds the lock. Returns its index, or -1.
+static int ftp_multi_add_range(FTPMultiDownload *download, long long offset, long long end, int owner) {
+    if (download->range_count == download->range_capacity) {
+        int capacity = download->range_capacity ? download->range_capacity * 2 : 64;
+        FTPSourceRange *ranges = realloc(download->ranges, capacity * sizeof(*ranges));
+        if (!ranges) return -1;
+        download->ranges = ranges;
+        download->range_capacity = capacity;
+    }
+    FTPSourceRange *range = &download->ranges[download->range_count];
+    range->offset = offset;
+    range->end = end;
+    range->owner = owner;
+    range->twin = -1;
+    range->done = 0;
+    return download->range_count++;
+}
+
+// Pick the next range for an idle worker; the caller holds the lock.
+// Queued ranges go first, lowest offset first. Then the range whose owner
+// would finish last is split at the point where both finish together, or,
+// when too little is left to split, raced from this worker's mirror if
+// that would be FTP_MULTI_HEDGE_FACTOR times sooner. An owner that has
+// received nothing yet is only raced once FTP_MULTI_HEDGE_MIN_AGE has passed.
+// Returns the range index, -1 when there is nothing to take now, -2 when all are done.
+static int ftp_multi_claim(FTPMultiDownload *download, FTPSourceWorker *worker) {
+    int index = -1, pending = 0;
+
+    for (int i = 0; i < download->range_count; i++) {
+        FTPSourceRange *range = &download->ranges[i];
+        if (range->done) continue;
+        pending = 1;
+        if (range->owner < 0 && (index < 0 || range->offset < download->ranges[index].offset)) index = i;
+    }
+    if (!pending) return -2;
+    if (index >= 0) {
+        download->ranges[index].owner = worker - download->workers;
+        return index;
+    }
+
+    double now = ftp_now(), my_rate = ftp_multi_worker_rate(worker, now), longest = -1;
+    for (int i = 0; i < download->range_count; i++) {
+        const FTPSourceRange *range = &download->ranges[i];
+        if (range->done || range->twin >= 0 || range->end - range->offset <= 0) continue;
+        double owner_rate = ftp_multi_worker_rate(&download->workers[range->owner], now);
+        double left = owner_rate > 0 ? (range->end - range->offset) / owner_rate : 1e12;
+        if (left > longest) {
+            longest = left;
+            index = i;
+        }
+    }
+    if (index < 0) return -1;
+
+    FTPSourceRange *victim = &download->ranges[index];
+    FTPSourceWorker *owner = &download->workers[victim->owner];
+    long long remaining = victim->end - victim->offset;
+    double owner_rate = ftp_multi_worker_rate(owner, now);
+    int other_mirror = owner->source != worker->source;
+    int owner_started = owner_rate > 0 ||
+                        (owner->range == index && now - owner->range_started >= FTP_MULTI_HEDGE_MIN_AGE);
+
+    // A stalled or much slower mirror: race the whole remainder from here
+    if (other_mirror && owner_started && my_rate > 0 && remaining / my_rate * FTP_MULTI_HEDGE_FACTOR < longest) {
+        int twin = ftp_multi_add_range(download, victim->offset, victim->end, worker - download->workers);
+        if (twin < 0) return -1;
+        victim = &download->ranges[index];  // the array may have moved
+        victim->twin = twin;
+        download->ranges[twin].twin = index;
+        download->sources[worker->source].hedges++;
+        return twin;
+    }
+    if (remaining < 2 * FTP_MULTI_MIN_STEAL) return -1;
+
+    double share = my_rate > 0 && owner_rate > 0 ? my_rate / (my_rate + owner_rate) : 0.5;
+    long long split = victim->end - (long long)(remaining * share);
+    split &= ~(long long)(FTP_SPLICE_CHUNK - 1);
+    if (split < victim->offset + FTP_MULTI_MIN_STEAL / 2) split = victim->offset + FTP_MULTI_MIN_STEAL / 2;
+    if (split > victim->end - FTP_MULTI_MIN_STEAL / 2) split = victim->end - FTP_MULTI_MIN_STEAL / 2;
+
+    int stolen = ftp_multi_add_range(download, split, victim->end, worker - download->workers);
+    if (stolen < 0) return -1;
+    download->ranges[index].end = split;
+    download->sources[worker->source].steals++;
+    return stolen;
+}
+
+// Mark a range finished; the caller holds the lock. A twin still racing it
+// has lost: shut its data connection so its worker moves on at once.
+static void ftp_multi_finish_range(FTPMultiDownload *download, int index) {
+    FTPSourceRange *range = &download->ranges[index];
+
+    range->done = 1;
+    if (range->twin >= 0) {
+        FTPSourceRange *twin = &download->ranges[range->twin];
+        if (!twin->done) {
+            twin->done = 1;
+            FTPSourceWorker *loser = &download->workers[twin->owner];
+            if (loser->range == range->twin && loser->client->data_socket >= 0) {
+                shutdown(loser->client->data_socket, SHUT_RDWR);
+            }
+        }
+    }
+    pthread_cond_broadcast(&download->changed);
+}
+
+// Stream one range from offset until its end, which thieves may lower, or
+// until its twin wins. Returns -1 when the mirror failed, 1 when it lost
+// the race (the session is dropped without waiting on the slow server).
+static int ftp_multi_fetch(FTPSourceWorker *worker, int index, long long offset) {
+    FTPMultiDownload *download = worker->download;
+    FTPClient *client = worker->client;
+    const char *path = download->sources[worker->source].location.path;
+    char rest_command[MAX_COMMAND], retr_command[MAX_COMMAND + MAX_PATH], response[MAX_BUFFER];
+
+    // PASV, REST and RETR go out in one write; replies are checked in order
+    snprintf(rest_command, sizeof(rest_command), "REST %lld", offset);
+    snprintf(retr_command, sizeof(retr_command), "RETR %s", path);
+    const char *commands[] = { NULL, rest_command, retr_command };
+    if (ftp_send_passive_pipelined(client, commands, 3, 0) < 0) return -1;
+    int rest_code = recv_ftp_response(client, response, sizeof(response));
+    if (rest_code != 350) fprintf(stderr, "Restart at %lld failed: %s\n", offset, response);
+    int retr_code = recv_ftp_response(client, response, sizeof(response));
+    if (rest_code != 350 || retr_code != 150) {
+        // Without a 350 the RETR would start at 0: drop it before reading any data
+        if (retr_code == 150 || retr_code == 125) {
+            ftp_close_socket(client, &client->data_socket);
+            recv_ftp_response(client, NULL, 0);
+        } else if (rest_code == 350) {
+            fprintf(stderr, "Range retrieval failed: %s\n", response);
+        }
+        return -1;
+    }
+
+    char *buffer = ftp_transfer_buffer(client);
+    size_t size = client->transfer_buffer_size;
+    int status = buffer ? 0 : -1, finished = !buffer, lost = 0;
+    while (!finished) {
+        ssize_t bytes_read = recv(client->data_socket, buffer, size, 0);
+        if (bytes_read < 0 && errno == EINTR) continue;
+
+        pthread_mutex_lock(&download->lock);
+        FTPSourceRange *range = &download->ranges[index];
+        if (range->done) {
+            // The twin won; whatever this read returned is not needed
+            finished = 1;
+            lost = 1;
+        } else if (bytes_read <= 0) {
+            fprintf(stderr, "Mirror %s ended the file at %lld\n", download->sources[worker->source].location.hostname,
+                    offset);
+            status = -1;
+            finished = 1;
+        }
+        long long keep = finished ? 0 : range->end - offset;
+        if (keep > bytes_read) keep = bytes_read;
+        if (bytes_read > 0) {
+            worker->bytes += bytes_read;
+            download->sources[worker->source].bytes += bytes_read;
+        }
+        pthread_mutex_unlock(&download->lock);
+        if (finished) break;
+
+        if (keep > 0 && pwrite_all(download->local_fd, buffer, keep, offset) < 0) {
+            print_error("Failed to write local file");
+            pthread_mutex_lock(&download->lock);
+            download->failed = 1;
+            pthread_cond_broadcast(&download->changed);
+            pthread_mutex_unlock(&download->lock);
+            status = -1;
+            break;
+        }
+        offset += keep;
+
+        pthread_mutex_lock(&download->lock);
+        range = &download->ranges[index];
+        range->offset = offset;
+        if (offset >= range->end && !range->done) ftp_multi_finish_range(download, index);
+        finished = range->done;
+        pthread_mutex_unlock(&download->lock);
+    }
+
+    // The rest of the stream belongs to other ranges: drop the connection.
+    // The server answers 226, or 426/451 for the cut-off transfer.
+    ftp_close_socket(client, &client->data_socket);
+    if (lost) {
+        ftp_close_socket(client, &client->control_socket);
+        client->state = FTP_DISCONNECTED;
+        return 1;
+    }
+    recv_ftp_response(client, NULL, 0);
+    return status;
+}
+
+static void *ftp_multi_worker(void *arg) {
+    FTPSourceWorker *worker = arg;
+    FTPMultiDownload *download = worker->download;
+    FTPSource *source = &download->sources[worker->source];
+    int connected = 1;
+
+    if (worker->client == &worker->own) {
+        connected = ftp_open_session(&worker->own, &source->probe) == 0 && ftp_set_binary_mode(&worker->own) == 0;
+    }
+    // ftp_multi_finish_range shuts the data socket of a losing twin under the lock
+    worker->client->socket_lock = &download->lock;
+
+    pthread_mutex_lock(&download->lock);
+    while (connected && !download->failed) {
+        int index = ftp_multi_claim(download, worker);
+        if (index == -2) break;
+        if (index == -1) {
+            // Wait for a range to finish or grow worth stealing
+            ftp_cond_wait_seconds(&download->changed, &download->lock, 0.1);
+            continue;
+        }
+        worker->range = index;
+        worker->range_started = ftp_now();
+        source->ranges++;
+        long long offset = download->ranges[index].offset;
+        pthread_mutex_unlock(&download->lock);
+
+        int status = ftp_multi_fetch(worker, index, offset);
+
+        pthread_mutex_lock(&download->lock);
+        worker->busy += ftp_now() - worker->range_started;
+        worker->range = -1;
+        if (status > 0) {
+            // Lost a race: the dropped session comes back for the next range
+            pthread_mutex_unlock(&download->lock);
+            connected = ftp_reconnect(worker->client) == 0 && ftp_set_binary_mode(worker->client) == 0;
+            pthread_mutex_lock(&download->lock);
+        }
+        if (status < 0) {
+            // Hand the rest back; a racing twin already covers it
+            FTPSourceRange *range = &download->ranges[index];
+            if (!range->done && range->twin >= 0) {
+                range->done = 1;
+                download->ranges[range->twin].twin = -1;
+            } else if (!range->done) {
+                range->owner = -1;
+            }
+            source->failures++;
+            connected = 0;
+        }
+        pthread_cond_broadcast(&download->changed);
+    }
+    pthread_cond_broadcast(&download->changed);
+    pthread_mutex_unlock(&download->lock);
+
+    worker->client->socket_lock = NULL;
+    if (worker->client == &worker->own) ftp_close_connection(&worker->own);
+    return NULL;
+}
+
+// Download the file the mirrors serve (each source's location.path) into
+// local_file over connections sessions per mirror, in ranges of chunk_size
+// bytes (0 picks a size). Returns the file size, or -1.
+long long ftp_multi_download(FTPSource *sources, int count, const char *local_file, int connections,
+                             long long chunk_size) {
+    FTPMultiDownload download;
+    int failed = 0;
+
+    if (count > FTP_MULTI_MAX_SOURCES) count = FTP_MULTI_MAX_SOURCES;
+    if (connections <= 0) connections = FTP_MULTI_CONNECTIONS;
+    long long size = ftp_multi_check_sources(sources, count);
+    if (size < 0) {
+        fprintf(stderr, "No mirror has %s\n", sources[0].location.path);
+        return -1;
+    }
+
+    memset(&download, 0, sizeof(download));
+    download.sources = sources;
+    download.source_count = count;
+    download.size = size;
+    pthread_mutex_init(&download.lock, NULL);
+    pthread_cond_init(&download.changed, NULL);
+    for (int i = 0; i < count; i++) {
+        for (int c = 0; sources[i].usable && c < connections && download.worker_count < FTP_MULTI_MAX_WORKERS; c++) {
+            FTPSourceWorker *worker = &download.workers[download.worker_count++];
+            worker->download = &download;
+            worker->source = i;
+            worker->range = -1;
+            worker->client = c == 0 ? &sources[i].probe : &worker->own;
+        }
+    }
+
+    // Enough ranges that fast mirrors take more of them before any stealing
+    if (chunk_size <= 0) chunk_size = size / (download.worker_count * FTP_MULTI_CHUNKS_PER_WORKER);
+    if (chunk_size < FTP_MIN_SEGMENT_SIZE) chunk_size = FTP_MIN_SEGMENT_SIZE;
+    for (long long offset = 0; offset < size && !failed; offset += chunk_size) {
+        failed = ftp_multi_add_range(&download, offset, offset + chunk_size < size ? offset + chunk_size : size, -1) < 0;
+    }
+
+    download.local_fd = open(local_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (download.local_fd < 0 || ftruncate(download.local_fd, size) < 0) {
+        print_error("Failed to open local file");
+        failed = 1;
+    }
+    if (!failed) posix_fallocate(download.local_fd, 0, size);
+
+    int running[FTP_MULTI_MAX_WORKERS], started = 0;
+    for (int i = 0; i < download.worker_count; i++) {
+        running[i] = !failed && pthread_create(&download.workers[i].thread, NULL, ftp_multi_worker,
+                                               &download.workers[i]) == 0;
+        started += running[i];
+    }
+    for (int i = 0; i < download.worker_count; i++) {
+        if (running[i]) pthread_join(download.workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < download.range_count; i++) {
+        if (!download.ranges[i].done) failed = 1;
+    }
+    if (download.failed || started == 0) failed = 1;
+    for (int i = 0; i < count; i++) {
+        if (sources[i].usable) ftp_close_connection(&sources[i].probe);
+    }
+    if (download.local_fd >= 0 && close(download.local_fd) < 0) failed = 1;
+    free(download.ranges);
+    pthread_mutex_destroy(&download.lock);
+    pthread_cond_destroy(&download.changed);
+
+    if (failed) {
+        fprintf(stderr, "Multi-mirror download failed: %s\n", local_file);
+        return -1;
+    }
+    return size;
+}
+
+static void ftp_multi_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s multiget [--connections N] [--chunk BYTES] [--quiet] FILE URL URL...\n"
+            "Downloads one file from several mirrors at once; every URL must name the same file.\n"
+            "--connections sets the sessions per mirror (default %d).\n", program, FTP_MULTI_CONNECTIONS);
+}
+
+// "multiget" subcommand
+int ftp_multi_main(int argc, char *argv[]) {
+    FTPSource sources[FTP_MULTI_MAX_SOURCES];
+    const char *local_file = NULL;
+    int count = 0, connections = FTP_MULTI_CONNECTIONS, quiet = 0;
+    long long chunk_size = 0;
+
+    memset(sources, 0, sizeof(sources));
+    for (int i = 2; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(argv[i], "--quiet")) quiet = 1;
+        else if (!strcmp(argv[i], "--connections") && value) {
+            connections = atoi(value);
+            i++;
+        } else if (!strcmp(argv[i], "--chunk") && value) {
+            chunk_size = ftp_parse_byte_count(value);
+            i++;
+        } else if (argv[i][0] == '-') {
+            ftp_multi_usage(argv[0]);
+            return 2;
+        } else if (!local_file) {
+            local_file = argv[i];
+        } else if (count == FTP_MULTI_MAX_SOURCES) {
+            fprintf(stderr, "At most %d mirrors\n", FTP_MULTI_MAX_SOURCES);
+            return 2;
+        } else if (ftp_parse_url(argv[i], &sources[count++].location) < 0) {
+            fprintf(stderr, "Bad URL: %s\n", argv[i]);
+            return 2;
+        }
+    }
+    if (!local_file || count == 0 || connections <= 0 || chunk_size < 0) {
+        ftp_multi_usage(argv[0]);
+        return 2;
+    }
+
+    // A mirror cut off by a race, or gone away, must not kill the whole download
+    signal(SIGPIPE, SIG_IGN);
+
+    double started = ftp_now();
+    long long bytes = ftp_multi_download(sources, count, local_file, connections, chunk_size);
+    double seconds = ftp_now() - started;
+    if (bytes < 0) return 1;
+
+    if (!quiet) {
+        printf("Downloaded %s: %lld bytes in %.2f s (%.1f MB/s)\n", local_file, bytes, seconds,
+               seconds > 0 ? bytes / seconds / 1e6 : 0);
+        for (int i = 0; i < count; i++) {
+            if (!sources[i].usable) continue;
+            printf("  %s:%d: %lld bytes, %d ranges, %d steals, %d hedges, %d failures\n",
+                   sources[i].location.hostname, sources[i].location.port, sources[i].bytes, sources[i].ranges,
+                   sources[i].steals, sources[i].hedges, sources[i].failures);
+        }
+    }
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Remote tree inventory: a breadth-first crawl over several sessions that
+// share one queue of directories, written to a sorted file that answers
+// path and subtree queries through mmap() without the server
+// ---------------------------------------------------------------------------
+
+// Listing entry whose name points into the listing buffer
+typedef struct {
+    const char *name;
+    size_t name_length;
+    FTPEntryType type;
+    long long size;
+    long long mtime;
+} FTPEntryView;
+
+static long long ftp_scan_number(const char *text, size_t length) {
+    long long value = 0;
+
+    for (size_t i = 0; i < length && isdigit((unsigned char)text[i]); i++) value = value * 10 + (text[i] - '0');
+    return value;
+}
+
+// Seconds since the epoch of a UTC civil date, without mktime's locale
+// and time zone work (days_from_civil, H. Hinnant)
+static long long ftp_civil_to_epoch(int year, int month, int day, int hour, int minute, int second) {
+    year -= month <= 2;
+    long long era = (year >= 0 ? year : year - 399) / 400;
+    unsigned year_of_era = (unsigned)(year - era * 400);
+    unsigned day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+    unsigned day_of_era = year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year;
+    long long days = era * 146097 + day_of_era - 719468;
+    return days * 86400 + hour * 3600 + minute * 60 + second;
+}
+
+// "YYYYMMDDHHMMSS[.sss]" as ftp_parse_timestamp, on a counted string
+static long long ftp_scan_timestamp(const char *text, size_t length) {
+    if (length < 14) return 0;
+    for (int i = 0; i < 14; i++) {
+        if (!isdigit((unsigned char)text[i])) return 0;
+    }
+    return ftp_civil_to_epoch(ftp_scan_number(text, 4), ftp_scan_number(text + 4, 2), ftp_scan_number(text + 6, 2),
+                              ftp_scan_number(text + 8, 2), ftp_scan_number(text + 10, 2),
+                              ftp_scan_number(text + 12, 2));
+}
+
+// Scan one MLSD line ("fact=value;...; name") in place, copying and
+// allocating nothing. Returns -1 for lines to skip: cdir, pdir, malformed.
+static int ftp_scan_mlsd_line(const char *line, size_t length, FTPEntryView *view) {
+    const char *space = memchr(line, ' ', length);
+
+    if (!space || space + 1 >= line + length) return -1;
+    view->name = space + 1;
+    view->name_length = line + length - view->name;
+    view->type = FTP_ENTRY_OTHER;
+    view->size = 0;
+    view->mtime = 0;
+
+    for (const char *fact = line; fact < space;) {
+        const char *fact_end = memchr(fact, ';', space - fact);
+        if (!fact_end) fact_end = space;
+        const char *equals = memchr(fact, '=', fact_end - fact);
+        if (equals) {
+            size_t key_length = equals - fact;
+            const char *value = equals + 1;
+            size_t value_length = fact_end - value;
+            if (key_length == 4 && !strncasecmp(fact, "type", 4)) {
+                if (value_length == 4 && !strncasecmp(value, "file", 4)) view->type = FTP_ENTRY_FILE;
+                else if (value_length == 3 && !strncasecmp(value, "dir", 3)) view->type = FTP_ENTRY_DIRECTORY;
+                else if (value_length == 4 && (!strncasecmp(value, "cdir", 4) || !strncasecmp(value, "pdir", 4))) return -1;
+                else if (value_length >= 13 && !strncasecmp(value, "OS.unix=slink", 13)) view->type = FTP_ENTRY_LINK;
+            } else if (key_length == 4 && !strncasecmp(fact, "size", 4)) {
+                view->size = ftp_scan_number(value, value_length);
+            } else if (key_length == 6 && !strncasecmp(fact, "modify", 6)) {
+                view->mtime = ftp_scan_timestamp(value, value_length);
+            }
+        }
+        fact = fact_end + 1;
+    }
+    return 0;
+}
+
+// Records and paths of one directory, or of the whole crawl
+typedef struct {
+    FTPInventoryRecord *records;
+    size_t count;
+    size_t capacity;
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+} FTPInventoryBuilder;
+
+static int ftp_inventory_builder_reserve(FTPInventoryBuilder *builder, size_t records, size_t names) {
+    if (builder->count + records > builder->capacity) {
+        size_t capacity = builder->capacity ? builder->capacity : 1024;
+        while (capacity < builder->count + records) capacity *= 2;
+        FTPInventoryRecord *grown = realloc(builder->records, capacity * sizeof(*grown));
+        if (!grown) return -1;
+        builder->records = grown;
+        builder->capacity = capacity;
+    }
+    if (builder->names_size + names > builder->names_capacity) {
+        size_t capacity = builder->names_capacity ? builder->names_capacity : 64 * 1024;
+        while (capacity < builder->names_size + names) capacity *= 2;
+        char *grown = realloc(builder->names, capacity);
+        if (!grown) return -1;
+        builder->names = grown;
+        builder->names_capacity = capacity;
+    }
+    return 0;
+}
+
+// Add "<directory>/<name>" (just name at the root)
+static int ftp_inventory_builder_add(FTPInventoryBuilder *builder, const char *directory, const FTPEntryView *view) {
+    size_t directory_length = strlen(directory);
+    size_t length = directory_length + (directory_length > 0) + view->name_length;
+
+    if (ftp_inventory_builder_reserve(builder, 1, length + 1) < 0) return -1;
+    FTPInventoryRecord *record = &builder->records[builder->count++];
+    char *path = builder->names + builder->names_size;
+    memset(record, 0, sizeof(*record));
+    record->name_offset = builder->names_size;
+    record->name_length = length;
+    record->type = view->type;
+    record->size = view->size;
+    record->mtime = view->mtime;
+    memcpy(path, directory, directory_length);
+    if (directory_length > 0) path[directory_length] = '/';
+    memcpy(path + length - view->name_length, view->name, view->name_length);
+    path[length] = '\0';
+    builder->names_size += length + 1;
+    return 0;
+}
+
+static void ftp_inventory_builder_free(FTPInventoryBuilder *builder) {
+    free(builder->records);
+    free(builder->names);
+    memset(builder, 0, sizeof(*builder));
+}
+
+// Shared state of a crawl. The queue holds the name offsets of directory
+// records, whose paths are relative to the root.
+typedef struct {
+    const FTPClient *origin;
+    const char *root;
+    int quiet;
+    FTPInventoryBuilder inventory;
+    uint64_t *queue;
+    size_t queue_head;
+    size_t queue_tail;
+    size_t queue_capacity;
+    int busy;              // workers listing a directory, which may queue more
+    int sessions_open;
+    long long directories;
+    long long unreadable;
+    double last_report;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+} FTPCrawl;
+
+// Fetch one directory's listing, reconnecting once if the session dropped.
+// Returns -1 when the server refuses it (5xx), -2 when the session failed.
+static int ftp_crawl_fetch(FTPClient *session, const char *path, int *mlsd, char **data, size_t *length) {
+    char command[MAX_COMMAND + MAX_PATH];
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        if (session->state != FTP_LOGGED_IN && ftp_reconnect(session) < 0) {
+            session->state = FTP_DISCONNECTED;
+            continue;
+        }
+        *mlsd = !session->mlsd_unsupported;
+        snprintf(command, sizeof(command), "%s %s", *mlsd ? "MLSD" : "LIST", path);
+        int response_code = ftp_fetch_listing(session, command, data, length);
+        if (response_code == 226) return 0;
+        if (*mlsd && (response_code == 500 || response_code == 502 || response_code == 504)) {
+            session->mlsd_unsupported = 1;
+            attempt--;
+            continue;
+        }
+        if (response_code >= 500) return -1;  // unreadable, not a broken session
+        session->state = FTP_DISCONNECTED;    // dropped, or a transient 4xx: start afresh
+    }
+    return -2;
+}
+
+// Parse a listing into builder as entries of directory
+static void ftp_crawl_parse(FTPInventoryBuilder *builder, const char *directory, char *data, size_t length, int mlsd) {
+    char *end = data + length;
+
+    for (char *line = data; line < end;) {
+        char *newline = memchr(line, '\n', end - line);
+        char *line_end = newline ? newline : end;
+        size_t line_length = line_end - line;
+        if (line_length > 0 && line[line_length - 1] == '\r') line_length--;
+
+        FTPEntryView view;
+        FTPEntry entry;
+        int parsed = -1;
+        if (mlsd) {
+            parsed = ftp_scan_mlsd_line(line, line_length, &view);
+        } else if (line_length < MAX_BUFFER) {
+            // The LIST parser works in place on a terminated line
+            char copy[MAX_BUFFER];
+            memcpy(copy, line, line_length);
+            copy[line_length] = '\0';
+            if ((parsed = ftp_parse_list_line(copy, &entry)) == 0) {
+                view.name = entry.name;
+                view.name_length = strlen(entry.name);
+                view.type = entry.type;
+                view.size = entry.size;
+                view.mtime = entry.mtime;
+            }
+        }
+        if (parsed == 0 && ftp_safe_entry_name(view.name, view.name_length)) {
+            ftp_inventory_builder_add(builder, directory, &view);
+        }
+        line = line_end + 1;
+    }
+}
+
+// Move one directory's records into the crawl and queue its subdirectories.
+// Called with the lock held.
+static int ftp_crawl_merge(FTPCrawl *crawl, const FTPInventoryBuilder *local) {
+    FTPInventoryBuilder *inventory = &crawl->inventory;
+    size_t base = inventory->names_size, subdirectories = 0;
+
+    for (size_t i = 0; i < local->count; i++) subdirectories += local->records[i].type == FTP_ENTRY_DIRECTORY;
+    if (ftp_inventory_builder_reserve(inventory, local->count, local->names_size) < 0) return -1;
+    if (crawl->queue_tail + subdirectories > crawl->queue_capacity) {
+        size_t capacity = crawl->queue_capacity ? crawl->queue_capacity : 1024;
+        while (capacity < crawl->queue_tail + subdirectories) capacity *= 2;
+        uint64_t *grown = realloc(crawl->queue, capacity * sizeof(*grown));
+        if (!grown) return -1;
+        crawl->queue = grown;
+        crawl->queue_capacity = capacity;
+    }
+
+    memcpy(inventory->names + base, local->names, local->names_size);
+    inventory->names_size += local->names_size;
+    for (size_t i = 0; i < local->count; i++) {
+        FTPInventoryRecord *record = &inventory->records[inventory->count++];
+        *record = local->records[i];
+        record->name_offset += base;
+        if (record->type == FTP_ENTRY_DIRECTORY) crawl->queue[crawl->queue_tail++] = record->name_offset;
+    }
+    return 0;
+}
+
+static void *ftp_crawl_worker(void *arg) {
+    FTPCrawl *crawl = arg;
+    FTPInventoryBuilder local;
+    char directory[MAX_PATH], path[MAX_PATH];
+    FTPClient session;
+
+    memset(&local, 0, sizeof(local));
+    if (ftp_open_session(&session, crawl->origin) < 0) return NULL;
+    session.quiet = 1;
+    session.compress_level = crawl->origin->compress_level;
+    ftp_set_binary_mode(&session);
+
+    pthread_mutex_lock(&crawl->lock);
+    crawl->sessions_open++;
+    while (1) {
+        while (crawl->queue_head == crawl->queue_tail && crawl->busy > 0) {
+            pthread_cond_wait(&crawl->changed, &crawl->lock);
+        }
+        if (crawl->queue_head == crawl->queue_tail) break;  // nothing queued, nobody listing
+
+        uint64_t taken = crawl->queue[crawl->queue_head++];
+        snprintf(directory, sizeof(directory), "%s", crawl->inventory.names + taken);
+        crawl->busy++;
+        pthread_mutex_unlock(&crawl->lock);
+
+        // Paths are relative to the root; "" is the root itself
+        int path_length;
+        if (!directory[0]) path_length = snprintf(path, sizeof(path), "%s", crawl->root);
+        else if (!strcmp(crawl->root, ".")) path_length = snprintf(path, sizeof(path), "%s", directory);
+        else if (!strcmp(crawl->root, "/")) path_length = snprintf(path, sizeof(path), "/%s", directory);
+        else path_length = snprintf(path, sizeof(path), "%s/%s", crawl->root, directory);
+
+        char *data = NULL;
+        size_t length = 0;
+        int mlsd, failed = path_length >= (int)sizeof(path) ? -1
+                                                              : ftp_crawl_fetch(&session, path, &mlsd, &data, &length);
+        local.count = 0;
+        local.names_size = 0;
+        if (!failed) ftp_crawl_parse(&local, directory, data, length, mlsd);
+        free(data);
+
+        pthread_mutex_lock(&crawl->lock);
+        crawl->busy--;
+        if (failed == -2) {
+            // The directory goes back for another session; this one is
+            // done. With none left the crawl ends with it unlisted.
+            fprintf(stderr, "Crawl session lost while listing %s\n", path);
+            crawl->queue[--crawl->queue_head] = taken;
+            break;
+        }
+        crawl->directories++;
+        if (failed) {
+            fprintf(stderr, "Skipping unreadable directory %s\n", path);
+            crawl->unreadable++;
+        } else if (ftp_crawl_merge(crawl, &local) < 0) {
+            fprintf(stderr, "Out of memory for the inventory\n");
+            crawl->unreadable++;
+        }
+        double now = ftp_now();
+        if (!crawl->quiet && now - crawl->last_report >= 1) {
+            crawl->last_report = now;
+            fprintf(stderr, "\r%lld directories, %zu entries, %zu queued", crawl->directories,
+                    crawl->inventory.count, crawl->queue_tail - crawl->queue_head);
+        }
+        pthread_cond_broadcast(&crawl->changed);
+    }
+    pthread_cond_broadcast(&crawl->changed);
+    pthread_mutex_unlock(&crawl->lock);
+
+    ftp_inventory_builder_free(&local);
+    ftp_close_connection(&session);
+    return NULL;
+}
+
+// Sort order of the inventory: byte order of the paths, so that a subtree
+// is one contiguous run of records
+static const char *ftp_inventory_sorting;
+
+static int ftp_inventory_compare(const void *a, const void *b) {
+    return strcmp(ftp_inventory_sorting + ((const FTPInventoryRecord *)a)->name_offset,
+                  ftp_inventory_sorting + ((const FTPInventoryRecord *)b)->name_offset);
+}
+
+// Sort the records and write the inventory file through a temporary file
+static int ftp_inventory_write(FTPInventoryBuilder *inventory, const char *path) {
+    char temp_path[MAX_PATH + 8];
+    FTPInventoryHeader header;
+
+    ftp_inventory_sorting = inventory->names;
+    qsort(inventory->records, inventory->count, sizeof(FTPInventoryRecord), ftp_inventory_compare);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, FTP_INVENTORY_MAGIC, sizeof(header.magic));
+    header.version = FTP_INVENTORY_VERSION;
+    header.record_size = sizeof(FTPInventoryRecord);
+    header.count = inventory->count;
+    header.names_offset = sizeof(header) + inventory->count * sizeof(FTPInventoryRecord);
+    header.names_size = inventory->names_size;
+    header.crawled_at = time(NULL);
+
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+    int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        print_error("Failed to write inventory");
+        return -1;
+    }
+    if (write_all(fd, (const char *)&header, sizeof(header)) < 0 ||
+        write_all(fd, (const char *)inventory->records, inventory->count * sizeof(FTPInventoryRecord)) < 0 ||
+        write_all(fd, inventory->names, inventory->names_size) < 0 || close(fd) < 0) {
+        print_error("Failed to write inventory");
+        unlink(temp_path);
+        return -1;
+    }
+    return rename(temp_path, path);
+}
+
+// Crawl root (relative to origin's directory, or absolute) breadth first
+// with up to sessions logged-in sessions and write the inventory. Returns
+// the number of entries, or -1 when no session could be opened.
+long long ftp_crawl(const FTPClient *origin, const char *root, int sessions, const char *inventory_path, int quiet) {
+    pthread_t workers[FTP_CRAWL_MAX_SESSIONS];
+    FTPCrawl crawl;
+    int started = 0;
+
+    if (sessions < 1) sessions = 1;
+    if (sessions > FTP_CRAWL_MAX_SESSIONS) sessions = FTP_CRAWL_MAX_SESSIONS;
+    memset(&crawl, 0, sizeof(crawl));
+    crawl.origin = origin;
+    crawl.root = root;
+    crawl.quiet = quiet;
+
+    // The root is queued as the empty path at names offset 0
+    if (ftp_inventory_builder_reserve(&crawl.inventory, 0, 1) < 0 ||
+        !(crawl.queue = malloc(sizeof(uint64_t)))) {
+        ftp_inventory_builder_free(&crawl.inventory);
+        return -1;
+    }
+    crawl.inventory.names[0] = '\0';
+    crawl.inventory.names_size = 1;
+    crawl.queue_capacity = 1;
+    crawl.queue[crawl.queue_tail++] = 0;
+    pthread_mutex_init(&crawl.lock, NULL);
+    pthread_cond_init(&crawl.changed, NULL);
+
+    for (; started < sessions; started++) {
+        if (pthread_create(&workers[started], NULL, ftp_crawl_worker, &crawl) != 0) break;
+    }
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+    if (!quiet && crawl.directories) fprintf(stderr, "\n");
+
+    long long entries = crawl.inventory.count;
+    int status = 0;
+    if (crawl.sessions_open == 0) {
+        fprintf(stderr, "Could not open any crawl session\n");
+        status = -1;
+    } else if (crawl.queue_head < crawl.queue_tail) {
+        fprintf(stderr, "Crawl ended with %zu directories unlisted\n", crawl.queue_tail - crawl.queue_head);
+        status = -1;
+    } else if (ftp_inventory_write(&crawl.inventory, inventory_path) < 0) {
+        status = -1;
+    }
+    if (status == 0 && !quiet) {
+        printf("Crawled %lld directories (%lld unreadable) over %d sessions: %lld entries\n", crawl.directories,
+               crawl.unreadable, crawl.sessions_open, entries);
+    }
+
+    ftp_inventory_builder_free(&crawl.inventory);
+    free(crawl.queue);
+    pthread_mutex_destroy(&crawl.lock);
+    pthread_cond_destroy(&crawl.changed);
+    return status < 0 ? -1 : entries;
+}
+
+// Map an inventory file read-only and check its header
+int ftp_inventory_open(FTPInventory *inventory, const char *path) {
+    struct stat st;
+
+    memset(inventory, 0, sizeof(*inventory));
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        print_error("Failed to open inventory");
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(FTPInventoryHeader)) {
+        fprintf(stderr, "%s: not an inventory file\n", path);
+        close(fd);
+        return -1;
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        print_error("Failed to map inventory");
+        return -1;
+    }
+
+    const FTPInventoryHeader *header = map;
+    if (memcmp(header->magic, FTP_INVENTORY_MAGIC, sizeof(header->magic)) ||
+        header->version != FTP_INVENTORY_VERSION || header->record_size != sizeof(FTPInventoryRecord) ||
+        header->count > (uint64_t)st.st_size / sizeof(FTPInventoryRecord) ||
+        header->names_offset != sizeof(*header) + header->count * sizeof(FTPInventoryRecord) ||
+        header->names_offset + header->names_size != (uint64_t)st.st_size) {
+        fprintf(stderr, "%s: not an inventory file, or from another version\n", path);
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    // Every name must lie inside the names block and end in its NUL
+    const FTPInventoryRecord *records = (const FTPInventoryRecord *)(header + 1);
+    const char *names = (const char *)map + header->names_offset;
+    for (uint64_t i = 0; i < header->count; i++) {
+        if (records[i].name_offset >= header->names_size ||
+            records[i].name_length >= header->names_size - records[i].name_offset ||
+            names[records[i].name_offset + records[i].name_length] != '\0') {
+            fprintf(stderr, "%s: corrupt inventory (record %llu)\n", path, (unsigned long long)i);
+            munmap(map, st.st_size);
+            return -1;
+        }
+    }
+    madvise(map, st.st_size, MADV_RANDOM);
+    inventory->map = map;
+    inventory->map_size = st.st_size;
+    inventory->header = header;
+    inventory->records = records;
+    inventory->names = names;
+    return 0;
+}
+
+void ftp_inventory_close(FTPInventory *inventory) {
+    if (inventory->map) munmap(inventory->map, inventory->map_size);
+    memset(inventory, 0, sizeof(*inventory));
+}
+
+static const char *ftp_inventory_path(const FTPInventory *inventory, const FTPInventoryRecord *record) {
+    return inventory->names + record->name_offset;
+}
+
+// Index of the first record whose path is not below path in sort order
+long long ftp_inventory_lower_bound(const FTPInventory *inventory, const char *path) {
+    long long low = 0, high = inventory->header->count;
+
+    while (low < high) {
+        long long middle = low + (high - low) / 2;
+        if (strcmp(ftp_inventory_path(inventory, &inventory->records[middle]), path) < 0) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+const FTPInventoryRecord *ftp_inventory_find(const FTPInventory *inventory, const char *path) {
+    long long index = ftp_inventory_lower_bound(inventory, path);
+
+    if (index < (long long)inventory->header->count &&
+        !strcmp(ftp_inventory_path(inventory, &inventory->records[index]), path)) {
+        return &inventory->records[index];
+    }
+    return NULL;
+}
+
+static void ftp_crawl_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s crawl [--sessions N] [--compress LEVEL] [--quiet] [--listing-cache DIR [--listing-ttl SECONDS]]\n"
+            "                [ftp://][USER[:PASSWORD]@]HOST[:PORT]/PATH INVENTORY\n"
+            "       %s inventory INVENTORY [PATH] [--summary]\n"
+            "crawl lists the tree under PATH (\".\" for the login directory) over N sessions\n"
+            "(default %d) into INVENTORY; with --listing-cache a crawl repeated within the\n"
+            "TTL (default %ds) reuses the listings kept in DIR. inventory prints PATH and\n"
+            "everything below it, or the whole tree, from that file alone.\n",
+            program, program, FTP_CRAWL_SESSIONS, FTP_LISTING_CACHE_TTL);
+}
+
+// "crawl" subcommand
+int ftp_crawl_main(int argc, char *argv[]) {
+    const char *operands[2] = { NULL, NULL };
+    const char *cache_dir = NULL;
+    int operand_count = 0, sessions = FTP_CRAWL_SESSIONS, compress_level = 0, quiet = 0, cache_ttl = 0;
+    FTPLocation location;
+    FTPClient origin;
+    FTPListingCache listing_cache;
+
+    for (int i = 2; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(argv[i], "--quiet")) quiet = 1;
+        else if (!strcmp(argv[i], "--sessions") && value) sessions = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--compress") && value) compress_level = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--listing-cache") && value) cache_dir = argv[++i];
+        else if (!strcmp(argv[i], "--listing-ttl") && value) cache_ttl = atoi(argv[++i]);
+        else if (operand_count < 2 && strncmp(argv[i], "--", 2)) operands[operand_count++] = argv[i];
+        else {
+            ftp_crawl_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (operand_count != 2 || sessions < 1 || ftp_parse_url(operands[0], &location) < 0) {
+        ftp_crawl_usage(argv[0]);
+        return 2;
+    }
+
+    if (cache_dir && ftp_listing_cache_init(&listing_cache, cache_ttl, cache_dir) < 0) return 1;
+
+    signal(SIGPIPE, SIG_IGN);
+    if (ftp_open_location(&origin, &location, 0, 1) < 0) {
+        if (cache_dir) ftp_listing_cache_destroy(&listing_cache);
+        return 1;
+    }
+    origin.compress_level = compress_level;
+    if (cache_dir) origin.listing_cache = &listing_cache;
+
+    double started = ftp_now();
+    long long entries = ftp_crawl(&origin, location.path, sessions, operands[1], quiet);
+    ftp_close_connection(&origin);
+    if (entries >= 0 && !quiet) printf("Wrote %s in %.2f s\n", operands[1], ftp_now() - started);
+    if (cache_dir) {
+        if (!quiet) ftp_listing_cache_print_stats(&listing_cache, stdout);
+        ftp_listing_cache_destroy(&listing_cache);
+    }
+    return entries < 0 ? 1 : 0;
+}
+
+// "inventory" subcommand: queries served from the file alone
+int ftp_inventory_main(int argc, char *argv[]) {
+    static const char types[] = { 'f', 'd', 'l', '?' };
+    const char *file = NULL, *path = NULL;
+    int summary = 0;
+    FTPInventory inventory;
+
+    for (int i = 2; i < argc; i++) {
+        if (!strcmp(argv[i], "--summary")) summary = 1;
+        else if (!file) file = argv[i];
+        else if (!path) path = argv[i];
+        else {
+            ftp_crawl_usage(argv[0]);
+            return 2;
+        }
+    }
+    if (!file) {
+        ftp_crawl_usage(argv[0]);
+        return 2;
+    }
+    if (ftp_inventory_open(&inventory, file) < 0) return 1;
+
+    // PATH itself, then the run of records under "PATH/"
+    char prefix[MAX_PATH + 2] = "";
+    long long first = 0, count = inventory.header->count;
+    const FTPInventoryRecord *self = NULL;
+    if (path && path[0] && strcmp(path, ".")) {
+        size_t length = strlen(path);
+        while (length > 1 && path[length - 1] == '/') length--;
+        snprintf(prefix, sizeof(prefix), "%.*s/", (int)length, path);
+        prefix[length] = '\0';
+        self = ftp_inventory_find(&inventory, prefix);
+        prefix[length] = '/';
+        first = ftp_inventory_lower_bound(&inventory, prefix);
+    }
+    size_t prefix_length = strlen(prefix);
+
+    long long matched = 0, files = 0, directories = 0, bytes = 0;
+    for (long long i = self ? -1 : first; i < count; i = i < 0 ? first : i + 1) {
+        const FTPInventoryRecord *record = i < 0 ? self : &inventory.records[i];
+        const char *name = ftp_inventory_path(&inventory, record);
+        if (i >= 0 && strncmp(name, prefix, prefix_length)) break;
+
+        matched++;
+        if (record->type == FTP_ENTRY_FILE) {
+            files++;
+            bytes += record->size;
+        } else if (record->type == FTP_ENTRY_DIRECTORY) {
+            directories++;
+        }
+        if (!summary) {
+            char stamp[32];
+            time_t mtime = record->mtime;
+            struct tm tm;
+            strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M", gmtime_r(&mtime, &tm));
+            printf("%c %14lld %s %s\n", types[record->type < 4 ? record->type : 3], (long long)record->size, stamp, name);
+        }
+    }
+    if (path && !matched) {
+        fprintf(stderr, "%s: not in the inventory\n", path);
+        ftp_inventory_close(&inventory);
+        return 1;
+    }
+    time_t crawled_at = inventory.header->crawled_at;
+    fprintf(summary ? stdout : stderr, "%lld entries: %lld files (%lld bytes), %lld directories; crawled %s",
+            matched, files, bytes, directories, ctime(&crawled_at));
+    ftp_inventory_close(&inventory);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Loopback benchmark: a stand-in server with synthetic files and a client
+// driver measuring throughput, small-file rate, login latency and CPU cost
+// ---------------------------------------------------------------------------
+
+#define FTP_STANDIN_PATTERN (64 * 1024)
+#define FTP_STANDIN_DATA_TIMEOUT_MS 10000  // wait for a passive data connection
+
+// Content of every synthetic file: byte at offset o is pattern[o % FTP_STANDIN_PATTERN]
+static unsigned char ftp_standin_pattern[FTP_STANDIN_PATTERN];
+static pthread_once_t ftp_standin_pattern_once = PTHREAD_ONCE_INIT;
+
+static void ftp_standin_fill_pattern(void) {
+    unsigned int state = 2463534242u;
+    for (int i = 0; i < FTP_STANDIN_PATTERN; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        ftp_standin_pattern[i] = (unsigned char)state;
+    }
+}
+
+typedef struct {
+    FTPStandInServer *server;
+    int control_socket;
+    int passive_socket;
+    FTPAddress active;              // PORT/EPRT target; length 0 in passive mode
+    long long rest;
+    char input[MAX_BUFFER];
+    size_t input_length;
+    double received_at;             // when the last input bytes arrived
+    double command_at;              // when the command being served arrived
+    double passive_at;              // when the last PASV/EPSV reply went out
+    int mode_z;                     // MODE Z selected; data is a zlib stream
+    int compress_level;             // OPTS MODE Z LEVEL
+    unsigned hash_algorithm;        // OPTS HASH selection, FTP_HASH_*
+    char stored_name[MAX_PATH];     // last STOR of this session and its digests
+    FTPDigest stored;
+} FTPStandInSession;
+
+// Emulated one-way delay: hold output until latency_ms after since, the
+// arrival of the command that caused it. Commands pipelined in one write
+// share the delay, as they would on a real link.
+static void ftp_standin_delay(const FTPStandInSession *session, double since) {
+    double wait = since + session->server->latency_ms / 1000.0 - ftp_now();
+    if (session->server->latency_ms > 0 && wait > 0) usleep((useconds_t)(wait * 1e6));
+}
+
+static int ftp_standin_reply(FTPStandInSession *session, const char *reply) {
+    char line[MAX_BUFFER];
+    int length = snprintf(line, sizeof(line), "%s\r\n", reply);
+
+    ftp_standin_delay(session, session->command_at);
+    return send_all(session->control_socket, line, length);
+}
+
+// Read one command line, without its CRLF. Returns -1 on EOF or error.
+static int ftp_standin_read_line(FTPStandInSession *session, char *line, size_t max_len) {
+    for (;;) {
+        char *end = memchr(session->input, '\n', session->input_length);
+        if (end) {
+            size_t length = end - session->input;
+            size_t copy = length < max_len - 1 ? length : max_len - 1;
+
+            memcpy(line, session->input, copy);
+            line[copy] = '\0';
+            if (copy > 0 && line[copy - 1] == '\r') line[copy - 1] = '\0';
+            session->input_length -= length + 1;
+            memmove(session->input, end + 1, session->input_length);
+            session->command_at = session->received_at;
+            return 0;
+        }
+        if (session->input_length == sizeof(session->input)) session->input_length = 0;  // overlong line
+
+        ssize_t n = recv(session->control_socket, session->input + session->input_length,
+                         sizeof(session->input) - session->input_length, 0);
+        if (n <= 0) return -1;
+        session->input_length += n;
+        session->received_at = ftp_now();
+    }
+}
+
+// Size of a synthetic file, or -1 if the name is not one of ours
+static long long ftp_standin_file_size(const FTPStandInServer *server, const char *path) {
+    const char *name = strrchr(path, '/');
+    int index;
+    char extra;
+
+    name = name ? name + 1 : path;
+    if (sscanf(name, "big%d%c", &index, &extra) == 1 && index >= 0 && index < server->file_count) {
+        return server->file_size;
+    }
+    if (sscanf(name, "small%d%c", &index, &extra) == 1 && index >= 0 && index < server->small_count) {
+        return server->small_size;
+    }
+    return -1;
+}
+
+// Open the data connection: connect out to the PORT/EPRT address, or accept
+// the one the client opened after PASV/EPSV (giving up after a while, as a
+// real server does, so an abandoned transfer cannot wedge the session)
+static int ftp_standin_accept_data(FTPStandInSession *session) {
+    int data_socket = -1;
+
+    if (session->active.length > 0) {
+        data_socket = socket(session->active.address.ss_family, SOCK_STREAM, 0);
+        if (data_socket >= 0 &&
+            connect(data_socket, (const struct sockaddr *)&session->active.address, session->active.length) < 0) {
+            close(data_socket);
+            data_socket = -1;
+        }
+        session->active.length = 0;
+        if (data_socket >= 0) ftp_standin_delay(session, session->command_at);
+        return data_socket;
+    }
+    if (session->passive_socket < 0) return -1;
+
+    struct pollfd listener = { session->passive_socket, POLLIN, 0 };
+    if (poll(&listener, 1, FTP_STANDIN_DATA_TIMEOUT_MS) > 0) data_socket = accept(session->passive_socket, NULL, NULL);
+    close(session->passive_socket);
+    session->passive_socket = -1;
+    // The client connects once it has the passive reply: the handshake costs one more delay
+    if (data_socket >= 0) {
+        ftp_standin_delay(session, session->command_at > session->passive_at ? session->command_at : session->passive_at);
+    }
+    return data_socket;
+}
+
+// PORT h1,h2,h3,h4,p1,p2 or EPRT |proto|address|port| (RFC 2428): the next
+// transfer connects out to that address, which need not be the client's
+static void ftp_standin_port(FTPStandInSession *session, const char *argument, int extended) {
+    FTPAddress *active = &session->active;
+    int h1, h2, h3, h4, p1, p2, port, family;
+    char host[INET6_ADDRSTRLEN];
+
+    memset(active, 0, sizeof(*active));
+    if (!extended) {
+        if (sscanf(argument, "%d,%d,%d,%d,%d,%d", &h1, &h2, &h3, &h4, &p1, &p2) != 6 ||
+            (h1 | h2 | h3 | h4 | p1 | p2) & ~0xff) {
+            ftp_standin_reply(session, "501 Bad PORT argument");
+            return;
+        }
+        snprintf(host, sizeof(host), "%d.%d.%d.%d", h1, h2, h3, h4);
+        family = 1;
+        port = p1 * 256 + p2;
+    } else {
+        char delimiter = argument[0];
+        char format[32];
+        snprintf(format, sizeof(format), "%%d%c%%45[^%c]%c%%d%c", delimiter, delimiter, delimiter, delimiter);
+        if (!delimiter || sscanf(argument + 1, format, &family, host, &port) != 3 || (family != 1 && family != 2)) {
+            ftp_standin_reply(session, "501 Bad EPRT argument");
+            return;
+        }
+    }
+
+    struct sockaddr_in *ipv4 = (struct sockaddr_in *)&active->address;
+    struct sockaddr_in6 *ipv6 = (struct sockaddr_in6 *)&active->address;
+    int parsed = family == 1 ? inet_pton(AF_INET, host, &ipv4->sin_addr) : inet_pton(AF_INET6, host, &ipv6->sin6_addr);
+    if (parsed != 1 || port <= 0 || port > 65535) {
+        memset(active, 0, sizeof(*active));
+        ftp_standin_reply(session, "501 Bad address");
+        return;
+    }
+    if (family == 1) {
+        ipv4->sin_family = AF_INET;
+        ipv4->sin_port = htons(port);
+        active->length = sizeof(*ipv4);
+    } else {
+        ipv6->sin6_family = AF_INET6;
+        ipv6->sin6_port = htons(port);
+        active->length = sizeof(*ipv6);
+    }
+
+    // Active and passive mode replace each other
+    if (session->passive_socket >= 0) close(session->passive_socket);
+    session->passive_socket = -1;
+    ftp_standin_reply(session, extended ? "200 EPRT command successful" : "200 PORT command successful");
+}
+
+static void ftp_standin_passive(FTPStandInSession *session, int extended) {
+    struct sockaddr_in address;
+    socklen_t address_length = sizeof(address);
+    char reply[MAX_COMMAND];
+
+    if (session->passive_socket >= 0) close(session->passive_socket);
+    session->active.length = 0;
+    session->passive_socket = socket(AF_INET, SOCK_STREAM, 0);
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (session->passive_socket < 0 ||
+        bind(session->passive_socket, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(session->passive_socket, 1) < 0 ||
+        getsockname(session->passive_socket, (struct sockaddr *)&address, &address_length) < 0) {
+        ftp_standin_reply(session, "425 Cannot open passive connection");
+        return;
+    }
+
+    int port = ntohs(address.sin_port);
+    if (extended) snprintf(reply, sizeof(reply), "229 Entering Extended Passive Mode (|||%d|)", port);
+    else snprintf(reply, sizeof(reply), "227 Entering Passive Mode (127,0,0,1,%d,%d)", port >> 8, port & 0xff);
+    ftp_standin_reply(session, reply);
+    session->passive_at = ftp_now();
+}
+
+// Hold a download while the server's send rate is used up
+static void ftp_standin_throttle(FTPStandInServer *server, size_t length) {
+    if (server->send_rate <= 0) return;
+
+    pthread_mutex_lock(&server->send_lock);
+    ftp_bucket_refill(&server->send_bucket, ftp_now());
+    server->send_bucket.tokens -= length;
+    double wait = ftp_bucket_delay(&server->send_bucket);
+    pthread_mutex_unlock(&server->send_lock);
+    if (wait > 0) usleep((useconds_t)(wait * 1e6));
+}
+
+// Sending side of a stand-in data connection, deflating in MODE Z
+typedef struct {
+    int socket;
+    int compressed;
+    z_stream stream;
+} FTPStandInData;
+
+static int ftp_standin_data_send_flush(FTPStandInData *data, const char *bytes, size_t length, int flush) {
+    char wire[FTP_SPLICE_CHUNK];
+
+    if (!data->compressed) return length > 0 ? send_all(data->socket, bytes, length) : 0;
+    data->stream.next_in = (Bytef *)bytes;
+    data->stream.avail_in = length;
+    do {
+        data->stream.next_out = (Bytef *)wire;
+        data->stream.avail_out = sizeof(wire);
+        deflate(&data->stream, flush);
+        size_t produced = sizeof(wire) - data->stream.avail_out;
+        if (produced > 0 && send_all(data->socket, wire, produced) < 0) return -1;
+    } while (data->stream.avail_out == 0);
+    return 0;
+}
+
+static int ftp_standin_data_open(FTPStandInSession *session, FTPStandInData *data) {
+    memset(data, 0, sizeof(*data));
+    if ((data->socket = ftp_standin_accept_data(session)) < 0) return -1;
+    data->compressed = session->mode_z && deflateInit(&data->stream, session->compress_level) == Z_OK;
+    return 0;
+}
+
+static int ftp_standin_data_send(FTPStandInData *data, const char *bytes, size_t length) {
+    return ftp_standin_data_send_flush(data, bytes, length, Z_NO_FLUSH);
+}
+
+// Finish the zlib stream unless the transfer already failed, then close
+static int ftp_standin_data_close(FTPStandInData *data, int failed) {
+    if (data->compressed) {
+        if (!failed && ftp_standin_data_send_flush(data, NULL, 0, Z_FINISH) < 0) failed = 1;
+        deflateEnd(&data->stream);
+    }
+    close(data->socket);
+    return failed ? -1 : 0;
+}
+
+// Hold a stalled data connection open, sending nothing, until the client closes it
+static void ftp_standin_wait_close(FTPStandInData *data, FTPStandInServer *server) {
+    struct pollfd peer = { data->socket, POLLIN, 0 };
+    char discard[256];
+
+    while (!server->stopping) {
+        int ready = poll(&peer, 1, 100);
+        if (ready < 0 && errno != EINTR) break;
+        if (ready > 0 && recv(data->socket, discard, sizeof(discard), 0) <= 0) break;
+    }
+}
+
+static void ftp_standin_retrieve(FTPStandInSession *session, const char *argument) {
+    long long size = ftp_standin_file_size(session->server, argument);
+    long long offset = session->rest;
+
+    session->rest = 0;
+    if (size < 0) {
+        ftp_standin_reply(session, "550 No such file");
+        return;
+    }
+    char reply[MAX_COMMAND];
+    snprintf(reply, sizeof(reply), "150 Opening BINARY mode data connection for %s (%lld bytes)", argument, size);
+    ftp_standin_reply(session, reply);
+
+    FTPStandInData data;
+    if (ftp_standin_data_open(session, &data) < 0) {
+        ftp_standin_reply(session, "425 No data connection");
+        return;
+    }
+
+    // A stalled download goes quiet part way, like a wedged mirror, until the client gives up
+    long long stall_at = -1;
+    FTPStandInServer *server = session->server;
+    if (server->stall_after > 0 && random() % 100 < server->stall_percent) stall_at = offset + server->stall_after;
+
+    int failed = 0;
+    while (offset < size) {
+        size_t start = offset % FTP_STANDIN_PATTERN;
+        size_t chunk = FTP_STANDIN_PATTERN - start;
+        if ((long long)chunk > size - offset) chunk = size - offset;
+        if (stall_at >= 0 && offset + (long long)chunk > stall_at) chunk = stall_at - offset;
+        if (chunk == 0) {
+            ftp_standin_wait_close(&data, server);
+            failed = 1;
+            break;
+        }
+
+        if (ftp_standin_data_send(&data, (const char *)ftp_standin_pattern + start, chunk) < 0) {
+            failed = 1;
+            break;
+        }
+        offset += chunk;
+        ftp_standin_throttle(session->server, chunk);
+    }
+    failed = ftp_standin_data_close(&data, failed) < 0;
+    ftp_standin_reply(session, failed ? "426 Connection closed; transfer aborted" : "226 Transfer complete");
+}
+
+// Uploads are discarded; with hash_uploads the last one is hashed for HASH/XCRC/XMD5
+static void ftp_standin_store(FTPStandInSession *session, const char *argument) {
+    int hashing = session->server->hash_uploads;
+    char buffer[FTP_SPLICE_CHUNK], plain[FTP_SPLICE_CHUNK];
+    int status = Z_OK;
+    z_stream stream;
+    ssize_t bytes_read;
+
+    session->rest = 0;
+    ftp_standin_reply(session, "150 Ok to send data");
+
+    int data_socket = ftp_standin_accept_data(session);
+    if (data_socket < 0) {
+        ftp_standin_reply(session, "425 No data connection");
+        return;
+    }
+    snprintf(session->stored_name, sizeof(session->stored_name), "%s", hashing ? argument : "");
+    ftp_digest_final(&session->stored);
+    ftp_digest_init(&session->stored, hashing ? FTP_HASH_SHA256 | FTP_HASH_MD5 | FTP_HASH_CRC32 : 0);
+    memset(&stream, 0, sizeof(stream));
+    int compressed = session->mode_z && inflateInit(&stream) == Z_OK;
+    while ((bytes_read = recv(data_socket, buffer, sizeof(buffer), 0)) > 0) {
+        if (!compressed) {
+            if (hashing) ftp_digest_update(&session->stored, buffer, bytes_read);
+            continue;
+        }
+        stream.next_in = (Bytef *)buffer;
+        stream.avail_in = bytes_read;
+        do {
+            stream.next_out = (Bytef *)plain;
+            stream.avail_out = sizeof(plain);
+            status = inflate(&stream, Z_NO_FLUSH);
+            if (hashing) ftp_digest_update(&session->stored, plain, sizeof(plain) - stream.avail_out);
+        } while (status == Z_OK && (stream.avail_in > 0 || stream.avail_out == 0));
+    }
+    ftp_digest_final(&session->stored);
+    close(data_socket);
+    if (compressed) inflateEnd(&stream);
+    ftp_standin_reply(session, compressed && status != Z_STREAM_END ? "451 Bad compressed data" : "226 Transfer complete");
+}
+
+// HASH (draft-bryan-ftpext-hash), XCRC and XMD5 of a synthetic or just-stored file
+static void ftp_standin_hash(FTPStandInSession *session, const char *command, const char *argument) {
+    unsigned algorithm = !strcasecmp(command, "XCRC") ? FTP_HASH_CRC32 :
+                         !strcasecmp(command, "XMD5") ? FTP_HASH_MD5 : session->hash_algorithm;
+    FTPDigest digest, *source = &digest;
+    char reply[MAX_COMMAND + MAX_PATH];
+    long long size;
+
+    if (session->stored_name[0] && !strcmp(argument, session->stored_name)) {
+        source = &session->stored;
+        size = session->stored.bytes;
+    } else {
+        if ((size = ftp_standin_file_size(session->server, argument)) < 0) {
+            ftp_standin_reply(session, "550 No such file");
+            return;
+        }
+        ftp_digest_init(&digest, algorithm);
+        for (long long offset = 0; offset < size; offset += FTP_STANDIN_PATTERN) {
+            ftp_digest_update(&digest, ftp_standin_pattern,
+                              size - offset < FTP_STANDIN_PATTERN ? (size_t)(size - offset) : FTP_STANDIN_PATTERN);
+        }
+        ftp_digest_final(&digest);
+    }
+
+    const char *hex = algorithm == FTP_HASH_SHA256 ? source->sha256_hex :
+                      algorithm == FTP_HASH_MD5 ? source->md5_hex : source->crc32_hex;
+    if (!strcasecmp(command, "HASH")) {
+        const char *name = algorithm == FTP_HASH_SHA256 ? "SHA-256" : algorithm == FTP_HASH_MD5 ? "MD5" : "CRC32";
+        snprintf(reply, sizeof(reply), "213 %s 0-%lld %s %s", name, size > 0 ? size - 1 : 0, hex, argument);
+    } else {
+        snprintf(reply, sizeof(reply), "250 %s", hex);
+    }
+    ftp_standin_reply(session, reply);
+}
+
+static void ftp_standin_list(FTPStandInSession *session, int machine) {
+    const FTPStandInServer *server = session->server;
+    char line[MAX_COMMAND];
+
+    ftp_standin_reply(session, "150 Here comes the directory listing");
+
+    FTPStandInData data;
+    int failed = 0;
+    if (ftp_standin_data_open(session, &data) < 0) {
+        ftp_standin_reply(session, "425 No data connection");
+        return;
+    }
+    for (int i = 0; i < server->file_count + server->small_count; i++) {
+        int big = i < server->file_count;
+        int index = big ? i : i - server->file_count;
+        long long size = big ? server->file_size : server->small_size;
+        int length;
+
+        if (machine) {
+            length = snprintf(line, sizeof(line), "type=file;size=%lld;modify=20240101000000; %s%d\r\n",
+                              size, big ? "big" : "small", index);
+        } else {
+            length = snprintf(line, sizeof(line), "-rw-r--r--    1 0        0        %10lld Jan 01  2024 %s%d\r\n",
+                              size, big ? "big" : "small", index);
+        }
+        if (ftp_standin_data_send(&data, line, length) < 0) {
+            failed = 1;
+            break;
+        }
+    }
+    failed = ftp_standin_data_close(&data, failed) < 0;
+    ftp_standin_reply(session, failed ? "426 Connection closed; transfer aborted" : "226 Directory send OK");
 }
 
-// Upload file
-int ftp_upload_file(FTPClient *client, const char *local_file, const char *remote_file) {
-    char response[MAX_BUFFER];
-    char command[MAX_COMMAND];
-    FILE *local_fp;
-    
-    // Enter passive mode
-    if (ftp_enter_passive_mode(client) < 0) return -1;
-    
-    // Open local file
-    local_fp = fopen(local_file, "rb");
-    if (!local_fp) {
-        print_error("Failed to open local file");
-        return -1;
+// Serve one control connection until QUIT or disconnect
+static void *ftp_standin_session(void *arg) {
+    FTPStandInSession *session = arg;
+    char line[MAX_BUFFER], reply[MAX_COMMAND];
+
+    ftp_standin_reply(session, "220 Stand-in FTP server ready");
+
+    while (ftp_standin_read_line(session, line, sizeof(line)) == 0) {
+        char *argument = strchr(line, ' ');
+        if (argument) *argument++ = '\0';
+        else argument = "";
+
+        if (!strcasecmp(line, "USER")) ftp_standin_reply(session, "331 Please specify the password");
+        else if (!strcasecmp(line, "PASS")) ftp_standin_reply(session, "230 Login successful");
+        else if (!strcasecmp(line, "SYST")) ftp_standin_reply(session, "215 UNIX Type: L8");
+        else if (!strcasecmp(line, "FEAT")) {
+            ftp_standin_reply(session, "211-Features:\r\n EPSV\r\n HASH SHA-256*;MD5;CRC32\r\n MDTM\r\n MLSD\r\n"
+                                       " MODE Z\r\n REST STREAM\r\n SIZE\r\n XCRC\r\n XMD5\r\n211 End");
+        } else if (!strcasecmp(line, "OPTS") && !strncasecmp(argument, "HASH ", 5)) {
+            const char *name = argument + 5;
+            if (!strcasecmp(name, "SHA-256")) session->hash_algorithm = FTP_HASH_SHA256;
+            else if (!strcasecmp(name, "MD5")) session->hash_algorithm = FTP_HASH_MD5;
+            else if (!strcasecmp(name, "CRC32")) session->hash_algorithm = FTP_HASH_CRC32;
+            else {
+                ftp_standin_reply(session, "501 Unknown algorithm");
+                continue;
+            }
+            snprintf(reply, sizeof(reply), "200 %s", name);
+            ftp_standin_reply(session, reply);
+        } else if (!strcasecmp(line, "OPTS") && !strncasecmp(argument, "MODE Z LEVEL ", 13)) {
+            int level = atoi(argument + 13);
+            if (level < 1 || level > 9) ftp_standin_reply(session, "501 Bad level");
+            else {
+                session->compress_level = level;
+                ftp_standin_reply(session, "200 MODE Z LEVEL set");
+            }
+        } else if (!strcasecmp(line, "MODE")) {
+            if (!strcasecmp(argument, "Z")) session->mode_z = 1;
+            else if (!strcasecmp(argument, "S")) session->mode_z = 0;
+            else {
+                ftp_standin_reply(session, "504 Unsupported mode");
+                continue;
+            }
+            ftp_standin_reply(session, "200 Mode set");
+        } else if (!strcasecmp(line, "HASH") || !strcasecmp(line, "XCRC") || !strcasecmp(line, "XMD5")) {
+            ftp_standin_hash(session, line, argument);
+        } else if (!strcasecmp(line, "TYPE") || !strcasecmp(line, "STRU") ||
+                   !strcasecmp(line, "NOOP") || !strcasecmp(line, "OPTS")) {
+            ftp_standin_reply(session, "200 Ok");
+        } else if (!strcasecmp(line, "PWD")) ftp_standin_reply(session, "257 \"/\" is the current directory");
+        else if (!strcasecmp(line, "CWD") || !strcasecmp(line, "CDUP")) ftp_standin_reply(session, "250 Directory successfully changed");
+        else if (!strcasecmp(line, "SIZE")) {
+            long long size = session->stored_name[0] && !strcmp(argument, session->stored_name)
+                             ? session->stored.bytes : ftp_standin_file_size(session->server, argument);
+            if (size < 0) ftp_standin_reply(session, "550 Could not get file size");
+            else {
+                snprintf(reply, sizeof(reply), "213 %lld", size);
+                ftp_standin_reply(session, reply);
+            }
+        } else if (!strcasecmp(line, "MDTM")) {
+            if (ftp_standin_file_size(session->server, argument) < 0) ftp_standin_reply(session, "550 Could not get file modification time");
+            else ftp_standin_reply(session, "213 20240101000000");
+        } else if (!strcasecmp(line, "REST")) {
+            session->rest = atoll(argument);
+            ftp_standin_reply(session, "350 Restart position accepted");
+        } else if (!strcasecmp(line, "PASV")) ftp_standin_passive(session, 0);
+        else if (!strcasecmp(line, "EPSV")) ftp_standin_passive(session, 1);
+        else if (!strcasecmp(line, "PORT")) ftp_standin_port(session, argument, 0);
+        else if (!strcasecmp(line, "EPRT")) ftp_standin_port(session, argument, 1);
+        else if (!strcasecmp(line, "ABOR")) ftp_standin_reply(session, "225 No transfer to abort");
+        else if (!strcasecmp(line, "RETR")) ftp_standin_retrieve(session, argument);
+        else if (!strcasecmp(line, "STOR") || !strcasecmp(line, "APPE")) ftp_standin_store(session, argument);
+        else if (!strcasecmp(line, "LIST") || !strcasecmp(line, "NLST")) ftp_standin_list(session, 0);
+        else if (!strcasecmp(line, "MLSD")) ftp_standin_list(session, 1);
+        else if (!strcasecmp(line, "MKD")) ftp_standin_reply(session, "257 Directory created");
+        else if (!strcasecmp(line, "DELE") || !strcasecmp(line, "RMD") || !strcasecmp(line, "RNTO")) ftp_standin_reply(session, "250 Ok");
+        else if (!strcasecmp(line, "RNFR")) ftp_standin_reply(session, "350 Ready for RNTO");
+        else if (!strcasecmp(line, "QUIT")) {
+            ftp_standin_reply(session, "221 Goodbye");
+            break;
+        } else ftp_standin_reply(session, "502 Command not implemented");
     }
-    
-    // Send STOR command
-    snprintf(command, sizeof(command), "STOR %s", remote_file);
-    if (send_ftp_command(client, command) < 0) {
-        fclose(local_fp);
-        return -1;
+
+    if (session->passive_socket >= 0) close(session->passive_socket);
+    close(session->control_socket);
+    ftp_digest_final(&session->stored);
+    free(session);
+    return NULL;
+}
+
+static void *ftp_standin_accept_loop(void *arg) {
+    FTPStandInServer *server = arg;
+
+    for (;;) {
+        int control_socket = accept(server->listen_socket, NULL, NULL);
+        if (server->stopping) {
+            if (control_socket >= 0) close(control_socket);
+            break;
+        }
+        if (control_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            break;
+        }
+
+        FTPStandInSession *session = calloc(1, sizeof(*session));
+        pthread_t thread;
+        pthread_attr_t attributes;
+        int nodelay = 1;
+
+        if (!session) {
+            close(control_socket);
+            continue;
+        }
+        session->server = server;
+        session->control_socket = control_socket;
+        session->passive_socket = -1;
+        session->hash_algorithm = FTP_HASH_SHA256;
+        session->compress_level = Z_DEFAULT_COMPRESSION;
+        // Like real servers: back-to-back replies must not wait on delayed ACKs
+        setsockopt(control_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+        pthread_attr_init(&attributes);
+        pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attributes, ftp_standin_session, session) != 0) {
+            close(control_socket);
+            free(session);
+        }
+        pthread_attr_destroy(&attributes);
     }
-    
-    // Initial response
-    int response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 150) {
-        fprintf(stderr, "File upload failed: %s\n", response);
-        fclose(local_fp);
-        close(client->data_socket);
+    return NULL;
+}
+
+// Listen on 127.0.0.1:port (0 picks a free port, stored in server->port) and
+// serve in the background. Sizes, counts and latency must be set beforehand.
+int ftp_standin_start(FTPStandInServer *server, int port) {
+    struct sockaddr_in address;
+    socklen_t address_length = sizeof(address);
+    int reuse = 1;
+
+    pthread_once(&ftp_standin_pattern_once, ftp_standin_fill_pattern);
+    server->stopping = 0;
+    pthread_mutex_init(&server->send_lock, NULL);
+    memset(&server->send_bucket, 0, sizeof(server->send_bucket));
+    ftp_bucket_set_rate(&server->send_bucket, server->send_rate, ftp_now());
+
+    server->listen_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listen_socket < 0) {
+        print_error("Stand-in server socket creation failed");
         return -1;
     }
-    
-    // Upload file
-    char data_buffer[MAX_BUFFER];
-    size_t bytes_read;
-    while ((bytes_read = fread(data_buffer, 1, sizeof(data_buffer), local_fp)) > 0) {
-        send(client->data_socket, data_buffer, bytes_read, 0);
+    setsockopt(server->listen_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if (bind(server->listen_socket, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(server->listen_socket, 128) < 0 ||
+        getsockname(server->listen_socket, (struct sockaddr *)&address, &address_length) < 0) {
+        print_error("Stand-in server bind failed");
+        close(server->listen_socket);
+        return -1;
     }
-    
-    // Close file and data connection
-    fclose(local_fp);
-    close(client->data_socket);
+    server->port = ntohs(address.sin_port);
 
-    // Final response
-    response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 226) {
-        fprintf(stderr, "File upload incomplete: %s\n",response);
+    if (pthread_create(&server->thread, NULL, ftp_standin_accept_loop, server) != 0) {
+        fprintf(stderr, "Failed to start stand-in server thread\n");
+        close(server->listen_socket);
         return -1;
     }
-    
-    printf("File uploaded successfully: %s\n", local_file);
     return 0;
 }
 
-// Create remote directory
-int ftp_make_remote_directory(FTPClient *client, const char *path) {
-    char command[MAX_COMMAND];
-    char response[MAX_BUFFER];
-    
-    snprintf(command, sizeof(command), "MKD %s", path);
-    if (send_ftp_command(client, command) < 0) return -1;
-    
-    int response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 257) {
-        fprintf(stderr, "Create directory failed: %s\n", response);
+// Stop accepting connections; sessions already running finish on their own
+void ftp_standin_stop(FTPStandInServer *server) {
+    server->stopping = 1;
+    shutdown(server->listen_socket, SHUT_RDWR);
+    pthread_join(server->thread, NULL);
+    close(server->listen_socket);
+}
+
+// CPU time (user + system) consumed by the calling thread, in seconds
+static double ftp_thread_cpu_seconds(void) {
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_THREAD, &usage) < 0) return 0;
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 +
+           usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+// Open a logged-in, binary-mode session to the stand-in server
+static int ftp_bench_session(FTPClient *client, const FTPStandInServer *server, const FTPBenchOptions *options) {
+    memset(client, 0, sizeof(*client));
+    client->control_socket = -1;
+    client->data_socket = -1;
+    client->prepared_socket = -1;
+    client->server_port = server->port;
+    client->data_path = options->data_path;
+    client->tuning = options->tuning;
+    client->verify = options->verify;
+    client->compress_level = options->compress_level;
+    client->quiet = 1;
+
+    if (ftp_connect(client, "127.0.0.1") < 0) return -1;
+    if (ftp_login(client, "bench", "bench") < 0 || ftp_set_binary_mode(client) < 0) {
+        ftp_close_connection(client);
         return -1;
     }
-    
-    printf("Directory created: %s\n", path);
     return 0;
 }
 
-// Remove remote file
-int ftp_remove_remote_file(FTPClient *client, const char *filename) {
-    char command[MAX_COMMAND];
-    char response[MAX_BUFFER];
-    
-    snprintf(command, sizeof(command), "DELE %s", filename);
-    if (send_ftp_command(client, command) < 0) return -1;
-    
-    int response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 250) {
-        fprintf(stderr, "File deletion failed: %s\n", response);
+// Create a temporary file of size bytes to upload from, or to download into
+static int ftp_bench_temp_file(char *path, size_t max_len, long long size) {
+    const char *directory = getenv("TMPDIR");
+
+    snprintf(path, max_len, "%s/ftpbench-XXXXXX", directory && directory[0] ? directory : "/tmp");
+    int fd = mkstemp(path);
+    if (fd < 0) {
+        print_error("Failed to create benchmark file");
         return -1;
     }
-    
-    printf("File deleted: %s\n", filename);
+    for (long long offset = 0; offset < size; offset += FTP_STANDIN_PATTERN) {
+        size_t chunk = size - offset < FTP_STANDIN_PATTERN ? size - offset : FTP_STANDIN_PATTERN;
+        if (write_all(fd, (const char *)ftp_standin_pattern, chunk) < 0) {
+            print_error("Failed to write benchmark file");
+            close(fd);
+            unlink(path);
+            return -1;
+        }
+    }
+    close(fd);
     return 0;
 }
 
-// Rename remote file
-int ftp_rename_remote_file(FTPClient *client, const char *old_name, const char *new_name) {
-    char command[MAX_COMMAND];
-    char response[MAX_BUFFER];
-    
-    // Send RNFR (Rename From) command
-    snprintf(command, sizeof(command), "RNFR %s", old_name);
-    if (send_ftp_command(client, command) < 0) return -1;
-    
-    int response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 350) {
-        fprintf(stderr, "Rename preparation failed: %s\n", response);
+// Run the full suite against a private stand-in server and print the results.
+// Client CPU is measured on this thread only, so the server's cost is excluded.
+int ftp_benchmark_run(const FTPBenchOptions *options) {
+    FTPStandInServer server;
+    FTPClient client;
+    FTPMetrics metrics;
+    FTPShaper shaper;
+    char source_path[MAX_PATH], target_path[MAX_PATH] = "", remote_file[MAX_COMMAND];
+    const char *target = options->download_path ? options->download_path : "/dev/null";
+    FTPDataPath download_data_path = options->data_path;
+    double *login_ms = NULL;
+    int status = -1;
+
+    double download_best = 0, download_total_seconds = 0, download_cpu = 0;
+    double upload_best = 0, upload_total_seconds = 0, upload_cpu = 0;
+    double small_ops = 0, small_prepared_ops = 0, login_mean = 0, login_p50 = 0, login_p99 = 0;
+    long long download_bytes = 0, upload_bytes = 0;
+    FTPCompression download_compression = {0}, upload_compression = {0};
+
+    memset(&client, 0, sizeof(client));
+    client.tuning = options->tuning;
+    memset(&server, 0, sizeof(server));
+    server.file_size = options->file_size;
+    server.file_count = 1;
+    server.small_size = options->small_size;
+    server.small_count = options->small_count;
+    server.latency_ms = options->latency_ms;
+    server.hash_uploads = options->verify;
+    if (ftp_shaper_init(&shaper, options->rate) < 0) return -1;
+    if (ftp_standin_start(&server, 0) < 0) {
+        ftp_shaper_destroy(&shaper);
         return -1;
     }
-    
-    // Send RNTO (Rename To) command
-    snprintf(command, sizeof(command), "RNTO %s", new_name);
-    if (send_ftp_command(client, command) < 0) return -1;
-    
-    response_code = recv_ftp_response(client, response, sizeof(response));
-    if (response_code != 250) {
-        fprintf(stderr, "File rename failed: %s\n", response);
-        return -1;
+
+    printf("Benchmark: stand-in server on 127.0.0.1:%d, %s data path, %zu byte buffer, %d ms added latency\n",
+           server.port, ftp_data_path_name(options->data_path), ftp_transfer_buffer_size(&client), options->latency_ms);
+
+    // Login latency: connect, banner, USER/PASS, per fresh session
+    login_ms = calloc(options->logins > 0 ? options->logins : 1, sizeof(double));
+    if (!login_ms) goto done;
+    for (int i = 0; i < options->logins; i++) {
+        double started = ftp_now();
+
+        if (ftp_bench_session(&client, &server, options) < 0) {
+            fprintf(stderr, "Benchmark login %d failed\n", i);
+            goto done;
+        }
+        login_ms[i] = (ftp_now() - started) * 1000;
+        login_mean += login_ms[i] / options->logins;
+        ftp_close_connection(&client);
     }
-    
-    printf("File renamed from %s to %s\n", old_name, new_name);
-    return 0;
+    if (options->logins > 0) {
+        qsort(login_ms, options->logins, sizeof(double), ftp_compare_doubles);
+        login_p50 = login_ms[options->logins / 2];
+        login_p99 = login_ms[(options->logins * 99) / 100 < options->logins ? (options->logins * 99) / 100 : options->logins - 1];
+    }
+
+    if (ftp_bench_session(&client, &server, options) < 0) {
+        fprintf(stderr, "Benchmark session failed\n");
+        goto done;
+    }
+    ftp_metrics_reset(&metrics);
+    client.metrics = &metrics;
+    if (options->rate > 0) client.shaper = &shaper;
+
+    // Bulk download into /dev/null, so only the network path is measured,
+    // unless a real target was asked for to include the disk. splice() and
+    // the pipelined path need a regular file and would fall back to buffered
+    // on /dev/null, so those get a temporary file.
+    if (!options->download_path &&
+        (options->data_path == FTP_DATA_ZEROCOPY || options->data_path == FTP_DATA_PIPELINED)) {
+        if (ftp_bench_temp_file(target_path, sizeof(target_path), 0) < 0) goto close;
+        target = target_path;
+    }
+    for (int i = 0; i < options->iterations; i++) {
+        double cpu = ftp_thread_cpu_seconds();
+        double started = ftp_now();
+
+        if (ftp_download_file(&client, "big0", target) < 0) goto close;
+        double seconds = ftp_now() - started;
+        download_data_path = client.last_data_path;
+
+        download_cpu += ftp_thread_cpu_seconds() - cpu;
+        download_total_seconds += seconds;
+        download_bytes += options->file_size;
+        download_compression = client.last_compression;
+        if (options->file_size / seconds > download_best) download_best = options->file_size / seconds;
+    }
+
+    // Bulk upload from a page-cached temporary file
+    if (options->iterations > 0) {
+        if (ftp_bench_temp_file(source_path, sizeof(source_path), options->file_size) < 0) goto close;
+        for (int i = 0; i < options->iterations; i++) {
+            double cpu = ftp_thread_cpu_seconds();
+            double started = ftp_now();
+
+            if (ftp_upload_file(&client, source_path, "upload0") < 0) {
+                unlink(source_path);
+                goto close;
+            }
+            double seconds = ftp_now() - started;
+
+            upload_cpu += ftp_thread_cpu_seconds() - cpu;
+            upload_total_seconds += seconds;
+            upload_bytes += options->file_size;
+            upload_compression = client.last_compression;
+            if (options->file_size / seconds > upload_best) upload_best = options->file_size / seconds;
+        }
+        unlink(source_path);
+    }
+
+    // Small files: one PASV + RETR round trip each over the same session,
+    // then again with the next data connection prepared during each transfer
+    for (int prepared = 0; prepared < 2 && options->small_count > 0; prepared++) {
+        double started = ftp_now();
+
+        client.prepare_data_channel = prepared;
+        for (int i = 0; i < options->small_count; i++) {
+            snprintf(remote_file, sizeof(remote_file), "small%d", i);
+            if (ftp_download_file(&client, remote_file, target) < 0) goto close;
+        }
+        *(prepared ? &small_prepared_ops : &small_ops) = options->small_count / (ftp_now() - started);
+    }
+    ftp_discard_prepared_channel(&client);
+    status = 0;
+
+    printf("  login latency:     mean %.3f ms, p50 %.3f ms, p99 %.3f ms (%d logins)\n",
+           login_mean, login_p50, login_p99, options->logins);
+    if (download_bytes > 0) {
+        printf("  download:          best %.1f MB/s, mean %.1f MB/s, %.3f CPU s/GB (%s)\n",
+               download_best / 1e6, download_bytes / download_total_seconds / 1e6, download_cpu / (download_bytes / 1e9),
+               ftp_data_path_name(download_data_path));
+    }
+    if (upload_bytes > 0) {
+        printf("  upload:            best %.1f MB/s, mean %.1f MB/s, %.3f CPU s/GB\n",
+               upload_best / 1e6, upload_bytes / upload_total_seconds / 1e6, upload_cpu / (upload_bytes / 1e9));
+    }
+    if (client.mode_z) {
+        printf("  MODE Z level %d:    download %.2fx, upload %.2fx smaller on the wire\n", options->compress_level,
+               download_compression.wire_bytes ? (double)download_compression.data_bytes / download_compression.wire_bytes : 0,
+               upload_compression.wire_bytes ? (double)upload_compression.data_bytes / upload_compression.wire_bytes : 0);
+    }
+    if (options->small_count > 0) {
+        printf("  small files:       %.1f files/s, %.3f ms each (%d x %lld bytes)\n",
+               small_ops, 1000 / small_ops, options->small_count, options->small_size);
+        printf("  prepared PASV:     %.1f files/s, %.3f ms each\n", small_prepared_ops, 1000 / small_prepared_ops);
+    }
+    printf("  control round trip: %.3f ms mean over %lld replies\n",
+           metrics.latency_count ? metrics.latency_sum_ms / metrics.latency_count : 0, metrics.latency_count);
+
+    // One line per run, so a file of results can be compared against a baseline
+    if (options->json_path) {
+        FILE *out = strcmp(options->json_path, "-") ? fopen(options->json_path, "a") : stdout;
+        if (!out) {
+            print_error("Failed to open benchmark results file");
+            status = -1;
+        } else {
+            fprintf(out, "{\"time\":%lld,\"data_path\":\"%s\",\"requested_data_path\":\"%s\",\"buffer\":%zu,\"latency_ms\":%d,\"file_size\":%lld,\"iterations\":%d,"
+                    "\"login_ms\":{\"mean\":%.3f,\"p50\":%.3f,\"p99\":%.3f},"
+                    "\"download\":{\"best_bps\":%.0f,\"mean_bps\":%.0f,\"cpu_s_per_gb\":%.4f},"
+                    "\"upload\":{\"best_bps\":%.0f,\"mean_bps\":%.0f,\"cpu_s_per_gb\":%.4f},"
+                    "\"small_files\":{\"count\":%d,\"size\":%lld,\"ops_per_s\":%.1f,\"prepared_ops_per_s\":%.1f}}\n",
+                    (long long)time(NULL), ftp_data_path_name(download_data_path), ftp_data_path_name(options->data_path),
+                    ftp_transfer_buffer_size(&client), options->latency_ms,
+                    options->file_size, options->iterations, login_mean, login_p50, login_p99,
+                    download_best, download_bytes ? download_bytes / download_total_seconds : 0,
+                    download_bytes ? download_cpu / (download_bytes / 1e9) : 0,
+                    upload_best, upload_bytes ? upload_bytes / upload_total_seconds : 0,
+                    upload_bytes ? upload_cpu / (upload_bytes / 1e9) : 0,
+                    options->small_count, options->small_size, small_ops, small_prepared_ops);
+            if (out != stdout) fclose(out);
+        }
+    }
+
+close:
+    client.metrics = NULL;
+    ftp_close_connection(&client);
+    if (target_path[0]) unlink(target_path);
+done:
+    free(login_ms);
+    ftp_standin_stop(&server);
+    ftp_shaper_destroy(&shaper);
+    return status;
 }
 
-// Close FTP connection
-void ftp_close_connection(FTPClient *client) {
-    if (client->state == FTP_LOGGED_IN || client->state == FTP_CONNECTED) {
-        send_ftp_command(client, "QUIT");
-        recv_ftp_response(client, NULL, 0);
+static void ftp_benchmark_usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s bench [--size BYTES] [--iterations N] [--small-size BYTES] [--small-count N]\n"
+            "                [--logins N] [--latency MS] [--data-path buffered|zerocopy|io_uring|pipelined|all]\n"
+            "                [--zerocopy] [--json FILE|-]\n"
+            "                [--buffer BYTES] [--socket-buffer BYTES|kernel] [--link MBIT/S] [--rtt MS]\n"
+            "                [--tcp-info]\n"
+            "                [--direct-io off|download|all] [--download-to FILE] [--verify]\n"
+            "                [--compress LEVEL] [--rate BYTES/S]\n"
+            "       %s serve [--port N] [--size BYTES] [--count N] [--small-size BYTES]\n"
+            "                [--small-count N] [--latency MS] [--rate BYTES/S] [--verify]\n"
+            "                [--stall-after BYTES] [--stall-percent P]\n"
+            "--latency holds every server reply and data transfer until MS after its\n"
+            "command arrived, and serve --rate caps what all downloads send together;\n"
+            "for full link emulation run under tc netem on lo instead. --stall-after\n"
+            "makes P%% of downloads (default all) go silent after BYTES.\n", program, program);
+}
+
+// "bench" and "serve" subcommands
+int ftp_benchmark_main(int argc, char *argv[]) {
+    FTPBenchOptions options;
+    FTPStandInServer server;
+    int serve = !strcmp(argv[1], "serve");
+    int port = 2121;
+    int compare = 0;  // run the suite once per data path
+
+    memset(&options, 0, sizeof(options));
+    options.file_size = 256LL * 1024 * 1024;
+    options.iterations = 3;
+    options.small_size = 4096;
+    options.small_count = 500;
+    options.logins = 50;
+    options.data_path = FTP_DATA_BUFFERED;
+    memset(&server, 0, sizeof(server));
+    server.file_count = 1;
+
+    for (int i = 2; i < argc; i++) {
+        const char *value = i + 1 < argc ? argv[i + 1] : NULL;
+
+        if (!strcmp(argv[i], "--zerocopy")) {
+            options.data_path = FTP_DATA_ZEROCOPY;
+            continue;
+        }
+        if (!strcmp(argv[i], "--verify")) {
+            options.verify = 1;
+            continue;
+        }
+        if (!strcmp(argv[i], "--tcp-info")) {
+            options.tuning.report_tcp_info = 1;
+            continue;
+        }
+        if (!value) {
+            ftp_benchmark_usage(argv[0]);
+            return 1;
+        }
+        if (!strcmp(argv[i], "--size")) options.file_size = ftp_parse_byte_count(value);
+        else if (!strcmp(argv[i], "--iterations")) options.iterations = atoi(value);
+        else if (!strcmp(argv[i], "--small-size")) options.small_size = ftp_parse_byte_count(value);
+        else if (!strcmp(argv[i], "--small-count")) options.small_count = atoi(value);
+        else if (!strcmp(argv[i], "--logins")) options.logins = atoi(value);
+        else if (!strcmp(argv[i], "--latency")) options.latency_ms = atoi(value);
+        else if (!strcmp(argv[i], "--json")) options.json_path = value;
+        else if (!strcmp(argv[i], "--data-path")) {
+            if (!strcmp(value, "all")) compare = 1;
+            else if (!strcmp(value, "zerocopy") || !strcmp(value, "zero-copy")) options.data_path = FTP_DATA_ZEROCOPY;
+            else if (!strcmp(value, "io_uring") || !strcmp(value, "uring")) options.data_path = FTP_DATA_URING;
+            else if (!strcmp(value, "pipelined")) options.data_path = FTP_DATA_PIPELINED;
+            else options.data_path = FTP_DATA_BUFFERED;
+        }
+        else if (!strcmp(argv[i], "--buffer")) options.tuning.transfer_buffer = ftp_parse_byte_count(value);
+        else if (!strcmp(argv[i], "--socket-buffer")) {
+            options.tuning.socket_buffer = strcmp(value, "kernel") ? ftp_parse_byte_count(value) : -1;
+        } else if (!strcmp(argv[i], "--link")) options.tuning.link_bps = atof(value) * 1e6;
+        else if (!strcmp(argv[i], "--rtt")) options.tuning.rtt_ms = atof(value);
+        else if (!strcmp(argv[i], "--direct-io")) {
+            options.tuning.direct_io = !strcmp(value, "all") ? 2 : !strcmp(value, "download") ? 1 : 0;
+        } else if (!strcmp(argv[i], "--download-to")) options.download_path = value;
+        else if (!strcmp(argv[i], "--compress")) options.compress_level = atoi(value);
+        else if (!strcmp(argv[i], "--rate")) options.rate = ftp_parse_byte_count(value);
+        else if (!strcmp(argv[i], "--port")) port = atoi(value);
+        else if (!strcmp(argv[i], "--count")) server.file_count = atoi(value);
+        else if (!strcmp(argv[i], "--stall-after")) server.stall_after = ftp_parse_byte_count(value);
+        else if (!strcmp(argv[i], "--stall-percent")) server.stall_percent = atoi(value);
+        else {
+            ftp_benchmark_usage(argv[0]);
+            return 1;
+        }
+        i++;
     }
-    
-    if (client->control_socket > 0) {
-        close(client->control_socket);
-        client->control_socket = -1;
+    if (options.file_size <= 0 || options.iterations < 0 || options.small_size < 0 ||
+        options.small_count < 0 || options.logins < 0 || options.latency_ms < 0) {
+        ftp_benchmark_usage(argv[0]);
+        return 1;
     }
-    
-    if (client->data_socket > 0) {
-        close(client->data_socket);
-        client->data_socket = -1;
+
+    if (!serve && compare) {
+        int failed = 0;
+        for (int path = FTP_DATA_BUFFERED; path <= FTP_DATA_PIPELINED; path++) {
+            options.data_path = path;
+            if (ftp_benchmark_run(&options) < 0) failed = 1;
+        }
+        return failed;
     }
-    
-    client->state = FTP_DISCONNECTED;
-    memset(client->username, 0, sizeof(client->username));
-    memset(client->password, 0, sizeof(client->password));
+    if (!serve) return ftp_benchmark_run(&options) < 0 ? 1 : 0;
+
+    server.file_size = options.file_size;
+    server.small_size = options.small_size;
+    server.small_count = options.small_count;
+    server.latency_ms = options.latency_ms;
+    server.hash_uploads = options.verify;
+    server.send_rate = options.rate;
+    if (server.stall_after > 0 && server.stall_percent <= 0) server.stall_percent = 100;
+    if (ftp_standin_start(&server, port) < 0) return 1;
+    printf("Stand-in server listening on 127.0.0.1:%d (%d x %lld bytes as big<N>, %d x %lld bytes as small<N>)\n",
+           server.port, server.file_count, server.file_size, server.small_count, server.small_size);
+    pthread_join(server.thread, NULL);
+    return 0;
 }
 
 // Interactive menu for FTP client
@@ -498,6 +9621,20 @@ void ftp_client_menu(FTPClient *client) {
     int choice;
     char hostname[256], username[64], password[64];
     char remote_path[MAX_PATH], local_path[MAX_PATH];
+    FTPMetrics metrics;
+    FTPShaper shaper;
+    FTPListingCache listing_cache;
+    
+    // Instrument everything done from the menu
+    ftp_metrics_reset(&metrics);
+    client->metrics = &metrics;
+    
+    // Listings are reused for a few seconds; changes made from here invalidate them
+    if (ftp_listing_cache_init(&listing_cache, 0, NULL) == 0) client->listing_cache = &listing_cache;
+    
+    // Unlimited until set from the menu; shared with segment sessions
+    ftp_shaper_init(&shaper, 0);
+    client->shaper = &shaper;
     
     while (1) {
         printf("\n--- FTP Client Menu ---\n");
@@ -510,6 +9647,19 @@ void ftp_client_menu(FTPClient *client) {
         printf("7. Create Remote Directory\n");
         printf("8. Delete Remote File\n");
         printf("9. Rename Remote File\n");
+        printf("10. Segmented Download\n");
+        printf("11. Switch Data Path (now: %s)\n", ftp_data_path_name(client->data_path));
+        printf("12. Concurrent Downloads\n");
+        printf("13. Resume Download\n");
+        printf("14. Resume Upload\n");
+        printf("15. Mirror Remote Directory\n");
+        printf("16. Export Transfer Metrics\n");
+        printf("17. Transfer Tuning (buffer %zu bytes)\n", ftp_transfer_buffer_size(client));
+        printf("18. Verify Transfers (now: %s)\n", client->verify ? "on" : "off");
+        printf("19. Compression (MODE Z level: %d)\n", client->compress_level);
+        printf("20. Bandwidth Limits (total %.0f B/s, per transfer %.0f B/s; 0 is unlimited)\n",
+               shaper.bucket.rate, client->rate_limit);
+        printf("21. Listing Cache Statistics\n");
         printf("0. Exit\n");
         printf("Enter your choice: ");
         
@@ -597,8 +9747,180 @@ void ftp_client_menu(FTPClient *client) {
                 ftp_rename_remote_file(client, remote_path, local_path);
                 break;
             
+            case 10: {
+                int segments = FTP_DEFAULT_SEGMENTS;
+                
+                printf("Enter remote file to download: ");
+                fgets(remote_path, sizeof(remote_path), stdin);
+                remote_path[strcspn(remote_path, "\n")] = 0;
+                
+                printf("Enter local file path: ");
+                fgets(local_path, sizeof(local_path), stdin);
+                local_path[strcspn(local_path, "\n")] = 0;
+                
+                printf("Enter number of segments (1-%d): ", FTP_MAX_SEGMENTS);
+                scanf("%d", &segments);
+                getchar(); // Consume newline
+                
+                ftp_download_file_segmented(client, remote_path, local_path, segments);
+                break;
+            }
+            
+            case 11:
+                // buffered -> zero-copy -> io_uring -> pipelined -> buffered
+                client->data_path = (client->data_path == FTP_DATA_PIPELINED) ? FTP_DATA_BUFFERED : client->data_path + 1;
+                printf("Data path: %s\n", ftp_data_path_name(client->data_path));
+                break;
+            
+            case 12: {
+                FTPEngine engine;
+                int count = 0;
+                
+                printf("Enter number of files: ");
+                scanf("%d", &count);
+                getchar(); // Consume newline
+                if (count <= 0 || ftp_engine_init(&engine, count) < 0) break;
+                
+                for (int i = 0; i < count; i++) {
+                    printf("Enter remote file %d: ", i + 1);
+                    fgets(remote_path, sizeof(remote_path), stdin);
+                    remote_path[strcspn(remote_path, "\n")] = 0;
+                    
+                    // Save under the remote file's base name
+                    const char *base_name = strrchr(remote_path, '/');
+                    ftp_engine_add_job(&engine, FTP_JOB_DOWNLOAD, client, remote_path,
+                                       base_name ? base_name + 1 : remote_path);
+                }
+                
+                ftp_engine_run(&engine);
+                ftp_engine_destroy(&engine);
+                break;
+            }
+            
+            case 13:
+                printf("Enter remote file to download: ");
+                fgets(remote_path, sizeof(remote_path), stdin);
+                remote_path[strcspn(remote_path, "\n")] = 0;
+                
+                printf("Enter local file path: ");
+                fgets(local_path, sizeof(local_path), stdin);
+                local_path[strcspn(local_path, "\n")] = 0;
+                
+                ftp_download_file_retry(client, remote_path, local_path);
+                break;
+            
+            case 14:
+                printf("Enter local file to upload: ");
+                fgets(local_path, sizeof(local_path), stdin);
+                local_path[strcspn(local_path, "\n")] = 0;
+                
+                printf("Enter remote file path: ");
+                fgets(remote_path, sizeof(remote_path), stdin);
+                remote_path[strcspn(remote_path, "\n")] = 0;
+                
+                ftp_upload_file_retry(client, local_path, remote_path);
+                break;
+            
+            case 15: {
+                char answer[8];
+                
+                printf("Enter remote directory to mirror: ");
+                fgets(remote_path, sizeof(remote_path), stdin);
+                remote_path[strcspn(remote_path, "\n")] = 0;
+                
+                printf("Enter local directory: ");
+                fgets(local_path, sizeof(local_path), stdin);
+                local_path[strcspn(local_path, "\n")] = 0;
+                
+                printf("Delete local files removed on the server? (y/n): ");
+                fgets(answer, sizeof(answer), stdin);
+                
+                ftp_mirror(client, remote_path, local_path, answer[0] == 'y' || answer[0] == 'Y');
+                break;
+            }
+            
+            case 16:
+                printf("Enter Prometheus file path (empty for JSON on stdout): ");
+                fgets(local_path, sizeof(local_path), stdin);
+                local_path[strcspn(local_path, "\n")] = 0;
+                
+                if (local_path[0]) ftp_metrics_write_prometheus(&metrics, local_path);
+                else ftp_metrics_write_json(&metrics, client->server_hostname, stdout);
+                break;
+            
+            case 17: {
+                long long buffer = 0, socket_buffer = 0;
+                double link_mbps = 0;
+                
+                printf("Enter transfer buffer size in bytes (0 for default): ");
+                scanf("%lld", &buffer);
+                printf("Enter socket buffer size in bytes (0 from BDP, -1 kernel autotuning): ");
+                scanf("%lld", &socket_buffer);
+                printf("Enter link speed in Mbit/s for the BDP (0 if unknown): ");
+                scanf("%lf", &link_mbps);
+                printf("Report TCP_INFO after each transfer (1/0): ");
+                scanf("%d", &client->tuning.report_tcp_info);
+                printf("O_DIRECT on the pipelined path (0 never, 1 downloads, 2 uploads too): ");
+                scanf("%d", &client->tuning.direct_io);
+                getchar(); // Consume newline
+                
+                client->tuning.transfer_buffer = buffer > 0 ? (size_t)buffer : 0;
+                client->tuning.socket_buffer = socket_buffer;
+                client->tuning.link_bps = link_mbps > 0 ? link_mbps * 1e6 : 0;
+                printf("Transfer buffer %zu bytes, estimated BDP %lld bytes\n",
+                       ftp_transfer_buffer_size(client), ftp_estimate_bdp(client));
+                break;
+            }
+            
+            case 18:
+                // Hashing needs the bytes in user space, so zero-copy falls back to buffered
+                client->verify = !client->verify;
+                printf("Transfer verification %s", client->verify ? "on" : "off");
+                if (client->verify && client->state == FTP_LOGGED_IN) {
+                    unsigned algorithm = ftp_verify_algorithm(client);
+                    printf(" (server check: %s)", algorithm == FTP_HASH_SHA256 ? "SHA-256" :
+                           algorithm == FTP_HASH_MD5 ? "MD5" : algorithm == FTP_HASH_CRC32 ? "CRC32" : "none");
+                }
+                printf("\n");
+                break;
+            
+            case 19:
+                printf("Enter MODE Z compression level (1-9, 0 for none): ");
+                scanf("%d", &client->compress_level);
+                getchar(); // Consume newline
+                
+                if (client->compress_level < 0 || client->compress_level > 9) client->compress_level = 0;
+                if (client->compress_level > 0 && client->state == FTP_LOGGED_IN &&
+                    !(client->features & FTP_FEATURE_MODE_Z)) {
+                    printf("Server does not offer MODE Z; transfers stay uncompressed\n");
+                }
+                break;
+            
+            case 20: {
+                char rate[64], transfer_rate[64];
+                
+                printf("Enter total bandwidth limit in bytes/s (K/M/G suffix, 0 for none): ");
+                fgets(rate, sizeof(rate), stdin);
+                printf("Enter per-transfer limit in bytes/s (0 for none): ");
+                fgets(transfer_rate, sizeof(transfer_rate), stdin);
+                
+                ftp_shaper_set_rate(&shaper, ftp_parse_byte_count(rate));
+                client->rate_limit = ftp_parse_byte_count(transfer_rate);
+                break;
+            }
+            
+            case 21:
+                if (client->listing_cache) ftp_listing_cache_print_stats(client->listing_cache, stdout);
+                else printf("Listing cache is off.\n");
+                break;
+            
             case 0:
                 ftp_close_connection(client);
+                client->metrics = NULL;
+                client->shaper = NULL;
+                ftp_shaper_destroy(&shaper);
+                if (client->listing_cache) ftp_listing_cache_destroy(&listing_cache);
+                client->listing_cache = NULL;
                 printf("Disconnected from server.\n");
                 return;
             
@@ -623,12 +9945,55 @@ void ftp_client_menu(FTPClient *client) {
     return 0;
 }*/
 
-int main() {
+int main(int argc, char *argv[]) {
     FTPClient client;
     const char *hostname = "ftp.up.pt"; // Substitua pelo hostname do servidor
     const char *username = "anonymous"; // Nome de usuário anônimo
     const char *password = "";          // Senha vazia para acesso anônimo
 
+    // Subcomandos: benchmark em loopback e servidor de teste
+    if (argc > 1 && (!strcmp(argv[1], "bench") || !strcmp(argv[1], "serve"))) {
+        return ftp_benchmark_main(argc, argv);
+    }
+
+    // Transferências pela linha de comando, com stdin/stdout para pipelines
+    if (argc > 1 && (!strcmp(argv[1], "get") || !strcmp(argv[1], "put"))) {
+        return ftp_transfer_main(argc, argv);
+    }
+
+    // Vários downloads ao mesmo tempo, num único laço de eventos
+    if (argc > 1 && !strcmp(argv[1], "mget")) {
+        return ftp_mget_main(argc, argv);
+    }
+
+    // Espelhamento incremental de um diretório remoto
+    if (argc > 1 && !strcmp(argv[1], "mirror")) {
+        return ftp_mirror_main(argc, argv);
+    }
+
+    // Cópia direta entre dois servidores (FXP)
+    if (argc > 1 && !strcmp(argv[1], "fxp")) {
+        return ftp_fxp_main(argc, argv);
+    }
+
+    // Download de um arquivo a partir de vários espelhos ao mesmo tempo
+    if (argc > 1 && !strcmp(argv[1], "multiget")) {
+        return ftp_multi_main(argc, argv);
+    }
+
+    // Inventário de uma árvore remota e consultas sobre ele
+    if (argc > 1 && !strcmp(argv[1], "crawl")) {
+        return ftp_crawl_main(argc, argv);
+    }
+    if (argc > 1 && !strcmp(argv[1], "inventory")) {
+        return ftp_inventory_main(argc, argv);
+    }
+
+    // Execução não interativa de um manifesto de operações
+    if (argc > 1 && !strcmp(argv[1], "batch")) {
+        return ftp_batch_main(argc, argv);
+    }
+
     // Inicializar a estrutura FTPClient
     memset(&client, 0, sizeof(client));
 